@@ -106,6 +106,12 @@ HEADERS += src/qt/bitcoingui.h \
     src/util.h \
     src/uint256.h \
     src/kernel.h \
+    src/blockcheck.h \
+    src/headerchain.h \
+    src/bloom.h \
+    src/staker.h \
+    src/compactblock.h \
+    src/blocktemplate.h \
     src/scrypt_mine.h \
     src/pbkdf2.h \
     src/serialize.h \
@@ -236,6 +242,12 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/crypter.cpp \
     src/noui.cpp \
     src/kernel.cpp \
+    src/blockcheck.cpp \
+    src/headerchain.cpp \
+    src/bloom.cpp \
+    src/staker.cpp \
+    src/compactblock.cpp \
+    src/blocktemplate.cpp \
     src/scrypt-x86.S \
     src/scrypt-x86_64.S \
     src/scrypt-arm.S \
@@ -0,0 +1,158 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockcheck.h"
+#include "net.h"
+
+using namespace std;
+
+CBlockCheckQueue blockCheckQueue;
+
+CBlockCheckQueue::CBlockCheckQueue()
+{
+    nMaxJobs = 0;
+    nThreads = 0;
+}
+
+void CBlockCheckQueue::Start(int nThreadsIn)
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    nThreads = nThreadsIn;
+    // Enough read-ahead to keep every worker busy while the serial stage
+    // catches up, without holding more than a few blocks per thread
+    nMaxJobs = 4 * nThreads;
+}
+
+bool CBlockCheckQueue::HasRoom()
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    return mapJobs.size() < nMaxJobs;
+}
+
+bool CBlockCheckQueue::Push(const uint256& hashData, const CDataStream& vData, NodeId nPeer)
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    if (mapJobs.size() >= nMaxJobs || fShutdown)
+        return false;
+    // The same block from two peers only needs checking once; the second
+    // one will be found already known by ProcessBlock anyway
+    if (mapJobs.count(hashData))
+        return false;
+
+    boost::shared_ptr<CJob> pjob(new CJob(vData, nPeer));
+    mapJobs[hashData] = pjob;
+    queueWork.push_back(pjob);
+    condWork.notify_one();
+    return true;
+}
+
+bool CBlockCheckQueue::Wait(const uint256& hashData)
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    map<uint256, boost::shared_ptr<CJob> >::iterator mi = mapJobs.find(hashData);
+    if (mi == mapJobs.end())
+        return false;
+    boost::shared_ptr<CJob> pjob = mi->second;
+    mapJobs.erase(mi);
+
+    while (!pjob->fDone)
+    {
+        if (fShutdown)
+            return false;
+        condDone.timed_wait(lock, boost::posix_time::seconds(1));
+    }
+    return pjob->fValid;
+}
+
+void CBlockCheckQueue::Forget(NodeId nPeer)
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    map<uint256, boost::shared_ptr<CJob> >::iterator mi = mapJobs.begin();
+    while (mi != mapJobs.end())
+    {
+        if (mi->second->nPeer == nPeer)
+            mapJobs.erase(mi++);
+        else
+            mi++;
+    }
+}
+
+void CBlockCheckQueue::ThreadWorker()
+{
+    while (!fShutdown)
+    {
+        boost::shared_ptr<CJob> pjob;
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            if (queueWork.empty())
+            {
+                condWork.timed_wait(lock, boost::posix_time::seconds(1));
+                continue;
+            }
+            pjob = queueWork.front();
+            queueWork.pop_front();
+        }
+
+        // A job whose peer went away before we got to it isn't worth doing
+        bool fValid = false;
+        if (!pjob.unique())
+        {
+            try
+            {
+                CBlock block;
+                pjob->vData >> block;
+                fValid = block.CheckBlock();
+            }
+            catch (std::exception& e) {
+                // Leave malformed data to the in-line path, which reports it
+                fValid = false;
+            }
+        }
+
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            pjob->vData.clear();
+            pjob->fValid = fValid;
+            pjob->fDone = true;
+        }
+        condDone.notify_all();
+    }
+}
+
+void static ThreadBlockCheck(void* parg)
+{
+    RenameThread("litecoinplus-blockcheck");
+    try
+    {
+        vnThreadsRunning[THREAD_BLOCKCHECK]++;
+        blockCheckQueue.ThreadWorker();
+        vnThreadsRunning[THREAD_BLOCKCHECK]--;
+    }
+    catch (std::exception& e) {
+        vnThreadsRunning[THREAD_BLOCKCHECK]--;
+        PrintException(&e, "ThreadBlockCheck()");
+    } catch (...) {
+        vnThreadsRunning[THREAD_BLOCKCHECK]--;
+        PrintException(NULL, "ThreadBlockCheck()");
+    }
+}
+
+void StartBlockCheckThreads(int nThreads)
+{
+    if (nThreads <= 0)
+        nThreads += boost::thread::hardware_concurrency();
+    if (nThreads > MAX_BLOCKCHECK_THREADS)
+        nThreads = MAX_BLOCKCHECK_THREADS;
+    if (nThreads <= 1)
+    {
+        printf("Block pre-check threads disabled, checking blocks in line\n");
+        return;
+    }
+
+    printf("Using %d block pre-check threads\n", nThreads);
+    blockCheckQueue.Start(nThreads);
+    for (int i = 0; i < nThreads; i++)
+        if (!NewThread(ThreadBlockCheck, NULL))
+            printf("Error: NewThread(ThreadBlockCheck) failed\n");
+}
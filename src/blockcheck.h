@@ -0,0 +1,82 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKCHECK_H
+#define BITCOIN_BLOCKCHECK_H
+
+#include "main.h"
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+/** Maximum number of block pre-check threads */
+static const int MAX_BLOCKCHECK_THREADS = 16;
+
+/** Runs the context-free half of block validation on a pool of worker threads.
+ *
+ * CBlock::CheckBlock (size limits, the scrypt proof-of-work hash, merkle root,
+ * block signature and CheckTransaction on every transaction) doesn't need
+ * cs_main or any chain state, so it is started as soon as a serialized block
+ * is seen: the message handler looks ahead in each peer's receive buffer and
+ * the bootstrap importer reads ahead in the file.  By the time the block
+ * reaches ProcessBlock, in order and under cs_main, Wait() usually has the
+ * answer already and only AcceptBlock/ConnectBlock are left to do serially.
+ *
+ * Jobs are keyed by the hash of the serialized block, so a result can only
+ * ever be applied to the exact same bytes.  The caller hands the verdict for
+ * a block that passed to ProcessBlock along with the block it unserialized
+ * from those bytes; one that failed is simply checked again in line,
+ * which keeps the error reporting and DoS scoring where they always were.
+ */
+class CBlockCheckQueue
+{
+private:
+    struct CJob
+    {
+        CDataStream vData;
+        NodeId nPeer;
+        bool fDone;
+        bool fValid;
+
+        CJob(const CDataStream& vDataIn, NodeId nPeerIn) : vData(vDataIn), nPeer(nPeerIn), fDone(false), fValid(false) {}
+    };
+
+    boost::mutex cs;
+    boost::condition_variable condWork;
+    boost::condition_variable condDone;
+    std::deque<boost::shared_ptr<CJob> > queueWork;
+    std::map<uint256, boost::shared_ptr<CJob> > mapJobs;
+    unsigned int nMaxJobs;
+    int nThreads;
+
+public:
+    CBlockCheckQueue();
+
+    // Size the queue for nThreadsIn workers; until this is called Push
+    // refuses everything and all checks stay in line
+    void Start(int nThreadsIn);
+
+    // Whether another Push would be accepted
+    bool HasRoom();
+
+    // Schedule the checks for the block serialized in vData, whose Hash() is
+    // hashData.  nPeer is the node it came from, -1 for local imports.
+    bool Push(const uint256& hashData, const CDataStream& vData, NodeId nPeer);
+
+    // Wait for the result of a pushed block and forget about it.  Returns
+    // true only if it was pushed and passed CheckBlock.
+    bool Wait(const uint256& hashData);
+
+    // Drop the jobs of a peer that went away
+    void Forget(NodeId nPeer);
+
+    void ThreadWorker();
+};
+
+extern CBlockCheckQueue blockCheckQueue;
+
+// Start the workers: nThreads <= 0 means one per core less that many,
+// and fewer than two leaves block checking entirely in line
+void StartBlockCheckThreads(int nThreads);
+
+#endif
@@ -0,0 +1,486 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blocktemplate.h"
+#include "db.h"
+#include "net.h"
+#include "wallet.h"
+
+using namespace std;
+
+CBlockTemplateManager blockTemplate;
+
+CBlockTemplateManager::CBlockTemplateManager()
+{
+    pblock = NULL;
+    pindexPrev = NULL;
+    nSequence = 0;
+    fPendingTip = false;
+    fActive = false;
+}
+
+CBlockTemplateManager::~CBlockTemplateManager()
+{
+    delete pblock;
+}
+
+void CBlockTemplateManager::TransactionAdded(const uint256& hash)
+{
+    boost::unique_lock<boost::mutex> lock(cs_pending);
+    if (!fActive)
+        return;
+    vPendingAdd.push_back(hash);
+    condPending.notify_one();
+}
+
+void CBlockTemplateManager::TransactionRemoved(const uint256& hash)
+{
+    boost::unique_lock<boost::mutex> lock(cs_pending);
+    if (!fActive)
+        return;
+    setPendingRemove.insert(hash);
+    condPending.notify_one();
+}
+
+void CBlockTemplateManager::NewTip()
+{
+    boost::unique_lock<boost::mutex> lock(cs_pending);
+    if (!fActive)
+        return;
+    fPendingTip = true;
+    vPendingAdd.clear();
+    setPendingRemove.clear();
+    condPending.notify_one();
+}
+
+unsigned int CBlockTemplateManager::GetSequence() const
+{
+    LOCK(cs);
+    return nSequence;
+}
+
+// Recompute the path from leaf nPos to the root.  nPos may be one past the
+// last leaf, which appends it.
+void CBlockTemplateManager::SetMerkleLeaf(unsigned int nPos, const uint256& hash)
+{
+    if (vMerkleLevels.empty())
+        vMerkleLevels.resize(1);
+    if (nPos == vMerkleLevels[0].size())
+        vMerkleLevels[0].push_back(hash);
+    else
+        vMerkleLevels[0][nPos] = hash;
+
+    unsigned int nLevel = 0;
+    for (; vMerkleLevels[nLevel].size() > 1; nLevel++)
+    {
+        const vector<uint256>& vLevel = vMerkleLevels[nLevel];
+        unsigned int nSize = vLevel.size();
+        unsigned int i = nPos & ~1u;
+        unsigned int i2 = std::min(i+1, nSize-1);
+        uint256 hashParent = Hash(BEGIN(vLevel[i]),  END(vLevel[i]),
+                                  BEGIN(vLevel[i2]), END(vLevel[i2]));
+        nPos >>= 1;
+        if (vMerkleLevels.size() == nLevel + 1)
+            vMerkleLevels.resize(nLevel + 2);
+        vMerkleLevels[nLevel+1].resize((nSize + 1) / 2);
+        vMerkleLevels[nLevel+1][nPos] = hashParent;
+    }
+    vMerkleLevels.resize(nLevel + 1);
+}
+
+void CBlockTemplateManager::RebuildMerkleLevels()
+{
+    vMerkleLevels.clear();
+    vMerkleLevels.resize(1);
+    BOOST_FOREACH(const CTransaction& tx, pblock->vtx)
+        vMerkleLevels[0].push_back(tx.GetHash());
+    while (vMerkleLevels.back().size() > 1)
+    {
+        const vector<uint256>& vLevel = vMerkleLevels.back();
+        unsigned int nSize = vLevel.size();
+        vector<uint256> vParent;
+        vParent.reserve((nSize + 1) / 2);
+        for (unsigned int i = 0; i < nSize; i += 2)
+        {
+            unsigned int i2 = std::min(i+1, nSize-1);
+            vParent.push_back(Hash(BEGIN(vLevel[i]),  END(vLevel[i]),
+                                   BEGIN(vLevel[i2]), END(vLevel[i2])));
+        }
+        vMerkleLevels.push_back(vParent);
+    }
+}
+
+void CBlockTemplateManager::UpdateCoinbaseValue()
+{
+    pblock->vtx[0].vout[0].nValue = GetProofOfWorkReward(pindexPrev->nHeight+1, state.nFees, pindexPrev->GetBlockHash());
+    SetMerkleLeaf(0, pblock->vtx[0].GetHash());
+}
+
+// Same acceptance rules as the collection loop in CreateNewBlock, applied to
+// a single transaction at the end of the block.  fReorder is set if the
+// transaction would be taken, but CreateNewBlock would have put it further up.
+bool CBlockTemplateManager::AppendTransaction(CTxDB& txdb, CTransaction& tx, bool& fReorder)
+{
+    if (tx.IsCoinBase() || tx.IsCoinStake() || !tx.IsFinal())
+        return false;
+
+    // Size limits
+    unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    if (state.nBlockSize + nTxSize >= state.nBlockMaxSize)
+        return false;
+
+    // Legacy limits on sigOps:
+    unsigned int nTxSigOps = tx.GetLegacySigOpCount();
+    if (state.nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+        return false;
+
+    // Timestamp limit
+    if (tx.nTime > GetAdjustedTime())
+        return false;
+
+    int64 nMinFee = tx.GetMinFee(state.nBlockSize, false, GMF_BLOCK);
+
+    // ConnectInputs writes spent markers into mapTestPool as it goes, so
+    // remember the entries it may touch in case the transaction is refused
+    map<uint256, CTxIndex> mapSaved;
+    set<uint256> setAbsent;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        map<uint256, CTxIndex>::iterator mi = state.mapTestPool.find(txin.prevout.hash);
+        if (mi != state.mapTestPool.end())
+            mapSaved.insert(*mi);
+        else
+            setAbsent.insert(txin.prevout.hash);
+    }
+
+    MapPrevTx mapInputs;
+    bool fInvalid;
+    if (!tx.FetchInputs(txdb, state.mapTestPool, false, true, mapInputs, fInvalid))
+        return false;
+
+    int64 nTxFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
+    if (nTxFees < nMinFee)
+        return false;
+
+    // Skip free transactions if we're past the minimum block size
+    double dFeePerKb = double(nTxFees) / (double(nTxSize)/1000.0);
+    if ((dFeePerKb < state.nMinTxFee) && (state.nBlockSize + nTxSize >= state.nBlockMinSize))
+        return false;
+
+    nTxSigOps += tx.GetP2SHSigOpCount(mapInputs);
+    if (state.nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+        return false;
+
+    // Only a transaction that would come last in fee order can go at the end
+    double dPriority = 0;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        const CTxIndex& txindex = mapInputs[txin.prevout.hash].first;
+        if (txindex.pos != CDiskTxPos(1,1,1))
+            dPriority += (double)mapInputs[txin.prevout.hash].second.vout[txin.prevout.n].nValue * txindex.GetDepthInMainChain();
+    }
+    dPriority /= nTxSize;
+    bool fSortedByFee = state.fSortedByFee || (state.nBlockSize + nTxSize >= state.nBlockPrioritySize) || (dPriority < COIN * 144 / 250);
+    if (!fSortedByFee || dFeePerKb > state.dLastFeePerKb)
+    {
+        fReorder = true;
+        return false;
+    }
+
+    if (!tx.ConnectInputs(txdb, mapInputs, state.mapTestPool, CDiskTxPos(1,1,1), pindexPrev, false, true))
+    {
+        BOOST_FOREACH(const PAIRTYPE(uint256, CTxIndex)& item, mapSaved)
+            state.mapTestPool[item.first] = item.second;
+        BOOST_FOREACH(const uint256& hash, setAbsent)
+            state.mapTestPool.erase(hash);
+        return false;
+    }
+    uint256 hash = tx.GetHash();
+    state.mapTestPool[hash] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
+
+    // Added
+    mapTxPos[hash] = pblock->vtx.size();
+    pblock->vtx.push_back(tx);
+    state.vTxFees.push_back(nTxFees);
+    state.vTxSigOps.push_back(nTxSigOps);
+    state.nBlockSize += nTxSize;
+    state.nBlockSigOps += nTxSigOps;
+    state.nFees += nTxFees;
+    state.fSortedByFee = true;
+    state.dLastFeePerKb = dFeePerKb;
+    SetMerkleLeaf(pblock->vtx.size() - 1, hash);
+    return true;
+}
+
+// Drop transactions that left the memory pool, along with anything in the
+// template that spends them, and give their inputs back to mapTestPool
+void CBlockTemplateManager::RemoveTransactions(const set<uint256>& setRemove)
+{
+    set<uint256> setGone;
+    for (unsigned int i = 1; i < pblock->vtx.size(); i++)
+    {
+        const CTransaction& tx = pblock->vtx[i];
+        uint256 hash = tx.GetHash();
+        bool fGone = setRemove.count(hash);
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            if (setGone.count(txin.prevout.hash))
+                fGone = true;
+        if (fGone)
+            setGone.insert(hash);
+    }
+    if (setGone.empty())
+        return;
+
+    vector<CTransaction> vtxKeep;
+    vector<int64> vFeesKeep;
+    vector<unsigned int> vSigOpsKeep;
+    vtxKeep.reserve(pblock->vtx.size() - setGone.size());
+    for (unsigned int i = 0; i < pblock->vtx.size(); i++)
+    {
+        const CTransaction& tx = pblock->vtx[i];
+        uint256 hash = tx.GetHash();
+        if (i == 0 || !setGone.count(hash))
+        {
+            vtxKeep.push_back(tx);
+            vFeesKeep.push_back(state.vTxFees[i]);
+            vSigOpsKeep.push_back(state.vTxSigOps[i]);
+            continue;
+        }
+
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            map<uint256, CTxIndex>::iterator mi = state.mapTestPool.find(txin.prevout.hash);
+            if (mi != state.mapTestPool.end() && txin.prevout.n < mi->second.vSpent.size())
+                mi->second.vSpent[txin.prevout.n].SetNull();
+        }
+        state.mapTestPool.erase(hash);
+        state.nBlockSize -= ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+        state.nBlockSigOps -= state.vTxSigOps[i];
+        state.nFees -= state.vTxFees[i];
+    }
+
+    pblock->vtx.swap(vtxKeep);
+    state.vTxFees.swap(vFeesKeep);
+    state.vTxSigOps.swap(vSigOpsKeep);
+    mapTxPos.clear();
+    for (unsigned int i = 0; i < pblock->vtx.size(); i++)
+        mapTxPos[pblock->vtx[i].GetHash()] = i;
+
+    pblock->vtx[0].vout[0].nValue = GetProofOfWorkReward(pindexPrev->nHeight+1, state.nFees, pindexPrev->GetBlockHash());
+    RebuildMerkleLevels();
+}
+
+bool CBlockTemplateManager::Update(CWallet* pwallet)
+{
+    vector<uint256> vAdd;
+    set<uint256> setRemove;
+    bool fTip;
+    {
+        boost::unique_lock<boost::mutex> lock(cs_pending);
+        fActive = true;
+        vAdd.swap(vPendingAdd);
+        setRemove.swap(setPendingRemove);
+        fTip = fPendingTip;
+        fPendingTip = false;
+    }
+
+    LOCK2(cs_main, mempool.cs);
+    LOCK(cs);
+    if (pindexBest == NULL)
+        return false;
+
+    if (fTip || pblock == NULL || pindexPrev != pindexBest)
+        return Rebuild(pwallet);
+
+    bool fChanged = false;
+    if (!setRemove.empty())
+    {
+        unsigned int nSizeBefore = pblock->vtx.size();
+        RemoveTransactions(setRemove);
+        fChanged = (pblock->vtx.size() != nSizeBefore);
+    }
+
+    if (!vAdd.empty())
+    {
+        CTxDB txdb("r");
+        bool fAdded = false;
+        BOOST_FOREACH(const uint256& hash, vAdd)
+        {
+            if (!mempool.exists(hash) || mapTxPos.count(hash))
+                continue;
+            bool fReorder = false;
+            if (AppendTransaction(txdb, mempool.lookup(hash), fReorder))
+                fAdded = true;
+            else if (fReorder)
+                return Rebuild(pwallet);
+        }
+        if (fAdded)
+        {
+            UpdateCoinbaseValue();
+            fChanged = true;
+        }
+    }
+
+    if (fChanged)
+        nSequence++;
+    return true;
+}
+
+// Collect the memory pool from scratch on top of pindexBest.  Caller holds
+// cs_main, mempool.cs and cs.
+bool CBlockTemplateManager::Rebuild(CWallet* pwallet)
+{
+    int64 nStart = GetTimeMillis();
+    CBlockTemplateState stateNew;
+    CBlock* pblockNew = CreateNewBlock(pwallet, false, &stateNew);
+    if (!pblockNew)
+        return false;
+
+    delete pblock;
+    pblock = pblockNew;
+    pindexPrev = pindexBest;
+    state = stateNew;
+    mapTxPos.clear();
+    for (unsigned int i = 0; i < pblock->vtx.size(); i++)
+        mapTxPos[pblock->vtx[i].GetHash()] = i;
+    RebuildMerkleLevels();
+    nSequence++;
+    if (fDebug)
+        printf("CBlockTemplateManager::Rebuild() : rebuilt template at height %d with %" PRIszu " transactions in %" PRI64d "ms\n",
+               pindexPrev->nHeight+1, pblock->vtx.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+CBlock* CBlockTemplateManager::CreateBlock(CWallet* pwallet, CBlockIndex*& pindexPrevRet)
+{
+    if (!Update(pwallet))
+        return NULL;
+
+    LOCK(cs);
+    if (pblock == NULL)
+        return NULL;
+
+    // Give the block time room to move by refreshing the coinbase timestamp,
+    // which only changes the coinbase path of the merkle tree
+    pblock->vtx[0].nTime = GetAdjustedTime();
+    SetMerkleLeaf(0, pblock->vtx[0].GetHash());
+
+    CBlock* pblockNew = new CBlock(*pblock);
+    pblockNew->vMerkleTree.clear();
+    BOOST_FOREACH(const vector<uint256>& vLevel, vMerkleLevels)
+        pblockNew->vMerkleTree.insert(pblockNew->vMerkleTree.end(), vLevel.begin(), vLevel.end());
+    pblockNew->hashMerkleRoot = pblockNew->vMerkleTree.back();
+
+    // Fill in header
+    pblockNew->hashPrevBlock  = pindexPrev->GetBlockHash();
+    pblockNew->nTime          = max(pindexPrev->GetMedianTimePast()+1, pblockNew->GetMaxTransactionTime());
+    pblockNew->nTime          = max(pblockNew->GetBlockTime(), pindexPrev->GetBlockTime() - nMaxClockDrift);
+    pblockNew->UpdateTime(pindexPrev);
+    pblockNew->nNonce         = 0;
+
+    pindexPrevRet = pindexPrev;
+    return pblockNew;
+}
+
+bool CBlockTemplateManager::FillStakeBlock(CBlock& block, CBlockIndex* pindexPrevIn)
+{
+    // The minter only borrows a template kept for proof-of-work users; it
+    // doesn't start the manager itself
+    {
+        boost::unique_lock<boost::mutex> lock(cs_pending);
+        if (!fActive || fPendingTip)
+            return false;
+    }
+
+    LOCK(cs);
+    if (pblock == NULL || pindexPrev != pindexPrevIn || !block.IsProofOfStake())
+        return false;
+
+    // Deltas may still be queued: anything no longer in the memory pool, newer
+    // than the coinstake or spending the stake itself is skipped, together
+    // with whatever depends on it
+    const CTransaction& txCoinStake = block.vtx[1];
+    unsigned int nTimeStake = txCoinStake.nTime;
+    set<COutPoint> setStakeIn;
+    BOOST_FOREACH(const CTxIn& txin, txCoinStake.vin)
+        setStakeIn.insert(txin.prevout);
+
+    // The template was sized without a coinstake, so the limits are counted
+    // again with it, as CreateNewBlock does
+    uint64 nBlockSize = 1000 + ::GetSerializeSize(txCoinStake, SER_NETWORK, PROTOCOL_VERSION);
+    int nBlockSigOps = 100 + txCoinStake.GetLegacySigOpCount();
+
+    set<uint256> setSkipped;
+    for (unsigned int i = 1; i < pblock->vtx.size(); i++)
+    {
+        const CTransaction& tx = pblock->vtx[i];
+        uint256 hash = tx.GetHash();
+        unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+        bool fSkip = (tx.nTime > nTimeStake || !mempool.exists(hash));
+        if (nBlockSize + nTxSize >= state.nBlockMaxSize || nBlockSigOps + state.vTxSigOps[i] >= MAX_BLOCK_SIGOPS)
+            fSkip = true;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            if (setSkipped.count(txin.prevout.hash) || setStakeIn.count(txin.prevout))
+                fSkip = true;
+        if (fSkip)
+        {
+            setSkipped.insert(hash);
+            continue;
+        }
+        block.vtx.push_back(tx);
+        nBlockSize += nTxSize;
+        nBlockSigOps += state.vTxSigOps[i];
+    }
+    return true;
+}
+
+void CBlockTemplateManager::ThreadBuilder(CWallet* pwallet)
+{
+    while (!fShutdown)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(cs_pending);
+            if (!fActive || (!fPendingTip && vPendingAdd.empty() && setPendingRemove.empty()))
+            {
+                condPending.timed_wait(lock, boost::posix_time::seconds(1));
+                continue;
+            }
+        }
+
+        if (IsInitialBlockDownload())
+        {
+            Sleep(1000);
+            continue;
+        }
+
+        Update(pwallet);
+    }
+}
+
+void static ThreadBlockTemplate(void* parg)
+{
+    printf("ThreadBlockTemplate started\n");
+    RenameThread("litecoinplus-template");
+    CWallet* pwallet = (CWallet*)parg;
+    try
+    {
+        vnThreadsRunning[THREAD_TEMPLATE]++;
+        blockTemplate.ThreadBuilder(pwallet);
+        vnThreadsRunning[THREAD_TEMPLATE]--;
+    }
+    catch (std::exception& e) {
+        vnThreadsRunning[THREAD_TEMPLATE]--;
+        PrintException(&e, "ThreadBlockTemplate()");
+    } catch (...) {
+        vnThreadsRunning[THREAD_TEMPLATE]--;
+        PrintException(NULL, "ThreadBlockTemplate()");
+    }
+    printf("ThreadBlockTemplate exiting, %d threads remaining\n", vnThreadsRunning[THREAD_TEMPLATE]);
+}
+
+void StartBlockTemplateThread(CWallet* pwallet)
+{
+    if (!NewThread(ThreadBlockTemplate, pwallet))
+        printf("Error: NewThread(ThreadBlockTemplate) failed\n");
+}
@@ -0,0 +1,92 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKTEMPLATE_H
+#define BITCOIN_BLOCKTEMPLATE_H
+
+#include "main.h"
+
+#include <boost/thread/condition_variable.hpp>
+
+class CWallet;
+
+/** Keeps a current proof-of-work candidate block on top of pindexBest.
+ *
+ * Rather than collecting the whole memory pool again every time a miner asks
+ * for work, mempool additions and removals are queued as deltas and applied to
+ * the existing candidate, and the merkle tree is kept level by level so that
+ * appending a transaction or changing the coinbase costs O(log n) hashes.
+ * Only transactions that CreateNewBlock would also have put last are appended;
+ * one paying more per kB than the last one taken by fee, or still in the
+ * high-priority part, has the template collected again.  A full rebuild
+ * (CreateNewBlock) otherwise only happens on a new tip, and is done by a
+ * background thread so the template is already waiting when the next getwork,
+ * getblocktemplate or miner loop comes around.
+ *
+ * The manager stays idle until the first proof-of-work template is requested,
+ * so nodes that never mine, or only stake, pay for a flag check on each
+ * mempool change.  The minter uses the template only if there is one.
+ */
+class CBlockTemplateManager
+{
+private:
+    // cs protects the template itself; cs_pending only the delta queue, and
+    // is always the innermost lock as it is taken from inside mempool.cs
+    mutable CCriticalSection cs;
+    CBlock* pblock;
+    CBlockIndex* pindexPrev;
+    CBlockTemplateState state;
+    std::vector<std::vector<uint256> > vMerkleLevels;
+    std::map<uint256, unsigned int> mapTxPos;
+    unsigned int nSequence;
+
+    boost::mutex cs_pending;
+    boost::condition_variable condPending;
+    std::vector<uint256> vPendingAdd;
+    std::set<uint256> setPendingRemove;
+    bool fPendingTip;
+    bool fActive;
+
+    void SetMerkleLeaf(unsigned int nPos, const uint256& hash);
+    void RebuildMerkleLevels();
+    bool AppendTransaction(CTxDB& txdb, CTransaction& tx, bool& fReorder);
+    void RemoveTransactions(const std::set<uint256>& setRemove);
+    void UpdateCoinbaseValue();
+    bool Rebuild(CWallet* pwallet);
+
+public:
+    CBlockTemplateManager();
+    ~CBlockTemplateManager();
+
+    // Called by the memory pool with mempool.cs held
+    void TransactionAdded(const uint256& hash);
+    void TransactionRemoved(const uint256& hash);
+    // Called by SetBestChain with cs_main held
+    void NewTip();
+
+    // Apply queued deltas, rebuilding from scratch if the tip moved.
+    // Takes cs_main and mempool.cs.
+    bool Update(CWallet* pwallet);
+
+    // Returns a heap copy of the current template with vMerkleTree filled in
+    // and a fresh coinbase timestamp, or NULL on failure.  pindexPrevRet is
+    // the block it was built on, which may be newer than the caller's view.
+    CBlock* CreateBlock(CWallet* pwallet, CBlockIndex*& pindexPrevRet);
+
+    // Copy the template's transactions into a proof-of-stake block being
+    // assembled on pindexPrevIn, within the size and sigop limits left by the
+    // coinstake.  Transactions later than the coinstake and their descendants
+    // are left out.  Caller holds cs_main and mempool.cs.
+    bool FillStakeBlock(CBlock& block, CBlockIndex* pindexPrevIn);
+
+    // Bumped every time the template contents change
+    unsigned int GetSequence() const;
+
+    void ThreadBuilder(CWallet* pwallet);
+};
+
+extern CBlockTemplateManager blockTemplate;
+
+void StartBlockTemplateThread(CWallet* pwallet);
+
+#endif
@@ -0,0 +1,145 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <math.h>
+
+#include "bloom.h"
+#include "util.h"
+
+using namespace std;
+
+static inline uint32_t ROTL32(uint32_t x, int8_t r)
+{
+    return (x << r) | (x >> (32 - r));
+}
+
+// MurmurHash3, x86 32-bit version: cheap, and good enough for spreading
+// elements over the filter, which the random tweak keeps others from predicting
+static unsigned int MurmurHash3(unsigned int nHashSeed, const unsigned char* pbegin, const unsigned char* pend)
+{
+    uint32_t h1 = nHashSeed;
+    const uint32_t c1 = 0xcc9e2d51;
+    const uint32_t c2 = 0x1b873593;
+    const int nblocks = (pend - pbegin) / 4;
+
+    // body
+    const unsigned char* blocks = pbegin;
+    for (int i = 0; i < nblocks; i++)
+    {
+        uint32_t k1 = (uint32_t)blocks[4*i] | ((uint32_t)blocks[4*i + 1] << 8) | ((uint32_t)blocks[4*i + 2] << 16) | ((uint32_t)blocks[4*i + 3] << 24);
+
+        k1 *= c1;
+        k1 = ROTL32(k1, 15);
+        k1 *= c2;
+
+        h1 ^= k1;
+        h1 = ROTL32(h1, 13);
+        h1 = h1 * 5 + 0xe6546b64;
+    }
+
+    // tail
+    const unsigned char* tail = pbegin + nblocks * 4;
+    uint32_t k1 = 0;
+    switch ((pend - pbegin) & 3)
+    {
+    case 3:
+        k1 ^= tail[2] << 16;
+        // fallthrough
+    case 2:
+        k1 ^= tail[1] << 8;
+        // fallthrough
+    case 1:
+        k1 ^= tail[0];
+        k1 *= c1;
+        k1 = ROTL32(k1, 15);
+        k1 *= c2;
+        h1 ^= k1;
+    }
+
+    // finalization
+    h1 ^= (uint32_t)(pend - pbegin);
+    h1 ^= h1 >> 16;
+    h1 *= 0x85ebca6b;
+    h1 ^= h1 >> 13;
+    h1 *= 0xc2b2ae35;
+    h1 ^= h1 >> 16;
+
+    return h1;
+}
+
+CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double nFPRate)
+{
+    // The optimal number of hash functions is log(1/fpRate)/log(2)
+    nHashFuncs = max(1, min((int)floor(log(nFPRate) / log(0.5) + 0.5), 50));
+    // Each generation holds half the elements, and up to three are in at once
+    nEntriesPerGeneration = max((int)(nElements + 1) / 2, 1);
+    uint64 nMaxElements = nEntriesPerGeneration * 3;
+    // Solve fpRate = (1 - exp(-nHashFuncs * nMaxElements / nFilterBits)) ^ nHashFuncs
+    // for nFilterBits
+    uint64 nFilterBits = (uint64)ceil(-1.0 * nHashFuncs * nMaxElements / log(1.0 - exp(log(nFPRate) / nHashFuncs)));
+    // Each 64 bits of the filter take two words, one per generation bit
+    data.resize(((nFilterBits + 63) / 64) << 1);
+    reset();
+}
+
+unsigned int CRollingBloomFilter::Hash(unsigned int nHashNum, const unsigned char* pbegin, const unsigned char* pend) const
+{
+    // 0xFBA4C795 chosen as it guarantees a reasonable bit difference between nHashNum values.
+    return MurmurHash3(nHashNum * 0xFBA4C795 + nTweak, pbegin, pend);
+}
+
+void CRollingBloomFilter::insert(const unsigned char* pbegin, const unsigned char* pend)
+{
+    if (nEntriesThisGeneration == nEntriesPerGeneration)
+    {
+        nEntriesThisGeneration = 0;
+        nGeneration++;
+        if (nGeneration == 4)
+            nGeneration = 1;
+        // Wipe the bits of the generation that is taking over: clear every
+        // pair equal to nGeneration
+        uint64 nGenerationMask1 = 0 - (uint64)(nGeneration & 1);
+        uint64 nGenerationMask2 = 0 - (uint64)(nGeneration >> 1);
+        for (unsigned int p = 0; p < data.size(); p += 2)
+        {
+            uint64 p1 = data[p], p2 = data[p + 1];
+            uint64 mask = (p1 ^ nGenerationMask1) | (p2 ^ nGenerationMask2);
+            data[p] = p1 & mask;
+            data[p + 1] = p2 & mask;
+        }
+    }
+    nEntriesThisGeneration++;
+
+    for (int n = 0; n < nHashFuncs; n++)
+    {
+        unsigned int h = Hash(n, pbegin, pend);
+        int bit = h & 0x3F;
+        unsigned int pos = (h >> 6) % data.size();
+        // The low bit of the generation in the even word, the high bit in the odd one
+        data[pos & ~1] = (data[pos & ~1] & ~(((uint64)1) << bit)) | ((uint64)(nGeneration & 1)) << bit;
+        data[pos | 1] = (data[pos | 1] & ~(((uint64)1) << bit)) | ((uint64)(nGeneration >> 1)) << bit;
+    }
+}
+
+bool CRollingBloomFilter::contains(const unsigned char* pbegin, const unsigned char* pend) const
+{
+    for (int n = 0; n < nHashFuncs; n++)
+    {
+        unsigned int h = Hash(n, pbegin, pend);
+        int bit = h & 0x3F;
+        unsigned int pos = (h >> 6) % data.size();
+        // Set by any generation still in
+        if (!(((data[pos & ~1] | data[pos | 1]) >> bit) & 1))
+            return false;
+    }
+    return true;
+}
+
+void CRollingBloomFilter::reset()
+{
+    nTweak = GetRand(std::numeric_limits<unsigned int>::max());
+    nEntriesThisGeneration = 0;
+    nGeneration = 1;
+    std::fill(data.begin(), data.end(), 0);
+}
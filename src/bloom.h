@@ -0,0 +1,164 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOOM_H
+#define BITCOIN_BLOOM_H
+
+#include <vector>
+
+#include "serialize.h"
+#include "uint256.h"
+
+/** A Bloom filter that forgets the oldest elements as new ones come in.
+ *
+ * The elements are spread over three generations of nElements / 2 each;
+ * once the newest generation is full, the oldest one is wiped and takes
+ * its place.  So the last nElements inserted are always found, and up to
+ * half as many again before them may still be.  Elements never inserted are
+ * reported with a probability of about nFPRate.
+ *
+ * Every bit of the filter is a pair of bits, which holds the generation
+ * that set it (1 to 3) or 0, so wiping a generation is a single pass over
+ * the data and the memory used is fixed at construction.
+ *
+ * Not thread safe.
+ */
+class CRollingBloomFilter
+{
+public:
+    CRollingBloomFilter(unsigned int nElements, double nFPRate);
+
+    void insert(const unsigned char* pbegin, const unsigned char* pend);
+    bool contains(const unsigned char* pbegin, const unsigned char* pend) const;
+
+    void insert(const std::vector<unsigned char>& vKey)
+    {
+        insert(vKey.empty() ? NULL : &vKey[0], vKey.empty() ? NULL : &vKey[0] + vKey.size());
+    }
+
+    bool contains(const std::vector<unsigned char>& vKey) const
+    {
+        return contains(vKey.empty() ? NULL : &vKey[0], vKey.empty() ? NULL : &vKey[0] + vKey.size());
+    }
+
+    void insert(const uint256& hash)
+    {
+        insert((const unsigned char*)&hash, (const unsigned char*)&hash + sizeof(hash));
+    }
+
+    bool contains(const uint256& hash) const
+    {
+        return contains((const unsigned char*)&hash, (const unsigned char*)&hash + sizeof(hash));
+    }
+
+    // Forget everything, and pick a new tweak for the hash functions
+    void reset();
+
+    // Bytes taken by the filter data
+    unsigned int GetMemoryUsage() const
+    {
+        return data.size() * sizeof(uint64);
+    }
+
+private:
+    int nEntriesPerGeneration;
+    int nEntriesThisGeneration;
+    int nGeneration;
+    std::vector<uint64> data;
+    unsigned int nTweak;
+    int nHashFuncs;
+
+    unsigned int Hash(unsigned int nHashNum, const unsigned char* pbegin, const unsigned char* pend) const;
+};
+
+/** Serializes an object into a buffer that is kept from one call to the
+ * next, for hashing it without an allocation each time */
+class CBloomKeyStream
+{
+private:
+    std::vector<unsigned char> vch;
+
+public:
+    int nType;
+    int nVersion;
+
+    CBloomKeyStream()
+    {
+        nType = SER_GETHASH;
+        nVersion = 0;
+    }
+
+    void write(const char* pch, size_t nSize)
+    {
+        vch.insert(vch.end(), (const unsigned char*)pch, (const unsigned char*)pch + nSize);
+    }
+
+    template<typename T>
+    CBloomKeyStream& operator<<(const T& obj)
+    {
+        ::Serialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+
+    template<typename T>
+    const std::vector<unsigned char>& Key(const T& obj)
+    {
+        vch.clear();
+        *this << obj;
+        return vch;
+    }
+};
+
+/** Stands in for an mruset where only insert and count are needed, such as
+ * the inventory and addresses a peer is known to have.  Memory is fixed by
+ * the size given, and count may say yes to an element that was never
+ * inserted with a probability of about nFPRate.  There is no iterating. */
+template <typename T> class mrufilter
+{
+public:
+    typedef T key_type;
+    typedef T value_type;
+    typedef unsigned int size_type;
+
+protected:
+    CRollingBloomFilter filter;
+    mutable CBloomKeyStream stream;
+    size_type nMaxSize;
+    double nFPRate;
+
+public:
+    mrufilter(size_type nMaxSizeIn = 1000, double nFPRateIn = 0.000001) : filter(nMaxSizeIn, nFPRateIn)
+    {
+        nMaxSize = nMaxSizeIn;
+        nFPRate = nFPRateIn;
+    }
+
+    size_type count(const key_type& k) const { return filter.contains(stream.Key(k)) ? 1 : 0; }
+
+    // Like set::insert, with the element in place of the iterator
+    std::pair<key_type, bool> insert(const key_type& x)
+    {
+        const std::vector<unsigned char>& vKey = stream.Key(x);
+        if (filter.contains(vKey))
+            return std::make_pair(x, false);
+        filter.insert(vKey);
+        return std::make_pair(x, true);
+    }
+
+    void clear() { filter.reset(); }
+
+    size_type max_size() const { return nMaxSize; }
+
+    // Unlike mruset this starts over empty, as a filter can't be resized
+    size_type max_size(size_type s)
+    {
+        if (s != nMaxSize)
+        {
+            filter = CRollingBloomFilter(s, nFPRate);
+            nMaxSize = s;
+        }
+        return nMaxSize;
+    }
+};
+
+#endif
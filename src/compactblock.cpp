@@ -0,0 +1,163 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "compactblock.h"
+
+using namespace std;
+
+CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block)
+{
+    nVersion = block.nVersion;
+    hashPrevBlock = block.hashPrevBlock;
+    hashMerkleRoot = block.hashMerkleRoot;
+    nTime = block.nTime;
+    nBits = block.nBits;
+    nNonce = block.nNonce;
+    vchBlockSig = block.vchBlockSig;
+    nSalt = GetRand(std::numeric_limits<uint64>::max());
+    SetSaltKey();
+
+    unsigned int nPrefilled = block.IsProofOfStake() ? 2 : 1;
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+    {
+        if (i < nPrefilled)
+        {
+            CPrefilledTransaction prefilled;
+            prefilled.nIndex = i;
+            prefilled.tx = block.vtx[i];
+            vPrefilledTxn.push_back(prefilled);
+        }
+        else
+            vShortTxIDs.push_back(CShortTxID(GetShortID(block.vtx[i].GetHash())));
+    }
+}
+
+// The key depends on the block and a salt the sender picks, so nobody can
+// make up transactions whose short IDs collide with a given block's ahead
+// of time
+void CBlockHeaderAndShortTxIDs::SetSaltKey()
+{
+    CBlock header;
+    GetHeader(header);
+    uint256 hashBlock = header.GetHash();
+    uint256 hashKey = Hash(BEGIN(hashBlock), END(hashBlock), BEGIN(nSalt), END(nSalt));
+    nSaltKey = hashKey.Get64();
+}
+
+uint64 CBlockHeaderAndShortTxIDs::GetShortID(const uint256& txhash) const
+{
+    uint256 hash = Hash(BEGIN(nSaltKey), END(nSaltKey), BEGIN(txhash), END(txhash));
+    return hash.Get64() & 0xffffffffffffULL;
+}
+
+void CBlockHeaderAndShortTxIDs::GetHeader(CBlock& block) const
+{
+    block.SetNull();
+    block.nVersion = nVersion;
+    block.hashPrevBlock = hashPrevBlock;
+    block.hashMerkleRoot = hashMerkleRoot;
+    block.nTime = nTime;
+    block.nBits = nBits;
+    block.nNonce = nNonce;
+    block.vchBlockSig = vchBlockSig;
+}
+
+int CPartialBlock::Init(const CBlockHeaderAndShortTxIDs& cmpctblock, CTxMemPool& pool)
+{
+    SetNull();
+
+    unsigned int nTxCount = cmpctblock.GetTxCount();
+    if (nTxCount == 0 || nTxCount > MAX_BLOCK_SIZE / 60)
+        return -1;
+
+    cmpctblock.GetHeader(block);
+    block.vtx.resize(nTxCount);
+    vHave.assign(nTxCount, false);
+
+    BOOST_FOREACH(const CPrefilledTransaction& prefilled, cmpctblock.vPrefilledTxn)
+    {
+        if (prefilled.nIndex >= nTxCount || vHave[prefilled.nIndex])
+            return -1;
+        block.vtx[prefilled.nIndex] = prefilled.tx;
+        vHave[prefilled.nIndex] = true;
+    }
+
+    // The remaining positions, in order, get the short IDs
+    map<uint64, unsigned int> mapShortIDs;
+    unsigned int nPos = 0;
+    BOOST_FOREACH(const CShortTxID& shortid, cmpctblock.vShortTxIDs)
+    {
+        while (vHave[nPos])
+            nPos++;
+        // Two transactions with the same short ID: can't tell them apart
+        if (!mapShortIDs.insert(make_pair(shortid.GetUint64(), nPos)).second)
+            return -1;
+        nPos++;
+    }
+
+    {
+        LOCK(pool.cs);
+        vector<bool> vCollided(nTxCount, false);
+        for (map<uint256, CTransaction>::const_iterator mi = pool.mapTx.begin(); mi != pool.mapTx.end(); ++mi)
+        {
+            map<uint64, unsigned int>::iterator it = mapShortIDs.find(cmpctblock.GetShortID(mi->first));
+            if (it == mapShortIDs.end())
+                continue;
+            unsigned int n = it->second;
+            if (vCollided[n])
+                continue;
+            if (vHave[n])
+            {
+                // Two pool transactions match; let the sender decide
+                vHave[n] = false;
+                vCollided[n] = true;
+                continue;
+            }
+            block.vtx[n] = mi->second;
+            vHave[n] = true;
+        }
+    }
+
+    hashBlock = block.GetHash();
+
+    int nMissing = 0;
+    for (unsigned int i = 0; i < nTxCount; i++)
+        if (!vHave[i])
+            nMissing++;
+    return nMissing;
+}
+
+void CPartialBlock::GetMissing(CBlockTransactionsRequest& req) const
+{
+    req.hashBlock = hashBlock;
+    req.vIndexes.clear();
+    for (unsigned int i = 0; i < vHave.size(); i++)
+        if (!vHave[i])
+            req.vIndexes.push_back(i);
+}
+
+bool CPartialBlock::FillMissing(const vector<CTransaction>& vtxMissing)
+{
+    unsigned int nNext = 0;
+    for (unsigned int i = 0; i < vHave.size(); i++)
+    {
+        if (vHave[i])
+            continue;
+        if (nNext >= vtxMissing.size())
+            return false;
+        block.vtx[i] = vtxMissing[nNext++];
+        vHave[i] = true;
+    }
+    return nNext == vtxMissing.size();
+}
+
+bool CPartialBlock::GetBlock(CBlock& blockRet) const
+{
+    for (unsigned int i = 0; i < vHave.size(); i++)
+        if (!vHave[i])
+            return false;
+    blockRet = block;
+    blockRet.vMerkleTree.clear();
+    return blockRet.BuildMerkleTree() == blockRet.hashMerkleRoot;
+}
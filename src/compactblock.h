@@ -0,0 +1,197 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_COMPACTBLOCK_H
+#define BITCOIN_COMPACTBLOCK_H
+
+#include "main.h"
+
+/** Compact block relay.
+ *
+ * Peers that set NODE_COMPACT_BLOCKS in their version message get a new tip
+ * pushed as a "cmpctblock" straight away, instead of an inv they have to
+ * answer with getdata: the header, the block signature, the coinbase and
+ * coinstake in full, and a 6-byte salted ID for every other transaction.
+ * The receiver fills the block in from its memory pool and asks for what it
+ * lacks with "getblocktxn", answered by "blocktxn".  If the rebuilt block
+ * doesn't match its merkle root (a short ID collision), the whole block is
+ * fetched with getdata as before.
+ */
+
+static const unsigned int SHORTTXID_SIZE = 6;
+
+/** A transaction ID shortened with a per-block salt */
+class CShortTxID
+{
+public:
+    unsigned char data[SHORTTXID_SIZE];
+
+    CShortTxID()
+    {
+        memset(data, 0, sizeof(data));
+    }
+
+    CShortTxID(uint64 n)
+    {
+        for (unsigned int i = 0; i < SHORTTXID_SIZE; i++)
+            data[i] = (n >> (8 * i)) & 0xff;
+    }
+
+    uint64 GetUint64() const
+    {
+        uint64 n = 0;
+        for (unsigned int i = 0; i < SHORTTXID_SIZE; i++)
+            n |= (uint64)data[i] << (8 * i);
+        return n;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(FLATDATA(data));
+    )
+};
+
+/** A transaction sent in full within a compact block */
+class CPrefilledTransaction
+{
+public:
+    unsigned int nIndex;
+    CTransaction tx;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nIndex);
+        READWRITE(tx);
+    )
+};
+
+/** The "cmpctblock" message */
+class CBlockHeaderAndShortTxIDs
+{
+private:
+    uint64 nSaltKey;
+
+    void SetSaltKey();
+
+public:
+    int nVersion;
+    uint256 hashPrevBlock;
+    uint256 hashMerkleRoot;
+    unsigned int nTime;
+    unsigned int nBits;
+    unsigned int nNonce;
+    std::vector<unsigned char> vchBlockSig;
+    uint64 nSalt;
+    std::vector<CShortTxID> vShortTxIDs;
+    std::vector<CPrefilledTransaction> vPrefilledTxn;
+
+    CBlockHeaderAndShortTxIDs()
+    {
+        nSaltKey = 0;
+    }
+
+    // Sends the coinbase, and the coinstake of a proof-of-stake block, in full
+    CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(this->nVersion);
+        nVersion = this->nVersion;
+        READWRITE(hashPrevBlock);
+        READWRITE(hashMerkleRoot);
+        READWRITE(nTime);
+        READWRITE(nBits);
+        READWRITE(nNonce);
+        READWRITE(vchBlockSig);
+        READWRITE(nSalt);
+        READWRITE(vShortTxIDs);
+        READWRITE(vPrefilledTxn);
+        if (fRead)
+            const_cast<CBlockHeaderAndShortTxIDs*>(this)->SetSaltKey();
+    )
+
+    uint64 GetShortID(const uint256& txhash) const;
+
+    unsigned int GetTxCount() const
+    {
+        return vShortTxIDs.size() + vPrefilledTxn.size();
+    }
+
+    // The block with the header filled in and no transactions
+    void GetHeader(CBlock& block) const;
+};
+
+/** The "getblocktxn" message: positions of the transactions still missing */
+class CBlockTransactionsRequest
+{
+public:
+    uint256 hashBlock;
+    std::vector<unsigned int> vIndexes;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hashBlock);
+        READWRITE(vIndexes);
+    )
+};
+
+/** The "blocktxn" message: the transactions asked for, in the same order */
+class CBlockTransactions
+{
+public:
+    uint256 hashBlock;
+    std::vector<CTransaction> vtx;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hashBlock);
+        READWRITE(vtx);
+    )
+};
+
+/** A block being rebuilt from a compact block; kept per peer in CNodeState */
+class CPartialBlock
+{
+private:
+    CBlock block;
+    std::vector<bool> vHave;
+    uint256 hashBlock;
+
+public:
+    CPartialBlock()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        block.SetNull();
+        vHave.clear();
+        hashBlock = 0;
+    }
+
+    bool IsNull() const
+    {
+        return hashBlock == 0;
+    }
+
+    const uint256& GetHash() const
+    {
+        return hashBlock;
+    }
+
+    // Fill in what we can from the prefilled transactions and the memory
+    // pool.  Returns the number of transactions still missing, or -1 if the
+    // compact block itself is malformed.  Takes mempool.cs.
+    int Init(const CBlockHeaderAndShortTxIDs& cmpctblock, CTxMemPool& pool);
+
+    void GetMissing(CBlockTransactionsRequest& req) const;
+
+    // Fill the holes with a "blocktxn" reply; false if it doesn't fit them
+    bool FillMissing(const std::vector<CTransaction>& vtxMissing);
+
+    // The complete block, if its merkle root comes out right
+    bool GetBlock(CBlock& blockRet) const;
+};
+
+#endif
@@ -48,6 +48,10 @@ typedef int socklen_t;
 #define SOCKET_ERROR        -1
 #endif
 
+#if defined(__linux__) && !defined(USE_EPOLL)
+#define USE_EPOLL 1
+#endif
+
 inline int myclosesocket(SOCKET& hSocket)
 {
     if (hSocket == INVALID_SOCKET)
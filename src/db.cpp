@@ -919,6 +919,15 @@ bool CBlkDB::LoadBlockIndex()
     if (fRequestShutdown)
 		return true;
 
+    // Skip pointers aren't stored, so build them anew, lowest block first
+    vector<pair<int, CBlockIndex*> > vSortedByHeight;
+    vSortedByHeight.reserve(mapBlockIndex.size());
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        vSortedByHeight.push_back(make_pair(item.second->nHeight, item.second));
+    sort(vSortedByHeight.begin(), vSortedByHeight.end());
+    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+        item.second->BuildSkip();
+
     unsigned int tempcount=0;
     unsigned int steptemp=0;
     string tempmess;
@@ -0,0 +1,260 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "headerchain.h"
+#include "checkpoints.h"
+#include "kernel.h"
+
+using namespace std;
+
+CHeaderIndex headerIndex;
+
+CHeaderEntry::CHeaderEntry(const CBlockIndex* pindex)
+{
+    nVersion = pindex->nVersion;
+    hashPrevBlock = pindex->pprev ? pindex->pprev->GetBlockHash() : 0;
+    hashMerkleRoot = pindex->hashMerkleRoot;
+    nTime = pindex->nTime;
+    nBits = pindex->nBits;
+    nNonce = pindex->nNonce;
+    nFlags = pindex->nFlags & CBlockIndex::BLOCK_PROOF_OF_STAKE;
+    hashProofOfStake = pindex->hashProofOfStake;
+}
+
+void CHeaderEntry::SetNull()
+{
+    nVersion = CBlock::CURRENT_VERSION;
+    hashPrevBlock = 0;
+    hashMerkleRoot = 0;
+    nTime = 0;
+    nBits = 0;
+    nNonce = 0;
+    nFlags = 0;
+    hashProofOfStake = 0;
+}
+
+CBlock CHeaderEntry::GetBlockHeader() const
+{
+    CBlock block;
+    block.nVersion = nVersion;
+    block.hashPrevBlock = hashPrevBlock;
+    block.hashMerkleRoot = hashMerkleRoot;
+    block.nTime = nTime;
+    block.nBits = nBits;
+    block.nNonce = nNonce;
+    return block;
+}
+
+CBlockIndex* CHeaderIndex::Lookup(const uint256& hash) const
+{
+    map<uint256, CBlockIndex*>::const_iterator mi = mapBlockIndex.find(hash);
+    if (mi != mapBlockIndex.end())
+        return (*mi).second;
+    mi = mapHeaders.find(hash);
+    if (mi != mapHeaders.end())
+        return (*mi).second;
+    return NULL;
+}
+
+bool CHeaderIndex::Accept(const CHeaderEntry& entry, const uint256& hash, NodeId nodeid, CBlockIndex*& pindexRet, int& nDoS)
+{
+    // Already known, with or without its block
+    CBlockIndex* pindex = Lookup(hash);
+    if (pindex)
+    {
+        pindexRet = pindex;
+        return true;
+    }
+
+    CBlockIndex* pindexPrev = Lookup(entry.hashPrevBlock);
+    if (!pindexPrev)
+        return error("CHeaderIndex::Accept() : prev block of %s not found", hash.ToString().substr(0,20).c_str());
+    int nHeight = pindexPrev->nHeight + 1;
+    bool fProofOfStake = entry.IsProofOfStake();
+
+    // Only so many headers ahead of our blocks, and from each peer; the
+    // rest come once the blocks have caught up
+    bool fUntrusted = (fProofOfStake && nHeight > Checkpoints::GetTotalBlocksEstimate()) || IsUntrusted(pindexPrev);
+    if (nHeight > nBestHeight + (fUntrusted ? MAX_UNTRUSTED_HEADERS_AHEAD : MAX_HEADERS_AHEAD))
+        return error("CHeaderIndex::Accept() : header %s at %d too far ahead of our blocks", hash.ToString().substr(0,20).c_str(), nHeight);
+    if (mapSourceCount[nodeid] >= MAX_HEADERS_PER_PEER)
+        return error("CHeaderIndex::Accept() : too many headers without their blocks from peer=%d", nodeid);
+
+    // The checks of AcceptBlock and CheckBlock that only need the header
+    if (!fProofOfStake && nHeight > POW_CUTOFF_BLOCK && nHeight < getPowRestartBlock())
+    {
+        nDoS = 100;
+        return error("CHeaderIndex::Accept() : no PoW block allowed between %d and %d (height = %d)", POW_CUTOFF_BLOCK, getPowRestartBlock(), nHeight);
+    }
+    if (!fProofOfStake && !CheckProofOfWork(hash, entry.nBits))
+    {
+        nDoS = 50;
+        return error("CHeaderIndex::Accept() : proof of work failed");
+    }
+    if (entry.nBits != GetNextTargetRequired(pindexPrev, fProofOfStake))
+    {
+        nDoS = 100;
+        return error("CHeaderIndex::Accept() : incorrect %s", fProofOfStake ? "proof-of-stake" : "proof-of-work");
+    }
+    if ((int64)entry.nTime <= pindexPrev->GetMedianTimePast() || (int64)entry.nTime + nMaxClockDrift < pindexPrev->GetBlockTime())
+        return error("CHeaderIndex::Accept() : block's timestamp is too early");
+    if ((int64)entry.nTime > GetAdjustedTime() + nMaxClockDrift)
+        return error("CHeaderIndex::Accept() : block timestamp too far in the future");
+    if (!Checkpoints::CheckHardened(nHeight, hash))
+    {
+        nDoS = 100;
+        return error("CHeaderIndex::Accept() : rejected by hardened checkpoint lock-in at %d", nHeight);
+    }
+
+    CBlockIndex* pindexNew = new CBlockIndex();
+    pindexNew->phashBlock = &hash;
+    pindexNew->pprev = pindexPrev;
+    pindexNew->nHeight = nHeight;
+    pindexNew->nVersion = entry.nVersion;
+    pindexNew->hashMerkleRoot = entry.hashMerkleRoot;
+    pindexNew->nTime = entry.nTime;
+    pindexNew->nBits = entry.nBits;
+    pindexNew->nNonce = entry.nNonce;
+    if (fProofOfStake)
+    {
+        // Only used for the stake modifier of the headers on top of it,
+        // which are untrusted as well
+        pindexNew->SetProofOfStake();
+        pindexNew->hashProofOfStake = entry.hashProofOfStake;
+    }
+    pindexNew->SetStakeEntropyBit(hash.Get64() & 1llu);
+    pindexNew->bnChainTrust = pindexPrev->bnChainTrust + pindexNew->GetBlockTrust();
+
+    // The stake modifier follows from the headers before this one, so a
+    // chain that leaves the stake modifier checkpoints is caught here
+    uint64 nStakeModifier = 0;
+    bool fGeneratedStakeModifier = false;
+    if (!ComputeNextStakeModifier(pindexPrev, nStakeModifier, fGeneratedStakeModifier))
+    {
+        delete pindexNew;
+        return error("CHeaderIndex::Accept() : ComputeNextStakeModifier() failed");
+    }
+    pindexNew->SetStakeModifier(nStakeModifier, fGeneratedStakeModifier);
+    pindexNew->nStakeModifierChecksum = GetStakeModifierChecksum(pindexNew);
+    if (!CheckStakeModifierCheckpoints(nHeight, pindexNew->nStakeModifierChecksum))
+    {
+        delete pindexNew;
+        nDoS = 100;
+        return error("CHeaderIndex::Accept() : rejected by stake modifier checkpoint height=%d, modifier=0x%016" PRI64x, nHeight, nStakeModifier);
+    }
+
+    map<uint256, CBlockIndex*>::iterator mi = mapHeaders.insert(make_pair(hash, pindexNew)).first;
+    pindexNew->phashBlock = &((*mi).first);
+    pindexNew->BuildSkip();
+    mapSource[pindexNew] = nodeid;
+    mapSourceCount[nodeid]++;
+    fPruneNeeded = true;
+
+    if (fUntrusted)
+        setUntrusted.insert(pindexNew);
+    else if (pindexBestHeader == NULL || pindexNew->bnChainTrust > pindexBestHeader->bnChainTrust)
+        pindexBestHeader = pindexNew;
+    pindexRet = pindexNew;
+    return true;
+}
+
+void CHeaderIndex::Remove(map<uint256, CBlockIndex*>::iterator mi)
+{
+    const CBlockIndex* pindex = (*mi).second;
+    map<const CBlockIndex*, NodeId>::iterator miSource = mapSource.find(pindex);
+    if (miSource != mapSource.end())
+    {
+        if (--mapSourceCount[(*miSource).second] == 0)
+            mapSourceCount.erase((*miSource).second);
+        mapSource.erase(miSource);
+    }
+    setUntrusted.erase(pindex);
+    mapHeaders.erase(mi);
+}
+
+CBlockIndex* CHeaderIndex::Take(const uint256& hash)
+{
+    map<uint256, CBlockIndex*>::iterator mi = mapHeaders.find(hash);
+    if (mi == mapHeaders.end())
+        return NULL;
+    CBlockIndex* pindex = (*mi).second;
+    Remove(mi);
+    return pindex;
+}
+
+CBlockIndex* CHeaderIndex::GetBest() const
+{
+    if (pindexBestHeader && (!pindexBest || pindexBestHeader->bnChainTrust > pindexBest->bnChainTrust))
+        return pindexBestHeader;
+    return pindexBest;
+}
+
+void CHeaderIndex::Prune(vector<CBlockIndex*>& vPruned)
+{
+    // Nothing to do if no headers came in and the best is the same
+    const CBlockIndex* pindexKeep = GetBest();
+    if (pindexKeep == NULL || (!fPruneNeeded && pindexKeep->GetBlockHash() == hashPrunedAt))
+        return;
+    fPruneNeeded = false;
+    hashPrunedAt = pindexKeep->GetBlockHash();
+
+    // The most chain trust and the greatest height of each header and the
+    // headers on top of it, handed down from the highest
+    vector<pair<int, CBlockIndex*> > vByHeight;
+    vByHeight.reserve(mapHeaders.size());
+    for (map<uint256, CBlockIndex*>::iterator mi = mapHeaders.begin(); mi != mapHeaders.end(); mi++)
+        vByHeight.push_back(make_pair((*mi).second->nHeight, (*mi).second));
+    sort(vByHeight.rbegin(), vByHeight.rend());
+    map<const CBlockIndex*, const CBlockIndex*> mapMostTrust;
+    map<const CBlockIndex*, int> mapMaxHeight;
+    for (vector<pair<int, CBlockIndex*> >::iterator it = vByHeight.begin(); it != vByHeight.end(); it++)
+    {
+        CBlockIndex* pindex = (*it).second;
+        const CBlockIndex*& pindexMostTrust = mapMostTrust[pindex];
+        if (pindexMostTrust == NULL)
+            pindexMostTrust = pindex;
+        int& nMaxHeight = mapMaxHeight[pindex];
+        nMaxHeight = max(nMaxHeight, pindex->nHeight);
+        if (pindex->pprev == NULL || !IsHeaderOnly(pindex->pprev))
+            continue;
+        const CBlockIndex*& pindexPrevMostTrust = mapMostTrust[pindex->pprev];
+        if (pindexPrevMostTrust == NULL || pindexMostTrust->bnChainTrust > pindexPrevMostTrust->bnChainTrust)
+            pindexPrevMostTrust = pindexMostTrust;
+        int& nPrevMaxHeight = mapMaxHeight[pindex->pprev];
+        nPrevMaxHeight = max(nPrevMaxHeight, nMaxHeight);
+    }
+
+    // A header off the branch goes once neither it nor anything on top of
+    // it can overtake the branch any more, taking everything on top along.
+    // Forks still close to the tip are kept: they may yet win.
+    map<uint256, CBlockIndex*>::iterator mi = mapHeaders.begin();
+    while (mi != mapHeaders.end())
+    {
+        CBlockIndex* pindex = (*mi).second;
+        if (pindexKeep->GetAncestor(pindex->nHeight) == pindex || pindex->GetAncestor(pindexKeep->nHeight) == pindexKeep ||
+            mapMostTrust[pindex]->bnChainTrust >= pindexKeep->bnChainTrust ||
+            mapMaxHeight[pindex] + PRUNE_HEADERS_DEPTH >= pindexKeep->nHeight)
+        {
+            mi++;
+            continue;
+        }
+        vPruned.push_back(pindex);
+        Remove(mi++);
+    }
+    if (vPruned.empty())
+        return;
+
+    // The best header may have been on one of them
+    if (find(vPruned.begin(), vPruned.end(), pindexBestHeader) != vPruned.end())
+    {
+        pindexBestHeader = NULL;
+        for (mi = mapHeaders.begin(); mi != mapHeaders.end(); mi++)
+        {
+            CBlockIndex* pindex = (*mi).second;
+            if (!IsUntrusted(pindex) && (pindexBestHeader == NULL || pindex->bnChainTrust > pindexBestHeader->bnChainTrust))
+                pindexBestHeader = pindex;
+        }
+    }
+    printf("CHeaderIndex::Prune() : %" PRIszu " stale headers off the branch of %s pruned\n", vPruned.size(), pindexKeep->GetBlockHash().ToString().substr(0,20).c_str());
+}
@@ -0,0 +1,162 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_HEADERCHAIN_H
+#define BITCOIN_HEADERCHAIN_H
+
+#include "main.h"
+
+/** Headers-first synchronization.
+ *
+ * Peers that set NODE_HEADERS answer "getheaders" with up to
+ * MAX_HEADERS_RESULTS headers of their main chain.  Each header is checked as
+ * far as it can be without its block: it has to connect, carry the target
+ * GetNextTargetRequired asks for at its height (and the proof-of-work for
+ * it, if it is a proof-of-work block), pass the hardened checkpoints, and
+ * the stake modifier it leads to has to match the stake modifier
+ * checkpoints.  An accepted header gets a CBlockIndex of its own, kept here
+ * until its block arrives and AddToBlockIndex takes the entry over, so the
+ * download code in main.cpp can ask several peers for the blocks under the
+ * best header at once.
+ *
+ * A proof-of-stake header can't be told from a made up one until its block
+ * is in, and past the last checkpoint nothing else pins it down.  Such a
+ * header, and any header on top of one, is only taken to fetch its block:
+ * it doesn't count for the best header, and it has to be within
+ * MAX_UNTRUSTED_HEADERS_AHEAD of pindexBest.  No peer can have more than
+ * MAX_HEADERS_PER_PEER headers waiting for their blocks, and forks that
+ * have fallen PRUNE_HEADERS_DEPTH behind the best branch are pruned.
+ *
+ * All of it requires cs_main.
+ */
+
+/** How far past pindexBest headers are taken without their blocks */
+static const int MAX_HEADERS_AHEAD = 4 * MAX_HEADERS_RESULTS;
+/** The same for headers that can't be trusted without their blocks */
+static const int MAX_UNTRUSTED_HEADERS_AHEAD = 2 * BLOCK_DOWNLOAD_WINDOW;
+/** Headers one peer may have in the index without their blocks */
+static const unsigned int MAX_HEADERS_PER_PEER = MAX_HEADERS_AHEAD;
+/** How far below the best header a fork has to end before it is pruned */
+static const int PRUNE_HEADERS_DEPTH = BLOCK_DOWNLOAD_WINDOW;
+
+/** One entry of a "headers" message.
+ *
+ * A bare header doesn't show whether its block is proof-of-stake, and the
+ * stake modifier needs the kernel hash of every proof-of-stake block, so
+ * the sender adds both from its own block index.  They can only be
+ * verified once the block is in, and AddToBlockIndex computes them anew.
+ */
+class CHeaderEntry
+{
+public:
+    int nVersion;
+    uint256 hashPrevBlock;
+    uint256 hashMerkleRoot;
+    unsigned int nTime;
+    unsigned int nBits;
+    unsigned int nNonce;
+    unsigned int nFlags;        // only CBlockIndex::BLOCK_PROOF_OF_STAKE is used
+    uint256 hashProofOfStake;
+
+    CHeaderEntry()
+    {
+        SetNull();
+    }
+
+    CHeaderEntry(const CBlockIndex* pindex);
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(this->nVersion);
+        nVersion = this->nVersion;
+        READWRITE(hashPrevBlock);
+        READWRITE(hashMerkleRoot);
+        READWRITE(nTime);
+        READWRITE(nBits);
+        READWRITE(nNonce);
+        READWRITE(nFlags);
+        READWRITE(hashProofOfStake);
+    )
+
+    void SetNull();
+
+    bool IsProofOfStake() const
+    {
+        return (nFlags & CBlockIndex::BLOCK_PROOF_OF_STAKE);
+    }
+
+    CBlock GetBlockHeader() const;
+};
+
+/** Index entries of headers whose blocks we don't have yet */
+class CHeaderIndex
+{
+private:
+    std::map<uint256, CBlockIndex*> mapHeaders;
+    // The peer each header came from, and how many headers each peer has here
+    std::map<const CBlockIndex*, NodeId> mapSource;
+    std::map<NodeId, unsigned int> mapSourceCount;
+    // Headers that count for nothing until their blocks are in
+    std::set<const CBlockIndex*> setUntrusted;
+    CBlockIndex* pindexBestHeader;
+    // Whether headers were added since the last Prune, and the best
+    // header it kept the branch of
+    bool fPruneNeeded;
+    uint256 hashPrunedAt;
+
+    void Remove(std::map<uint256, CBlockIndex*>::iterator mi);
+
+public:
+    CHeaderIndex()
+    {
+        pindexBestHeader = NULL;
+        fPruneNeeded = false;
+        hashPrunedAt = 0;
+    }
+
+    // The index entry for hash, whether we have its block or only its
+    // header; NULL if neither
+    CBlockIndex* Lookup(const uint256& hash) const;
+
+    // Whether pindex is only a header so far
+    bool IsHeaderOnly(const CBlockIndex* pindex) const
+    {
+        return mapHeaders.count(pindex->GetBlockHash()) > 0;
+    }
+
+    // Whether pindex is only a header so far, and one that can't be trusted
+    bool IsUntrusted(const CBlockIndex* pindex) const
+    {
+        return setUntrusted.count(pindex) > 0;
+    }
+
+    // Check the header entry, whose block hash is hash, sent by peer nodeid,
+    // and add it.  Returns the new or already known index entry in
+    // pindexRet.  On failure nDoS says how much the peer is to blame; a
+    // header that doesn't connect, is too far ahead of our blocks or is one
+    // too many from its peer fails with pindexRet and nDoS left alone.
+    bool Accept(const CHeaderEntry& entry, const uint256& hash, NodeId nodeid, CBlockIndex*& pindexRet, int& nDoS);
+
+    // Hand the entry for hash, if any, to AddToBlockIndex.  The object
+    // stays where it is, as peers' sync state and later headers point to it.
+    CBlockIndex* Take(const uint256& hash);
+
+    // The header with the most chain trust, or pindexBest if no header has more
+    CBlockIndex* GetBest() const;
+
+    // Take out the headers that are neither on the branch of GetBest() nor
+    // on top of it, and can't overtake it: nothing on top of them has as
+    // much chain trust, and they end PRUNE_HEADERS_DEPTH or more below it.
+    // They are handed over in vPruned, for the caller to clear what points
+    // to them and delete them.
+    void Prune(std::vector<CBlockIndex*>& vPruned);
+
+    unsigned int size() const
+    {
+        return mapHeaders.size();
+    }
+};
+
+extern CHeaderIndex headerIndex;
+
+#endif
@@ -5,6 +5,7 @@
 
 #include <openssl/ec.h> // for EC_KEY definition
 
+#include "blockcheck.h"
 #include "db.h"
 #include "walletdb.h"
 #include "bitcoinrpc.h"
@@ -288,6 +289,19 @@ std::string HelpMessage()
         "  -bantime=<n>           " + _("Number of seconds to keep misbehaving peers from reconnecting (default: 86400)") + "\n" +
         "  -maxreceivebuffer=<n>  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 5000)") + "\n" +
         "  -maxsendbuffer=<n>     " + _("Maximum per-connection send buffer, <n>*1000 bytes (default: 1000)") + "\n" +
+        "  -maxuploadrate=<n>     " + _("Limit the upload rate to <n>*1000 bytes per second (default: 0 = no limit)") + "\n" +
+        "  -maxdownloadrate=<n>   " + _("Limit the download rate to <n>*1000 bytes per second (default: 0 = no limit)") + "\n" +
+        "  -maxpeeruploadrate=<n> " + _("Limit the upload rate to each peer to <n>*1000 bytes per second (default: 0 = no limit)") + "\n" +
+        "  -maxpeerdownloadrate=<n> " + _("Limit the download rate from each peer to <n>*1000 bytes per second (default: 0 = no limit)") + "\n" +
+        "  -maxuploadtarget=<n>   " + _("Stop serving blocks older than a week once <n> MiB have been sent in 24 hours, keeping a tenth for new blocks and transactions (default: 0 = no limit)") + "\n" +
+        "  -msghandlers=<n>       " + _("Number of threads handling peer messages (1 to 8, default: 2)") + "\n" +
+        "  -compactblocks         " + _("Relay new blocks to peers that support it as header and short transaction IDs (default: 1)") + "\n" +
+        "  -headersfirst          " + _("Download the headers first and then the blocks from several peers at once, with peers that support it (default: 1)") + "\n" +
+#ifdef USE_EPOLL
+        "  -epoll                 " + _("Wait for network sockets with epoll rather than select (default: 1)") + "\n" +
+#endif
+        "  -maxorphanblocksize=<n> " + _("Keep at most <n> MB of orphan blocks, a quarter of it per peer (default: 40)") + "\n" +
+        "  -spillorphanblocks=<n> " + _("Keep orphan blocks larger than <n> KB in a temporary file instead of memory (default: 0 = never)") + "\n" +
 #ifdef USE_UPNP
 #if USE_UPNP
         "  -upnp                  " + _("Use UPnP to map the listening port (default: 1 when listening)") + "\n" +
@@ -323,11 +337,15 @@ std::string HelpMessage()
         "  -upgradewallet         " + _("Upgrade wallet to latest format") + "\n" +
         "  -keypool=<n>           " + _("Set key pool size to <n> (default: 100)") + "\n" +
         "  -rescan                " + _("Rescan the block chain for missing wallet transactions") + "\n" +
+        "  -rescanthreads=<n>     " + _("Set the number of threads reading blocks for a rescan (up to 16, 0 = auto, <0 = leave that many cores free, default: 0)") + "\n" +
         "  -salvagewallet         " + _("Attempt to recover private keys from a corrupt wallet.dat") + "\n" +
         "  -zapwallettxes  " + _("Delete all wallet transactions and only recover those parts of the blockchain through -rescan on startup") + "\n" +
         "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 2500, 0 = all)") + "\n" +
         "  -checklevel=<n>        " + _("How thorough the block verification is (0-6, default: 1)") + "\n" +
         "  -loadblock=<file>      " + _("Imports blocks from external blk000?.dat file") + "\n" +
+        "  -assumevalid=<hash>    " + _("If this block is in the chain assume that it and its ancestors are valid and skip their signature checks (default: 0 = verify all)") + "\n" +
+        "  -par=<n>               " + _("Set the number of block pre-check threads (up to 16, 0 = auto, <0 = leave that many cores free, 1 = none, default: 0)") + "\n" +
+        "  -stakethreads=<n>      " + _("Set the number of threads searching for stake kernels (up to 16, 0 = auto, <0 = leave that many cores free, 1 = none, default: 0)") + "\n" +
 
         "\n" + _("Block creation options:") + "\n" +
         "  -blockminsize=<n>      "   + _("Set minimum block size in bytes (default: 0)") + "\n" +
@@ -568,6 +586,16 @@ bool AppInit2()
             InitWarning(_("Warning: -paytxfee is set very high! This is the transaction fee you will pay if you send a transaction."));
     }
 
+    if (mapArgs.count("-assumevalid"))
+    {
+        string strAssumeValid = mapArgs["-assumevalid"];
+        if (!IsHex(strAssumeValid) || strAssumeValid.size() > 64)
+            return InitError(strprintf(_("Invalid block hash for -assumevalid=<hash>: '%s'"), strAssumeValid.c_str()));
+        hashAssumeValid.SetHex(strAssumeValid);
+    }
+
+    orphanBlocks.SetLimits(GetArg("-maxorphanblocksize", 40) * 1000000, GetArg("-spillorphanblocks", 0) * 1000);
+
     // ********************************************************* Step 4: application initialization: dir lock, daemonize, pidfile, debug log
 
     std::string strDataDir = GetDataDir().string();
@@ -742,6 +770,10 @@ bool AppInit2()
     fNoListen = !GetBoolArg("-listen", true);
     fDiscover = GetBoolArg("-discover", true);
     fNameLookup = GetBoolArg("-dns", true);
+    if (GetBoolArg("-compactblocks", true))
+        nLocalServices |= NODE_COMPACT_BLOCKS;
+    if (GetBoolArg("-headersfirst", true))
+        nLocalServices |= NODE_HEADERS;
 #ifdef USE_UPNP
     fUseUPnP = GetBoolArg("-upnp", USE_UPNP);
 #endif
@@ -1013,6 +1045,8 @@ bool AppInit2()
 
     // ********************************************************* Step 9: import blocks
 
+    StartBlockCheckThreads(GetArg("-par", 0));
+
     if (mapArgs.count("-loadblock"))
     {
         uiInterface.InitMessage(_("Importing blockchain data file."));
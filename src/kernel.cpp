@@ -57,7 +57,7 @@ static int64 GetStakeModifierSelectionIntervalSection(int nSection)
 }
 
 // Get stake modifier selection interval (in seconds)
-static int64 GetStakeModifierSelectionInterval()
+int64 GetStakeModifierSelectionInterval()
 {
     int64 nSelectionInterval = 0;
     for (int nSection=0; nSection<64; nSection++)
@@ -69,9 +69,11 @@ static int64 GetStakeModifierSelectionInterval()
 
 // select a block from the candidate blocks in vSortedByTimestamp, excluding
 // already selected blocks in vSelectedBlocks, and with timestamp up to
-// nSelectionIntervalStop.
+// nSelectionIntervalStop.  The candidates are looked up in mapCandidates
+// rather than mapBlockIndex, so this also works on a chain of headers.
 static bool SelectBlockFromCandidates(
     vector<pair<int64, uint256> >& vSortedByTimestamp,
+    const map<uint256, const CBlockIndex*>& mapCandidates,
     map<uint256, const CBlockIndex*>& mapSelectedBlocks,
     int64 nSelectionIntervalStop, uint64 nStakeModifierPrev,
     const CBlockIndex** pindexSelected)
@@ -81,9 +83,10 @@ static bool SelectBlockFromCandidates(
     *pindexSelected = (const CBlockIndex*) 0;
     BOOST_FOREACH(const PAIRTYPE(int64, uint256)& item, vSortedByTimestamp)
     {
-        if (!mapBlockIndex.count(item.second))
+        map<uint256, const CBlockIndex*>::const_iterator mi = mapCandidates.find(item.second);
+        if (mi == mapCandidates.end())
             return error("SelectBlockFromCandidates: failed to find block index for candidate block %s", item.second.ToString().c_str());
-        const CBlockIndex* pindex = mapBlockIndex[item.second];
+        const CBlockIndex* pindex = (*mi).second;
         if (fSelected && pindex->GetBlockTime() > nSelectionIntervalStop)
             break;
         if (mapSelectedBlocks.count(pindex->GetBlockHash()) > 0)
@@ -155,10 +158,12 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64& nStakeModif
     vSortedByTimestamp.reserve(64 * nModifierInterval / nStakeTargetSpacing);
     int64 nSelectionInterval = GetStakeModifierSelectionInterval();
     int64 nSelectionIntervalStart = (pindexPrev->GetBlockTime() / nModifierInterval) * nModifierInterval - nSelectionInterval;
+    map<uint256, const CBlockIndex*> mapCandidates;
     const CBlockIndex* pindex = pindexPrev;
     while (pindex && pindex->GetBlockTime() >= nSelectionIntervalStart)
     {
         vSortedByTimestamp.push_back(make_pair(pindex->GetBlockTime(), pindex->GetBlockHash()));
+        mapCandidates.insert(make_pair(pindex->GetBlockHash(), pindex));
         pindex = pindex->pprev;
     }
     int nHeightFirstCandidate = pindex ? (pindex->nHeight + 1) : 0;
@@ -174,7 +179,7 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64& nStakeModif
         // add an interval section to the current selection round
         nSelectionIntervalStop += GetStakeModifierSelectionIntervalSection(nRound);
         // select a block from the candidates of current round
-        if (!SelectBlockFromCandidates(vSortedByTimestamp, mapSelectedBlocks, nSelectionIntervalStop, nStakeModifier, &pindex))
+        if (!SelectBlockFromCandidates(vSortedByTimestamp, mapCandidates, mapSelectedBlocks, nSelectionIntervalStop, nStakeModifier, &pindex))
             return error("ComputeNextStakeModifier: unable to select block at round %d", nRound);
         // write the entropy bit of the selected block
         nStakeModifierNew |= (((uint64)pindex->GetStakeEntropyBit()) << nRound);
@@ -217,9 +222,68 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64& nStakeModif
     return true;
 }
 
+// Main chain blocks that generated a stake modifier, in height order, so
+// GetKernelStakeModifier can find the one a selection interval after a coin
+// without walking pnext block by block.  nTimeMax is the latest block time
+// up to and including the entry: block times are not in order, but nTimeMax
+// is, and can be searched.
+struct CStakeModifierEntry
+{
+    int nHeight;
+    int64 nTime;
+    int64 nTimeMax;
+    const CBlockIndex* pindex;
+
+    bool operator<(int nHeightIn) const { return nHeight < nHeightIn; }
+};
+
+static vector<CStakeModifierEntry> vStakeModifierIndex;
+// Main chain block the index goes up to
+static const CBlockIndex* pindexStakeModifierIndex = NULL;
+
+void UpdateStakeModifierIndex()
+{
+    if (pindexStakeModifierIndex == pindexBest)
+        return;
+
+    // Drop the blocks a reorganization took out of the main chain
+    const CBlockIndex* pindexFork = pindexStakeModifierIndex;
+    while (pindexFork && !pindexFork->IsInMainChain())
+        pindexFork = pindexFork->pprev;
+    int nForkHeight = pindexFork ? pindexFork->nHeight : -1;
+    while (!vStakeModifierIndex.empty() && vStakeModifierIndex.back().nHeight > nForkHeight)
+        vStakeModifierIndex.pop_back();
+    pindexStakeModifierIndex = pindexFork;
+    if (pindexBest == NULL)
+        return;
+
+    // and add the blocks after it
+    const CBlockIndex* pindex = pindexFork ? pindexFork->pnext : pindexGenesisBlock;
+    for (; pindex; pindex = pindex->pnext)
+    {
+        if (pindex->GeneratedStakeModifier())
+        {
+            CStakeModifierEntry entry;
+            entry.nHeight = pindex->nHeight;
+            entry.nTime = pindex->GetBlockTime();
+            entry.nTimeMax = vStakeModifierIndex.empty() ? entry.nTime : max(entry.nTime, vStakeModifierIndex.back().nTimeMax);
+            entry.pindex = pindex;
+            vStakeModifierIndex.push_back(entry);
+        }
+        pindexStakeModifierIndex = pindex;
+        if (pindex == pindexBest)
+            break;
+    }
+}
+
+static bool CompareTimeMax(const CStakeModifierEntry& entry, int64 nTime)
+{
+    return entry.nTimeMax < nTime;
+}
+
 // The stake modifier used to hash for a stake kernel is chosen as the stake
 // modifier about a selection interval later than the coin generating the kernel
-static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64& nStakeModifier, int& nStakeModifierHeight, int64& nStakeModifierTime, bool fPrintProofOfStake)
+bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64& nStakeModifier, int& nStakeModifierHeight, int64& nStakeModifierTime, bool fPrintProofOfStake)
 {
     nStakeModifier = 0;
     if (!mapBlockIndex.count(hashBlockFrom))
@@ -230,28 +294,54 @@ static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64& nStakeModifier
     int64 nStakeModifierSelectionInterval = GetStakeModifierSelectionInterval();
     const CBlockIndex* pindex = pindexFrom;
 
-    // loop to find the stake modifier later by a selection interval
-    while (nStakeModifierTime < pindexFrom->GetBlockTime() + nStakeModifierSelectionInterval)
+    UpdateStakeModifierIndex();
+    if (pindexStakeModifierIndex == pindexBest && pindexFrom->IsInMainChain())
     {
-        if (!pindex->pnext)
-        {   // reached best block; may happen if node is behind on block chain
-            if (fPrintProofOfStake || (pindex->GetBlockTime() + nStakeMinAge - nStakeModifierSelectionInterval > GetAdjustedTime()))
-                return error("GetKernelStakeModifier() : reached best block %s at height %d from block %s",
-                    pindex->GetBlockHash().ToString().c_str(), pindex->nHeight, hashBlockFrom.ToString().c_str());
-            else
-			{
-				// printf(">> nStakeModifierTime = %" PRI64d ", pindexFrom->GetBlockTime() = %" PRI64d ", nStakeModifierSelectionInterval = %" PRI64d "\n",
-				//  	nStakeModifierTime, pindexFrom->GetBlockTime(), nStakeModifierSelectionInterval);
-                return false;
-			}
+        // The first modifier generated after the block, and at least a
+        // selection interval after it
+        int64 nTimeSelection = pindexFrom->GetBlockTime() + nStakeModifierSelectionInterval;
+        vector<CStakeModifierEntry>::iterator it = lower_bound(vStakeModifierIndex.begin(), vStakeModifierIndex.end(), pindexFrom->nHeight + 1);
+        if (it == vStakeModifierIndex.begin() || (it - 1)->nTimeMax < nTimeSelection)
+            it = lower_bound(it, vStakeModifierIndex.end(), nTimeSelection, CompareTimeMax);
+        else
+        {
+            // A block before has a later time than this one
+            while (it != vStakeModifierIndex.end() && it->nTime < nTimeSelection)
+                ++it;
         }
-        pindex = pindex->pnext;
-        if (pindex->GeneratedStakeModifier())
+
+        if (it == vStakeModifierIndex.end())
+            pindex = pindexBest;
+        else
         {
-            nStakeModifierHeight = pindex->nHeight;
-            nStakeModifierTime = pindex->GetBlockTime();
+            nStakeModifierHeight = it->nHeight;
+            nStakeModifierTime = it->nTime;
+            pindex = it->pindex;
         }
     }
+    else
+    {
+        // loop to find the stake modifier later by a selection interval
+        while (nStakeModifierTime < pindexFrom->GetBlockTime() + nStakeModifierSelectionInterval)
+        {
+            if (!pindex->pnext)
+                break;
+            pindex = pindex->pnext;
+            if (pindex->GeneratedStakeModifier())
+            {
+                nStakeModifierHeight = pindex->nHeight;
+                nStakeModifierTime = pindex->GetBlockTime();
+            }
+        }
+    }
+
+    if (nStakeModifierTime < pindexFrom->GetBlockTime() + nStakeModifierSelectionInterval)
+    {   // reached best block; may happen if node is behind on block chain
+        if (fPrintProofOfStake || (pindex->GetBlockTime() + nStakeMinAge - nStakeModifierSelectionInterval > GetAdjustedTime()))
+            return error("GetKernelStakeModifier() : reached best block %s at height %d from block %s",
+                pindex->GetBlockHash().ToString().c_str(), pindex->nHeight, hashBlockFrom.ToString().c_str());
+        return false;
+    }
     nStakeModifier = pindex->nStakeModifier;
     return true;
 }
@@ -376,9 +466,9 @@ bool CheckProofOfStake(const CTransaction& tx, unsigned int nBits, uint256& hash
     if (!VerifySignature(txPrev, tx, 0, true, 0))
         return tx.DoS(100, error("CheckProofOfStake() : VerifySignature failed on coinstake %s", tx.GetHash().ToString().c_str()));
 
-    // Read block header
+    // Read block header; GetCoinAge needs it again when the block connects
     CBlock block;
-    if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+    if (!ReadStakeBlockHeader(txindex.pos.nFile, txindex.pos.nBlockPos, block))
         return fDebug? error("CheckProofOfStake() : read block failed") : false; // unable to read block of previous transaction
 
     if (!CheckStakeKernelHash(nBits, block, txindex.pos.nTxPos - txindex.pos.nBlockPos, txPrev, txin.prevout, tx.nTime, hashProofOfStake, fDebug))
@@ -17,6 +17,18 @@ static const int MODIFIER_INTERVAL_RATIO = 3;
 // Compute the hash modifier for proof-of-stake
 bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64& nStakeModifier, bool& fGeneratedStakeModifier);
 
+// Get the length of the stake modifier selection interval
+int64 GetStakeModifierSelectionInterval();
+
+// Bring the index of the blocks that generated a stake modifier up to
+// pindexBest; requires cs_main
+void UpdateStakeModifierIndex();
+
+// Get the stake modifier a kernel from block hashBlockFrom hashes with;
+// false while the chain doesn't reach a selection interval past the block.
+// Requires cs_main
+bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64& nStakeModifier, int& nStakeModifierHeight, int64& nStakeModifierTime, bool fPrintProofOfStake);
+
 // Check whether stake kernel meets hash target
 // Sets hashProofOfStake on success return
 bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, bool fPrintProofOfStake=false);
@@ -274,6 +274,41 @@ CPrivKey CKey::GetPrivKey() const
     return vchPrivKey;
 }
 
+bool CKey::ExtractSecret(const CPrivKey& vchPrivKey, CSecret& vchSecret)
+{
+    // ECPrivateKey ::= SEQUENCE { INTEGER 1, OCTET STRING privateKey, ... }
+    unsigned int nSize = vchPrivKey.size();
+    unsigned int n = 0;
+    if (nSize < 2 || vchPrivKey[n++] != 0x30)
+        return false;
+    unsigned int nLen = vchPrivKey[n++];
+    if (nLen & 0x80)
+    {
+        unsigned int nLenBytes = nLen & 0x7f;
+        if (nLenBytes < 1 || nLenBytes > 2 || n + nLenBytes > nSize)
+            return false;
+        nLen = 0;
+        while (nLenBytes--)
+            nLen = (nLen << 8) | vchPrivKey[n++];
+    }
+    if (n + nLen != nSize)
+        return false;
+    if (n + 5 > nSize || vchPrivKey[n] != 0x02 || vchPrivKey[n+1] != 0x01 || vchPrivKey[n+2] != 0x01 || vchPrivKey[n+3] != 0x04)
+        return false;
+
+    // Older OpenSSL leaves out the leading zeros of the secret
+    unsigned int nSecret = vchPrivKey[n+4];
+    n += 5;
+    if (nSecret < 1 || nSecret > 32 || n + nSecret > nSize)
+        return false;
+    vchSecret.assign(32 - nSecret, 0);
+    vchSecret.insert(vchSecret.end(), vchPrivKey.begin() + n, vchPrivKey.begin() + n + nSecret);
+    for (unsigned int i = 0; i < 32; i++)
+        if (vchSecret[i] != 0)
+            return true;
+    return false;
+}
+
 bool CKey::SetPubKey(const CPubKey& vchPubKey)
 {
     const unsigned char* pbegin = &vchPubKey.vchPubKey[0];
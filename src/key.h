@@ -134,6 +134,9 @@ public:
     bool SetSecret(const CSecret& vchSecret, bool fCompressed = false);
     CSecret GetSecret(bool &fCompressed) const;
     CPrivKey GetPrivKey() const;
+    // Pick the secret out of a private key as GetPrivKey encodes it, with
+    // no elliptic curve arithmetic and so no check it matches any public key
+    static bool ExtractSecret(const CPrivKey& vchPrivKey, CSecret& vchSecret);
     bool SetPubKey(const CPubKey& vchPubKey);
     CPubKey GetPubKey() const;
 
@@ -26,7 +26,20 @@ bool CBasicKeyStore::AddKey(const CKey& key)
     CSecret secret = key.GetSecret(fCompressed);
     {
         LOCK(cs_KeyStore);
-        mapKeys[key.GetPubKey().GetID()] = make_pair(secret, fCompressed);
+        CKeyID keyID = key.GetPubKey().GetID();
+        mapKeys[keyID] = make_pair(secret, fCompressed);
+        setKeyUnverified.erase(keyID);
+    }
+    return true;
+}
+
+bool CBasicKeyStore::AddKeyUnverified(const CPubKey& vchPubKey, const CSecret& vchSecret)
+{
+    {
+        LOCK(cs_KeyStore);
+        CKeyID keyID = vchPubKey.GetID();
+        mapKeys[keyID] = make_pair(vchSecret, vchPubKey.IsCompressed());
+        setKeyUnverified.insert(keyID);
     }
     return true;
 }
@@ -65,6 +78,16 @@ bool CBasicKeyStore::GetCScript(const CScriptID &hash, CScript& redeemScriptOut)
     return false;
 }
 
+void CBasicKeyStore::GetCScripts(std::set<CScriptID> &setScriptID) const
+{
+    setScriptID.clear();
+    {
+        LOCK(cs_KeyStore);
+        for (ScriptMap::const_iterator mi = mapScripts.begin(); mi != mapScripts.end(); ++mi)
+            setScriptID.insert((*mi).first);
+    }
+}
+
 bool CCryptoKeyStore::SetCrypted()
 {
     {
@@ -145,6 +168,16 @@ bool CCryptoKeyStore::AddKey(const CKey& key)
 }
 
 
+bool CCryptoKeyStore::AddKeyUnverified(const CPubKey& vchPubKey, const CSecret& vchSecret)
+{
+    {
+        LOCK(cs_KeyStore);
+        if (IsCrypted())
+            return false;
+        return CBasicKeyStore::AddKeyUnverified(vchPubKey, vchSecret);
+    }
+}
+
 bool CCryptoKeyStore::AddCryptedKey(const CPubKey &vchPubKey, const std::vector<unsigned char> &vchCryptedSecret)
 {
     {
@@ -213,6 +246,8 @@ bool CCryptoKeyStore::EncryptKeys(CKeyingMaterial& vMasterKeyIn)
             if (!key.SetSecret(mKey.second.first, mKey.second.second))
                 return false;
             const CPubKey vchPubKey = key.GetPubKey();
+            if (vchPubKey.GetID() != mKey.first)
+                return false;
             std::vector<unsigned char> vchCryptedSecret;
             bool fCompressed;
             if (!EncryptSecret(vMasterKeyIn, key.GetSecret(fCompressed), vchPubKey.GetHash(), vchCryptedSecret))
@@ -221,6 +256,7 @@ bool CCryptoKeyStore::EncryptKeys(CKeyingMaterial& vMasterKeyIn)
                 return false;
         }
         mapKeys.clear();
+        setKeyUnverified.clear();
     }
     return true;
 }
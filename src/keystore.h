@@ -53,9 +53,13 @@ class CBasicKeyStore : public CKeyStore
 protected:
     KeyMap mapKeys;
     ScriptMap mapScripts;
+    // Keys added by AddKeyUnverified whose secret hasn't been checked against
+    // the public key yet; GetKey does it the first time the key is used
+    mutable std::set<CKeyID> setKeyUnverified;
 
 public:
     bool AddKey(const CKey& key);
+    bool AddKeyUnverified(const CPubKey& vchPubKey, const CSecret& vchSecret);
     bool HaveKey(const CKeyID &address) const
     {
         bool result;
@@ -87,6 +91,15 @@ public:
             {
                 keyOut.Reset();
                 keyOut.SetSecret((*mi).second.first, (*mi).second.second);
+                if (setKeyUnverified.count(address))
+                {
+                    if (keyOut.GetPubKey().GetID() != address)
+                    {
+                        keyOut.Reset();
+                        return error("CBasicKeyStore::GetKey() : secret doesn't match public key %s", address.ToString().c_str());
+                    }
+                    setKeyUnverified.erase(address);
+                }
                 return true;
             }
         }
@@ -95,6 +108,7 @@ public:
     virtual bool AddCScript(const CScript& redeemScript);
     virtual bool HaveCScript(const CScriptID &hash) const;
     virtual bool GetCScript(const CScriptID &hash, CScript& redeemScriptOut) const;
+    void GetCScripts(std::set<CScriptID> &setScriptID) const;
 };
 
 typedef std::map<CKeyID, std::pair<CPubKey, std::vector<unsigned char> > > CryptedKeyMap;
@@ -147,6 +161,7 @@ public:
 
     virtual bool AddCryptedKey(const CPubKey &vchPubKey, const std::vector<unsigned char> &vchCryptedSecret);
     bool AddKey(const CKey& key);
+    bool AddKeyUnverified(const CPubKey& vchPubKey, const CSecret& vchSecret);
     bool HaveKey(const CKeyID &address) const
     {
         {
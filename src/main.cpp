@@ -4,6 +4,10 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "alert.h"
+#include "blockcheck.h"
+#include "blocktemplate.h"
+#include "compactblock.h"
+#include "headerchain.h"
 #include "checkpoints.h"
 #include "db.h"
 #include "net.h"
@@ -67,6 +71,10 @@ uint256 hashBestChain = 0;
 CBlockIndex* pindexBest = NULL;
 int64 nTimeBestReceived = 0;
 
+// -assumevalid: the block whose ancestors' scripts aren't checked
+uint256 hashAssumeValid = 0;
+static CChainTxStats chainTxStats;
+
 // by Simone, use just a single value....
 int cPeerBlockCounts = 0;
 CMedianFilter<int> cPeerBlockCountsList(5, 0);  // Amount of blocks that other nodes claim to have
@@ -78,13 +86,14 @@ static bool blockSyncingAcceptBlock = false;
 static bool blockSyncingAddToBlockIndex = false;
 static bool blockSyncingSetBestChain = false;
 
-map<uint256, CBlock*> mapOrphanBlocks;
-multimap<uint256, CBlock*> mapOrphanBlocksByPrev;
-set<pair<COutPoint, unsigned int> > setStakeSeenOrphan;
+COrphanBlockPool orphanBlocks;
 map<uint256, uint256> mapProofOfStake;
 
-map<uint256, CDataStream*> mapOrphanTransactions;
-map<uint256, map<uint256, CDataStream*> > mapOrphanTransactionsByPrev;
+CCriticalSection cs_mapOrphanTransactions;
+map<uint256, COrphanTx> mapOrphanTransactions;
+map<COutPoint, set<uint256> > mapOrphanTransactionsByPrev;
+map<NodeId, unsigned int> mapOrphanTransactionsByPeer;
+set<pair<int64, uint256> > setOrphanTransactionsByExpire;
 
 // Constant stuff for coinbase transactions we create:
 CScript COINBASE_FLAGS;
@@ -97,6 +106,18 @@ int64 nHPSTimerStart;
 // Settings
 int64 nTransactionFee = MIN_TX_FEE;
 
+/** A block asked for from a peer */
+struct QueuedBlock {
+    uint256 hash;
+    //! Its index entry, NULL if even the header was unknown when it was asked for
+    CBlockIndex *pindex;
+    //! When it was asked for, in microseconds
+    int64_t nTime;
+    //! When it is asked for from another peer instead, in microseconds; 0
+    //! until the blocks asked for before it are in
+    int64_t nDeadline;
+};
+
 /**
  * Maintain validation-specific state about nodes, protected by cs_main, instead
  * by CNode's own locks. This simplifies asynchronous operation, where
@@ -128,12 +149,28 @@ struct CNodeState {
     CBlockIndex *pindexBestHeaderSent;
     //! Length of current-streak of unconnecting headers announcements
     int nUnconnectingHeaders;
+    //! The last header taken from a headers message that was cut short, to
+    //! ask for the rest from once our blocks have caught up.
+    CBlockIndex *pindexHeadersResume;
     //! Whether we've started headers synchronization with this peer.
     bool fSyncStarted;
     //! Since when we're stalling block download progress (in microseconds), or 0.
     int64_t nStallingSince;
-
-//    list<QueuedBlock> vBlocksInFlight;
+    //! Blocks this peer delivered that we asked it for.
+    int nBlocksReceived;
+    //! Moving averages of the time from getdata to block, and of the time each block took
+    //! after the one before it, in microseconds; 0 until the first block.
+    int64_t nAvgBlockLatency;
+    int64_t nAvgBlockTime;
+    //! Moving average of the block bytes it delivers per second.
+    int64_t nAvgBlockBytesPerSec;
+    //! When its last requested block arrived, in microseconds.
+    int64_t nLastBlockReceived;
+    //! Passes in a row in which it let requests time out, and all requests it let time out.
+    int nTimeoutStreak;
+    int nTimeouts;
+
+    list<QueuedBlock> vBlocksInFlight;
 
     //! When the first entry in vBlocksInFlight started downloading. Don't care when vBlocksInFlight is empty.
     int64_t nDownloadingSince;
@@ -143,6 +180,8 @@ struct CNodeState {
     bool fPreferredDownload;
     //! Whether this peer wants invs or headers (when possible) for block announcements.
     bool fPreferHeaders;
+    //! Whether we both set NODE_HEADERS, and blocks are fetched from it headers first.
+    bool fSyncHeaders;
     //! Whether this peer wants invs or cmpctblocks (when possible) for block announcements.
     bool fPreferHeaderAndIDs;
     /**
@@ -160,6 +199,8 @@ struct CNodeState {
      * otherwise: whether this peer sends non-witnesses in cmpctblocks/blocktxns.
      */
     bool fSupportsDesiredCmpctVersion;
+    //! Block being rebuilt from this peer's last cmpctblock
+    CPartialBlock partialBlock;
 
     CNodeState() {
         fCurrentlyConnected = false;
@@ -170,13 +211,22 @@ struct CNodeState {
         pindexLastCommonBlock = NULL;
         pindexBestHeaderSent = NULL;
         nUnconnectingHeaders = 0;
+        pindexHeadersResume = NULL;
         fSyncStarted = false;
         nStallingSince = 0;
+        nBlocksReceived = 0;
+        nAvgBlockLatency = 0;
+        nAvgBlockTime = 0;
+        nAvgBlockBytesPerSec = 0;
+        nLastBlockReceived = 0;
+        nTimeoutStreak = 0;
+        nTimeouts = 0;
         nDownloadingSince = 0;
         nBlocksInFlight = 0;
         nBlocksInFlightValidHeaders = 0;
         fPreferredDownload = false;
         fPreferHeaders = false;
+        fSyncHeaders = false;
         fPreferHeaderAndIDs = false;
         fProvidesHeaderAndIDs = false;
         fHaveWitness = false;
@@ -191,10 +241,21 @@ map<NodeId, CNodeState> mapNodeState;
 /** Number of preferable block download peers. */
 int nPreferredDownload = 0;
 
+/** Blocks asked for with getdata, and the peer and its queue entry for each. Requires cs_main. */
+map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
+
+/** Number of peers we have asked for headers. */
+int nSyncStarted = 0;
+
+/** Blocks whose request timed out, with the peer and the time (in microseconds).  That
+ *  peer isn't asked for it again for a while, so another one gets the chance.  Requires cs_main. */
+map<uint256, pair<NodeId, int64_t> > mapBlocksTimedOut;
+
 // by Simone: latched status for the IsInitialBlockDownload() function
 bool ibdLatched = false;
 bool irdLatched = false;
 extern void NetResumed();
+void EraseOrphansFor(NodeId peer);
 
 // Requires cs_main.
 CNodeState *State(NodeId pnode) {
@@ -204,6 +265,286 @@ CNodeState *State(NodeId pnode) {
     return &it->second;
 }
 
+// Moving average with a weight of 1/8 for the new sample, like TCP's RTT estimate
+static int64_t UpdateAverage(int64_t nAvg, int64_t nSample)
+{
+    if (nAvg == 0)
+        return nSample;
+    return nAvg + (nSample - nAvg) / 8;
+}
+
+// The deadline of a request the peer is getting to now
+int64_t static BlockDownloadDeadline(const CNodeState* state, int64_t nNow)
+{
+    return nNow + BLOCK_DOWNLOAD_TIMEOUT_BASE * 1000000 + 2 * state->nAvgBlockTime;
+}
+
+// Requires cs_main.  nodeFrom is the peer that delivered the block, if it
+// did arrive; its nSize bytes count towards that peer's download stats.
+void MarkBlockAsReceived(const uint256& hash, NodeId nodeFrom = -1, unsigned int nSize = 0)
+{
+    if (nodeFrom != -1)
+    {
+        mapBlocksTimedOut.erase(hash);
+        // Whatever it was, the peer is delivering
+        CNodeState *stateFrom = State(nodeFrom);
+        if (stateFrom)
+            stateFrom->nTimeoutStreak = 0;
+    }
+
+    map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+    if (itInFlight != mapBlocksInFlight.end())
+    {
+        CNodeState *state = State(itInFlight->second.first);
+        if (itInFlight->second.first == nodeFrom)
+        {
+            // Blocks are asked for in batches, so the time a block took is
+            // counted from the later of its request and the block before
+            int64_t nNow = GetTimeMicros();
+            const QueuedBlock& entry = *itInFlight->second.second;
+            int64_t nBlockTime = std::max<int64_t>(nNow - std::max(entry.nTime, state->nLastBlockReceived), 1);
+            state->nAvgBlockLatency = UpdateAverage(state->nAvgBlockLatency, nNow - entry.nTime);
+            state->nAvgBlockTime = UpdateAverage(state->nAvgBlockTime, nBlockTime);
+            state->nAvgBlockBytesPerSec = UpdateAverage(state->nAvgBlockBytesPerSec, (int64_t)nSize * 1000000 / nBlockTime);
+            state->nLastBlockReceived = nNow;
+            state->nBlocksReceived++;
+        }
+        state->vBlocksInFlight.erase(itInFlight->second.second);
+        state->nBlocksInFlight--;
+        state->nStallingSince = 0;
+        mapBlocksInFlight.erase(itInFlight);
+
+        // The peer sends the blocks in the order they were asked for, so
+        // the clock of the next one starts now
+        if (!state->vBlocksInFlight.empty() && state->vBlocksInFlight.front().nDeadline == 0)
+            state->vBlocksInFlight.front().nDeadline = BlockDownloadDeadline(state, GetTimeMicros());
+    }
+}
+
+// Requires cs_main.
+void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, CBlockIndex *pindex = NULL)
+{
+    CNodeState *state = State(nodeid);
+    assert(state != NULL);
+
+    // Make sure it's not listed somewhere already.
+    MarkBlockAsReceived(hash);
+
+    // Its clock only starts once the peer gets to it, so blocks queued
+    // before it don't eat into its time
+    int64_t nNow = GetTimeMicros();
+    int64_t nDeadline = state->vBlocksInFlight.empty() ? BlockDownloadDeadline(state, nNow) : 0;
+    QueuedBlock newentry = {hash, pindex, nNow, nDeadline};
+    list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(), newentry);
+    state->nBlocksInFlight++;
+    if (state->nBlocksInFlight == 1)
+        state->nDownloadingSince = newentry.nTime;
+    mapBlocksInFlight[hash] = std::make_pair(nodeid, it);
+}
+
+/** Check whether the last unknown block a peer advertised is not yet known. */
+void ProcessBlockAvailability(NodeId nodeid)
+{
+    CNodeState *state = State(nodeid);
+    assert(state != NULL);
+
+    if (state->hashLastUnknownBlock != 0)
+    {
+        CBlockIndex* pindex = headerIndex.Lookup(state->hashLastUnknownBlock);
+        if (pindex)
+        {
+            if (state->pindexBestKnownBlock == NULL || pindex->bnChainTrust >= state->pindexBestKnownBlock->bnChainTrust)
+                state->pindexBestKnownBlock = pindex;
+            state->hashLastUnknownBlock = 0;
+        }
+    }
+}
+
+/** Update tracking information about which blocks a peer is assumed to have. */
+void UpdateBlockAvailability(NodeId nodeid, const uint256 &hash)
+{
+    CNodeState *state = State(nodeid);
+    assert(state != NULL);
+
+    ProcessBlockAvailability(nodeid);
+
+    CBlockIndex* pindex = headerIndex.Lookup(hash);
+    if (pindex)
+    {
+        // A better block or header we didn't know about.
+        if (state->pindexBestKnownBlock == NULL || pindex->bnChainTrust >= state->pindexBestKnownBlock->bnChainTrust)
+            state->pindexBestKnownBlock = pindex;
+    }
+    else
+    {
+        // An unknown block was announced; just assume that the latest one is the best one.
+        state->hashLastUnknownBlock = hash;
+    }
+}
+
+/** Find the last common ancestor two blocks have. */
+CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb)
+{
+    if (pa->nHeight > pb->nHeight)
+        pa = pa->GetAncestor(pb->nHeight);
+    else if (pb->nHeight > pa->nHeight)
+        pb = pb->GetAncestor(pa->nHeight);
+
+    while (pa != pb && pa && pb)
+    {
+        pa = pa->pprev;
+        pb = pb->pprev;
+    }
+
+    // Eventually all chain branches meet at the genesis block.
+    assert(pa == pb);
+    return pa;
+}
+
+/** Whether this peer let its request for the block time out not long ago. */
+bool BlockTimedOutAt(const uint256& hash, NodeId nodeid)
+{
+    map<uint256, pair<NodeId, int64_t> >::iterator it = mapBlocksTimedOut.find(hash);
+    if (it == mapBlocksTimedOut.end() || it->second.first != nodeid)
+        return false;
+    // With nobody else to ask, it gets another try eventually
+    return it->second.second > GetTimeMicros() - 2 * BLOCK_DOWNLOAD_TIMEOUT_BASE * 1000000;
+}
+
+/** Release the requests of this peer that are past their deadline, so that
+ *  FindNextBlocksToDownload hands them to another peer.  Returns the number;
+ *  however many there are, they add one to the peer's streak. */
+int ExpireBlocksInFlight(NodeId nodeid)
+{
+    CNodeState *state = State(nodeid);
+    assert(state != NULL);
+
+    int64_t nNow = GetTimeMicros();
+    vector<uint256> vExpired;
+    BOOST_FOREACH(const QueuedBlock& entry, state->vBlocksInFlight)
+        if (entry.nDeadline != 0 && entry.nDeadline < nNow)
+            vExpired.push_back(entry.hash);
+    BOOST_FOREACH(const uint256& hash, vExpired)
+    {
+        MarkBlockAsReceived(hash);
+        mapBlocksTimedOut[hash] = make_pair(nodeid, nNow);
+        state->nTimeouts++;
+    }
+    if (!vExpired.empty())
+        state->nTimeoutStreak++;
+    return vExpired.size();
+}
+
+/** How many blocks may be in flight from this peer: fewer the slower it is
+ *  than the fastest peer we're downloading from. */
+int BlocksInFlightLimit(const CNodeState& state)
+{
+    if (state.nAvgBlockTime == 0)
+        return MAX_BLOCKS_IN_TRANSIT_PER_PEER;
+
+    int64_t nFastest = state.nAvgBlockTime;
+    for (map<NodeId, CNodeState>::const_iterator it = mapNodeState.begin(); it != mapNodeState.end(); ++it)
+        if (it->second.nAvgBlockTime > 0 && it->second.nAvgBlockTime < nFastest)
+            nFastest = it->second.nAvgBlockTime;
+
+    if (state.nAvgBlockTime > 4 * nFastest)
+        return std::max(MAX_BLOCKS_IN_TRANSIT_PER_PEER / 8, 1);
+    if (state.nAvgBlockTime > 2 * nFastest)
+        return std::max(MAX_BLOCKS_IN_TRANSIT_PER_PEER / 2, 1);
+    return MAX_BLOCKS_IN_TRANSIT_PER_PEER;
+}
+
+/** Update pindexLastCommonBlock and add not-in-flight missing successors to vBlocks, until it has
+ *  at most count entries.  A block waiting in the orphan pool counts as downloaded. */
+void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, vector<CBlockIndex*>& vBlocks, NodeId& nodeStaller)
+{
+    if (count == 0)
+        return;
+
+    vBlocks.reserve(vBlocks.size() + count);
+    CNodeState *state = State(nodeid);
+    assert(state != NULL);
+
+    // Make sure pindexBestKnownBlock is up to date, we'll need it.
+    ProcessBlockAvailability(nodeid);
+
+    if (state->pindexBestKnownBlock == NULL || state->pindexBestKnownBlock->bnChainTrust < pindexBest->bnChainTrust)
+    {
+        // This peer has nothing interesting.
+        return;
+    }
+
+    if (state->pindexLastCommonBlock == NULL)
+    {
+        // Bootstrap quickly by guessing a parent of our best tip is the forking point.
+        // Guessing wrong in either direction is not a problem.
+        state->pindexLastCommonBlock = pindexBest->GetAncestor(std::min(state->pindexBestKnownBlock->nHeight, pindexBest->nHeight));
+    }
+
+    // If the peer reorganized, our previous pindexLastCommonBlock may not be an ancestor
+    // of its current tip anymore. Go back enough to fix that.
+    state->pindexLastCommonBlock = LastCommonAncestor(state->pindexLastCommonBlock, state->pindexBestKnownBlock);
+    if (state->pindexLastCommonBlock == state->pindexBestKnownBlock)
+        return;
+
+    vector<CBlockIndex*> vToFetch;
+    CBlockIndex *pindexWalk = state->pindexLastCommonBlock;
+    // Never fetch further than the best block we know the peer has, or more than BLOCK_DOWNLOAD_WINDOW + 1 beyond the last
+    // linked block we have in common with this peer. The +1 is so we can detect stalling, namely if we would be able to
+    // download that next block if the window were 1 larger.
+    int nWindowEnd = state->pindexLastCommonBlock->nHeight + BLOCK_DOWNLOAD_WINDOW;
+    int nMaxHeight = std::min<int>(state->pindexBestKnownBlock->nHeight, nWindowEnd + 1);
+    NodeId waitingfor = -1;
+    while (pindexWalk->nHeight < nMaxHeight)
+    {
+        // Read up to 128 (or more, if more blocks than that are needed) successors of pindexWalk (towards
+        // pindexBestKnownBlock) into vToFetch. We fetch 128, because CBlockIndex::GetAncestor may be as expensive
+        // as iterating over ~100 CBlockIndex* entries anyway.
+        int nToFetch = std::min(nMaxHeight - pindexWalk->nHeight, std::max<int>(count - vBlocks.size(), 128));
+        vToFetch.resize(nToFetch);
+        pindexWalk = state->pindexBestKnownBlock->GetAncestor(pindexWalk->nHeight + nToFetch);
+        vToFetch[nToFetch - 1] = pindexWalk;
+        for (unsigned int i = nToFetch - 1; i > 0; i--)
+            vToFetch[i - 1] = vToFetch[i]->pprev;
+
+        // Iterate over those blocks in vToFetch (in forward direction), adding the ones that
+        // are not yet downloaded and not in flight to vBlocks. In the meantime, update
+        // pindexLastCommonBlock as long as all ancestors are already downloaded.
+        BOOST_FOREACH(CBlockIndex* pindex, vToFetch)
+        {
+            uint256 hash = pindex->GetBlockHash();
+            if (!headerIndex.IsHeaderOnly(pindex))
+            {
+                // Only blocks that connect leave the header index, so
+                // everything before this one is in too
+                state->pindexLastCommonBlock = pindex;
+            }
+            else if (mapBlocksInFlight.count(hash) == 0 && !orphanBlocks.Have(hash) && !BlockTimedOutAt(hash, nodeid))
+            {
+                // The block is not already downloaded, and not yet in flight.
+                if (pindex->nHeight > nWindowEnd)
+                {
+                    // We reached the end of the window.
+                    if (vBlocks.size() == 0 && waitingfor != nodeid)
+                    {
+                        // We aren't able to fetch anything, but we would be if the download window was one larger.
+                        nodeStaller = waitingfor;
+                    }
+                    return;
+                }
+                vBlocks.push_back(pindex);
+                if (vBlocks.size() == count)
+                    return;
+            }
+            else if (waitingfor == -1 && mapBlocksInFlight.count(hash))
+            {
+                // This is the first already-in-flight block.
+                waitingfor = mapBlocksInFlight[hash].first;
+            }
+        }
+    }
+}
+
 void InitializeNode(NodeId nodeid, const CNode *pnode)
 {
     //LOCK(cs_main);
@@ -217,8 +558,25 @@ void FinalizeNode(NodeId nodeid)
     //LOCK(cs_main);
     CNodeState *state = State(nodeid);
 
+    if (state->fSyncStarted)
+        nSyncStarted--;
+
+    // Let the other peers have this one's blocks
+    BOOST_FOREACH(const QueuedBlock& entry, state->vBlocksInFlight)
+        mapBlocksInFlight.erase(entry.hash);
+    for (map<uint256, pair<NodeId, int64_t> >::iterator it = mapBlocksTimedOut.begin(); it != mapBlocksTimedOut.end(); )
+    {
+        if (it->second.first == nodeid)
+            mapBlocksTimedOut.erase(it++);
+        else
+            ++it;
+    }
+
     nPreferredDownload -= state->fPreferredDownload;
 
+    EraseOrphansFor(nodeid);
+    blockCheckQueue.Forget(nodeid);
+
     mapNodeState.erase(nodeid);
 
     if (mapNodeState.empty()) {
@@ -247,9 +605,37 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
     stats.nMisbehavior = state->nMisbehavior;
     stats.nSyncHeight = state->pindexBestKnownBlock ? state->pindexBestKnownBlock->nHeight : -1;
     stats.nCommonHeight = state->pindexLastCommonBlock ? state->pindexLastCommonBlock->nHeight : -1;
+    BOOST_FOREACH(const QueuedBlock& queue, state->vBlocksInFlight)
+    {
+        if (queue.pindex)
+            stats.vHeightInFlight.push_back(queue.pindex->nHeight);
+    }
+    stats.nBlocksReceived = state->nBlocksReceived;
+    stats.nBlockTimeouts = state->nTimeouts;
+    stats.nAvgBlockLatency = state->nAvgBlockLatency;
+    stats.nAvgBlockBytesPerSec = state->nAvgBlockBytesPerSec;
+    stats.nBlocksInFlightLimit = BlocksInFlightLimit(*state);
     return true;
 }
 
+void GetBlocksInFlight(vector<CBlockInFlightStats>& vStats)
+{
+    LOCK(cs_main);
+    vStats.clear();
+    vStats.reserve(mapBlocksInFlight.size());
+    for (map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::const_iterator it = mapBlocksInFlight.begin(); it != mapBlocksInFlight.end(); ++it)
+    {
+        const QueuedBlock& entry = *it->second.second;
+        CBlockInFlightStats stats;
+        stats.hash = entry.hash;
+        stats.nHeight = entry.pindex ? entry.pindex->nHeight : -1;
+        stats.nodeid = it->second.first;
+        stats.nTime = entry.nTime;
+        stats.nDeadline = entry.nDeadline;
+        vStats.push_back(stats);
+    }
+}
+
 void RegisterNodeSignals(CNodeSignals& nodeSignals)
 {
     //nodeSignals.GetHeight.connect(&GetHeight);
@@ -381,16 +767,13 @@ void ResendWalletTransactions()
 // mapOrphanTransactions
 //
 
-bool AddOrphanTx(const CDataStream& vMsg)
+bool AddOrphanTx(const CTransaction& tx, NodeId peer)
 {
-    CTransaction tx;
-    CDataStream(vMsg) >> tx;
     uint256 hash = tx.GetHash();
+    LOCK(cs_mapOrphanTransactions);
     if (mapOrphanTransactions.count(hash))
         return false;
 
-    CDataStream* pvMsg = new CDataStream(vMsg);
-
     // Ignore big transactions, to avoid a
     // send-big-orphans memory exhaustion attack. If a peer has a legitimate
     // large transaction with a missing parent then we assume
@@ -398,16 +781,29 @@ bool AddOrphanTx(const CDataStream& vMsg)
     // have been mined or received.
     // 10,000 orphans, each of which is at most 5,000 bytes big is
     // at most 500 megabytes of orphans:
-    if (pvMsg->size() > 5000)
+    unsigned int sz = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    if (sz > 5000)
+    {
+        printf("ignoring large orphan tx (size: %u, hash: %s)\n", sz, hash.ToString().substr(0,10).c_str());
+        return false;
+    }
+
+    // No single peer gets to fill the whole pool
+    map<NodeId, unsigned int>::const_iterator itPeer = mapOrphanTransactionsByPeer.find(peer);
+    if (itPeer != mapOrphanTransactionsByPeer.end() && itPeer->second >= MAX_ORPHAN_TRANSACTIONS_PER_PEER)
     {
-        printf("ignoring large orphan tx (size: %" PRIszu ", hash: %s)\n", pvMsg->size(), hash.ToString().substr(0,10).c_str());
-        delete pvMsg;
+        printf("ignoring orphan tx %s, peer=%d has too many orphans\n", hash.ToString().substr(0,10).c_str(), peer);
         return false;
     }
 
-    mapOrphanTransactions[hash] = pvMsg;
+    COrphanTx& orphan = mapOrphanTransactions[hash];
+    orphan.tx = tx;
+    orphan.fromPeer = peer;
+    orphan.nTimeExpire = GetTime() + ORPHAN_TX_EXPIRE_TIME;
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
-        mapOrphanTransactionsByPrev[txin.prevout.hash].insert(make_pair(hash, pvMsg));
+        mapOrphanTransactionsByPrev[txin.prevout].insert(hash);
+    mapOrphanTransactionsByPeer[peer]++;
+    setOrphanTransactionsByExpire.insert(make_pair(orphan.nTimeExpire, hash));
 
     printf("stored orphan tx %s (mapsz %" PRIszu ")\n", hash.ToString().substr(0,10).c_str(),
         mapOrphanTransactions.size());
@@ -416,37 +812,78 @@ bool AddOrphanTx(const CDataStream& vMsg)
 
 void static EraseOrphanTx(uint256 hash)
 {
-    if (!mapOrphanTransactions.count(hash))
+    LOCK(cs_mapOrphanTransactions);
+    map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
+    if (it == mapOrphanTransactions.end())
         return;
-    const CDataStream* pvMsg = mapOrphanTransactions[hash];
-    CTransaction tx;
-    CDataStream(*pvMsg) >> tx;
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    const COrphanTx& orphan = it->second;
+    BOOST_FOREACH(const CTxIn& txin, orphan.tx.vin)
     {
-        mapOrphanTransactionsByPrev[txin.prevout.hash].erase(hash);
-        if (mapOrphanTransactionsByPrev[txin.prevout.hash].empty())
-            mapOrphanTransactionsByPrev.erase(txin.prevout.hash);
+        map<COutPoint, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout);
+        if (itPrev == mapOrphanTransactionsByPrev.end())
+            continue;
+        itPrev->second.erase(hash);
+        if (itPrev->second.empty())
+            mapOrphanTransactionsByPrev.erase(itPrev);
     }
-    delete pvMsg;
-    mapOrphanTransactions.erase(hash);
+    map<NodeId, unsigned int>::iterator itPeer = mapOrphanTransactionsByPeer.find(orphan.fromPeer);
+    if (itPeer != mapOrphanTransactionsByPeer.end() && --itPeer->second == 0)
+        mapOrphanTransactionsByPeer.erase(itPeer);
+    setOrphanTransactionsByExpire.erase(make_pair(orphan.nTimeExpire, hash));
+    mapOrphanTransactions.erase(it);
+}
+
+void EraseOrphansFor(NodeId peer)
+{
+    LOCK(cs_mapOrphanTransactions);
+    vector<uint256> vErase;
+    for (map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.begin(); it != mapOrphanTransactions.end(); ++it)
+        if (it->second.fromPeer == peer)
+            vErase.push_back(it->first);
+    BOOST_FOREACH(const uint256& hash, vErase)
+        EraseOrphanTx(hash);
+    if (!vErase.empty())
+        printf("Erased %" PRIszu " orphan tx from peer %d\n", vErase.size(), peer);
 }
 
 unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
 {
+    LOCK(cs_mapOrphanTransactions);
     unsigned int nEvicted = 0;
+
+    // Drop orphans whose parents never showed up
+    int64 nNow = GetTime();
+    while (!setOrphanTransactionsByExpire.empty() && setOrphanTransactionsByExpire.begin()->first <= nNow)
+    {
+        EraseOrphanTx(setOrphanTransactionsByExpire.begin()->second);
+        ++nEvicted;
+    }
+
+    // Then the oldest ones until we are within bounds
     while (mapOrphanTransactions.size() > nMaxOrphans)
     {
-        // Evict a random orphan:
-        uint256 randomhash = GetRandHash();
-        map<uint256, CDataStream*>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
-        if (it == mapOrphanTransactions.end())
-            it = mapOrphanTransactions.begin();
-        EraseOrphanTx(it->first);
+        EraseOrphanTx(setOrphanTransactionsByExpire.begin()->second);
         ++nEvicted;
     }
     return nEvicted;
 }
 
+// Orphans spending any output of hashPrev, collected in one pass over its outputs
+void static GetOrphanChildren(const CTransaction& txPrev, const uint256& hashPrev, vector<CTransaction>& vChildren)
+{
+    LOCK(cs_mapOrphanTransactions);
+    set<uint256> setSeen;
+    for (unsigned int i = 0; i < txPrev.vout.size(); i++)
+    {
+        map<COutPoint, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(COutPoint(hashPrev, i));
+        if (itPrev == mapOrphanTransactionsByPrev.end())
+            continue;
+        BOOST_FOREACH(const uint256& hash, itPrev->second)
+            if (setSeen.insert(hash).second)
+                vChildren.push_back(mapOrphanTransactions[hash].tx);
+    }
+}
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // CBlockLocator
@@ -932,6 +1369,7 @@ bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
         for (unsigned int i = 0; i < tx.vin.size(); i++)
             mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
         nTransactionsUpdated++;
+        blockTemplate.TransactionAdded(hash);
     }
     return true;
 }
@@ -949,6 +1387,7 @@ bool CTxMemPool::remove(CTransaction &tx)
                 mapNextTx.erase(txin.prevout);
             mapTx.erase(hash);
             nTransactionsUpdated++;
+            blockTemplate.TransactionRemoved(hash);
         }
     }
     return true;
@@ -960,6 +1399,7 @@ void CTxMemPool::clear()
     mapTx.clear();
     mapNextTx.clear();
     ++nTransactionsUpdated;
+    blockTemplate.NewTip();
 }
 
 void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
@@ -1173,22 +1613,276 @@ bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
 }
 
 
-uint256 static GetOrphanRoot(const CBlock* pblock)
+//////////////////////////////////////////////////////////////////////////////
+//
+// COrphanBlockPool
+//
+
+COrphanBlockPool::COrphanBlockPool()
 {
-    // Work back to the first block in the orphan chain
-    while (mapOrphanBlocks.count(pblock->hashPrevBlock))
-        pblock = mapOrphanBlocks[pblock->hashPrevBlock];
-    return pblock->GetHash();
+    nBytes = 0;
+    nSpilledBytes = 0;
+    nSpilled = 0;
+    nEvicted = 0;
+    nMaxBytes = 40 * 1000000;
+    nMaxPeerBytes = nMaxBytes / 4;
+    nSpillThreshold = 0;
+    fileSpill = NULL;
+}
+
+COrphanBlockPool::~COrphanBlockPool()
+{
+    for (map<uint256, COrphanBlock>::iterator it = mapOrphans.begin(); it != mapOrphans.end(); ++it)
+        delete it->second.pblock;
+    if (fileSpill)
+        fclose(fileSpill);
+}
+
+void COrphanBlockPool::SetLimits(uint64 nMaxBytesIn, unsigned int nSpillThresholdIn)
+{
+    LOCK(cs);
+    nMaxBytes = std::max(nMaxBytesIn, (uint64)MAX_BLOCK_SIZE);
+    nMaxPeerBytes = std::max(nMaxBytes / 4, (uint64)MAX_BLOCK_SIZE);
+    nSpillThreshold = nSpillThresholdIn;
+}
+
+bool COrphanBlockPool::Spill(COrphanBlock& orphan, const CBlock& block)
+{
+    if (!fileSpill)
+    {
+        // Nothing in the file survives a restart, so start from an empty one
+        boost::filesystem::path pathSpill = GetDataDir() / "orphanblocks.tmp";
+        fileSpill = fopen(pathSpill.string().c_str(), "w+b");
+        if (!fileSpill)
+            return error("COrphanBlockPool::Spill() : cannot open %s", pathSpill.string().c_str());
+    }
+
+    CDataStream ssBlock(SER_DISK, CLIENT_VERSION);
+    ssBlock << block;
+    if (fseek(fileSpill, 0, SEEK_END) != 0)
+        return error("COrphanBlockPool::Spill() : fseek failed");
+    orphan.nFilePos = ftell(fileSpill);
+    if (orphan.nFilePos < 0 || fwrite(&ssBlock[0], 1, ssBlock.size(), fileSpill) != ssBlock.size())
+        return error("COrphanBlockPool::Spill() : write failed");
+    orphan.nSize = ssBlock.size();
+    return true;
+}
+
+CBlock* COrphanBlockPool::Load(const COrphanBlock& orphan)
+{
+    std::vector<char> vchBlock(orphan.nSize);
+    if (!fileSpill || fseek(fileSpill, orphan.nFilePos, SEEK_SET) != 0 ||
+        fread(&vchBlock[0], 1, vchBlock.size(), fileSpill) != vchBlock.size())
+    {
+        printf("COrphanBlockPool::Load() : read failed\n");
+        return NULL;
+    }
+
+    CBlock* pblock = new CBlock();
+    try {
+        CDataStream ssBlock(vchBlock, SER_DISK, CLIENT_VERSION);
+        ssBlock >> *pblock;
+    }
+    catch (std::exception &e) {
+        printf("COrphanBlockPool::Load() : deserialize failed\n");
+        delete pblock;
+        return NULL;
+    }
+    return pblock;
+}
+
+// Unlink an entry from every index.  Returns the in-memory block, if any,
+// which now belongs to the caller.
+CBlock* COrphanBlockPool::Erase(map<uint256, COrphanBlock>::iterator it)
+{
+    const uint256& hash = it->first;
+    COrphanBlock& orphan = it->second;
+
+    for (multimap<uint256, uint256>::iterator mi = mapOrphansByPrev.lower_bound(orphan.hashPrev);
+         mi != mapOrphansByPrev.upper_bound(orphan.hashPrev); ++mi)
+    {
+        if (mi->second == hash)
+        {
+            mapOrphansByPrev.erase(mi);
+            break;
+        }
+    }
+
+    map<NodeId, uint64>::iterator mp = mapPeerBytes.find(orphan.nPeer);
+    if (mp != mapPeerBytes.end())
+    {
+        mp->second -= orphan.nSize;
+        if (mp->second == 0)
+            mapPeerBytes.erase(mp);
+    }
+
+    if (orphan.fProofOfStake)
+        setStakeSeen.erase(orphan.proofOfStake);
+    listLRU.erase(orphan.itLRU);
+    nBytes -= orphan.nSize;
+    if (!orphan.pblock)
+    {
+        nSpilled--;
+        nSpilledBytes -= orphan.nSize;
+    }
+
+    CBlock* pblock = orphan.pblock;
+    mapOrphans.erase(it);
+
+    // The spill file is append only; throw it away once nothing refers to it
+    if (nSpilled == 0 && fileSpill)
+    {
+        fclose(fileSpill);
+        fileSpill = NULL;
+    }
+    return pblock;
+}
+
+void COrphanBlockPool::Evict(map<uint256, COrphanBlock>::iterator it)
+{
+    if (fDebug)
+        printf("COrphanBlockPool : evicting orphan block %s\n", it->first.ToString().substr(0,20).c_str());
+    delete Erase(it);
+    nEvicted++;
+}
+
+void COrphanBlockPool::MakeRoom(NodeId nPeer, unsigned int nSize)
+{
+    // A peer over its quota pays with its own least recently used orphans
+    if (nPeer != -1)
+    {
+        list<uint256>::iterator li = listLRU.end();
+        while (mapPeerBytes.count(nPeer) && mapPeerBytes[nPeer] + nSize > nMaxPeerBytes && li != listLRU.begin())
+        {
+            --li;
+            map<uint256, COrphanBlock>::iterator it = mapOrphans.find(*li);
+            if (it->second.nPeer == nPeer)
+            {
+                // step off the entry before it goes away
+                ++li;
+                Evict(it);
+            }
+        }
+    }
+
+    while (nBytes + nSize > nMaxBytes && !listLRU.empty())
+        Evict(mapOrphans.find(listLRU.back()));
+}
+
+bool COrphanBlockPool::Add(const uint256& hash, const CBlock& block, NodeId nPeer)
+{
+    LOCK(cs);
+    if (mapOrphans.count(hash))
+        return false;
+
+    unsigned int nSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+    if (nPeer != -1 && nSize > nMaxPeerBytes)
+        return false;
+    MakeRoom(nPeer, nSize);
+
+    COrphanBlock& orphan = mapOrphans[hash];
+    orphan.hashPrev = block.hashPrevBlock;
+    orphan.pblock = NULL;
+    orphan.nSize = nSize;
+    orphan.nFilePos = -1;
+    orphan.nPeer = nPeer;
+    orphan.fProofOfStake = block.IsProofOfStake();
+    orphan.proofOfStake = block.GetProofOfStake();
+    if (nSpillThreshold > 0 && nSize > nSpillThreshold && Spill(orphan, block))
+    {
+        nSpilled++;
+        nSpilledBytes += orphan.nSize;
+    }
+    else
+        orphan.pblock = new CBlock(block);
+
+    listLRU.push_front(hash);
+    orphan.itLRU = listLRU.begin();
+    mapOrphansByPrev.insert(make_pair(orphan.hashPrev, hash));
+    mapPeerBytes[nPeer] += orphan.nSize;
+    if (orphan.fProofOfStake)
+        setStakeSeen.insert(orphan.proofOfStake);
+    nBytes += orphan.nSize;
+    return true;
 }
 
+bool COrphanBlockPool::Have(const uint256& hash) const
+{
+    LOCK(cs);
+    return mapOrphans.count(hash) != 0;
+}
+
+bool COrphanBlockPool::HaveChildren(const uint256& hashPrev) const
+{
+    LOCK(cs);
+    return mapOrphansByPrev.count(hashPrev) != 0;
+}
+
+bool COrphanBlockPool::HaveStake(const pair<COutPoint, unsigned int>& proofOfStake) const
+{
+    LOCK(cs);
+    return setStakeSeen.count(proofOfStake) != 0;
+}
 
-// ppcoin: find block wanted by given orphan block
-uint256 WantedByOrphan(const CBlock* pblockOrphan)
+uint256 COrphanBlockPool::GetRoot(const uint256& hash)
 {
+    LOCK(cs);
+    map<uint256, COrphanBlock>::iterator it = mapOrphans.find(hash);
+    if (it == mapOrphans.end())
+        return hash;
+
+    // Somebody still cares about this chain
+    listLRU.splice(listLRU.begin(), listLRU, it->second.itLRU);
+
     // Work back to the first block in the orphan chain
-    while (mapOrphanBlocks.count(pblockOrphan->hashPrevBlock))
-        pblockOrphan = mapOrphanBlocks[pblockOrphan->hashPrevBlock];
-    return pblockOrphan->hashPrevBlock;
+    map<uint256, COrphanBlock>::iterator itPrev;
+    while ((itPrev = mapOrphans.find(it->second.hashPrev)) != mapOrphans.end())
+        it = itPrev;
+    return it->first;
+}
+
+uint256 COrphanBlockPool::GetWanted(const uint256& hash)
+{
+    LOCK(cs);
+    uint256 hashRoot = GetRoot(hash);
+    map<uint256, COrphanBlock>::iterator it = mapOrphans.find(hashRoot);
+    if (it == mapOrphans.end())
+        return 0;
+    return it->second.hashPrev;
+}
+
+void COrphanBlockPool::TakeChildren(const uint256& hashPrev, vector<pair<uint256, CBlock*> >& vChildren)
+{
+    LOCK(cs);
+    vector<uint256> vHashes;
+    for (multimap<uint256, uint256>::iterator mi = mapOrphansByPrev.lower_bound(hashPrev);
+         mi != mapOrphansByPrev.upper_bound(hashPrev); ++mi)
+        vHashes.push_back(mi->second);
+
+    BOOST_FOREACH(const uint256& hash, vHashes)
+    {
+        map<uint256, COrphanBlock>::iterator it = mapOrphans.find(hash);
+        CBlock* pblock = it->second.pblock;
+        if (!pblock)
+            pblock = Load(it->second);
+        Erase(it);
+        if (pblock)
+            vChildren.push_back(make_pair(hash, pblock));
+    }
+}
+
+void COrphanBlockPool::GetStats(COrphanBlockStats& stats) const
+{
+    LOCK(cs);
+    stats.nOrphans = mapOrphans.size();
+    stats.nSpilled = nSpilled;
+    stats.nPeers = mapPeerBytes.size();
+    stats.nBytes = nBytes;
+    stats.nSpilledBytes = nSpilledBytes;
+    stats.nEvicted = nEvicted;
+    stats.nMaxBytes = nMaxBytes;
+    stats.nMaxPeerBytes = nMaxPeerBytes;
+    stats.nSpillThreshold = nSpillThreshold;
 }
 
 
@@ -1629,6 +2323,33 @@ unsigned int CTransaction::GetP2SHSigOpCount(const MapPrevTx& inputs) const
     return nSigOps;
 }
 
+bool IsAssumedValid(const CBlockIndex* pindex)
+{
+    if (hashAssumeValid == 0 || pindex == NULL)
+        return false;
+
+    // Only its header is needed, so the blocks under it are sped up while
+    // they are still being downloaded; nothing is assumed until it shows up
+    const CBlockIndex* pindexAssumeValid = headerIndex.Lookup(hashAssumeValid);
+    if (pindexAssumeValid == NULL || pindex->nHeight > pindexAssumeValid->nHeight)
+        return false;
+    return pindexAssumeValid->GetAncestor(pindex->nHeight) == pindex;
+}
+
+// Whether ConnectInputs may leave out signature checks for a block connected at pindexBlock
+bool static SkipScriptChecks(const CBlockIndex* pindexBlock)
+{
+    return nBestHeight < Checkpoints::GetTotalBlocksEstimate() || IsAssumedValid(pindexBlock);
+}
+
+void GetChainTxStats(CChainTxStats& stats)
+{
+    LOCK(cs_main);
+    stats = chainTxStats;
+    const CBlockIndex* pindexAssumeValid = hashAssumeValid == 0 ? NULL : headerIndex.Lookup(hashAssumeValid);
+    stats.nAssumeValidHeight = pindexAssumeValid ? pindexAssumeValid->nHeight : -1;
+}
+
 
 bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
                                  map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
@@ -1685,9 +2406,10 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
                 return fMiner ? false : error("ConnectInputs() : %s prev tx already used at %s", GetHash().ToString().substr(0,10).c_str(), txindex.vSpent[prevout.n].ToString().c_str());
 
             // Skip ECDSA signature verification when connecting blocks (fBlock=true)
-            // before the last blockchain checkpoint. This is safe because block merkle hashes are
-            // still computed and checked, and any change will be caught at the next checkpoint.
-            if (!(fBlock && (nBestHeight < Checkpoints::GetTotalBlocksEstimate())))
+            // before the last blockchain checkpoint or below the -assumevalid block. This is safe
+            // because block merkle hashes are still computed and checked, and any change will be
+            // caught at the next checkpoint or when the assumed-valid block doesn't connect.
+            if (!(fBlock && SkipScriptChecks(pindexBlock)))
             {
                 // Verify signature
                 if (!VerifySignature(txPrev, *this, i, fStrictPayToScriptHash, 0))
@@ -1715,7 +2437,7 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
         {
             // ppcoin: coin stake tx earns reward instead of paying fee
             uint64 nCoinAge;
-            if (!GetCoinAge(txdb, nCoinAge))
+            if (!GetCoinAge(inputs, nCoinAge))
                 return error("ConnectInputs() : %s unable to get coin age for coinstake", GetHash().ToString().substr(0,10).c_str());
             int64 nStakeReward = GetValueOut() - nValueIn;
             if (nStakeReward > GetProofOfStakeReward(nCoinAge, pindexBlock->nBits, nTime, pindexBlock->nHeight) - GetMinFee() + MIN_TX_FEE)
@@ -1815,10 +2537,11 @@ bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     return true;
 }
 
-bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
+bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck, bool fChecked)
 {
-    // Check it again in case a previous version let a bad block in
-    if (!CheckBlock(!fJustCheck, !fJustCheck))
+    // Check it again in case a previous version let a bad block in, unless
+    // ProcessBlock or a pre-check thread just did
+    if ((fJustCheck || !fChecked) && !CheckBlock(!fJustCheck, !fJustCheck))
         return false;
 
     // Do not allow blocks that contain transactions which 'overwrite' older transactions,
@@ -1918,6 +2641,19 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     if (fJustCheck)
         return true;
 
+    chainTxStats.nBlocks++;
+    chainTxStats.nTx += vtx.size();
+    unsigned int nInputs = 0;
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+        if (!tx.IsCoinBase())
+            nInputs += tx.vin.size();
+    chainTxStats.nInputs += nInputs;
+    if (SkipScriptChecks(pindex))
+    {
+        chainTxStats.nBlocksSkipped++;
+        chainTxStats.nInputsSkipped += nInputs;
+    }
+
     // Write queued txindex changes
     for (map<uint256, CTxIndex>::iterator mi = mapQueuedChanges.begin(); mi != mapQueuedChanges.end(); ++mi)
     {
@@ -1952,7 +2688,8 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     return true;
 }
 
-bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
+// hashChecked is a block that passed CheckBlock on its way in, if any
+bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew, const uint256& hashChecked)
 {
     printf("REORGANIZE\n");
 
@@ -2008,7 +2745,7 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
         CBlock block;
         if (!block.ReadFromDisk(pindex))
             return error("Reorganize() : ReadFromDisk for connect failed");
-        if (!block.ConnectBlock(txdb, pindex))
+        if (!block.ConnectBlock(txdb, pindex, false, hashChecked != 0 && pindex->GetBlockHash() == hashChecked))
         {
             // Invalid block
             return error("Reorganize() : ConnectBlock %s failed", pindex->GetBlockHash().ToString().substr(0,20).c_str());
@@ -2050,12 +2787,12 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
 
 
 // Called from inside SetBestChain: attaches a block to the new best chain being built
-bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
+bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew, bool fChecked)
 {
     uint256 hash = GetHash();
 
     // Adding to current best branch
-    if (!ConnectBlock(txdb, pindexNew) || !txdb.WriteHashBestChain(hash))
+    if (!ConnectBlock(txdb, pindexNew, false, fChecked) || !txdb.WriteHashBestChain(hash))
     {
         txdb.TxnAbort();
         InvalidChainFound(pindexNew);
@@ -2075,7 +2812,7 @@ bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
 }
 
 
-bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
+bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew, bool fChecked)
 {
     uint256 hash = GetHash();
 
@@ -2092,7 +2829,7 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     }
     else if (hashPrevBlock == hashBestChain)
     {
-        if (!SetBestChainInner(txdb, pindexNew))
+        if (!SetBestChainInner(txdb, pindexNew, fChecked))
             return error("SetBestChain() : SetBestChainInner failed");
 		if (blockSyncingTraceTiming && blockSyncingSetBestChain)
 			fprintf(stderr, "SetBestChain()/[chk 0.1] lasted %15" PRI64d "ms\n", GetTimeMillis() - nStart);
@@ -2122,7 +2859,7 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
             printf("Postponing %" PRIszu " reconnects\n", vpindexSecondary.size());
 
         // Switch to new best branch
-        if (!Reorganize(txdb, pindexIntermediate))
+        if (!Reorganize(txdb, pindexIntermediate, fChecked ? hash : uint256(0)))
         {
             txdb.TxnAbort();
             InvalidChainFound(pindexNew);
@@ -2147,7 +2884,7 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
                 break;
             }
             // errors now are not fatal, we still did a reorganisation to a new chain in a valid way
-            if (!block.SetBestChainInner(txdb, pindex))
+            if (!block.SetBestChainInner(txdb, pindex, fChecked && pindex == pindexNew))
                 break;
         }
     }
@@ -2181,8 +2918,10 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     pblockindexFBBHLast = NULL;
     nBestHeight = pindexBest->nHeight;
     bnBestChainTrust = pindexNew->bnChainTrust;
+    UpdateStakeModifierIndex();
     nTimeBestReceived = GetTime();
     nTransactionsUpdated++;
+    blockTemplate.NewTip();
     printf("SetBestChain: new best=%s  height=%d  trust=%s  date=%s\n",
       hashBestChain.ToString().c_str(), nBestHeight, bnBestChainTrust.ToString().c_str(),
       DateTimeStrFormat("%x %H:%M:%S", pindexBest->GetBlockTime()).c_str());
@@ -2229,7 +2968,44 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     return true;
 }
 
-// ppcoin: total coin age spent in transaction, in the unit of coin-days.
+// Block headers by their place on disk, which never changes, so entries
+// need no invalidation.  CheckProofOfStake reads the block of the kernel,
+// and GetCoinAge the blocks of all coinstake inputs when the block is
+// connected, and the minter does the same for its own coinstakes.
+static map<pair<unsigned int, unsigned int>, CBlock> mapStakeBlockHeaders;
+static deque<pair<unsigned int, unsigned int> > dequeStakeBlockHeaders;
+static CCriticalSection cs_mapStakeBlockHeaders;
+
+bool ReadStakeBlockHeader(unsigned int nFile, unsigned int nBlockPos, CBlock& block)
+{
+    pair<unsigned int, unsigned int> pos = make_pair(nFile, nBlockPos);
+    {
+        LOCK(cs_mapStakeBlockHeaders);
+        map<pair<unsigned int, unsigned int>, CBlock>::iterator mi = mapStakeBlockHeaders.find(pos);
+        if (mi != mapStakeBlockHeaders.end())
+        {
+            block = (*mi).second;
+            return true;
+        }
+    }
+
+    if (!block.ReadFromDisk(nFile, nBlockPos, false))
+        return false;
+
+    {
+        LOCK(cs_mapStakeBlockHeaders);
+        if (mapStakeBlockHeaders.insert(make_pair(pos, block)).second)
+            dequeStakeBlockHeaders.push_back(pos);
+        while (dequeStakeBlockHeaders.size() > MAX_STAKE_HEADER_CACHE)
+        {
+            mapStakeBlockHeaders.erase(dequeStakeBlockHeaders.front());
+            dequeStakeBlockHeaders.pop_front();
+        }
+    }
+    return true;
+}
+
+// ppcoin: total coin age spent in transaction, in the unit of coin-days.
 // Only those coins meeting minimum age requirement counts. As those
 // transactions not in main chain are not currently indexed so we
 // might not find out about their coin age. Older transactions are 
@@ -2238,25 +3014,49 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
 // age (trust score) of competing branches.
 bool CTransaction::GetCoinAge(CTxDB& txdb, uint64& nCoinAge) const
 {
-    CBigNum bnCentSecond = 0;  // coin age in the unit of cent-seconds
     nCoinAge = 0;
-
     if (IsCoinBase())
         return true;
 
+    MapPrevTx inputs;
     BOOST_FOREACH(const CTxIn& txin, vin)
     {
+        if (inputs.count(txin.prevout.hash))
+            continue;
         // First try finding the previous transaction in database
         CTransaction txPrev;
         CTxIndex txindex;
-        if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
+        if (!txdb.ReadTxIndex(txin.prevout.hash, txindex) || !txPrev.ReadFromDisk(txindex.pos))
+            continue;  // previous transaction not in main chain
+        inputs[txin.prevout.hash] = make_pair(txindex, txPrev);
+    }
+    return GetCoinAge(inputs, nCoinAge);
+}
+
+// Same as above, with the previous transactions FetchInputs found
+bool CTransaction::GetCoinAge(const MapPrevTx& inputs, uint64& nCoinAge) const
+{
+    CBigNum bnCentSecond = 0;  // coin age in the unit of cent-seconds
+    nCoinAge = 0;
+
+    if (IsCoinBase())
+        return true;
+
+    BOOST_FOREACH(const CTxIn& txin, vin)
+    {
+        MapPrevTx::const_iterator mi = inputs.find(txin.prevout.hash);
+        if (mi == inputs.end() || (*mi).second.first.pos == CDiskTxPos(1,1,1))
             continue;  // previous transaction not in main chain
+        const CTxIndex& txindex = (*mi).second.first;
+        const CTransaction& txPrev = (*mi).second.second;
+        if (txin.prevout.n >= txPrev.vout.size())
+            continue;
         if (nTime < txPrev.nTime)
             return false;  // Transaction timestamp violation
 
         // Read block header
         CBlock block;
-        if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+        if (!ReadStakeBlockHeader(txindex.pos.nFile, txindex.pos.nBlockPos, block))
             return false; // unable to read block of previous transaction
         if (block.GetBlockTime() + nStakeMinAge > nTime)
             continue; // only count coins meeting min age requirement
@@ -2299,7 +3099,7 @@ bool CBlock::GetCoinAge(uint64& nCoinAge) const
 
 // by Simone: global CTxDB object for the below function can save hours of download...
 CTxDB *gtxdb = NULL;
-bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
+bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, bool fChecked)
 {
     // Check for duplicate
     uint256 hash = GetHash();
@@ -2353,11 +3153,22 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
 		fprintf(stderr, "AddToBlockIndex()/[chk 2] lasted %15" PRI64d "ms\n", GetTimeMillis() - nStart);
     nStart = GetTimeMillis();
 
+    // A block whose header came first moves into the header's index entry,
+    // which peers' sync state and later headers may point to
+    CBlockIndex* pindexHeader = headerIndex.Take(hash);
+    if (pindexHeader)
+    {
+        *pindexHeader = *pindexNew;
+        delete pindexNew;
+        pindexNew = pindexHeader;
+    }
+
     // Add to mapBlockIndex
     map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     if (pindexNew->IsProofOfStake())
         setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
     pindexNew->phashBlock = &((*mi).first);
+    pindexNew->BuildSkip();
 
 	// by Simone: use global CTxDB object !
     // Write to disk block index
@@ -2376,7 +3187,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
 
     // New best
 	if (pindexNew->bnChainTrust > bnBestChainTrust)
-		if (!SetBestChain(*gtxdb, pindexNew))
+		if (!SetBestChain(*gtxdb, pindexNew, fChecked))
 			return false;
 
 	if (blockSyncingTraceTiming && blockSyncingAddToBlockIndex)
@@ -2420,11 +3231,20 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
 
 
 
-bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot) const
+bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fPrechecked) const
 {
     // These are checks that are independent of context
     // that can be verified before saving an orphan block.
 
+    // Already passed all of them on a pre-check thread; only the clock drift
+    // rule may have changed since
+    if (fPrechecked)
+    {
+        if (GetBlockTime() > GetAdjustedTime() + nMaxClockDrift)
+            return error("CheckBlock() : block timestamp too far in the future");
+        return true;
+    }
+
     // Size limits
     if (vtx.empty() || vtx.size() > MAX_BLOCK_SIZE || ::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION) > MAX_BLOCK_SIZE)
         return DoS(100, error("CheckBlock() : size limits failed"));
@@ -2502,7 +3322,7 @@ bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot) const
 }
 
 
-bool CBlock::AcceptBlock(bool lessAggressive)
+bool CBlock::AcceptBlock(bool lessAggressive, bool fChecked)
 {
 	uint256 hash;
 
@@ -2628,7 +3448,7 @@ bool CBlock::AcceptBlock(bool lessAggressive)
 	if (blockSyncingTraceTiming && blockSyncingAcceptBlock)
 		fprintf(stderr, "AcceptBlock()/WriteToDisk() lasted %15" PRI64d "ms\n", GetTimeMillis() - nStart);
 	nStart = GetTimeMillis();
-	if (!AddToBlockIndex(nFile, nBlockPos))
+	if (!AddToBlockIndex(nFile, nBlockPos, fChecked))
 		return error("AcceptBlock() : AddToBlockIndex failed");
 	if (blockSyncingTraceTiming && blockSyncingAcceptBlock)
 		fprintf(stderr, "AcceptBlock()/AddToBlockIndex() lasted %15" PRI64d "ms\n", GetTimeMillis() - nStart);
@@ -2648,10 +3468,29 @@ bool CBlock::AcceptBlock(bool lessAggressive)
 				    TRY_LOCK(cs_vNodes, lockStatus);
 					if (lockStatus)
 				    {
+						// Peers that asked for compact blocks get the block pushed
+						// straight away, built and serialized once for all of them
+						bool fCompact = !IsInitialBlockDownload();
+						CSerializedNetMsgRef msgCompact;
+						CInv inv(MSG_BLOCK, hash);
 						BOOST_FOREACH(CNode* pnode, vNodes)
 						{
-						    if (nBestHeight > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-						        pnode->PushInventory(CInv(MSG_BLOCK, hash));
+						    if (nBestHeight <= (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+						        continue;
+						    CNodeState* state = State(pnode->GetId());
+						    if (fCompact && state && state->fPreferHeaderAndIDs)
+						    {
+						        {
+						            LOCK(pnode->cs_inventory);
+						            if (!pnode->setInventoryKnown.insert(inv).second)
+						                continue;
+						        }
+						        if (!msgCompact)
+						            msgCompact = MakeSerializedMessage("cmpctblock", CBlockHeaderAndShortTxIDs(*this));
+						        pnode->PushSerializedMessage(msgCompact);
+						    }
+						    else
+						        pnode->PushInventory(inv);
 						}
 						break;
 					}
@@ -2696,6 +3535,58 @@ CBigNum CBlockIndex::GetBlockTrust() const
     }
 } 
 
+// Turn the lowest set bit off
+static inline int InvertLowestOne(int n) { return n & (n - 1); }
+
+// The height pskip points to: every height gets a different, mostly much
+// lower, target, so that any ancestor is reached in about log(n) jumps
+static inline int GetSkipHeight(int nHeight)
+{
+    if (nHeight < 2)
+        return 0;
+    return (nHeight & 1) ? InvertLowestOne(InvertLowestOne(nHeight - 1)) + 1 : InvertLowestOne(nHeight);
+}
+
+void CBlockIndex::BuildSkip()
+{
+    if (pprev)
+        pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
+}
+
+CBlockIndex* CBlockIndex::GetAncestor(int nHeightIn)
+{
+    if (nHeightIn > nHeight || nHeightIn < 0)
+        return NULL;
+
+    // Entries without a pskip yet are walked one by one
+    CBlockIndex* pindexWalk = this;
+    int nHeightWalk = nHeight;
+    while (nHeightWalk > nHeightIn)
+    {
+        int nHeightSkip = GetSkipHeight(nHeightWalk);
+        int nHeightSkipPrev = GetSkipHeight(nHeightWalk - 1);
+        if (pindexWalk->pskip != NULL &&
+            (nHeightSkip == nHeightIn ||
+             (nHeightSkip > nHeightIn && !(nHeightSkipPrev < nHeightSkip - 2 && nHeightSkipPrev >= nHeightIn))))
+        {
+            // Only follow pskip if pprev->pskip isn't better than pskip->pprev
+            pindexWalk = pindexWalk->pskip;
+            nHeightWalk = nHeightSkip;
+        }
+        else
+        {
+            pindexWalk = pindexWalk->pprev;
+            nHeightWalk--;
+        }
+    }
+    return pindexWalk;
+}
+
+const CBlockIndex* CBlockIndex::GetAncestor(int nHeightIn) const
+{
+    return const_cast<CBlockIndex*>(this)->GetAncestor(nHeightIn);
+}
+
 bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, unsigned int nRequired, unsigned int nToCheck)
 {
     unsigned int nFound = 0;
@@ -2715,6 +3606,9 @@ void Misbehaving(NodeId pnode, int howmuch)
     if (howmuch == 0)
         return;
 
+    // Node state lives under cs_main, which the lock-free message handlers
+    // don't hold
+    LOCK(cs_main);
     CNodeState *state = State(pnode);
     if (state == NULL)
         return;
@@ -2727,6 +3621,36 @@ void Misbehaving(NodeId pnode, int howmuch)
     }
 }
 
+// Drop the headers of stale forks, and everything pointing to them.  An
+// honest peer may well have sent them, so nobody is penalized for it.
+void static PruneHeaders()
+{
+    vector<CBlockIndex*> vPruned;
+    headerIndex.Prune(vPruned);
+    if (vPruned.empty())
+        return;
+
+    set<CBlockIndex*> setPruned(vPruned.begin(), vPruned.end());
+    BOOST_FOREACH(PAIRTYPE(const NodeId, CNodeState)& item, mapNodeState)
+    {
+        CNodeState& state = item.second;
+        if (setPruned.count(state.pindexBestKnownBlock))
+            state.pindexBestKnownBlock = NULL;
+        if (setPruned.count(state.pindexLastCommonBlock))
+            state.pindexLastCommonBlock = NULL;
+        if (setPruned.count(state.pindexBestHeaderSent))
+            state.pindexBestHeaderSent = NULL;
+        if (setPruned.count(state.pindexHeadersResume))
+            state.pindexHeadersResume = NULL;
+        BOOST_FOREACH(QueuedBlock& queued, state.vBlocksInFlight)
+            if (setPruned.count(queued.pindex))
+                queued.pindex = NULL;
+    }
+
+    BOOST_FOREACH(CBlockIndex* pindex, vPruned)
+        delete pindex;
+}
+
 // by Simone: a nice logic to pick the current best node to download during initial sync
 CNode *PickCurrentBestNode()
 {
@@ -2756,7 +3680,8 @@ CNode *PickCurrentBestNode()
 	if (retNode)
 	{
 		retNode->currentPushBlock = true;
-		if (IsInitialBlockDownload() && (GetTime() - lastRecvBlockTime) > 9)
+		// peers synced headers first get their blocks asked for in SendMessages
+		if (nSyncStarted == 0 && IsInitialBlockDownload() && (GetTime() - lastRecvBlockTime) > 9)
 		{
 			lastRecvBlockTime = GetTime();
     		retNode->PushGetBlocks(pindexBest, uint256(0));
@@ -2766,7 +3691,7 @@ CNode *PickCurrentBestNode()
 	return retNode;
 }
 
-bool ProcessBlock(CNode* pfrom, CBlock* pblock, bool lessAggressive)
+bool ProcessBlock(CNode* pfrom, CBlock* pblock, bool lessAggressive, bool fPrechecked)
 {
 	// by Simone: we process generic rules here as well, to keep some coherence with other parameters,
 	// although generic rules by definition are rules that do not affect the acceptance of blocks
@@ -2791,17 +3716,17 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock, bool lessAggressive)
     // Check for duplicate
 	if (mapBlockIndex.count(hash))
 	    return error("ProcessBlock() : already have block %d %s", mapBlockIndex[hash]->nHeight, hash.ToString().substr(0,20).c_str());
-	if (mapOrphanBlocks.count(hash))
+	if (orphanBlocks.Have(hash))
 	    return error("ProcessBlock() : already have block (orphan) %s", hash.ToString().substr(0,20).c_str());
 
     // ppcoin: check proof-of-stake
     // Limited duplicity on stake: prevents block flood attack
     // Duplicate stake allowed only when there is orphan child block
-	if (pblock->IsProofOfStake() && setStakeSeen.count(pblock->GetProofOfStake()) && !mapOrphanBlocksByPrev.count(hash) && !Checkpoints::WantedByPendingSyncCheckpoint(hash))
+	if (pblock->IsProofOfStake() && setStakeSeen.count(pblock->GetProofOfStake()) && !orphanBlocks.HaveChildren(hash) && !Checkpoints::WantedByPendingSyncCheckpoint(hash))
 	    return error("ProcessBlock() : duplicate proof-of-stake (%s, %d) for block %s", pblock->GetProofOfStake().first.ToString().c_str(), pblock->GetProofOfStake().second, hash.ToString().c_str());
 
     // Preliminary checks
-    if (!pblock->CheckBlock())
+    if (!pblock->CheckBlock(true, true, fPrechecked))
         return error("ProcessBlock() : CheckBlock FAILED");
 
     // ppcoin: verify hash target and signature of coinstake tx
@@ -2851,32 +3776,30 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock, bool lessAggressive)
     if (!mapBlockIndex.count(pblock->hashPrevBlock))
     {
         printf("ProcessBlock: ORPHAN BLOCK, prev=%s\n", pblock->hashPrevBlock.ToString().substr(0,20).c_str());
-        CBlock* pblock2 = new CBlock(*pblock);
         // ppcoin: check proof-of-stake
-        if (pblock2->IsProofOfStake())
+        if (pblock->IsProofOfStake())
         {
             // Limited duplicity on stake: prevents block flood attack
             // Duplicate stake allowed only when there is orphan child block
-            if (setStakeSeenOrphan.count(pblock2->GetProofOfStake()) && !mapOrphanBlocksByPrev.count(hash) && !Checkpoints::WantedByPendingSyncCheckpoint(hash))
-                return error("ProcessBlock() : duplicate proof-of-stake (%s, %d) for orphan block %s", pblock2->GetProofOfStake().first.ToString().c_str(), pblock2->GetProofOfStake().second, hash.ToString().c_str());
-            else
-                setStakeSeenOrphan.insert(pblock2->GetProofOfStake());
+            if (orphanBlocks.HaveStake(pblock->GetProofOfStake()) && !orphanBlocks.HaveChildren(hash) && !Checkpoints::WantedByPendingSyncCheckpoint(hash))
+                return error("ProcessBlock() : duplicate proof-of-stake (%s, %d) for orphan block %s", pblock->GetProofOfStake().first.ToString().c_str(), pblock->GetProofOfStake().second, hash.ToString().c_str());
         }
-        mapOrphanBlocks.insert(make_pair(hash, pblock2));
-        mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrevBlock, pblock2));
+        if (!orphanBlocks.Add(hash, *pblock, pfrom ? pfrom->GetId() : -1))
+            return error("ProcessBlock() : orphan block %s does not fit in the orphan pool", hash.ToString().substr(0,20).c_str());
 
-        // Ask this guy to fill in what we're missing
-        if (pfrom)
+        // Ask this guy to fill in what we're missing, unless its header is
+        // known and the download in SendMessages will get there anyway
+        if (pfrom && !headerIndex.Lookup(hash))
 		{
 			if ((pfrom->currentPushBlock) || (!IsInitialBlockDownload()))
 		    {
-				pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(pblock2));
+				pfrom->PushGetBlocks(pindexBest, orphanBlocks.GetRoot(hash));
 
 		        // ppcoin: getblocks may not obtain the ancestor block rejected
 		        // earlier by duplicate-stake check so we ask for it again directly
 		        if (!IsInitialBlockDownload())
 				{
-		            pfrom->AskFor(CInv(MSG_BLOCK, WantedByOrphan(pblock2)));
+		            pfrom->AskFor(CInv(MSG_BLOCK, orphanBlocks.GetWanted(hash)));
 				}
 		    }
 		}
@@ -2885,7 +3808,9 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock, bool lessAggressive)
 
     // Store to disk
     int64 nStart = GetTimeMillis();
-	if (!pblock->AcceptBlock(lessAggressive))
+	// It passed CheckBlock above, in line or on a pre-check thread, and
+	// ConnectBlock needn't do it all again
+	if (!pblock->AcceptBlock(lessAggressive, true))
 		return error("ProcessBlock() : AcceptBlock FAILED");
 	if (blockSyncingTraceTiming)
 		fprintf(stderr, "AcceptBlock()/normal lasted %15" PRI64d "ms\n", GetTimeMillis() - nStart);
@@ -2896,22 +3821,20 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock, bool lessAggressive)
 	for (unsigned int i = 0; i < vWorkQueue.size(); i++)
 	{
 	    uint256 hashPrev = vWorkQueue[i];
-	    for (multimap<uint256, CBlock*>::iterator mi = mapOrphanBlocksByPrev.lower_bound(hashPrev);
-	         mi != mapOrphanBlocksByPrev.upper_bound(hashPrev);
-	         ++mi)
+	    vector<pair<uint256, CBlock*> > vChildren;
+	    orphanBlocks.TakeChildren(hashPrev, vChildren);
+	    for (unsigned int j = 0; j < vChildren.size(); j++)
 	    {
-	        CBlock* pblockOrphan = (*mi).second;
-			hash = pblockOrphan->GetHash();
+	        CBlock* pblockOrphan = vChildren[j].second;
+			hash = vChildren[j].first;
 			int64 nStart = GetTimeMillis();
-	        if (pblockOrphan->AcceptBlock())
+	        // Orphans passed CheckBlock before they went into the pool
+	        if (pblockOrphan->AcceptBlock(false, true))
 	            vWorkQueue.push_back(hash);
 			if (blockSyncingTraceTiming)
 				fprintf(stderr, "AcceptBlock()/orphans lasted %15" PRI64d "ms\n", GetTimeMillis() - nStart);
-	        mapOrphanBlocks.erase(hash);
-	        setStakeSeenOrphan.erase(pblockOrphan->GetProofOfStake());
 	        delete pblockOrphan;
 	    }
-	    mapOrphanBlocksByPrev.erase(hashPrev);
 	}
 
     // ppcoin: if responsible for sync-checkpoint send it
@@ -3306,6 +4229,16 @@ void PrintBlockTree()
     }
 }
 
+// A block read from a bootstrap file, waiting for its pre-check result
+struct CImportBlock
+{
+    uint256 hash;
+    CDataStream vData;
+    unsigned int nPosEnd;
+
+    CImportBlock(const uint256& hashIn, const CDataStream& vDataIn, unsigned int nPosEndIn) : hash(hashIn), vData(vDataIn), nPosEnd(nPosEndIn) {}
+};
+
 bool LoadExternalBlockFile(FILE* fileIn)
 {
     int64 nStart = GetTimeMillis();
@@ -3320,55 +4253,74 @@ bool LoadExternalBlockFile(FILE* fileIn)
 			double fSize = GetFilesize(fileIn);
             CAutoFile blkdat(fileIn, SER_DISK, CLIENT_VERSION);
             unsigned int nPos = 0;
-            while (nPos != (unsigned int)-1 && blkdat.good() && !fRequestShutdown)
+            // Blocks are read ahead of the one being connected so the
+            // pre-check threads can work on them in the meantime
+            deque<CImportBlock> queueRead;
+            while (!fRequestShutdown)
             {
-                unsigned char pchData[65536];
-                do {
-                    fseek(blkdat, nPos, SEEK_SET);
-                    int nRead = fread(pchData, 1, sizeof(pchData), blkdat);
-                    if (nRead <= 8)
-                    {
-                        nPos = (unsigned int)-1;
-                        break;
-                    }
-                    void* nFind = memchr(pchData, pchMessageStart[0], nRead+1-sizeof(pchMessageStart));
-                    if (nFind)
-                    {
-                        if (memcmp(nFind, pchMessageStart, sizeof(pchMessageStart))==0)
+                while (nPos != (unsigned int)-1 && blkdat.good() && !fRequestShutdown &&
+                       (queueRead.empty() || blockCheckQueue.HasRoom()))
+                {
+                    unsigned char pchData[65536];
+                    do {
+                        fseek(blkdat, nPos, SEEK_SET);
+                        int nRead = fread(pchData, 1, sizeof(pchData), blkdat);
+                        if (nRead <= 8)
                         {
-                            nPos += ((unsigned char*)nFind - pchData) + sizeof(pchMessageStart);
+                            nPos = (unsigned int)-1;
                             break;
                         }
-                        nPos += ((unsigned char*)nFind - pchData) + 1;
+                        void* nFind = memchr(pchData, pchMessageStart[0], nRead+1-sizeof(pchMessageStart));
+                        if (nFind)
+                        {
+                            if (memcmp(nFind, pchMessageStart, sizeof(pchMessageStart))==0)
+                            {
+                                nPos += ((unsigned char*)nFind - pchData) + sizeof(pchMessageStart);
+                                break;
+                            }
+                            nPos += ((unsigned char*)nFind - pchData) + 1;
+                        }
+                        else
+                            nPos += sizeof(pchData) - sizeof(pchMessageStart) + 1;
+                    } while(!fRequestShutdown);
+                    if (nPos == (unsigned int)-1)
+                        break;
+                    fseek(blkdat, nPos, SEEK_SET);
+                    unsigned int nSize;
+                    blkdat >> nSize;
+                    if (nSize > 0 && nSize <= MAX_BLOCK_SIZE)
+                    {
+                        CDataStream vData(SER_DISK, CLIENT_VERSION);
+                        vData.resize(nSize);
+                        blkdat.read(&vData[0], nSize);
+                        uint256 hash = Hash(vData.begin(), vData.end());
+                        blockCheckQueue.Push(hash, vData, -1);
+                        queueRead.push_back(CImportBlock(hash, vData, nPos + 4 + nSize));
+                        nPos += 4 + nSize;
                     }
-                    else
-                        nPos += sizeof(pchData) - sizeof(pchMessageStart) + 1;
-                } while(!fRequestShutdown);
-                if (nPos == (unsigned int)-1)
+                }
+                if (queueRead.empty())
                     break;
-                fseek(blkdat, nPos, SEEK_SET);
-                unsigned int nSize;
-                blkdat >> nSize;
-                if (nSize > 0 && nSize <= MAX_BLOCK_SIZE)
+
+                CImportBlock& imported = queueRead.front();
+                bool fChecked = blockCheckQueue.Wait(imported.hash);
+                CBlock block;
+                imported.vData >> block;
+                if (ProcessBlock(NULL, &block, true, fChecked))
                 {
-                    CBlock block;
-                    blkdat >> block;
-                    if (ProcessBlock(NULL, &block, true))
-                    {
-                        nLoaded++;
-                        nPos += 4 + nSize;
-						progress = ((double)nPos * 1000.0) / fSize;
-						if (progress != oldProgress)
-						{
-							double dispProgress = progress / 10;
-							sprintf(msg, "Importing bootstrap (%.2f%%)...", dispProgress);
+                    nLoaded++;
+					progress = ((double)imported.nPosEnd * 1000.0) / fSize;
+					if (progress != oldProgress)
+					{
+						double dispProgress = progress / 10;
+						sprintf(msg, "Importing bootstrap (%.2f%%)...", dispProgress);
 #ifdef QT_GUI
-							uiInterface.InitMessage(_(msg));
+						uiInterface.InitMessage(_(msg));
 #endif
-							oldProgress = progress;
-						}
-                    }
+						oldProgress = progress;
+					}
                 }
+                queueRead.pop_front();
             }
         }
         catch (std::exception &e) {
@@ -3515,14 +4467,19 @@ bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
             LOCK(mempool.cs);
             txInMap = (mempool.exists(inv.hash));
             }
+        bool txInOrphans = false;
+            {
+            LOCK(cs_mapOrphanTransactions);
+            txInOrphans = mapOrphanTransactions.count(inv.hash);
+            }
         return txInMap ||
-               mapOrphanTransactions.count(inv.hash) ||
+               txInOrphans ||
                txdb.ContainsTx(inv.hash);
         }
 
     case MSG_BLOCK:
         return mapBlockIndex.count(inv.hash) ||
-               mapOrphanBlocks.count(inv.hash);
+               orphanBlocks.Have(inv.hash);
     }
     // Don't know what it is, just say we already got one
     return true;
@@ -3553,7 +4510,122 @@ string SanitizeString(const string& str, int rule)
 // a large 4-byte int at any alignment.
 unsigned char pchMessageStart[4] = { 0xce, 0xfb, 0xfa, 0xdb };
 
-bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
+// A new block is asked for by most peers within seconds of being announced;
+// keep the last few serialized so it is read from disk and serialized once
+static const unsigned int MAX_RECENT_BLOCK_MESSAGES = 4;
+static CCriticalSection cs_recentBlockMessages;
+static deque<pair<uint256, CSerializedNetMsgRef> > vRecentBlockMessages;
+
+CSerializedNetMsgRef static GetBlockMessage(CBlockIndex* pindex)
+{
+    uint256 hash = pindex->GetBlockHash();
+    {
+        LOCK(cs_recentBlockMessages);
+        for (unsigned int i = 0; i < vRecentBlockMessages.size(); i++)
+            if (vRecentBlockMessages[i].first == hash)
+                return vRecentBlockMessages[i].second;
+    }
+
+    CBlock block;
+    if (!block.ReadFromDisk(pindex))
+        return CSerializedNetMsgRef();
+    CSerializedNetMsgRef msg = MakeSerializedMessage("block", block);
+
+    LOCK(cs_recentBlockMessages);
+    vRecentBlockMessages.push_back(make_pair(hash, msg));
+    if (vRecentBlockMessages.size() > MAX_RECENT_BLOCK_MESSAGES)
+        vRecentBlockMessages.pop_front();
+    return msg;
+}
+
+bool static IsHistoricBlock(const CBlockIndex* pindex)
+{
+    return pindex->GetBlockTime() < GetAdjustedTime() - HISTORIC_BLOCK_AGE;
+}
+
+// Send a block from disk, or the copy already made for the peers that asked
+// before.  Old blocks go to peers catching up, which can wait for them; once
+// the upload target is nearly used up, not at all, and the peer is dropped.
+bool static PushBlock(CNode* pfrom, CBlockIndex* pindex)
+{
+    bool fHistoric = IsHistoricBlock(pindex);
+    if (fHistoric && CNode::OutboundTargetReached(true) && !pfrom->fWhitelisted)
+    {
+        printf("historical block serving limit reached, disconnect peer=%d\n", pfrom->GetId());
+        pfrom->fDisconnect = true;
+        return false;
+    }
+
+    CSerializedNetMsgRef msg = GetBlockMessage(pindex);
+    if (msg)
+        pfrom->PushSerializedMessage(msg, fHistoric);
+    return true;
+}
+
+void static RequestFullBlock(CNode* pfrom, const uint256& hash)
+{
+    vector<CInv> vGetData(1, CInv(MSG_BLOCK, hash));
+    pfrom->PushMessage("getdata", vGetData);
+    MarkBlockAsInFlight(pfrom->GetId(), hash, headerIndex.Lookup(hash));
+}
+
+// The checks of CHeaderIndex::Accept on the header of a compact block, done
+// before any work goes into rebuilding it.  Its previous block has to be
+// known, with or without its own block.
+bool static CheckCompactBlockHeader(const CBlock& header, const uint256& hash, bool fProofOfStake, CBlockIndex* pindexPrev, int& nDoS)
+{
+    int nHeight = pindexPrev->nHeight + 1;
+    if (!fProofOfStake && nHeight > POW_CUTOFF_BLOCK && nHeight < getPowRestartBlock())
+    {
+        nDoS = 100;
+        return error("CheckCompactBlockHeader() : no PoW block allowed between %d and %d (height = %d)", POW_CUTOFF_BLOCK, getPowRestartBlock(), nHeight);
+    }
+    if (!fProofOfStake && !CheckProofOfWork(hash, header.nBits))
+    {
+        nDoS = 50;
+        return error("CheckCompactBlockHeader() : proof of work failed");
+    }
+    if (header.nBits != GetNextTargetRequired(pindexPrev, fProofOfStake))
+    {
+        nDoS = 100;
+        return error("CheckCompactBlockHeader() : incorrect %s", fProofOfStake ? "proof-of-stake" : "proof-of-work");
+    }
+    if (header.GetBlockTime() <= pindexPrev->GetMedianTimePast() || header.GetBlockTime() + nMaxClockDrift < pindexPrev->GetBlockTime())
+    {
+        nDoS = 20;
+        return error("CheckCompactBlockHeader() : block's timestamp is too early");
+    }
+    if (header.GetBlockTime() > GetAdjustedTime() + nMaxClockDrift)
+    {
+        nDoS = 20;
+        return error("CheckCompactBlockHeader() : block timestamp too far in the future");
+    }
+    return true;
+}
+
+// Hand a block rebuilt from a compact block to ProcessBlock, or fetch it in
+// full if it didn't come out right
+void static ProcessPartialBlock(CNode* pfrom, CPartialBlock& partial)
+{
+    CBlock block;
+    uint256 hash = partial.GetHash();
+    bool fComplete = partial.GetBlock(block);
+    partial.SetNull();
+    if (!fComplete)
+    {
+        printf("compact block %s doesn't match its merkle root, fetching it in full\n", hash.ToString().substr(0,20).c_str());
+        RequestFullBlock(pfrom, hash);
+        return;
+    }
+
+    CInv inv(MSG_BLOCK, hash);
+    MarkBlockAsReceived(hash, pfrom->GetId(), ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
+    if (ProcessBlock(pfrom, &block))
+        mapAlreadyAskedFor.erase(inv);
+    if (block.nDoS) Misbehaving(pfrom->GetId(), block.nDoS);
+}
+
+bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, bool fBlockChecked)
 {
     static map<CService, CPubKey> mapReuseKey;
     RandAddSeedPerfmon();
@@ -3579,6 +4651,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         CAddress addrFrom;
         uint64 nNonce = 1;
         vRecv >> pfrom->nVersion >> pfrom->nServices >> nTime >> addrMe;
+        State(pfrom->GetId())->fPreferHeaderAndIDs = (nLocalServices & NODE_COMPACT_BLOCKS) && (pfrom->nServices & NODE_COMPACT_BLOCKS);
+        State(pfrom->GetId())->fSyncHeaders = (nLocalServices & NODE_HEADERS) && (pfrom->nServices & NODE_HEADERS);
         if (pfrom->nVersion < MIN_PROTO_VERSION)
         {
             // Since February 20, 2012, the protocol is initiated at version 209,
@@ -3679,7 +4753,7 @@ std::string testver=incomingver.substr(index); // first chr should be ':'
 
         // Change version
         pfrom->PushMessage("verack");
-        pfrom->vSend.SetVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+        pfrom->SetSendVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
 
         if (!pfrom->fInbound)
         {
@@ -3706,9 +4780,12 @@ std::string testver=incomingver.substr(index); // first chr should be ':'
             }
         }
 
-        // Ask the first connected node for block updates
+        UpdatePreferredDownload(pfrom, State(pfrom->GetId()));
+
+        // Ask the first connected node for block updates; peers that sync
+        // headers first are asked for headers by SendMessages instead
         static int nAskedForBlocks = 0;
-        if (!pfrom->fClient && !pfrom->fOneShot &&
+        if (!pfrom->fClient && !pfrom->fOneShot && !State(pfrom->GetId())->fSyncHeaders &&
             (pfrom->nStartingHeight > (nBestHeight - 144)) &&
             (pfrom->nVersion < NOBLKS_VERSION_START ||
              pfrom->nVersion >= NOBLKS_VERSION_END) &&
@@ -3759,7 +4836,7 @@ std::string testver=incomingver.substr(index); // first chr should be ':'
 
     else if (strCommand == "verack")
     {
-        pfrom->vRecv.SetVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+        pfrom->SetRecvVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
     }
 
 
@@ -3860,6 +4937,8 @@ std::string testver=incomingver.substr(index); // first chr should be ':'
                 break;
             }
         }
+        CNodeState *state = State(pfrom->GetId());
+        vector<CInv> vToFetch;
         CTxDB txdb("r");
         for (unsigned int nInv = 0; nInv < vInv.size(); nInv++)
         {
@@ -3873,11 +4952,27 @@ std::string testver=incomingver.substr(index); // first chr should be ':'
             if (fDebug)
                 printf("  got inventory: %s  %s\n", inv.ToString().c_str(), fAlreadyHave ? "have" : "new");
 
-            if (!fAlreadyHave)
+            if (inv.type == MSG_BLOCK && state->fSyncHeaders)
+            {
+                // SendMessages fetches it once its header is in, along with
+                // whatever else this peer has that we don't
+                UpdateBlockAvailability(pfrom->GetId(), inv.hash);
+                if (!fAlreadyHave && !mapBlocksInFlight.count(inv.hash))
+                {
+                    pfrom->PushMessage("getheaders", CBlockLocator(headerIndex.GetBest()), inv.hash);
+                    // Most likely the new tip, which isn't worth waiting for
+                    if (!IsInitialBlockDownload())
+                    {
+                        vToFetch.push_back(inv);
+                        MarkBlockAsInFlight(pfrom->GetId(), inv.hash, headerIndex.Lookup(inv.hash));
+                    }
+                }
+            }
+            else if (!fAlreadyHave)
                 pfrom->AskFor(inv);
-            else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) {
+            else if (inv.type == MSG_BLOCK && orphanBlocks.Have(inv.hash)) {
 				if ((pfrom->currentPushBlock) || (!IsInitialBlockDownload()))
-	                pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(mapOrphanBlocks[inv.hash]));
+	                pfrom->PushGetBlocks(pindexBest, orphanBlocks.GetRoot(inv.hash));
             } else if (nInv == nLastBlock) {
                 // In case we are on a very long side-chain, it is possible that we already have
                 // the last block in an inv bundle sent in response to getblocks. Try to detect
@@ -3893,6 +4988,9 @@ std::string testver=incomingver.substr(index); // first chr should be ':'
             // Track requests for our stuff
             Inventory(inv.hash);
         }
+
+        if (!vToFetch.empty())
+            pfrom->PushMessage("getdata", vToFetch);
     }
 
 
@@ -3918,13 +5016,19 @@ std::string testver=incomingver.substr(index); // first chr should be ':'
 
             if (inv.type == MSG_BLOCK)
             {
-                // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end())
+                // Only the index lookup needs cs_main; the block is read from
+                // disk without it, so serving old blocks doesn't hold up the tip
+                CBlockIndex* pindex = NULL;
+                {
+                    LOCK(cs_main);
+                    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+                    if (mi != mapBlockIndex.end())
+                        pindex = (*mi).second;
+                }
+                if (pindex)
                 {
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
-                    pfrom->PushMessage("block", block);
+                    if (!PushBlock(pfrom, pindex))
+                        break;
 
                     // Trigger them to send a getblocks request for the next batch of inventory
                     if (inv.hash == pfrom->hashContinue)
@@ -3933,8 +5037,12 @@ std::string testver=incomingver.substr(index); // first chr should be ':'
                         // download node to accept as orphan (proof-of-stake 
                         // block might be rejected by stake connection check)
                         vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, GetLastBlockIndex(pindexBest, false)->GetBlockHash()));
-                        pfrom->PushMessage("inv", vInv);
+                        {
+                            LOCK(cs_main);
+                            vInv.push_back(CInv(MSG_BLOCK, GetLastBlockIndex(pindexBest, false)->GetBlockHash()));
+                        }
+                        // behind the block it follows
+                        pfrom->PushSerializedMessage(MakeSerializedMessage("inv", vInv), IsHistoricBlock(pindex));
                         pfrom->hashContinue = 0;
                     }
                 }
@@ -3945,9 +5053,9 @@ std::string testver=incomingver.substr(index); // first chr should be ':'
                 bool pushed = false;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, CSerializedNetMsgRef>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                        pfrom->PushSerializedMessage((*mi).second);
                         pushed = true;
                     }
                 }
@@ -4005,6 +5113,121 @@ std::string testver=incomingver.substr(index); // first chr should be ':'
             }
         }
     }
+    else if (strCommand == "getheaders")
+    {
+        CBlockLocator locator;
+        uint256 hashStop;
+        vRecv >> locator >> hashStop;
+
+        // Our own headers aren't worth much while we're catching up
+        if (IsInitialBlockDownload())
+            return true;
+
+        CBlockIndex* pindex = NULL;
+        if (locator.IsNull())
+        {
+            // If locator is null, return the hashStop block
+            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            if (mi == mapBlockIndex.end())
+                return true;
+            pindex = (*mi).second;
+        }
+        else
+        {
+            // Find the last block the caller has in the main chain
+            pindex = locator.GetBlockIndex();
+            if (pindex)
+                pindex = pindex->pnext;
+        }
+
+        vector<CHeaderEntry> vHeaders;
+        int nLimit = MAX_HEADERS_RESULTS;
+        if (fDebugNet)
+            printf("getheaders %d to %s\n", (pindex ? pindex->nHeight : -1), hashStop.ToString().substr(0,20).c_str());
+        for (; pindex; pindex = pindex->pnext)
+        {
+            vHeaders.push_back(CHeaderEntry(pindex));
+            if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
+                break;
+        }
+        pfrom->PushMessage("headers", vHeaders);
+    }
+
+
+    else if (strCommand == "headers")
+    {
+        // Like blocks, headers need the PALADIN rules to be checked against
+        if (nPaladinOnlyClients && IsInitialRuleDownload())
+            return true;
+
+        vector<CHeaderEntry> vHeaders;
+        vRecv >> vHeaders;
+        if (vHeaders.size() > MAX_HEADERS_RESULTS)
+        {
+            Misbehaving(pfrom->GetId(), 20);
+            return error("message headers size() = %" PRIszu "", vHeaders.size());
+        }
+        if (vHeaders.empty())
+            return true;
+
+        // Hashing takes the better part of the time, so it is done before
+        // cs_main is taken
+        vector<uint256> vHashes;
+        vHashes.reserve(vHeaders.size());
+        BOOST_FOREACH(const CHeaderEntry& entry, vHeaders)
+            vHashes.push_back(entry.GetBlockHeader().GetHash());
+
+        LOCK(cs_main);
+        CNodeState *state = State(pfrom->GetId());
+        if (state == NULL)
+            return true;
+        CBlockIndex* pindexLast = NULL;
+        for (unsigned int i = 0; i < vHeaders.size(); i++)
+        {
+            if (i > 0 && vHeaders[i].hashPrevBlock != vHashes[i - 1])
+            {
+                Misbehaving(pfrom->GetId(), 20);
+                return error("message headers : non-continuous headers sequence");
+            }
+            int nDoS = 0;
+            if (!headerIndex.Accept(vHeaders[i], vHashes[i], pfrom->GetId(), pindexLast, nDoS))
+            {
+                if (nDoS > 0)
+                {
+                    Misbehaving(pfrom->GetId(), nDoS);
+                    return error("message headers : invalid header %s", vHashes[i].ToString().substr(0,20).c_str());
+                }
+                if (i == 0 && !headerIndex.Lookup(vHeaders[0].hashPrevBlock))
+                {
+                    // Most likely a new tip announced on top of headers we
+                    // haven't got yet; ask for those, but don't let a peer
+                    // send nothing but these forever
+                    if (++state->nUnconnectingHeaders % MAX_UNCONNECTING_HEADERS == 0)
+                        Misbehaving(pfrom->GetId(), 20);
+                    pfrom->PushMessage("getheaders", CBlockLocator(headerIndex.GetBest()), uint256(0));
+                    UpdateBlockAvailability(pfrom->GetId(), vHashes.back());
+                    return true;
+                }
+                // Too far ahead of our blocks, most likely
+                if (pindexLast)
+                    state->pindexHeadersResume = pindexLast;
+                break;
+            }
+        }
+        state->nUnconnectingHeaders = 0;
+
+        if (pindexLast)
+        {
+            UpdateBlockAvailability(pfrom->GetId(), pindexLast->GetBlockHash());
+            printf("received %" PRIszu " headers from peer=%d, best header now %d, %u without their block\n", vHeaders.size(), pfrom->GetId(), headerIndex.GetBest()->nHeight, headerIndex.size());
+
+            // A full message means there are more where these came from
+            if (vHeaders.size() == MAX_HEADERS_RESULTS)
+                pfrom->PushMessage("getheaders", CBlockLocator(pindexLast), uint256(0));
+        }
+    }
+
+
     else if (strCommand == "checkpoint")
     {
         CSyncCheckpoint checkpoint;
@@ -4024,7 +5247,7 @@ std::string testver=incomingver.substr(index); // first chr should be ':'
 
     else if (strCommand == "tx")
     {
-        vector<uint256> vWorkQueue;
+        vector<CTransaction> vWorkQueue;
         vector<uint256> vEraseQueue;
         CDataStream vMsg(vRecv);
         CTxDB txdb("r");
@@ -4040,20 +5263,16 @@ std::string testver=incomingver.substr(index); // first chr should be ':'
             SyncWithWallets(tx, NULL, true);
             RelayMessage(inv, vMsg);
             mapAlreadyAskedFor.erase(inv);
-            vWorkQueue.push_back(inv.hash);
+            vWorkQueue.push_back(tx);
             vEraseQueue.push_back(inv.hash);
 
             // Recursively process any orphan transactions that depended on this one
             for (unsigned int i = 0; i < vWorkQueue.size(); i++)
             {
-                uint256 hashPrev = vWorkQueue[i];
-                for (map<uint256, CDataStream*>::iterator mi = mapOrphanTransactionsByPrev[hashPrev].begin();
-                     mi != mapOrphanTransactionsByPrev[hashPrev].end();
-                     ++mi)
+                vector<CTransaction> vChildren;
+                GetOrphanChildren(vWorkQueue[i], vWorkQueue[i].GetHash(), vChildren);
+                BOOST_FOREACH(CTransaction& tx, vChildren)
                 {
-                    const CDataStream& vMsg = *((*mi).second);
-                    CTransaction tx;
-                    CDataStream(vMsg) >> tx;
                     CInv inv(MSG_TX, tx.GetHash());
                     bool fMissingInputs2 = false;
 
@@ -4061,9 +5280,9 @@ std::string testver=incomingver.substr(index); // first chr should be ':'
                     {
                         printf("   accepted orphan tx %s\n", inv.hash.ToString().substr(0,10).c_str());
                         SyncWithWallets(tx, NULL, true);
-                        RelayMessage(inv, vMsg);
+                        RelayMessage(inv, tx);
                         mapAlreadyAskedFor.erase(inv);
-                        vWorkQueue.push_back(inv.hash);
+                        vWorkQueue.push_back(tx);
                         vEraseQueue.push_back(inv.hash);
                     }
                     else if (!fMissingInputs2)
@@ -4080,7 +5299,7 @@ std::string testver=incomingver.substr(index); // first chr should be ':'
         }
         else if (fMissingInputs)
         {
-            AddOrphanTx(vMsg);
+            AddOrphanTx(tx, pfrom->GetId());
 
             // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
             unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS);
@@ -4124,17 +5343,154 @@ std::string testver=incomingver.substr(index); // first chr should be ':'
 
 			CInv inv(MSG_BLOCK, block.GetHash());
 			pfrom->AddInventoryKnown(inv);
+			MarkBlockAsReceived(inv.hash, pfrom->GetId(), ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
 
-			if (ProcessBlock(pfrom, &block))
+			if (ProcessBlock(pfrom, &block, false, fBlockChecked))
 			    mapAlreadyAskedFor.erase(inv);
 			if (block.nDoS) Misbehaving(pfrom->GetId(), block.nDoS);
 		}
     }
 
 
+    else if (strCommand == "cmpctblock")
+    {
+		if ((!nPaladinOnlyClients) ||
+			(nPaladinOnlyClients && !IsInitialRuleDownload()))
+		{
+			if ((pfrom->currentPushBlock) || (!IsInitialBlockDownload()))
+				lastRecvBlockTime = GetTime();
+		    CBlockHeaderAndShortTxIDs cmpctblock;
+		    vRecv >> cmpctblock;
+
+		    CBlock header;
+		    cmpctblock.GetHeader(header);
+		    uint256 hash = header.GetHash();
+		    pfrom->AddInventoryKnown(CInv(MSG_BLOCK, hash));
+		    UpdateBlockAvailability(pfrom->GetId(), hash);
+		    if (mapBlockIndex.count(hash) || orphanBlocks.Have(hash))
+		        return true;
+
+		    // Nothing is rebuilt, or asked for, before the header checks out
+		    CNodeState* state = State(pfrom->GetId());
+		    CBlockIndex* pindexPrev = headerIndex.Lookup(header.hashPrevBlock);
+		    if (!pindexPrev)
+		    {
+		        // Ahead of us; fetch what leads up to it the usual way, but
+		        // don't let a peer send nothing but these forever
+		        if (++state->nUnconnectingHeaders % MAX_UNCONNECTING_HEADERS == 0)
+		            Misbehaving(pfrom->GetId(), 20);
+		        if (state->fSyncHeaders)
+		            pfrom->PushMessage("getheaders", CBlockLocator(headerIndex.GetBest()), hash);
+		        else
+		            pfrom->AskFor(CInv(MSG_BLOCK, hash));
+		        return true;
+		    }
+		    // The coinstake always comes in full
+		    bool fProofOfStake = false;
+		    BOOST_FOREACH(const CPrefilledTransaction& prefilled, cmpctblock.vPrefilledTxn)
+		        if (prefilled.nIndex == 1 && prefilled.tx.IsCoinStake())
+		            fProofOfStake = true;
+		    int nDoS = 0;
+		    if (!CheckCompactBlockHeader(header, hash, fProofOfStake, pindexPrev, nDoS))
+		    {
+		        if (nDoS > 0)
+		            Misbehaving(pfrom->GetId(), nDoS);
+		        return error("message cmpctblock : invalid header %s", hash.ToString().substr(0,20).c_str());
+		    }
+		    state->nUnconnectingHeaders = 0;
+
+		    CPartialBlock& partial = state->partialBlock;
+		    int nMissing = partial.Init(cmpctblock, mempool);
+		    if (nMissing < 0)
+		    {
+		        // Malformed, or two of its short IDs collide
+		        partial.SetNull();
+		        RequestFullBlock(pfrom, hash);
+		        return true;
+		    }
+		    printf("received compact block %s, %d of %u transactions missing\n", hash.ToString().substr(0,20).c_str(), nMissing, cmpctblock.GetTxCount());
+		    if (nMissing > 0)
+		    {
+		        CBlockTransactionsRequest req;
+		        partial.GetMissing(req);
+		        pfrom->PushMessage("getblocktxn", req);
+		    }
+		    else
+		        ProcessPartialBlock(pfrom, partial);
+		}
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        CBlockTransactionsRequest req;
+        vRecv >> req;
+
+        // Only blocks near the tip, which peers rebuilding a compact block
+        // ask for; anything older goes whole, under the limits getdata has
+        CBlockIndex* pindex = NULL;
+        bool fRecent = false;
+        {
+            LOCK(cs_main);
+            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(req.hashBlock);
+            if (mi == mapBlockIndex.end())
+                return true;
+            pindex = (*mi).second;
+            fRecent = pindex->IsInMainChain() && pindex->nHeight >= nBestHeight - MAX_BLOCKTXN_DEPTH;
+        }
+        if (!fRecent)
+        {
+            printf("peer=%d asked for the transactions of block %s, %d deep; sending it whole\n", pfrom->GetId(), req.hashBlock.ToString().substr(0,20).c_str(), nBestHeight - pindex->nHeight);
+            PushBlock(pfrom, pindex);
+            return true;
+        }
+
+        CBlock block;
+        if (!block.ReadFromDisk(pindex))
+            return true;
+
+        CBlockTransactions resp;
+        resp.hashBlock = req.hashBlock;
+        BOOST_FOREACH(unsigned int nIndex, req.vIndexes)
+        {
+            if (nIndex >= block.vtx.size())
+            {
+                Misbehaving(pfrom->GetId(), 100);
+                return error("message getblocktxn : index %u out of range", nIndex);
+            }
+            resp.vtx.push_back(block.vtx[nIndex]);
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "blocktxn")
+    {
+        CBlockTransactions resp;
+        vRecv >> resp;
+
+        // Not asked for, or overtaken by a newer cmpctblock
+        CPartialBlock& partial = State(pfrom->GetId())->partialBlock;
+        if (partial.IsNull() || partial.GetHash() != resp.hashBlock)
+            return true;
+
+        if (!partial.FillMissing(resp.vtx))
+        {
+            partial.SetNull();
+            Misbehaving(pfrom->GetId(), 10);
+            RequestFullBlock(pfrom, resp.hashBlock);
+            return error("message blocktxn : %" PRIszu " transactions don't fit the block", resp.vtx.size());
+        }
+        ProcessPartialBlock(pfrom, partial);
+    }
+
+
     else if (strCommand == "getaddr")
     {
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_vAddrToSend);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             pfrom->PushAddress(addr);
@@ -4320,16 +5676,197 @@ std::string testver=incomingver.substr(index); // first chr should be ':'
     return true;
 }
 
-bool ProcessMessages(CNode* pfrom)
+// Look ahead in a peer's received messages for complete blocks and hand
+// them to the pre-check threads, so that they are being verified while the
+// messages in front of them are still waiting for cs_main
+void static PrecheckBlockMessages(CNode* pfrom)
 {
-    CDataStream& vRecv = pfrom->vRecv;
-    if (vRecv.empty())
-	{
-        return true;
-	}
+    BOOST_FOREACH(CNetMessage& msg, pfrom->vRecvMsg)
+    {
+        if (!msg.complete() || !blockCheckQueue.HasRoom())
+            break;
+        if (msg.fPrechecked)
+            continue;
+        msg.fPrechecked = true;
+
+        if (msg.hdr.GetCommand() == "block")
+        {
+            uint256 hash = Hash(msg.vRecv.begin(), msg.vRecv.end());
+            if (memcmp(&hash, &msg.hdr.nChecksum, sizeof(msg.hdr.nChecksum)) == 0)
+                blockCheckQueue.Push(hash, msg.vRecv, pfrom->GetId());
+        }
+    }
+}
+
+// Messages that only touch per-node state, the address manager, the relay
+// pool or the memory pool, which all have locks of their own.  These are
+// handled without cs_main, so pings, addresses and getdata requests keep
+// being answered while a block is being connected.  "headers" takes cs_main
+// itself once the headers are hashed.
+bool static MessageNeedsChainState(const string& strCommand)
+{
+    return !(strCommand == "ping" || strCommand == "pong" || strCommand == "verack" ||
+             strCommand == "addr" || strCommand == "getaddr" || strCommand == "getdata" ||
+             strCommand == "mempool" || strCommand == "headers");
+}
+
+// Run a message through ProcessMessage, under cs_main if it needs it
+bool static HandleMessage(CNode* pfrom, const string& strCommand, CDataStream& vMsg, unsigned int nMessageSize, bool fBlockChecked, int64 nTimeReceived)
+{
+    bool fRet = false;
+    try
+    {
+        if (MessageNeedsChainState(strCommand))
+        {
+            LOCK(cs_main);
+            if (nTimeReceived)
+                pfrom->RecordMsgLatency(GetTimeMicros() - nTimeReceived);
+            fRet = ProcessMessage(pfrom, strCommand, vMsg, fBlockChecked);
+        }
+        else
+        {
+            if (nTimeReceived)
+                pfrom->RecordMsgLatency(GetTimeMicros() - nTimeReceived);
+            fRet = ProcessMessage(pfrom, strCommand, vMsg, fBlockChecked);
+        }
+    }
+    catch (std::ios_base::failure& e)
+    {
+        if (strstr(e.what(), "end of data"))
+        {
+            // Allow exceptions from under-length message on vRecv
+            printf("ProcessMessages(%s, %u bytes) : Exception '%s' caught, normally caused by a message being shorter than its stated length\n", strCommand.c_str(), nMessageSize, e.what());
+        }
+        else if (strstr(e.what(), "size too large"))
+        {
+            // Allow exceptions from over-long size
+            printf("ProcessMessages(%s, %u bytes) : Exception '%s' caught\n", strCommand.c_str(), nMessageSize, e.what());
+        }
+        else
+        {
+            PrintExceptionContinue(&e, "ProcessMessages()");
+        }
+    }
+    catch (std::exception& e) {
+        PrintExceptionContinue(&e, "ProcessMessages()");
+    } catch (...) {
+        PrintExceptionContinue(NULL, "ProcessMessages()");
+    }
+
+    if (!fRet)
+        printf("ProcessMessage(%s, %u bytes) FAILED\n", strCommand.c_str(), nMessageSize);
+    return fRet;
+}
+
+// Blocks and transactions are validated by a thread of their own, so a long
+// ConnectBlock doesn't tie up the message handler threads.  While a peer has
+// a message queued here the handlers leave its receive buffer alone, which
+// keeps its messages in the order they were sent.
+struct CValidationJob
+{
+    CNode* pfrom;
+    string strCommand;
+    CDataStream vMsg;
+    uint256 hashMsg;
+    int64 nTimeReceived;
+
+    CValidationJob(CNode* pfromIn, const string& strCommandIn, const uint256& hashMsgIn, int64 nTimeReceivedIn) :
+        pfrom(pfromIn), strCommand(strCommandIn), vMsg(SER_NETWORK, PROTOCOL_VERSION), hashMsg(hashMsgIn), nTimeReceived(nTimeReceivedIn) {}
+};
+
+static boost::mutex mutexValidation;
+static boost::condition_variable condValidation;
+static deque<CValidationJob*> queueValidation;
+static bool fValidationThread = false;
+
+bool static ValidationPending(CNode* pfrom)
+{
+    boost::lock_guard<boost::mutex> lock(mutexValidation);
+    return pfrom->fValidationPending;
+}
+
+// Takes over the contents of vMsg
+void static QueueValidation(CNode* pfrom, const string& strCommand, CDataStream& vMsg, const uint256& hashMsg, int64 nTimeReceived)
+{
+    {
+        LOCK(cs_vNodes);
+        pfrom->AddRef();
+    }
+    CValidationJob* pjob = new CValidationJob(pfrom, strCommand, hashMsg, nTimeReceived);
+    pjob->vMsg.swap(vMsg);
+    {
+        boost::lock_guard<boost::mutex> lock(mutexValidation);
+        pfrom->fValidationPending = true;
+        queueValidation.push_back(pjob);
+    }
+    condValidation.notify_one();
+}
+
+void static ThreadMessageValidation2()
+{
+    while (!fShutdown)
+    {
+        CValidationJob* pjob = NULL;
+        {
+            boost::unique_lock<boost::mutex> lock(mutexValidation);
+            if (queueValidation.empty())
+            {
+                condValidation.timed_wait(lock, boost::posix_time::seconds(1));
+                continue;
+            }
+            pjob = queueValidation.front();
+            queueValidation.pop_front();
+        }
+
+        CNode* pfrom = pjob->pfrom;
+        bool fBlockChecked = false;
+        if (pjob->strCommand == "block")
+            fBlockChecked = blockCheckQueue.Wait(pjob->hashMsg);
+        HandleMessage(pfrom, pjob->strCommand, pjob->vMsg, pjob->vMsg.size(), fBlockChecked, pjob->nTimeReceived);
+        delete pjob;
+
+        {
+            boost::lock_guard<boost::mutex> lock(mutexValidation);
+            pfrom->fValidationPending = false;
+        }
+        // Let the handlers get on with the rest of this peer's messages
+        QueueMessageHandler(pfrom);
+        {
+            LOCK(cs_vNodes);
+            pfrom->Release();
+        }
+    }
+}
+
+void static ThreadMessageValidation(void* parg)
+{
+    RenameThread("litecoinplus-validation");
+    try
+    {
+        vnThreadsRunning[THREAD_VALIDATION]++;
+        ThreadMessageValidation2();
+        vnThreadsRunning[THREAD_VALIDATION]--;
+    }
+    catch (std::exception& e) {
+        vnThreadsRunning[THREAD_VALIDATION]--;
+        PrintException(&e, "ThreadMessageValidation()");
+    } catch (...) {
+        vnThreadsRunning[THREAD_VALIDATION]--;
+        PrintException(NULL, "ThreadMessageValidation()");
+    }
+}
+
+void StartMessageValidationThread()
+{
+    fValidationThread = NewThread(ThreadMessageValidation, NULL);
+    if (!fValidationThread)
+        printf("Error: NewThread(ThreadMessageValidation) failed, validating in line\n");
+}
 
+bool ProcessMessages(CNode* pfrom)
+{
     //if (fDebug)
-    //    printf("ProcessMessages(%u bytes)\n", vRecv.size());
+    //    printf("ProcessMessages(%" PRIszu " messages)\n", pfrom->vRecvMsg.size());
 
     //
     // Message format
@@ -4339,59 +5876,40 @@ bool ProcessMessages(CNode* pfrom)
     //  (4) checksum
     //  (x) data
     //
+    // The socket thread has already split the stream into messages, see
+    // CNetMessage; here they are checked and dispatched.
+    //
 
-    loop()
+    PrecheckBlockMessages(pfrom);
+
+    std::deque<CNetMessage>::iterator it = pfrom->vRecvMsg.begin();
+    while (!pfrom->fDisconnect && it != pfrom->vRecvMsg.end())
     {
+        // Still validating an earlier block or tx from this peer
+        if (ValidationPending(pfrom))
+            break;
 
         // Don't bother if send buffer is too full to respond anyway
-        if (pfrom->vSend.size() >= SendBufferSize())
-		{
+        if (pfrom->nSendSize >= SendBufferSize())
             break;
-		}
 
-        // Scan for message start
-        CDataStream::iterator pstart = search(vRecv.begin(), vRecv.end(), BEGIN(pchMessageStart), END(pchMessageStart));
-        int nHeaderSize = vRecv.GetSerializeSize(CMessageHeader());
-        if (vRecv.end() - pstart < nHeaderSize)
-        {
-            if ((int)vRecv.size() > nHeaderSize)
-            {
-                printf("\n\nPROCESSMESSAGE MESSAGESTART NOT FOUND\n\n");
-                vRecv.erase(vRecv.begin(), vRecv.end() - nHeaderSize);
-            }
+        // get next message
+        CNetMessage& msg = *it;
+
+        // end, if an incomplete message is found
+        if (!msg.complete())
             break;
-        }
-        if (pstart - vRecv.begin() > 0)
-            printf("\n\nPROCESSMESSAGE SKIPPED %" PRIpdd " BYTES\n\n", pstart - vRecv.begin());
-        vRecv.erase(vRecv.begin(), pstart);
-
-        // Read header
-        vector<char> vHeaderSave(vRecv.begin(), vRecv.begin() + nHeaderSize);
-        CMessageHeader hdr;
-        vRecv >> hdr;
-        if (!hdr.IsValid())
-        {
-            printf("\n\nPROCESSMESSAGE: ERRORS IN HEADER %s\n\n\n", hdr.GetCommand().c_str());
-            continue;
-        }
-        string strCommand = hdr.GetCommand();
 
-        // Message size
+        // at this point, any failure means we can delete the current message
+        it++;
+
+        CMessageHeader& hdr = msg.hdr;
+        string strCommand = hdr.GetCommand();
         unsigned int nMessageSize = hdr.nMessageSize;
-        if (nMessageSize > MAX_SIZE)
-        {
-            printf("ProcessMessages(%s, %u bytes) : nMessageSize > MAX_SIZE\n", strCommand.c_str(), nMessageSize);
-            continue;
-        }
-        if (nMessageSize > vRecv.size())
-        {
-            // Rewind and wait for rest of message
-            vRecv.insert(vRecv.begin(), vHeaderSave.begin(), vHeaderSave.end());
-            break;
-        }
 
         // Checksum
-        uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
+        CDataStream& vMsg = msg.vRecv;
+        uint256 hash = Hash(vMsg.begin(), vMsg.begin() + nMessageSize);
         unsigned int nChecksum = 0;
         memcpy(&nChecksum, &hash, sizeof(nChecksum));
         if (nChecksum != hdr.nChecksum)
@@ -4401,64 +5919,45 @@ bool ProcessMessages(CNode* pfrom)
             continue;
         }
 
-        // Copy message to its own buffer
-        CDataStream vMsg(vRecv.begin(), vRecv.begin() + nMessageSize, vRecv.nType, vRecv.nVersion);
-        vRecv.ignore(nMessageSize);
-
-        // Process message
-        bool fRet = false;
-        try
-        {
-			loop()
-			{
-		        {
-		            TRY_LOCK(cs_main, lockMain);
-					if (lockMain)
-					{
-		            	fRet = ProcessMessage(pfrom, strCommand, vMsg);
-						break;
-					}
-					else
-					{
-						Sleep(20);
-						continue;
-					}
-		        }
-			}
-            if (fShutdown)
-                return true;
-        }
-        catch (std::ios_base::failure& e)
+        // Blocks and transactions go to the validation thread, and the rest
+        // of this peer's messages wait for them
+        if (fValidationThread && (strCommand == "block" || strCommand == "tx" || strCommand == "cmpctblock" || strCommand == "blocktxn"))
         {
-            if (strstr(e.what(), "end of data"))
-            {
-                // Allow exceptions from under-length message on vRecv
-                printf("ProcessMessages(%s, %u bytes) : Exception '%s' caught, normally caused by a message being shorter than its stated length\n", strCommand.c_str(), nMessageSize, e.what());
-            }
-            else if (strstr(e.what(), "size too large"))
-            {
-                // Allow exceptions from over-long size
-                printf("ProcessMessages(%s, %u bytes) : Exception '%s' caught\n", strCommand.c_str(), nMessageSize, e.what());
-            }
-            else
-            {
-                PrintExceptionContinue(&e, "ProcessMessages()");
-            }
-        }
-        catch (std::exception& e) {
-            PrintExceptionContinue(&e, "ProcessMessages()");
-        } catch (...) {
-            PrintExceptionContinue(NULL, "ProcessMessages()");
+            QueueValidation(pfrom, strCommand, vMsg, hash, msg.nTime);
+            continue;
         }
 
-        if (!fRet)
-            printf("ProcessMessage(%s, %u bytes) FAILED\n", strCommand.c_str(), nMessageSize);
+        // Collect the pre-check result before taking cs_main, so any
+        // waiting for it is done without holding up everyone else
+        bool fBlockChecked = false;
+        if (strCommand == "block")
+            fBlockChecked = blockCheckQueue.Wait(hash);
+
+        HandleMessage(pfrom, strCommand, vMsg, nMessageSize, fBlockChecked, msg.nTime);
+        if (fShutdown)
+            break;
     }
 
-    vRecv.Compact();
+    // In case the connection got shut down, its receive buffer was wiped
+    if (!pfrom->fDisconnect)
+        pfrom->vRecvMsg.erase(pfrom->vRecvMsg.begin(), it);
+
     return true;
 }
 
+
+// Whether the peer has messages in that aren't handled yet: queued for
+// the validation thread, or complete in its receive buffer
+bool static HaveUnhandledMessages(CNode* pnode)
+{
+    if (ValidationPending(pnode))
+        return true;
+    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+    if (!lockRecv)
+        return true;
+    return !pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().complete();
+}
+
 static const int PING_INTERVAL = 30;
 extern void GetRandBytes(unsigned char* buf, int num);
 extern void AdvertiseLocal(CNode *pnode);
@@ -4516,7 +6015,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
 				        {
 				            // Periodically clear setAddrKnown to allow refresh broadcasts
 				            if (nLastRebroadcast)
+				            {
+				                LOCK(pnode->cs_vAddrToSend);
 				                pnode->setAddrKnown.clear();
+				            }
 
 				            // Rebroadcast our address
 				            if (!fNoListen)
@@ -4537,6 +6039,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
 		    //
 		    if (fSendTrickle)
 		    {
+		        LOCK(pto->cs_vAddrToSend);
 		        vector<CAddress> vAddr;
 		        vAddr.reserve(pto->vAddrToSend.size());
 		        BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
@@ -4671,6 +6174,81 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
 				    }
 				    pto->mapAskFor.erase(pto->mapAskFor.begin());
 				}
+
+				// Headers-first: start syncing headers with one peer at first,
+				// and with the others once we're close to the tip
+				bool fFetch = state.fPreferredDownload || (nPreferredDownload == 0 && !pto->fClient && !pto->fOneShot);
+				CBlockIndex* pindexBestHeader = headerIndex.GetBest();
+				if (state.fSyncHeaders && !state.fSyncStarted && !pto->fClient && fFetch)
+				{
+				    if (nSyncStarted == 0 || pindexBestHeader->GetBlockTime() > GetAdjustedTime() - 24 * 60 * 60)
+				    {
+				        state.fSyncStarted = true;
+				        nSyncStarted++;
+				        // Start one back, so the reply isn't empty when we're in sync
+				        CBlockIndex* pindexStart = pindexBestHeader->pprev ? pindexBestHeader->pprev : pindexBestHeader;
+				        printf("initial getheaders (%d) to peer=%d (startheight:%d)\n", pindexStart->nHeight, pto->GetId(), pto->nStartingHeight);
+				        pto->PushMessage("getheaders", CBlockLocator(pindexStart), uint256(0));
+				    }
+				}
+
+				// A peer that held up the whole download window for too long
+				// makes way for one that doesn't.  Neither this nor the
+				// timeouts below count against a peer that has sent us
+				// messages we haven't got to, as the blocks may well be
+				// among them.
+				int64 nNowMicros = GetTimeMicros();
+				bool fUnhandled = HaveUnhandledMessages(pto);
+				if (!pto->fDisconnect && !fUnhandled && state.nStallingSince && state.nStallingSince < nNowMicros - BLOCK_STALLING_TIMEOUT * 1000000)
+				{
+				    printf("Peer=%d is stalling block download, disconnecting\n", pto->GetId());
+				    pto->fDisconnect = true;
+				}
+
+				// Requests past their deadline go to another peer, and a peer
+				// that lets them time out several passes in a row is dropped
+				if (!fUnhandled && ExpireBlocksInFlight(pto->GetId()) > 0)
+				{
+				    printf("Block requests to peer=%d timed out (%d in a row)\n", pto->GetId(), state.nTimeoutStreak);
+				    if (state.nTimeoutStreak >= MAX_BLOCK_DOWNLOAD_TIMEOUTS && !pto->fWhitelisted)
+				        pto->fDisconnect = true;
+				}
+
+				// Headers off the best branch go, and the rest of a headers
+				// message cut short is asked for once the blocks have caught up
+				PruneHeaders();
+				if (state.pindexHeadersResume && state.pindexHeadersResume->nHeight <= nBestHeight + MAX_UNTRUSTED_HEADERS_AHEAD / 2)
+				{
+				    pto->PushMessage("getheaders", CBlockLocator(state.pindexHeadersResume), uint256(0));
+				    state.pindexHeadersResume = NULL;
+				}
+
+				// Blocks under the best header, from every peer that has them,
+				// with more at a time from the faster ones
+				int nMaxInFlight = BlocksInFlightLimit(state);
+				if (!pto->fDisconnect && state.fSyncHeaders && !pto->fClient && fFetch && state.nBlocksInFlight < nMaxInFlight)
+				{
+				    vector<CBlockIndex*> vToDownload;
+				    NodeId staller = -1;
+				    FindNextBlocksToDownload(pto->GetId(), nMaxInFlight - state.nBlocksInFlight, vToDownload, staller);
+				    BOOST_FOREACH(CBlockIndex* pindex, vToDownload)
+				    {
+				        vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
+				        MarkBlockAsInFlight(pto->GetId(), pindex->GetBlockHash(), pindex);
+				        if (fDebugNet)
+				            printf("Requesting block %s (%d) peer=%d\n", pindex->GetBlockHash().ToString().substr(0,20).c_str(), pindex->nHeight, pto->GetId());
+				    }
+				    if (state.nBlocksInFlight == 0 && staller != -1)
+				    {
+				        CNodeState* stateStaller = State(staller);
+				        if (stateStaller && stateStaller->nStallingSince == 0)
+				        {
+				            stateStaller->nStallingSince = nNowMicros;
+				            printf("Stall started peer=%d\n", staller);
+				        }
+				    }
+				}
+
 				if (!vGetData.empty())
 				{
 				    pto->PushMessage("getdata", vGetData);
@@ -4782,7 +6360,8 @@ public:
 
 // CreateNewBlock:
 //   fProofOfStake: try (best effort) to make a proof-of-stake block
-CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake)
+//   pstate: if not NULL, receives the running totals needed to extend the block later
+CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake, CBlockTemplateState* pstate)
 {
     CReserveKey reservekey(pwallet);
 
@@ -4861,6 +6440,10 @@ CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake)
 
     pblock->nBits = GetNextTargetRequired(pindexPrev, pblock->IsProofOfStake());
 
+    // No kernel found, the caller is going to throw this block away anyway
+    if (fProofOfStake && !pblock->IsProofOfStake())
+        return pblock.release();
+
     // Collect memory pool transactions into the block
     int64 nFees = 0;
     {
@@ -4868,6 +6451,10 @@ CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake)
         CBlockIndex* pindexPrev = pindexBest;
         CTxDB txdb("r");
 
+        // A proof-of-stake block can take its transactions straight from the
+        // current template instead of walking the memory pool again
+        bool fFromTemplate = pblock->IsProofOfStake() && blockTemplate.FillStakeBlock(*pblock, pindexPrev);
+
         // Priority order to process transactions
         list<COrphan> vOrphan; // list memory doesn't move
         map<uint256, vector<COrphan*> > mapDependers;
@@ -4875,7 +6462,7 @@ CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake)
         // This vector will be sorted into a priority queue:
         vector<TxPriority> vecPriority;
         vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+        for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); !fFromTemplate && mi != mempool.mapTx.end(); ++mi)
         {
             CTransaction& tx = (*mi).second;
             if (tx.IsCoinBase() || tx.IsCoinStake() || !tx.IsFinal())
@@ -4949,10 +6536,25 @@ CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake)
         uint64 nBlockTx = 0;
         int nBlockSigOps = 100;
         bool fSortedByFee = (nBlockPrioritySize <= 0);
+        double dLastFeePerKb = std::numeric_limits<double>::max();
+
+        // The coinstake takes its share of the limits like any transaction
+        if (pblock->IsProofOfStake())
+        {
+            nBlockSize += ::GetSerializeSize(pblock->vtx[1], SER_NETWORK, PROTOCOL_VERSION);
+            nBlockSigOps += pblock->vtx[1].GetLegacySigOpCount();
+        }
 
         TxPriorityCompare comparer(fSortedByFee);
         std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
 
+        if (pstate)
+        {
+            pstate->SetNull();
+            pstate->vTxFees.resize(pblock->vtx.size(), 0);
+            pstate->vTxSigOps.resize(pblock->vtx.size(), 0);
+        }
+
         while (!vecPriority.empty())
         {
             // Take highest priority transaction off the priority queue:
@@ -5021,6 +6623,13 @@ CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake)
             ++nBlockTx;
             nBlockSigOps += nTxSigOps;
             nFees += nTxFees;
+            if (fSortedByFee)
+                dLastFeePerKb = dFeePerKb;
+            if (pstate)
+            {
+                pstate->vTxFees.push_back(nTxFees);
+                pstate->vTxSigOps.push_back(nTxSigOps);
+            }
 
             if (fDebug && GetBoolArg("-printpriority"))
             {
@@ -5047,8 +6656,25 @@ CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake)
             }
         }
 
-        nLastBlockTx = nBlockTx;
-        nLastBlockSize = nBlockSize;
+        if (!fFromTemplate)
+        {
+            nLastBlockTx = nBlockTx;
+            nLastBlockSize = nBlockSize;
+        }
+
+        if (pstate)
+        {
+            pstate->mapTestPool.swap(mapTestPool);
+            pstate->nBlockSize = nBlockSize;
+            pstate->nBlockSigOps = nBlockSigOps;
+            pstate->nFees = nFees;
+            pstate->nBlockMaxSize = nBlockMaxSize;
+            pstate->nBlockMinSize = nBlockMinSize;
+            pstate->nBlockPrioritySize = nBlockPrioritySize;
+            pstate->nMinTxFee = nMinTxFee;
+            pstate->fSortedByFee = fSortedByFee;
+            pstate->dLastFeePerKb = dLastFeePerKb;
+        }
 
         if (fDebug && GetBoolArg("-printpriority"))
             printf("CreateNewBlock(): total size %" PRI64u "\n", nBlockSize);
@@ -5085,7 +6711,7 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
     pblock->vtx[0].vin[0].scriptSig = (CScript() << nHeight << CBigNum(nExtraNonce)) + COINBASE_FLAGS;
     assert(pblock->vtx[0].vin[0].scriptSig.size() <= 100);
 
-    pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+    pblock->hashMerkleRoot = pblock->UpdateMerkleTreeCoinbase();
 }
 
 
@@ -5221,15 +6847,16 @@ void BitcoinMiner(CWallet *pwallet, bool fProofOfStake)
         //
         // Create new block
         //
-        unsigned int nTransactionsUpdatedLast = nTransactionsUpdated;
         CBlockIndex* pindexPrev = pindexBest;
+        CBlock* pblockNew = fProofOfStake ? CreateNewBlock(pwallet, true) : blockTemplate.CreateBlock(pwallet, pindexPrev);
+        unsigned int nSequenceLast = blockTemplate.GetSequence();
 
 #if __cplusplus == 201703L
-    	std::unique_ptr<CBlock> pblock(CreateNewBlock(pwallet, fProofOfStake));
+    	std::unique_ptr<CBlock> pblock(pblockNew);
 #elif __cplusplus == 201402L
-    	std::unique_ptr<CBlock> pblock(CreateNewBlock(pwallet, fProofOfStake));
+    	std::unique_ptr<CBlock> pblock(pblockNew);
 #else
-		auto_ptr<CBlock> pblock(CreateNewBlock(pwallet, fProofOfStake));
+		auto_ptr<CBlock> pblock(pblockNew);
 #endif
 
         if (!pblock.get())
@@ -5358,7 +6985,7 @@ void BitcoinMiner(CWallet *pwallet, bool fProofOfStake)
                 break;
             if (nBlockNonce >= 0xffff0000)
                 break;
-            if (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60)
+            if (blockTemplate.GetSequence() != nSequenceLast && GetTime() - nStart > 60)
                 break;
             if (pindexPrev != pindexBest)
                 break;
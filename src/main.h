@@ -29,7 +29,31 @@ static const unsigned int MAX_BLOCK_SIZE = 1000000;
 static const unsigned int MAX_BLOCK_SIZE_GEN = MAX_BLOCK_SIZE/2;
 static const unsigned int MAX_BLOCK_SIGOPS = MAX_BLOCK_SIZE/50;
 static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/100;
+static const unsigned int MAX_ORPHAN_TRANSACTIONS_PER_PEER = MAX_ORPHAN_TRANSACTIONS/10;
+/** Orphan transactions whose parents haven't shown up by then are dropped, in seconds */
+static const int64 ORPHAN_TX_EXPIRE_TIME = 20 * 60;
 static const unsigned int MAX_INV_SZ = 50000;
+/** Blocks older than this are sent behind everything else, and no longer
+ *  once -maxuploadtarget is nearly used up, in seconds */
+static const int64 HISTORIC_BLOCK_AGE = 7 * 24 * 60 * 60;
+/** Deepest block under the tip whose transactions are served by getblocktxn;
+ *  older ones are sent whole, under the historic block limits */
+static const int MAX_BLOCKTXN_DEPTH = 10;
+/** Most headers in one "headers" message */
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** Headers announcements in a row that don't connect before a peer is penalized */
+static const int MAX_UNCONNECTING_HEADERS = 10;
+/** Most blocks requested from one peer at a time during headers-first sync */
+static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** How far past the last block we have blocks are fetched; also bounds the orphans it leaves */
+static const int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** A peer holding up the download window for longer is disconnected, in seconds */
+static const int BLOCK_STALLING_TIMEOUT = 5;
+/** How long a block request gets, from when the peer gets to it, before it
+ *  goes to another peer, in seconds; twice the peer's average per block on top */
+static const int BLOCK_DOWNLOAD_TIMEOUT_BASE = 60;
+/** Passes in a row in which a peer let block requests time out before it is disconnected */
+static const int MAX_BLOCK_DOWNLOAD_TIMEOUTS = 3;
 static const int64 MIN_TX_FEE = 0.001 * CENT;
 static const int64 MIN_RELAY_TX_FEE = 0.001 * CENT;
 //static const int64 MAX_MONEY = 442800 * COIN;			// 442,800
@@ -91,11 +115,13 @@ extern int64 nTimeBestReceived;
 extern CCriticalSection cs_setpwalletRegistered;
 extern std::set<CWallet*> setpwalletRegistered;
 extern unsigned char pchMessageStart[4];
-extern std::map<uint256, CBlock*> mapOrphanBlocks;
+extern uint256 hashAssumeValid;
 
 // Settings
 extern int64 nTransactionFee;
 
+/** Headers of the blocks proof-of-stake inputs came from kept in memory */
+static const unsigned int MAX_STAKE_HEADER_CACHE = 2000;
 // Minimum disk space required - used in CheckDiskSpace()
 static const uint64 nMinDiskSpace = 52428800;
 
@@ -107,51 +133,83 @@ void UnregisterNodeSignals(CNodeSignals& nodeSignals);
 class CReserveKey;
 class CTxDB;
 class CTxIndex;
+class CBlockTemplateState;
 
 void RegisterWallet(CWallet* pwalletIn);
 void UnregisterWallet(CWallet* pwalletIn);
 void SyncWithWallets(const CTransaction& tx, const CBlock* pblock = NULL, bool fUpdate = false, bool fConnect = true);
-bool ProcessBlock(CNode* pfrom, CBlock* pblock, bool lessAggressive = false);
+// fPrechecked: the block, as is, already passed CheckBlock on a pre-check thread
+bool ProcessBlock(CNode* pfrom, CBlock* pblock, bool lessAggressive = false, bool fPrechecked = false);
 bool CheckDiskSpace(uint64 nAdditionalBytes=0);
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
+bool ReadStakeBlockHeader(unsigned int nFile, unsigned int nBlockPos, CBlock& block);
 FILE* AppendBlockFile(unsigned int& nFileRet);
 bool LoadBlockIndex(bool fAllowNew=true);
 void PrintBlockTree();
 CBlockIndex* FindBlockByHeight(int nHeight);
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
+void StartMessageValidationThread();
 bool LoadExternalBlockFile(FILE* fileIn);
 void GenerateBitcoins(bool fGenerate, CWallet* pwallet);
-CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake=false);
+CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake=false, CBlockTemplateState* pstate=NULL);
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 void FormatHashBuffers(CBlock* pblock, char* pmidstate, char* pdata, char* phash1);
 bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey);
 bool CheckProofOfWork(uint256 hash, unsigned int nBits);
 int64 GetProofOfWorkReward(int nHeight, int64 nFees, uint256 prevHash);
 int64 GetProofOfStakeReward(int64 nCoinAge, unsigned int nBits, unsigned int nTime, int nHeight);
+int getPowRestartBlock();
 unsigned int GetStakeMinAge(unsigned int nTime);
 unsigned int GetStakeMaxAge(unsigned int nTime);
 
 unsigned int ComputeMinWork(unsigned int nBase, int64 nTime);
+unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfStake);
 unsigned int ComputeMinStake(unsigned int nBase, int64 nTime, unsigned int nBlockTime);
 int GetNumBlocksOfPeers();
 bool IsInitialBlockDownload();
 bool IsInitialRuleDownload();
 std::string GetWarnings(std::string strFor);
 bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock);
-uint256 WantedByOrphan(const CBlock* pblockOrphan);
 const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfStake);
 void BitcoinMiner(CWallet *pwallet, bool fProofOfStake);
 void ResendWalletTransactions();
+bool IsAssumedValid(const CBlockIndex* pindex);
+
+/** Signature checking done by ConnectBlock since startup */
+struct CChainTxStats {
+    int nAssumeValidHeight;     // -1 while the -assumevalid header isn't known
+    int64 nBlocks;
+    int64 nBlocksSkipped;       // connected without checking signatures
+    int64 nTx;
+    int64 nInputs;
+    int64 nInputsSkipped;
+};
+void GetChainTxStats(CChainTxStats& stats);
 
 struct CNodeStateStats {
     int nMisbehavior;
     int nSyncHeight;
     int nCommonHeight;
     std::vector<int> vHeightInFlight;
+    int nBlocksReceived;
+    int nBlockTimeouts;
+    int64_t nAvgBlockLatency;
+    int64_t nAvgBlockBytesPerSec;
+    int nBlocksInFlightLimit;
 };
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats);
 
+struct CBlockInFlightStats {
+    uint256 hash;
+    int nHeight;
+    NodeId nodeid;
+    int64_t nTime;
+    int64_t nDeadline;
+};
+/** The outstanding block requests of headers-first download */
+void GetBlocksInFlight(std::vector<CBlockInFlightStats>& vStats);
+
 
 bool GetWalletFile(CWallet* pwallet, std::string &strWalletFileOut);
 
@@ -724,6 +782,7 @@ public:
     bool CheckTransaction() const;
     bool AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs=true, bool* pfMissingInputs=NULL);
     bool GetCoinAge(CTxDB& txdb, uint64& nCoinAge) const;  // ppcoin: get transaction coin age
+    bool GetCoinAge(const MapPrevTx& inputs, uint64& nCoinAge) const;
 
 protected:
     const CTxOut& GetOutputFor(const CTxIn& input, const MapPrevTx& inputs) const;
@@ -988,6 +1047,32 @@ public:
         return (vMerkleTree.empty() ? 0 : vMerkleTree.back());
     }
 
+    // Recompute the merkle root when only the coinbase has changed since
+    // vMerkleTree was built, touching one node per level
+    uint256 UpdateMerkleTreeCoinbase() const
+    {
+        unsigned int nTreeSize = 0;
+        for (int nSize = vtx.size(); nSize > 0; nSize = (nSize + 1) / 2)
+        {
+            nTreeSize += nSize;
+            if (nSize == 1)
+                break;
+        }
+        if (vtx.empty() || vMerkleTree.size() != nTreeSize)
+            return BuildMerkleTree();
+
+        vMerkleTree[0] = vtx[0].GetHash();
+        int j = 0;
+        for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
+        {
+            int i2 = std::min(1, nSize-1);
+            vMerkleTree[j+nSize] = Hash(BEGIN(vMerkleTree[j]),    END(vMerkleTree[j]),
+                                        BEGIN(vMerkleTree[j+i2]), END(vMerkleTree[j+i2]));
+            j += nSize;
+        }
+        return vMerkleTree.back();
+    }
+
     std::vector<uint256> GetMerkleBranch(int nIndex) const
     {
         if (vMerkleTree.empty())
@@ -1097,18 +1182,20 @@ public:
 
 
     bool DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex);
-    bool ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck=false);
+    // fChecked: the block passed CheckBlock on its way in, so only the
+    // checks that need the chain are left to do
+    bool ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck=false, bool fChecked=false);
     bool ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions=true);
-    bool SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew);
-    bool AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos);
-    bool CheckBlock(bool fCheckPOW=true, bool fCheckMerkleRoot=true) const;
-    bool AcceptBlock(bool lessAggressive = false);
+    bool SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew, bool fChecked=false);
+    bool AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, bool fChecked=false);
+    bool CheckBlock(bool fCheckPOW=true, bool fCheckMerkleRoot=true, bool fPrechecked=false) const;
+    bool AcceptBlock(bool lessAggressive = false, bool fChecked = false);
     bool GetCoinAge(uint64& nCoinAge) const; // ppcoin: calculate total coin age spent in block
     bool SignBlock(const CKeyStore& keystore);
     bool CheckBlockSignature() const;
 
 private:
-    bool SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew);
+    bool SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew, bool fChecked=false);
 };
 
 
@@ -1129,6 +1216,7 @@ public:
     const uint256* phashBlock;
     CBlockIndex* pprev;
     CBlockIndex* pnext;
+    CBlockIndex* pskip; // an ancestor further back, for GetAncestor; in-memory only
     unsigned int nFile;
     unsigned int nBlockPos;
     CBigNum bnChainTrust; // ppcoin: trust score of block chain
@@ -1165,6 +1253,7 @@ public:
         phashBlock = NULL;
         pprev = NULL;
         pnext = NULL;
+        pskip = NULL;
         nFile = 0;
         nBlockPos = 0;
         nHeight = 0;
@@ -1190,6 +1279,7 @@ public:
         phashBlock = NULL;
         pprev = NULL;
         pnext = NULL;
+        pskip = NULL;
         nFile = nFileIn;
         nBlockPos = nBlockPosIn;
         nHeight = 0;
@@ -1244,6 +1334,13 @@ public:
 
     CBigNum GetBlockTrust() const;
 
+    // Point pskip at an earlier ancestor; pprev's must already be set
+    void BuildSkip();
+
+    // The ancestor at nHeightIn, in about log(n) steps where pskip is set
+    CBlockIndex* GetAncestor(int nHeightIn);
+    const CBlockIndex* GetAncestor(int nHeightIn) const;
+
     bool IsInMainChain() const
     {
         return (pnext || this == pindexBest);
@@ -1675,6 +1772,141 @@ public:
 
 
 
+/** Running totals of a block under construction, kept by CreateNewBlock so
+ * the block can later be extended without collecting the memory pool again */
+class CBlockTemplateState
+{
+public:
+    std::map<uint256, CTxIndex> mapTestPool;
+    std::vector<int64> vTxFees;
+    std::vector<unsigned int> vTxSigOps;
+    uint64 nBlockSize;
+    int nBlockSigOps;
+    int64 nFees;
+    unsigned int nBlockMaxSize;
+    unsigned int nBlockMinSize;
+    unsigned int nBlockPrioritySize;
+    int64 nMinTxFee;
+    // Whether the collection got past the high-priority part, and the fee
+    // rate of the last transaction it took in fee order
+    bool fSortedByFee;
+    double dLastFeePerKb;
+
+    CBlockTemplateState()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        mapTestPool.clear();
+        vTxFees.clear();
+        vTxSigOps.clear();
+        nBlockSize = 0;
+        nBlockSigOps = 0;
+        nFees = 0;
+        nBlockMaxSize = 0;
+        nBlockMinSize = 0;
+        nBlockPrioritySize = 0;
+        nMinTxFee = 0;
+        fSortedByFee = false;
+        dLastFeePerKb = std::numeric_limits<double>::max();
+    }
+};
+
+
+
+
+/** Statistics of the orphan block pool */
+struct COrphanBlockStats
+{
+    unsigned int nOrphans;
+    unsigned int nSpilled;
+    unsigned int nPeers;
+    uint64 nBytes;
+    uint64 nSpilledBytes;
+    uint64 nEvicted;
+    uint64 nMaxBytes;
+    uint64 nMaxPeerBytes;
+    unsigned int nSpillThreshold;
+};
+
+/** Blocks whose parent we don't have yet.
+ *
+ * Entries are indexed by their cached hash and by hashPrevBlock, so walking
+ * an orphan chain never hashes a block again.  The pool is held to a byte
+ * budget with least-recently-used eviction, and a single peer may fill at most
+ * a quarter of it.  Blocks above the spill threshold are written to a
+ * temporary file in the data directory instead of being kept in memory.
+ */
+class COrphanBlockPool
+{
+private:
+    struct COrphanBlock
+    {
+        uint256 hashPrev;
+        CBlock* pblock;         // NULL while spilled to disk
+        unsigned int nSize;
+        long nFilePos;
+        NodeId nPeer;
+        bool fProofOfStake;
+        std::pair<COutPoint, unsigned int> proofOfStake;
+        std::list<uint256>::iterator itLRU;
+    };
+
+    mutable CCriticalSection cs;
+    std::map<uint256, COrphanBlock> mapOrphans;
+    std::multimap<uint256, uint256> mapOrphansByPrev;
+    std::map<NodeId, uint64> mapPeerBytes;
+    std::set<std::pair<COutPoint, unsigned int> > setStakeSeen;
+    std::list<uint256> listLRU;     // most recently used first
+    uint64 nBytes;
+    uint64 nSpilledBytes;
+    unsigned int nSpilled;
+    uint64 nEvicted;
+    uint64 nMaxBytes;
+    uint64 nMaxPeerBytes;
+    unsigned int nSpillThreshold;
+    FILE* fileSpill;
+
+    bool Spill(COrphanBlock& orphan, const CBlock& block);
+    CBlock* Load(const COrphanBlock& orphan);
+    CBlock* Erase(std::map<uint256, COrphanBlock>::iterator it);
+    void Evict(std::map<uint256, COrphanBlock>::iterator it);
+    void MakeRoom(NodeId nPeer, unsigned int nSize);
+
+public:
+    COrphanBlockPool();
+    ~COrphanBlockPool();
+
+    void SetLimits(uint64 nMaxBytesIn, unsigned int nSpillThresholdIn);
+    bool Add(const uint256& hash, const CBlock& block, NodeId nPeer);
+    bool Have(const uint256& hash) const;
+    bool HaveChildren(const uint256& hashPrev) const;
+    bool HaveStake(const std::pair<COutPoint, unsigned int>& proofOfStake) const;
+    // Hash of the first orphan in the chain ending at hash
+    uint256 GetRoot(const uint256& hash);
+    // Missing block the chain ending at hash is waiting for, 0 if unknown
+    uint256 GetWanted(const uint256& hash);
+    // Remove the orphans building on hashPrev and hand them to the caller,
+    // who is responsible for deleting them
+    void TakeChildren(const uint256& hashPrev, std::vector<std::pair<uint256, CBlock*> >& vChildren);
+    void GetStats(COrphanBlockStats& stats) const;
+};
+
+extern COrphanBlockPool orphanBlocks;
+
+
+
+
+/** A transaction whose inputs are not all known yet, waiting for its parents */
+struct COrphanTx
+{
+    CTransaction tx;
+    NodeId fromPeer;
+    int64 nTimeExpire;
+};
+
 class CTxMemPool
 {
 public:
@@ -3,6 +3,7 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "blocktemplate.h"
 #include "db.h"
 #include "net.h"
 #include "init.h"
@@ -12,6 +13,13 @@
 
 #ifdef WIN32
 #include <string.h>
+#else
+#include <sys/uio.h>
+#endif
+
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #endif
 
 #ifdef USE_UPNP
@@ -64,7 +72,7 @@ CAddrMan addrman;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CSerializedNetMsgRef> mapRelay;
 deque<pair<int64, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 map<CInv, int64> mapAlreadyAskedFor;
@@ -98,8 +106,7 @@ unsigned short GetListenPort()
 }
 
 CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fInboundIn) :
-	vSend(SER_NETWORK, MIN_PROTO_VERSION),
-	vRecv(SER_NETWORK, MIN_PROTO_VERSION)
+    setAddrKnown(5000, 0.001), setInventoryKnown(SendBufferSize() / 1000)
 {
     nServices = 0;
     hSocket = hSocketIn;
@@ -107,6 +114,20 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
 	nLastRecv = 0;
 	nSendBytes = 0;
 	nRecvBytes = 0;
+	nRecvVersion = MIN_PROTO_VERSION;
+	nSendOffset = 0;
+	nSendSize = 0;
+    bucketSend.SetRate(nMaxPeerUploadRate);
+    bucketRecv.SetRate(nMaxPeerDownloadRate);
+	nSendVersion = MIN_PROTO_VERSION;
+	fSocketPolled = false;
+	fSocketReadable = false;
+	fSocketWritable = false;
+	fValidationPending = false;
+	fMsgReady = false;
+	nMsgLatencyCount = 0;
+	nMsgLatencyTotal = 0;
+	nMsgLatencyMax = 0;
 	nTimeOffset = 0;
 	addrName = addrNameIn == "" ? addr.ToStringIPPort() : addrNameIn;
 	nVersion = 0;
@@ -114,8 +135,6 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
 	nLastRecvMicro = 0;
     nLastSendEmpty = GetTime();
     nTimeConnected = GetTime();
-    nHeaderStart = -1;
-    nMessageStart = -1;
     addr = addrIn;
     addrName = addrNameIn == "" ? addr.ToStringIPPort() : addrNameIn;
     nVersion = 0;
@@ -135,7 +154,6 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     fGetAddr = false;
     nMisbehavior = 0;
     hashCheckpointKnown = 0;
-    setInventoryKnown.max_size(SendBufferSize() / 1000);
 	nPingNonceSent = 0;
 	nPingUsecStart = 0;
 	nPingUsecTime = 0;
@@ -187,6 +205,11 @@ uint64_t CNode::nTotalBytesSent = 0;
 CCriticalSection CNode::cs_totalBytesRecv;
 CCriticalSection CNode::cs_totalBytesSent;
 
+uint64_t CNode::nMaxOutboundTotalBytesSentInCycle = 0;
+uint64_t CNode::nMaxOutboundCycleStartTime = 0;
+uint64_t CNode::nMaxOutboundLimit = 0;
+uint64_t CNode::nMaxOutboundTimeframe = 60 * 60 * 24;
+
 uint64_t CNode::GetTotalBytesRecv()
 {
     LOCK(cs_totalBytesRecv);
@@ -209,6 +232,151 @@ void CNode::RecordBytesSent(uint64_t bytes)
 {
     LOCK(cs_totalBytesSent);
     nTotalBytesSent += bytes;
+
+    uint64_t now = GetTime();
+    if (nMaxOutboundCycleStartTime + nMaxOutboundTimeframe < now)
+    {
+        // timeframe expired, reset cycle
+        nMaxOutboundCycleStartTime = now;
+        nMaxOutboundTotalBytesSentInCycle = 0;
+    }
+    nMaxOutboundTotalBytesSentInCycle += bytes;
+}
+
+void CNode::SetMaxOutboundTarget(uint64_t nLimit)
+{
+    LOCK(cs_totalBytesSent);
+    nMaxOutboundLimit = nLimit;
+}
+
+uint64_t CNode::GetMaxOutboundTarget()
+{
+    LOCK(cs_totalBytesSent);
+    return nMaxOutboundLimit;
+}
+
+uint64_t CNode::GetMaxOutboundTimeframe()
+{
+    LOCK(cs_totalBytesSent);
+    return nMaxOutboundTimeframe;
+}
+
+uint64_t CNode::GetMaxOutboundTimeLeftInCycle()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return 0;
+    if (nMaxOutboundCycleStartTime == 0)
+        return nMaxOutboundTimeframe;
+    uint64_t cycleEndTime = nMaxOutboundCycleStartTime + nMaxOutboundTimeframe;
+    uint64_t now = GetTime();
+    return (cycleEndTime < now) ? 0 : cycleEndTime - now;
+}
+
+bool CNode::OutboundTargetReached(bool fHistoricalBlockServingLimit)
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return false;
+
+    // A cycle that ran out without anything sent since starts over empty
+    if (nMaxOutboundCycleStartTime + nMaxOutboundTimeframe < (uint64_t)GetTime())
+        return false;
+
+    if (fHistoricalBlockServingLimit)
+    {
+        // keep a tenth of the target for new blocks and transactions
+        uint64_t nBuffer = nMaxOutboundLimit / 10;
+        if (nMaxOutboundTotalBytesSentInCycle + nBuffer >= nMaxOutboundLimit)
+            return true;
+    }
+    else if (nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit)
+        return true;
+
+    return false;
+}
+
+uint64_t CNode::GetOutboundTargetBytesLeft()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return 0;
+    if (nMaxOutboundCycleStartTime + nMaxOutboundTimeframe < (uint64_t)GetTime())
+        return nMaxOutboundLimit;
+    return (nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit) ? 0 : nMaxOutboundLimit - nMaxOutboundTotalBytesSentInCycle;
+}
+
+//
+// Bandwidth limits
+//
+
+int64 nMaxUploadRate = 0;
+int64 nMaxDownloadRate = 0;
+int64 nMaxPeerUploadRate = 0;
+int64 nMaxPeerDownloadRate = 0;
+
+// Shared by all peers, on top of each peer's own bucket
+static CTokenBucket bucketUpload;
+static CTokenBucket bucketDownload;
+
+void CTokenBucket::SetRate(int64 nRateIn)
+{
+    nRate = max(nRateIn, (int64)0);
+    // A second's worth, and at least a full-size packet
+    nBurst = max(nRate, (int64)1500);
+    nTokens = nBurst;
+    nLastRefill = GetTimeMicros();
+}
+
+int64 CTokenBucket::Available()
+{
+    if (nRate == 0)
+        return std::numeric_limits<int64>::max();
+
+    int64 nNow = GetTimeMicros();
+    int64 nElapsed = nNow - nLastRefill;
+    if (nElapsed > 1000000)
+    {
+        // Past a second it's full anyway
+        nTokens = nBurst;
+        nLastRefill = nNow;
+    }
+    else if (nElapsed > 0)
+    {
+        // Only the time that made whole tokens is used up
+        int64 nAdd = nElapsed * nRate / 1000000;
+        if (nAdd > 0)
+        {
+            nTokens = min(nBurst, nTokens + nAdd);
+            nLastRefill += nAdd * 1000000 / nRate;
+        }
+    }
+    return nTokens;
+}
+
+void SetBandwidthLimits()
+{
+    nMaxUploadRate = GetArg("-maxuploadrate", 0) * 1000;
+    nMaxDownloadRate = GetArg("-maxdownloadrate", 0) * 1000;
+    nMaxPeerUploadRate = GetArg("-maxpeeruploadrate", 0) * 1000;
+    nMaxPeerDownloadRate = GetArg("-maxpeerdownloadrate", 0) * 1000;
+    bucketUpload.SetRate(nMaxUploadRate);
+    bucketDownload.SetRate(nMaxDownloadRate);
+
+    CNode::SetMaxOutboundTarget(GetArg("-maxuploadtarget", 0) * 1024 * 1024);
+
+    if (nMaxUploadRate || nMaxDownloadRate || nMaxPeerUploadRate || nMaxPeerDownloadRate)
+        printf("Bandwidth limits: upload %" PRI64d " B/s (%" PRI64d " per peer), download %" PRI64d " B/s (%" PRI64d " per peer)\n",
+               nMaxUploadRate, nMaxPeerUploadRate, nMaxDownloadRate, nMaxPeerDownloadRate);
+    if (CNode::GetMaxOutboundTarget())
+        printf("Upload target: %" PRI64u " bytes per day\n", (uint64)CNode::GetMaxOutboundTarget());
+}
+
+// Whether old blocks may go out now: only with part of the upload rate
+// still unused, so new blocks and transactions don't have to wait for them
+bool static HistoricSendAllowed()
+{
+    return !bucketUpload.IsLimited() || bucketUpload.Available() >= bucketUpload.GetBurst() / 2;
 }
 
 // find 'best' local address for a particular peer
@@ -655,6 +823,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest, int64 nTimeout)
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
         }
+        WakeSocketHandler();
 
         pnode->nTimeConnected = GetTime();
         return pnode;
@@ -673,8 +842,12 @@ void CNode::CloseSocketDisconnect()
         printf("disconnecting node %s\n", addrName.c_str());
         CloseSocket(hSocket);
         hSocket = INVALID_SOCKET;
-        vRecv.clear();
     }
+
+    // in case this fails, we'll empty the recv buffer when the CNode is deleted
+    TRY_LOCK(cs_vRecvMsg, lockRecv);
+    if (lockRecv)
+        vRecvMsg.clear();
 }
 
 void CNode::Cleanup()
@@ -882,6 +1055,8 @@ void CNode::copyStats(CNodeStats &stats)
     X(mapSendBytesPerMsgCmd);
     X(nRecvBytes);
     X(mapRecvBytesPerMsgCmd);
+    stats.nSendThrottled = bucketSend.nThrottled;
+    stats.nRecvThrottled = bucketRecv.nThrottled;
     X(fWhitelisted);
 	X(currentPushBlock);
 	X(nMisbehavior);
@@ -901,6 +1076,8 @@ void CNode::copyStats(CNodeStats &stats)
     stats.dPingTime = (((double)nPingUsecTime) / 1e6);
     stats.dPingMin  = (((double)nMinPingUsecTime) / 1e6);
     stats.dPingWait = (((double)nPingUsecWait) / 1e6);
+    stats.dMsgLatency = nMsgLatencyCount ? ((double)nMsgLatencyTotal / nMsgLatencyCount) / 1e6 : 0;
+    stats.dMsgLatencyMax = ((double)nMsgLatencyMax) / 1e6;
 
     // Leave string empty if addrLocal invalid (not filled in yet)
     stats.addrLocal = addrSeenByPeer.IsValid() ? addrSeenByPeer.ToString() : "";
@@ -931,70 +1108,67 @@ void ThreadSocketHandler(void* parg)
     printf("ThreadSocketHandler exited\n");
 }
 
-void ThreadSocketHandler2(void* parg)
+// Drop nodes that asked to be disconnected, and free those nobody uses anymore
+void static DisconnectNodes(list<CNode*>& vNodesDisconnected, unsigned int& nPrevNodeCount)
 {
-    printf("ThreadSocketHandler started\n");
-    list<CNode*> vNodesDisconnected;
-    unsigned int nPrevNodeCount = 0;
-
-    loop()
     {
-        //
-        // Disconnect nodes
-        //
+        LOCK(cs_vNodes);
+        // Disconnect unused nodes
+        vector<CNode*> vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            if (pnode->fDisconnect ||
+                (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0))
             {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecv.empty() && pnode->vSend.empty()))
-                {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                // remove from vNodes
+                vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
 
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
+                // release outbound grant (if any)
+                pnode->grantOutbound.Release();
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
-                    pnode->Cleanup();
+                // close socket and cleanup
+                pnode->CloseSocketDisconnect();
+                pnode->Cleanup();
 
-                    // hold in disconnected pool until all refs are released
-                    pnode->nReleaseTime = max(pnode->nReleaseTime, GetTime() + 15 * 60);
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-                }
+                // hold in disconnected pool until all refs are released
+                pnode->nReleaseTime = max(pnode->nReleaseTime, GetTime() + 15 * 60);
+                if (pnode->fNetworkNode || pnode->fInbound)
+                    pnode->Release();
+                vNodesDisconnected.push_back(pnode);
             }
+        }
 
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+        // Delete disconnected nodes
+        list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+        BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+        {
+            // wait until threads are done using it
+            if (pnode->GetRefCount() <= 0)
             {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
+                bool fDelete = false;
                 {
-                    bool fDelete = false;
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend)
                     {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend)
+                        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                        if (lockRecv)
                         {
-                            TRY_LOCK(pnode->cs_vRecv, lockRecv);
-                            if (lockRecv)
+                            TRY_LOCK(pnode->cs_mapRequests, lockReq);
+                            if (lockReq)
                             {
-                                TRY_LOCK(pnode->cs_mapRequests, lockReq);
-                                if (lockReq)
-                                {
-                                    TRY_LOCK(pnode->cs_inventory, lockInv);
-                                    if (lockInv)
-                                        fDelete = true;
-                                }
+                                TRY_LOCK(pnode->cs_inventory, lockInv);
+                                if (lockInv)
+                                    fDelete = true;
                             }
                         }
                     }
-                    if (fDelete)
+                }
+                if (fDelete)
+                {
+                    // FinalizeNode drops its block download state, which
+                    // lives under cs_main; try again next time if it's busy
+                    TRY_LOCK(cs_main, lockMain);
+                    if (lockMain)
                     {
                         vNodesDisconnected.remove(pnode);
                         delete pnode;
@@ -1002,26 +1176,703 @@ void ThreadSocketHandler2(void* parg)
                 }
             }
         }
-        if (vNodes.size() != nPrevNodeCount)
+    }
+    if (vNodes.size() != nPrevNodeCount)
+    {
+		// by Simone: net resumed event
+		// when coming back from sleep, the number of node passes from N to zero, good time to catch the event here
+		// when the connection is down or anything, it can do also the same thing, if down for long time, when back up will run this event
+		if ((nPrevNodeCount > 0) && (vNodes.size() == 0))
+		{
+			GetNodeSignals().NetResumed();
+		}
+        nPrevNodeCount = vNodes.size();
+        uiInterface.NotifyNumConnectionsChanged(vNodes.size());
+    }
+}
+
+void static AcceptConnection(SOCKET hListenSocket)
+{
+#ifdef USE_IPV6
+    struct sockaddr_storage sockaddr;
+#else
+    struct sockaddr sockaddr;
+#endif
+
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr;
+    int nInbound = 0;
+
+	// by Simone: if we are offline, don't accept any new connection
+	if (netOffline)
+	{
+		CloseSocket(hSocket);
+		return;
+	}
+
+    if (hSocket != INVALID_SOCKET)
+        if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+            printf("Warning: Unknown socket family\n");
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            if (pnode->fInbound)
+                nInbound++;
+    }
+
+    if (hSocket == INVALID_SOCKET)
+    {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK)
+            printf("socket error accept failed: %d\n", nErr);
+    }
+    else if (nInbound >= GetArg("-maxconnections", 125) - MAX_OUTBOUND_CONNECTIONS)
+    {
+        {
+            LOCK(cs_setservAddNodeAddresses);
+            if (!setservAddNodeAddresses.count(addr))
+                CloseSocket(hSocket);
+        }
+    }
+    else if (CNode::IsBanned(addr))
+    {
+        printf("connection from %s dropped (banned)\n", addr.ToString().c_str());
+        CloseSocket(hSocket);
+    }
+    else
+    {
+        printf("accepted connection %s\n", addr.ToString().c_str());
+        CNode* pnode = new CNode(hSocket, addr, "", true);
+        pnode->AddRef();
+        {
+            LOCK(cs_vNodes);
+            vNodes.push_back(pnode);
+        }
+        WakeSocketHandler();
+    }
+}
+
+bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
+{
+    while (nBytes > 0)
+    {
+        // get current incomplete message, or create a new one
+        if (vRecvMsg.empty() || vRecvMsg.back().complete())
+            vRecvMsg.push_back(CNetMessage(SER_NETWORK, nRecvVersion));
+
+        CNetMessage& msg = vRecvMsg.back();
+
+        // absorb network data
+        int handled;
+        if (!msg.in_data)
+            handled = msg.readHeader(pch, nBytes);
+        else
+            handled = msg.readData(pch, nBytes);
+
+        if (handled < 0)
+            return false;
+
+        pch += handled;
+        nBytes -= handled;
+
+        if (msg.complete())
+            msg.nTime = GetTimeMicros();
+    }
+
+    return true;
+}
+
+int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
+{
+    // copy data to temporary parsing buffer
+    unsigned int nRemaining = CMessageHeader::HEADER_SIZE - nHdrPos;
+    unsigned int nCopy = std::min(nRemaining, nBytes);
+
+    memcpy(&hdrbuf[nHdrPos], pch, nCopy);
+    nHdrPos += nCopy;
+
+    // if header incomplete, exit
+    if (nHdrPos < CMessageHeader::HEADER_SIZE)
+        return nCopy;
+
+    // deserialize header
+    try {
+        hdrbuf >> hdr;
+    }
+    catch (std::exception &e) {
+        return -1;
+    }
+
+    // Out of sync, or a message we'd never have room for: there's no
+    // finding the next message start in a stream we no longer trust
+    if (!hdr.IsValid())
+    {
+        printf("PROCESSMESSAGE: ERRORS IN HEADER %s\n", hdr.GetCommand().c_str());
+        return -1;
+    }
+    if (hdr.nMessageSize > MAX_SIZE || hdr.nMessageSize > ReceiveBufferSize())
+    {
+        printf("PROCESSMESSAGE: %s message of %u bytes is too large\n", hdr.GetCommand().c_str(), hdr.nMessageSize);
+        return -1;
+    }
+
+    // switch state to reading message data; the buffer grows as the data
+    // comes in, so a header alone can't make us allocate the whole size
+    in_data = true;
+
+    return nCopy;
+}
+
+int CNetMessage::readData(const char *pch, unsigned int nBytes)
+{
+    unsigned int nRemaining = hdr.nMessageSize - nDataPos;
+    unsigned int nCopy = std::min(nRemaining, nBytes);
+
+    if (vRecv.size() < nDataPos + nCopy)
+    {
+        // Up to 256 KiB ahead of the data, never past the message size
+        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
+    }
+
+    memcpy(&vRecv[nDataPos], pch, nCopy);
+    nDataPos += nCopy;
+
+    return nCopy;
+}
+
+// Whether the message handler has a message to get on with
+bool static HaveCompleteMessage(CNode* pnode)
+{
+    return !pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().complete();
+}
+
+// Read at most nMaxReads chunks from the socket into vRecvMsg.  Returns -1
+// if vRecvMsg was busy or the download limits are used up, 0 once the socket
+// has nothing more to give (drained, closed or failed) and 1 if it stopped
+// with data possibly still waiting.
+int static SocketRecvData(CNode* pnode, unsigned int nMaxReads)
+{
+    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+    if (!lockRecv)
+        return -1;
+
+    for (unsigned int nReads = 0; nReads < nMaxReads; nReads++)
+    {
+        if (pnode->hSocket == INVALID_SOCKET)
+            return 0;
+
+        if (pnode->GetTotalRecvSize() > ReceiveBufferSize()) {
+            if (!pnode->fDisconnect)
+                printf("socket recv flood control disconnect (%u bytes)\n", pnode->GetTotalRecvSize());
+            pnode->CloseSocketDisconnect();
+            return 0;
+        }
+
+        // The rest of a payload whose header is in goes straight into that
+        // message's buffer; headers and small messages through pchBuf
+        CNetMessage* pmsg = NULL;
+        if (!pnode->vRecvMsg.empty() && pnode->vRecvMsg.back().in_data && !pnode->vRecvMsg.back().complete())
+            pmsg = &pnode->vRecvMsg.back();
+
+        // typical socket buffer is 8K-64K
+        char pchBuf[0x10000];
+        char* pchDest = pchBuf;
+        unsigned int nMaxBytes = sizeof(pchBuf);
+        if (pmsg)
+        {
+            // Grow the buffer the same way readData does, and never read
+            // past what it holds
+            if (pmsg->vRecv.size() < pmsg->nDataPos + sizeof(pchBuf))
+                pmsg->vRecv.resize(std::min(pmsg->hdr.nMessageSize, pmsg->nDataPos + 256 * 1024));
+            pchDest = &pmsg->vRecv[pmsg->nDataPos];
+            nMaxBytes = std::min((unsigned int)pmsg->vRecv.size() - pmsg->nDataPos, pmsg->hdr.nMessageSize - pmsg->nDataPos);
+        }
+
+        // The rest stays in the kernel's buffer, which slows the sender down
+        int64 nAllowed = min(bucketDownload.Available(), pnode->bucketRecv.Available());
+        if (nAllowed <= 0)
+        {
+            pnode->bucketRecv.nThrottled++;
+            return -1;
+        }
+        if (nAllowed < (int64)nMaxBytes)
+            nMaxBytes = nAllowed;
+
+        int nBytes = recv(pnode->hSocket, pchDest, nMaxBytes, MSG_DONTWAIT);
+        pnode->nLastRecv = GetTime();
+		pnode->nLastRecvMicro = GetTimeMicros();
+        if (nBytes > 0)
+        {
+            pnode->nRecvBytes += nBytes;
+			pnode->RecordBytesRecv(nBytes);
+            bucketDownload.Consume(nBytes);
+            pnode->bucketRecv.Consume(nBytes);
+            if (pmsg)
+            {
+                pmsg->nDataPos += nBytes;
+                if (pmsg->complete())
+                    pmsg->nTime = pnode->nLastRecvMicro;
+            }
+            else if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+            {
+                pnode->CloseSocketDisconnect();
+                return 0;
+            }
+            if (HaveCompleteMessage(pnode))
+                QueueMessageHandler(pnode);
+            if (nBytes < (int)nMaxBytes)
+                return 0;
+        }
+        else if (nBytes == 0)
+        {
+            // socket closed gracefully
+            if (!pnode->fDisconnect)
+                printf("socket closed\n");
+            pnode->CloseSocketDisconnect();
+            return 0;
+        }
+        else
+        {
+            // error
+            int nErr = WSAGetLastError();
+            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+            {
+                if (!pnode->fDisconnect)
+                    printf("socket recv error %d\n", nErr);
+                pnode->CloseSocketDisconnect();
+            }
+            return 0;
+        }
+    }
+    return 1;
+}
+
+CSerializedNetMsg::CSerializedNetMsg(CDataStream& ssIn) : ss(ssIn.nType, ssIn.nVersion)
+{
+    ss.swap(ssIn);
+    assert(ss.size() >= CMessageHeader::HEADER_SIZE);
+
+    // Set the size
+    unsigned int nSize = ss.size() - CMessageHeader::HEADER_SIZE;
+    memcpy(&ss[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+
+    // Set the checksum
+    uint256 hash = Hash(ss.begin() + CMessageHeader::HEADER_SIZE, ss.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    memcpy(&ss[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+}
+
+#ifndef WIN32
+// Most queued messages handed to one sendmsg() call
+static const int MAX_SEND_IOV = 64;
+#endif
+
+// Send as much of vSendMsg, and then of vSendMsgHistoric, as the socket and
+// the upload limits take.  Returns -1 if vSendMsg was busy or the limits are
+// used up, 0 if the socket would block or failed and 1 if all was sent.
+int static SocketSendData(CNode* pnode)
+{
+    TRY_LOCK(pnode->cs_vSend, lockSend);
+    if (!lockSend)
+        return -1;
+
+    loop()
+    {
+        if (pnode->vSendMsg.empty())
         {
-			// by Simone: net resumed event
-			// when coming back from sleep, the number of node passes from N to zero, good time to catch the event here
-			// when the connection is down or anything, it can do also the same thing, if down for long time, when back up will run this event
-			if ((nPrevNodeCount > 0) && (vNodes.size() == 0))
-			{
-				GetNodeSignals().NetResumed();
-			}
-            nPrevNodeCount = vNodes.size();
-            uiInterface.NotifyNumConnectionsChanged(vNodes.size());
+            if (pnode->vSendMsgHistoric.empty())
+                break;
+            if (!HistoricSendAllowed())
+            {
+                pnode->bucketSend.nThrottled++;
+                return -1;
+            }
+            pnode->vSendMsg.push_back(pnode->vSendMsgHistoric.front());
+            pnode->vSendMsgHistoric.pop_front();
         }
 
+        int64 nAllowed = min(bucketUpload.Available(), pnode->bucketSend.Available());
+        if (nAllowed <= 0)
+        {
+            pnode->bucketSend.nThrottled++;
+            return -1;
+        }
+
+#ifdef WIN32
+        const CSerializedNetMsg& msg = *pnode->vSendMsg.front();
+        size_t nWant = msg.size() - pnode->nSendOffset;
+        if ((int64)nWant > nAllowed)
+            nWant = nAllowed;
+        int nBytes = send(pnode->hSocket, msg.data() + pnode->nSendOffset, nWant, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        // Gather the front of the queue into a single call
+        struct iovec iov[MAX_SEND_IOV];
+        int nIov = 0;
+        size_t nWant = 0;
+        for (std::deque<CSerializedNetMsgRef>::iterator it = pnode->vSendMsg.begin(); it != pnode->vSendMsg.end() && nIov < MAX_SEND_IOV; ++it, ++nIov)
+        {
+            unsigned int nOffset = (nIov == 0 ? pnode->nSendOffset : 0);
+            iov[nIov].iov_base = (void*)((*it)->data() + nOffset);
+            iov[nIov].iov_len = (*it)->size() - nOffset;
+            if ((int64)(nWant + iov[nIov].iov_len) >= nAllowed)
+            {
+                // As much as the limits allow, and no further
+                iov[nIov].iov_len = nAllowed - nWant;
+                nWant += iov[nIov].iov_len;
+                nIov++;
+                break;
+            }
+            nWant += iov[nIov].iov_len;
+        }
+        struct msghdr msgh;
+        memset(&msgh, 0, sizeof(msgh));
+        msgh.msg_iov = iov;
+        msgh.msg_iovlen = nIov;
+        int nBytes = sendmsg(pnode->hSocket, &msgh, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
+        if (nBytes > 0)
+        {
+            pnode->nLastSend = GetTime();
+            pnode->nSendBytes += nBytes;
+            pnode->RecordBytesSent(nBytes);
+            bucketUpload.Consume(nBytes);
+            pnode->bucketSend.Consume(nBytes);
+            pnode->nSendSize -= nBytes;
+
+            // Drop the messages that went out in full
+            unsigned int nLeft = nBytes;
+            while (nLeft > 0)
+            {
+                unsigned int nRemaining = pnode->vSendMsg.front()->size() - pnode->nSendOffset;
+                if (nLeft < nRemaining)
+                {
+                    pnode->nSendOffset += nLeft;
+                    break;
+                }
+                nLeft -= nRemaining;
+                pnode->nSendOffset = 0;
+                pnode->vSendMsg.pop_front();
+            }
+
+            // The socket took less than offered, it's full
+            if ((size_t)nBytes < nWant)
+                return 0;
+        }
+        else
+        {
+            if (nBytes < 0)
+            {
+                // error
+                int nErr = WSAGetLastError();
+                if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+                {
+                    printf("socket send error %d\n", nErr);
+                    pnode->CloseSocketDisconnect();
+                }
+            }
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void static InactivityCheck(CNode* pnode)
+{
+    if (pnode->nSendSize == 0)
+        pnode->nLastSendEmpty = GetTime();
+    if (GetTime() - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            printf("socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
+            pnode->fDisconnect = true;
+        }
+
+		// by Simone: SEND timeout = 90 minutes...... it is extremely excessive, as the nodes always ping every 30 seconds, so setting to 3 minutes is enough
+        else if (GetTime() - pnode->nLastSend > 3 * 60 && GetTime() - pnode->nLastSendEmpty > 3 * 60)
+        {
+            printf("socket not sending\n");
+            pnode->fDisconnect = true;
+        }
+
+		// by Simone: timeout = 90 minutes...... it is extremely excessive, as the nodes always have a little bit to send here, 3 minutes is enough (2 pings)
+        else if (GetTime() - pnode->nLastRecv > 3 * 60)
+        {
+            printf("socket inactivity timeout\n");
+            pnode->fDisconnect = true;
+        }
+    }
+}
+
+#ifdef USE_EPOLL
+//
+// Edge-triggered epoll engine.  Every node socket is registered once for
+// EPOLLIN|EPOLLOUT; an edge only marks the node readable or writable, and the
+// flag stays set until recv/send reports the socket drained or full.  An
+// eventfd wakes the thread when a send buffer goes from empty to non-empty,
+// so it can block in epoll_wait instead of polling the send queues.
+//
+static const int MAX_EPOLL_EVENTS = 256;
+static int hEpoll = -1;
+static int hWakeupEvent = -1;
+
+bool static SocketEngineEpollInit()
+{
+    hEpoll = epoll_create1(0);
+    if (hEpoll == -1)
+    {
+        printf("epoll_create1 failed: %d, using select()\n", errno);
+        return false;
+    }
+
+    int hEvent = eventfd(0, EFD_NONBLOCK);
+    if (hEvent == -1)
+    {
+        printf("eventfd failed: %d, using select()\n", errno);
+        close(hEpoll);
+        hEpoll = -1;
+        return false;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = hEvent;
+    epoll_ctl(hEpoll, EPOLL_CTL_ADD, hEvent, &ev);
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+    {
+        ev.data.fd = hListenSocket;
+        if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hListenSocket, &ev) == -1)
+            printf("epoll_ctl failed for listening socket: %d\n", errno);
+    }
+    hWakeupEvent = hEvent;
+    return true;
+}
+
+void static SocketEngineEpoll(list<CNode*>& vNodesDisconnected, unsigned int& nPrevNodeCount)
+{
+    struct epoll_event vEvents[MAX_EPOLL_EVENTS];
+    // Set when the last pass left work undone because a buffer was busy or a
+    // socket had more to read, so the next wait mustn't block
+    bool fPending = false;
+
+    loop()
+    {
+        DisconnectNodes(vNodesDisconnected, nPrevNodeCount);
+
+        vector<CNode*> vNodesCopy;
+        {
+            LOCK(cs_vNodes);
+            vNodesCopy = vNodes;
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->AddRef();
+        }
+
+        // Register the sockets of nodes added since the last pass
+        map<SOCKET, CNode*> mapSocketNode;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        {
+            SOCKET hSocket = pnode->hSocket;
+            if (hSocket == INVALID_SOCKET)
+                continue;
+            mapSocketNode[hSocket] = pnode;
+            if (pnode->fSocketPolled)
+                continue;
+
+            struct epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            ev.data.fd = hSocket;
+            if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hSocket, &ev) == -1 && errno != EEXIST)
+                printf("epoll_ctl failed for %s: %d\n", pnode->addrName.c_str(), errno);
+            pnode->fSocketPolled = true;
+        }
+
+        vnThreadsRunning[THREAD_SOCKETHANDLER]--;
+        int nEvents = epoll_wait(hEpoll, vEvents, MAX_EPOLL_EVENTS, fPending ? 10 : 1000);
+        vnThreadsRunning[THREAD_SOCKETHANDLER]++;
+        if (fShutdown)
+            return;
+        if (nEvents == -1 && errno != EINTR)
+        {
+            printf("socket epoll_wait error %d\n", errno);
+            Sleep(100);
+        }
+
+        for (int i = 0; i < nEvents; i++)
+        {
+            int hFd = vEvents[i].data.fd;
+            if (hFd == hWakeupEvent)
+            {
+                uint64_t nCount;
+                if (read(hWakeupEvent, &nCount, sizeof(nCount)) < 0 && errno != EAGAIN)
+                    printf("socket wakeup read error %d\n", errno);
+                continue;
+            }
+            if (find(vhListenSocket.begin(), vhListenSocket.end(), (SOCKET)hFd) != vhListenSocket.end())
+            {
+                AcceptConnection(hFd);
+                continue;
+            }
+
+            map<SOCKET, CNode*>::iterator mi = mapSocketNode.find(hFd);
+            if (mi == mapSocketNode.end())
+            {
+                // Descriptor number reused since it was registered
+                epoll_ctl(hEpoll, EPOLL_CTL_DEL, hFd, NULL);
+                continue;
+            }
+            CNode* pnode = mi->second;
+            if (vEvents[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                pnode->fSocketReadable = true;
+            if (vEvents[i].events & EPOLLOUT)
+                pnode->fSocketWritable = true;
+        }
+
+        //
+        // Service the sockets that are ready
+        //
+        fPending = false;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        {
+            if (fShutdown)
+                return;
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+
+            if (pnode->fSocketReadable)
+            {
+                int nRet = SocketRecvData(pnode, 4);
+                if (nRet == 0)
+                    pnode->fSocketReadable = false;
+                else
+                    fPending = true;
+            }
+
+            if (pnode->hSocket != INVALID_SOCKET && pnode->fSocketWritable && pnode->nSendSize > 0)
+            {
+                int nRet = SocketSendData(pnode);
+                if (nRet == 0)
+                    pnode->fSocketWritable = false;
+                else if (nRet < 0)
+                    fPending = true;
+            }
+
+            InactivityCheck(pnode);
+        }
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->Release();
+        }
+    }
+}
+#endif
+
+// The message handler sleeps on this until a node has messages for it, a
+// block is to be announced or the send side timers are due
+static boost::mutex mutexMsgProc;
+static boost::condition_variable condMsgProc;
+static bool fMsgProcWake = false;
+static int64 nLastTrickleMicros = 0;
+// Nodes with complete messages, in the order they got them
+static std::deque<CNode*> queueMsgReady;
+
+// Whether this thread is to make the pass over all nodes for the send side
+// timers, and whether that pass trickles.  With several handler threads,
+// one pass per interval gets to trickle, so the rate stays what it always was.
+bool static SendPassDue(bool& fTrickle)
+{
+    boost::lock_guard<boost::mutex> lock(mutexMsgProc);
+    int64 nNow = GetTimeMicros();
+    fTrickle = (nNow - nLastTrickleMicros >= 100000);
+    if (!fTrickle && !fMsgProcWake)
+        return false;
+    if (fTrickle)
+        nLastTrickleMicros = nNow;
+    fMsgProcWake = false;
+    return true;
+}
+
+// The next node in the ready queue, whose reference passes to the caller;
+// NULL if there is none
+CNode static *PopReadyNode()
+{
+    boost::lock_guard<boost::mutex> lock(mutexMsgProc);
+    if (queueMsgReady.empty())
+        return NULL;
+    CNode* pnode = queueMsgReady.front();
+    queueMsgReady.pop_front();
+    pnode->fMsgReady = false;
+    return pnode;
+}
+
+void QueueMessageHandler(CNode* pnode)
+{
+    {
+        LOCK(cs_vNodes);
+        {
+            boost::lock_guard<boost::mutex> lock(mutexMsgProc);
+            if (pnode->fMsgReady)
+                return;
+            pnode->fMsgReady = true;
+            queueMsgReady.push_back(pnode);
+        }
+        pnode->AddRef();
+    }
+    condMsgProc.notify_one();
+}
+
+void WakeMessageHandler()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mutexMsgProc);
+        fMsgProcWake = true;
+    }
+    condMsgProc.notify_one();
+}
+
+void WakeSocketHandler()
+{
+#ifdef USE_EPOLL
+    if (hWakeupEvent != -1)
+    {
+        uint64_t nOne = 1;
+        if (write(hWakeupEvent, &nOne, sizeof(nOne)) < 0 && errno != EAGAIN)
+            printf("socket wakeup write error %d\n", errno);
+    }
+#endif
+}
+
+void ThreadSocketHandler2(void* parg)
+{
+    printf("ThreadSocketHandler started\n");
+    list<CNode*> vNodesDisconnected;
+    unsigned int nPrevNodeCount = 0;
+
+#ifdef USE_EPOLL
+    if (GetBoolArg("-epoll", true) && SocketEngineEpollInit())
+    {
+        printf("ThreadSocketHandler using epoll\n");
+        SocketEngineEpoll(vNodesDisconnected, nPrevNodeCount);
+        return;
+    }
+#endif
+
+    loop()
+    {
+        DisconnectNodes(vNodesDisconnected, nPrevNodeCount);
+
 
         //
         // Find which sockets have data to receive
         //
         struct timeval timeout;
         timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
+        timeout.tv_usec = 50000; // frequency to poll pnode->vSendMsg
 
         fd_set fdsetRecv;
         fd_set fdsetSend;
@@ -1049,7 +1900,7 @@ void ThreadSocketHandler2(void* parg)
                 have_fds = true;
                 {
                     TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSend.empty())
+                    if (lockSend && pnode->nSendSize > 0)
                         FD_SET(pnode->hSocket, &fdsetSend);
                 }
             }
@@ -1080,67 +1931,8 @@ void ThreadSocketHandler2(void* parg)
         // Accept new connections
         //
         BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
-        {
-#ifdef USE_IPV6
-            struct sockaddr_storage sockaddr;
-#else
-            struct sockaddr sockaddr;
-#endif
-
-            socklen_t len = sizeof(sockaddr);
-            SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
-            CAddress addr;
-            int nInbound = 0;
-
-			// by Simone: if we are offline, don't accept any new connection
-			if (netOffline)
-			{
-				CloseSocket(hSocket);
-				continue;
-			}
-
-            if (hSocket != INVALID_SOCKET)
-                if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                    printf("Warning: Unknown socket family\n");
-
-            {
-                LOCK(cs_vNodes);
-                BOOST_FOREACH(CNode* pnode, vNodes)
-                    if (pnode->fInbound)
-                        nInbound++;
-            }
-
-            if (hSocket == INVALID_SOCKET)
-            {
-                int nErr = WSAGetLastError();
-                if (nErr != WSAEWOULDBLOCK)
-                    printf("socket error accept failed: %d\n", nErr);
-            }
-            else if (nInbound >= GetArg("-maxconnections", 125) - MAX_OUTBOUND_CONNECTIONS)
-            {
-                {
-                    LOCK(cs_setservAddNodeAddresses);
-                    if (!setservAddNodeAddresses.count(addr))
-                        CloseSocket(hSocket);
-                }
-            }
-            else if (CNode::IsBanned(addr))
-            {
-                printf("connection from %s dropped (banned)\n", addr.ToString().c_str());
-                CloseSocket(hSocket);
-            }
-            else
-            {
-                printf("accepted connection %s\n", addr.ToString().c_str());
-                CNode* pnode = new CNode(hSocket, addr, "", true);
-                pnode->AddRef();
-                {
-                    LOCK(cs_vNodes);
-                    vNodes.push_back(pnode);
-                }
-            }
-        }
+            if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+                AcceptConnection(hListenSocket);
 
 
         //
@@ -1164,52 +1956,7 @@ void ThreadSocketHandler2(void* parg)
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
             if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
-            {
-                TRY_LOCK(pnode->cs_vRecv, lockRecv);
-                if (lockRecv)
-                {
-                    CDataStream& vRecv = pnode->vRecv;
-                    unsigned int nPos = vRecv.size();
-
-                    if (nPos > ReceiveBufferSize()) {
-                        if (!pnode->fDisconnect)
-                            printf("socket recv flood control disconnect (%" PRIszu " bytes)\n", vRecv.size());
-                        pnode->CloseSocketDisconnect();
-                    }
-                    else {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        pnode->nLastRecv = GetTime();
-						pnode->nLastRecvMicro = GetTimeMicros();
-                        if (nBytes > 0)
-                        {
-                            pnode->nRecvBytes += nBytes;
-							pnode->RecordBytesRecv(nBytes);
-                            vRecv.resize(nPos + nBytes);
-                            memcpy(&vRecv[nPos], pchBuf, nBytes);
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                printf("socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    printf("socket recv error %d\n", nErr);
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
-            }
+                SocketRecvData(pnode, 1);
 
             //
             // Send
@@ -1217,63 +1964,12 @@ void ThreadSocketHandler2(void* parg)
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
             if (FD_ISSET(pnode->hSocket, &fdsetSend))
-            {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                {
-                    CDataStream& vSend = pnode->vSend;
-                    if (!vSend.empty())
-                    {
-                        int nBytes = send(pnode->hSocket, &vSend[0], vSend.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
-						pnode->nLastSend = GetTime();
-						pnode->nSendBytes += nBytes;
-						pnode->RecordBytesSent(vSend.size());
-                        if (nBytes > 0)
-                        {
-                            vSend.erase(vSend.begin(), vSend.begin() + nBytes);
-                            pnode->nLastSend = GetTime();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                printf("socket send error %d\n", nErr);
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
-            }
+                SocketSendData(pnode);
 
             //
             // Inactivity checking
             //
-            if (pnode->vSend.empty())
-                pnode->nLastSendEmpty = GetTime();
-            if (GetTime() - pnode->nTimeConnected > 60)
-            {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    printf("socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
-                    pnode->fDisconnect = true;
-                }
-
-				// by Simone: SEND timeout = 90 minutes...... it is extremely excessive, as the nodes always ping every 30 seconds, so setting to 3 minutes is enough
-                else if (GetTime() - pnode->nLastSend > 3 * 60 && GetTime() - pnode->nLastSendEmpty > 3 * 60)
-                {
-                    printf("socket not sending\n");
-                    pnode->fDisconnect = true;
-                }
-
-				// by Simone: timeout = 90 minutes...... it is extremely excessive, as the nodes always have a little bit to send here, 3 minutes is enough (2 pings)
-                else if (GetTime() - pnode->nLastRecv > 3 * 60)
-                {
-                    printf("socket inactivity timeout\n");
-                    pnode->fDisconnect = true;
-                }
-            }
+            InactivityCheck(pnode);
         }
         {
             LOCK(cs_vNodes);
@@ -1901,6 +2597,39 @@ void ThreadMessageHandler(void* parg)
     printf("ThreadMessageHandler exited\n");
 }
 
+// Handle the messages a node has in, and send what it has to go.  Returns
+// false if it was left with messages it could get on with now.
+bool static HandleNode(CNode* pnode, bool fTrickle)
+{
+    bool fDone = true;
+
+    // Receive messages.  What is left once they're handled waits on a full
+    // send buffer or the validation thread, which queues the node again
+    // when it's done; a stale look at either costs one pass at most.
+    {
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        if (lockRecv)
+        {
+            GetNodeSignals().ProcessMessages(pnode);
+            if (HaveCompleteMessage(pnode) && !pnode->fDisconnect &&
+                pnode->nSendSize < SendBufferSize() && !pnode->fValidationPending)
+                fDone = false;
+        }
+        else
+            fDone = false;
+    }
+    if (fShutdown || netOffline)
+        return fDone;
+
+    // Send messages
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (lockSend)
+            GetNodeSignals().SendMessages(pnode, fTrickle);
+    }
+    return fDone;
+}
+
 void ThreadMessageHandler2(void* parg)
 {
     printf("ThreadMessageHandler started\n");
@@ -1914,57 +2643,75 @@ void ThreadMessageHandler2(void* parg)
 			continue;
 		}
 
-
-		// by Simone: let's try a TRY_LOCK approach here in case of busy situations
-        vector<CNode*> vNodesCopy;
-		{
-			LOCK(cs_vNodes);
-	        vNodesCopy = vNodes;
-	        BOOST_FOREACH(CNode* pnode, vNodesCopy)
-	            pnode->AddRef();
-		}
-
-        // Poll the connected nodes for messages*/
-        CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
-        	pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        // The nodes that got complete messages, one at a time so that the
+        // other handler threads can take the next ones
+        CNode* pnode;
+        while (!fShutdown && !netOffline && (pnode = PopReadyNode()) != NULL)
         {
-            // Receive messages
+            bool fDone = true;
             {
-                TRY_LOCK(pnode->cs_vRecv, lockRecv);
-                if (lockRecv)
-                    GetNodeSignals().ProcessMessages(pnode);
+                // Another handler thread may still be sending for it
+                LOCK(pnode->cs_handler);
+                fDone = HandleNode(pnode, false);
             }
-            if (fShutdown)
-                return;
-			if (netOffline)
-				continue;
+            if (!fDone)
+                QueueMessageHandler(pnode);
+            LOCK(cs_vNodes);
+            pnode->Release();
+        }
+        if (fShutdown)
+            return;
 
-            // Send messages
+        // Every 100ms, and when a block is to be announced, one thread goes
+        // over all nodes for the send side timers: trickle, ping, getdata
+        // and block download.  Messages held up by a full send buffer are
+        // picked up here too.
+        bool fTrickle = false;
+        if (!netOffline && SendPassDue(fTrickle))
+        {
+            vector<CNode*> vNodesCopy;
             {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-					GetNodeSignals().SendMessages(pnode, pnode == pnodeTrickle);
+                LOCK(cs_vNodes);
+                vNodesCopy = vNodes;
+                BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                    pnode->AddRef();
             }
-            if (fShutdown)
-                return;
-			if (netOffline)
-				continue;
-        }
 
+            CNode* pnodeTrickle = NULL;
+            if (!vNodesCopy.empty() && fTrickle)
+                pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            {
+                // Another handler thread is on this node already
+                TRY_LOCK(pnode->cs_handler, lockHandler);
+                if (!lockHandler)
+                    continue;
+                if (!HandleNode(pnode, pnode == pnodeTrickle))
+                    QueueMessageHandler(pnode);
+                if (fShutdown)
+                    return;
+                if (netOffline)
+                    break;
+            }
 
-		{
-		    LOCK(cs_vNodes);
-			BOOST_FOREACH(CNode* pnode, vNodesCopy)
-			    pnode->Release();
-		}
+            {
+                LOCK(cs_vNodes);
+                BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                    pnode->Release();
+            }
+        }
 
-        // Wait and allow messages to bunch up.
+        // Wait until a node has messages, a block is to be announced or the
+        // timers are due.
         // Reduce vnThreadsRunning so StopNode has permission to exit while
-        // we're sleeping, but we must always check fShutdown after doing this.
+        // we're waiting, but we must always check fShutdown after doing this.
         vnThreadsRunning[THREAD_MESSAGEHANDLER]--;
-        Sleep(100);
+        {
+            boost::unique_lock<boost::mutex> lock(mutexMsgProc);
+            int64 nWait = nLastTrickleMicros + 100000 - GetTimeMicros();
+            if (queueMsgReady.empty() && !fMsgProcWake && nWait > 0)
+                condMsgProc.timed_wait(lock, boost::posix_time::microseconds(nWait));
+        }
         if (fRequestShutdown)
             StartShutdown();
         vnThreadsRunning[THREAD_MESSAGEHANDLER]++;
@@ -2156,6 +2903,8 @@ void StartNode(void* parg)
         semOutbound = new CSemaphore(nMaxOutbound);
     }
 
+    SetBandwidthLimits();
+
     if (pnodeLocalHost == NULL)
         pnodeLocalHost = new CNode(INVALID_SOCKET, CAddress(CService("127.0.0.1", 0), nLocalServices));
 
@@ -2195,14 +2944,22 @@ void StartNode(void* parg)
         printf("Error: NewThread(ThreadOpenConnections) failed\n");
 
     // Process messages
-    if (!NewThread(ThreadMessageHandler, NULL))
-        printf("Error: NewThread(ThreadMessageHandler) failed\n");
+    StartMessageValidationThread();
+    int nHandlers = GetArg("-msghandlers", DEFAULT_MSGHANDLER_THREADS);
+    nHandlers = std::max(1, std::min(nHandlers, MAX_MSGHANDLER_THREADS));
+    for (int i = 0; i < nHandlers; i++)
+        if (!NewThread(ThreadMessageHandler, NULL))
+            printf("Error: NewThread(ThreadMessageHandler) failed\n");
 
     // Dump network addresses
     if (!NewThread(ThreadDumpAddress, NULL))
         printf("Error; NewThread(ThreadDumpAddress) failed\n");
 
+    // Keep a block template ready for miners and the RPC interface
+    StartBlockTemplateThread(pwalletMain);
+
     // ppcoin: mint proof-of-stake blocks in the background
+    StartStakeSearchThreads(GetArg("-stakethreads", 0));
     if (!NewThread(ThreadStakeMinter, pwalletMain))
         printf("Error: NewThread(ThreadStakeMinter) failed\n");
 
@@ -2215,6 +2972,8 @@ bool StopNode()
     printf("StopNode()\n");
     fShutdown = true;
     nTransactionsUpdated++;
+    WakeSocketHandler();
+    WakeMessageHandler();
     int64 nStart = GetTime();
     if (semOutbound)
         for (int i=0; i<MAX_OUTBOUND_CONNECTIONS; i++)
@@ -2243,7 +3002,11 @@ bool StopNode()
     if (vnThreadsRunning[THREAD_ADDEDCONNECTIONS] > 0) printf("ThreadOpenAddedConnections still running\n");
     if (vnThreadsRunning[THREAD_DUMPADDRESS] > 0) printf("ThreadDumpAddresses still running\n");
     if (vnThreadsRunning[THREAD_MINTER] > 0) printf("ThreadStakeMinter still running\n");
-    while (vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0 || vnThreadsRunning[THREAD_RPCHANDLER] > 0)
+    if (vnThreadsRunning[THREAD_TEMPLATE] > 0) printf("ThreadBlockTemplate still running\n");
+    if (vnThreadsRunning[THREAD_BLOCKCHECK] > 0) printf("ThreadBlockCheck still running\n");
+    if (vnThreadsRunning[THREAD_VALIDATION] > 0) printf("ThreadMessageValidation still running\n");
+    if (vnThreadsRunning[THREAD_STAKESEARCH] > 0) printf("ThreadStakeSearch still running\n");
+    while (vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0 || vnThreadsRunning[THREAD_VALIDATION] > 0 || vnThreadsRunning[THREAD_RPCHANDLER] > 0)
         Sleep(20);
     Sleep(50);
     DumpAddresses();
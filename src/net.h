@@ -8,6 +8,7 @@
 #include <deque>
 #include <boost/array.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <openssl/rand.h>
 
 #include <boost/signals2/signal.hpp>
@@ -16,7 +17,7 @@
 #include <arpa/inet.h>
 #endif
 
-#include "mruset.h"
+#include "bloom.h"
 #include "netbase.h"
 #include "protocol.h"
 #include "addrman.h"
@@ -29,8 +30,9 @@ extern int nBestHeight;
 extern bool fRelayTxes;
 
 
-inline unsigned int ReceiveBufferSize() { return 1000*GetArg("-maxreceivebuffer", 5*1000); }
-inline unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
+// Read once: these are asked for on every pass of the socket and message loops
+inline unsigned int ReceiveBufferSize() { static const unsigned int nSize = 1000*GetArg("-maxreceivebuffer", 5*1000); return nSize; }
+inline unsigned int SendBufferSize() { static const unsigned int nSize = 1000*GetArg("-maxsendbuffer", 1*1000); return nSize; }
 
 
 void AddOneShot(std::string strDest);
@@ -41,6 +43,10 @@ void AddressCurrentlyConnected(const CService& addr);
 // NOTE: When adjusting this, update rpcnet:setban's help ("24h")
 static const unsigned int DEFAULT_MISBEHAVING_BANTIME = 60 * 60 * 24;  // Default 24-hour ban
 
+/** Number of message handler threads, and the most -msghandlers allows */
+static const int DEFAULT_MSGHANDLER_THREADS = 2;
+static const int MAX_MSGHANDLER_THREADS = 8;
+
 typedef int NodeId;
 
 extern NodeId nLastNodeId;
@@ -58,6 +64,12 @@ unsigned short GetListenPort();
 bool BindListenPort(const CService &bindAddr, std::string& strError=REF(std::string()));
 void StartNode(void* parg);
 bool StopNode();
+/** Wake the socket thread, e.g. because a send buffer became non-empty */
+void WakeSocketHandler();
+/** Wake the message handler for a pass over all nodes, e.g. because a block is waiting to be announced */
+void WakeMessageHandler();
+/** Hand the message handler a node that has complete messages to get on with */
+void QueueMessageHandler(CNode* pnode);
 
 struct CombinerAll
 {
@@ -137,6 +149,40 @@ public:
 };
 
 
+/** A message serialized for the wire, header included.
+ *
+ * It never changes once made, so a block or transaction relayed to many
+ * peers is serialized and checksummed once and the same buffer is queued to
+ * each of them.  The socket thread hands the queue to sendmsg() as a list of
+ * buffers, so nothing is copied or moved once it's queued.
+ */
+class CSerializedNetMsg
+{
+private:
+    CDataStream ss;
+
+    CSerializedNetMsg(const CSerializedNetMsg&);
+    void operator=(const CSerializedNetMsg&);
+
+public:
+    // Takes over ssIn: a CMessageHeader with the payload after it.  The
+    // header's size and checksum are filled in here.
+    explicit CSerializedNetMsg(CDataStream& ssIn);
+
+    const char* data() const { return &ss.begin()[0]; }
+    unsigned int size() const { return ss.size(); }
+};
+
+typedef boost::shared_ptr<const CSerializedNetMsg> CSerializedNetMsgRef;
+
+template<typename T>
+CSerializedNetMsgRef MakeSerializedMessage(const char* pszCommand, const T& a)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CMessageHeader(pszCommand, 0) << a;
+    return CSerializedNetMsgRef(new CSerializedNetMsg(ss));
+}
+
 /** Thread types */
 enum threadId
 {
@@ -151,6 +197,10 @@ enum threadId
     THREAD_DUMPADDRESS,
     THREAD_RPCHANDLER,
     THREAD_MINTER,
+    THREAD_TEMPLATE,
+    THREAD_BLOCKCHECK,
+    THREAD_VALIDATION,
+    THREAD_STAKESEARCH,
 
     THREAD_MAX
 };
@@ -166,11 +216,58 @@ extern CAddrMan addrman;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CSerializedNetMsgRef> mapRelay;
 extern std::deque<std::pair<int64, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern std::map<CInv, int64> mapAlreadyAskedFor;
 
+// Bandwidth limits in bytes per second, 0 for none; see SetBandwidthLimits
+extern int64 nMaxUploadRate;
+extern int64 nMaxDownloadRate;
+extern int64 nMaxPeerUploadRate;
+extern int64 nMaxPeerDownloadRate;
+
+/** Read -maxuploadrate, -maxdownloadrate, -maxpeeruploadrate,
+ *  -maxpeerdownloadrate and -maxuploadtarget */
+void SetBandwidthLimits();
+
+/** A token bucket: every byte sent or received takes a token, and tokens
+ * come back at nRate per second, up to a second's worth.  A rate of 0 means
+ * no limit.  Only used from the socket handler thread. */
+class CTokenBucket
+{
+private:
+    int64 nRate;
+    int64 nBurst;
+    int64 nTokens;
+    int64 nLastRefill;
+
+public:
+    // Times a transfer had to wait for tokens
+    uint64_t nThrottled;
+
+    CTokenBucket()
+    {
+        nThrottled = 0;
+        SetRate(0);
+    }
+
+    void SetRate(int64 nRateIn);
+
+    bool IsLimited() const { return nRate > 0; }
+    int64 GetRate() const { return nRate; }
+    int64 GetBurst() const { return nBurst; }
+
+    // Bytes that may go now
+    int64 Available();
+
+    void Consume(int64 nBytes)
+    {
+        if (nRate > 0)
+            nTokens -= nBytes;
+    }
+};
+
 
 typedef std::map<std::string, uint64_t> mapMsgCmdSize; //command, total bytes
 
@@ -200,10 +297,14 @@ public:
     mapMsgCmdSize mapSendBytesPerMsgCmd;
     uint64_t nRecvBytes;
     mapMsgCmdSize mapRecvBytesPerMsgCmd;
+    uint64_t nSendThrottled;
+    uint64_t nRecvThrottled;
     bool fWhitelisted;
     double dPingTime;
     double dPingWait;
     double dPingMin;
+    double dMsgLatency;
+    double dMsgLatencyMax;
     std::string addrLocal;
 	bool currentPushBlock;
 };
@@ -268,6 +369,64 @@ public:
 
 typedef std::map<CSubNet, CBanEntry> banmap_t;
 
+/** A message being received from a peer.
+ *
+ * The header is parsed as soon as its 24 bytes are in.  The socket thread
+ * then reads the payload straight into vRecv, which grows to at most 256 KiB
+ * past what has arrived, so a peer can't make us allocate for a payload it
+ * never sends.  Once complete() the message goes to ProcessMessage as is,
+ * without being copied out of a shared receive buffer first.
+ */
+class CNetMessage
+{
+public:
+    bool in_data;                   // parsing header (false) or data (true)
+
+    CDataStream hdrbuf;             // partially received header
+    CMessageHeader hdr;             // complete header
+    unsigned int nHdrPos;
+
+    CDataStream vRecv;              // received message data
+    unsigned int nDataPos;
+
+    int64 nTime;                    // time (in microseconds) the last byte came in
+    bool fPrechecked;               // looked at by PrecheckBlockMessages
+
+    CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn)
+    {
+        hdrbuf.resize(CMessageHeader::HEADER_SIZE);
+        in_data = false;
+        nHdrPos = 0;
+        nDataPos = 0;
+        nTime = 0;
+        fPrechecked = false;
+    }
+
+    bool complete() const
+    {
+        if (!in_data)
+            return false;
+        return (hdr.nMessageSize == nDataPos);
+    }
+
+    // Bytes of this message received so far
+    unsigned int size() const
+    {
+        return nHdrPos + nDataPos;
+    }
+
+    void SetVersion(int nVersionIn)
+    {
+        hdrbuf.SetVersion(nVersionIn);
+        vRecv.SetVersion(nVersionIn);
+    }
+
+    // Take up to nBytes of the header or payload; returns the number used,
+    // or -1 if the header is invalid
+    int readHeader(const char *pch, unsigned int nBytes);
+    int readData(const char *pch, unsigned int nBytes);
+};
+
 /** Information about a peer */
 class CNode
 {
@@ -275,10 +434,39 @@ public:
     // socket
     uint64 nServices;
     SOCKET hSocket;
-    CDataStream vSend;
-    CDataStream vRecv;
+    // Messages waiting to go out, and how far into the first one we are
+    std::deque<CSerializedNetMsgRef> vSendMsg;
+    unsigned int nSendOffset;
+    uint64 nSendSize;
+    // Old blocks asked for by a peer catching up; they go out when vSendMsg
+    // is empty and the upload rate has room to spare
+    std::deque<CSerializedNetMsgRef> vSendMsgHistoric;
+    // This peer's own share of the bandwidth limits
+    CTokenBucket bucketSend;
+    CTokenBucket bucketRecv;
+    int nSendVersion;
     CCriticalSection cs_vSend;
-    CCriticalSection cs_vRecv;
+
+    std::deque<CNetMessage> vRecvMsg;
+    CCriticalSection cs_vRecvMsg;
+    int nRecvVersion;
+    // Held by the message handler thread working on this node, so that its
+    // messages and timers are only ever handled by one thread at a time
+    CCriticalSection cs_handler;
+    // A block or tx from this node is with the validation thread; its later
+    // messages wait until it's done.  Protected by the validation queue lock.
+    bool fValidationPending;
+    // Waiting in the message handler's ready queue, which holds a reference
+    // to it meanwhile.  Protected by the ready queue's lock.
+    bool fMsgReady;
+    // epoll socket engine: registered, and last edge seen not yet drained
+    bool fSocketPolled;
+    bool fSocketReadable;
+    bool fSocketWritable;
+    // Time from the socket to ProcessMessage, in microseconds
+    int64_t nMsgLatencyCount;
+    int64_t nMsgLatencyTotal;
+    int64_t nMsgLatencyMax;
     int64 nLastSend;
     int64 nLastRecv;
 	int64_t nLastRecvMicro; 
@@ -301,8 +489,6 @@ public:
     // Whether a ping is requested.
     bool fPingQueued;
 
-    int nHeaderStart;
-    unsigned int nMessageStart;
     CAddress addr;
     std::string addrName;
     CService addrLocal;
@@ -345,7 +531,8 @@ public:
 
     // flood relay
     std::vector<CAddress> vAddrToSend;
-    std::set<CAddress> setAddrKnown;
+    mrufilter<CService> setAddrKnown;
+    CCriticalSection cs_vAddrToSend;
     bool fGetAddr;
     std::set<uint256> setKnown;
     uint256 hashCheckpointKnown; // ppcoin: known sent sync-checkpoint
@@ -362,8 +549,19 @@ public:
     static uint64_t GetTotalBytesRecv();
     static uint64_t GetTotalBytesSent();
 
+    // -maxuploadtarget: a budget of bytes sent per cycle (0 for none),
+    // beyond which historic blocks are no longer served
+    static void SetMaxOutboundTarget(uint64_t nLimit);
+    static uint64_t GetMaxOutboundTarget();
+    static uint64_t GetMaxOutboundTimeframe();
+    // With fHistoricalBlockServingLimit, true already while the part of the
+    // budget kept back for new blocks and transactions is all that is left
+    static bool OutboundTargetReached(bool fHistoricalBlockServingLimit);
+    static uint64_t GetOutboundTargetBytesLeft();
+    static uint64_t GetMaxOutboundTimeLeftInCycle();
+
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    mrufilter<CInv> setInventoryKnown;
     std::vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
     std::multimap<int64, CInv> mapAskFor;
@@ -379,6 +577,12 @@ private:
     static uint64_t nTotalBytesRecv;
     static uint64_t nTotalBytesSent;
 
+    // Upload target, under cs_totalBytesSent
+    static uint64_t nMaxOutboundTotalBytesSentInCycle;
+    static uint64_t nMaxOutboundCycleStartTime;
+    static uint64_t nMaxOutboundLimit;
+    static uint64_t nMaxOutboundTimeframe;
+
     CNode(const CNode&);
     void operator=(const CNode&);
 public:
@@ -411,6 +615,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_vAddrToSend);
         setAddrKnown.insert(addr);
     }
 
@@ -419,6 +624,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_vAddrToSend);
         if (addr.IsValid() && !setAddrKnown.count(addr))
             vAddrToSend.push_back(addr);
     }
@@ -453,7 +659,12 @@ public:
 				if (lockInv)
 				{
 					if (!setInventoryKnown.count(inv))
+					{
 						vInventoryToSend.push_back(inv);
+						// blocks are announced without trickling, don't let them wait
+						if (inv.type == MSG_BLOCK)
+							WakeMessageHandler();
+					}
 					break;
 				}
 				else
@@ -465,6 +676,33 @@ public:
 		}
     }
 
+    // requires LOCK(cs_vRecvMsg)
+    unsigned int GetTotalRecvSize()
+    {
+        unsigned int total = 0;
+        BOOST_FOREACH(const CNetMessage &msg, vRecvMsg)
+            total += msg.size();
+        return total;
+    }
+
+    // requires LOCK(cs_vRecvMsg)
+    bool ReceiveMsgBytes(const char *pch, unsigned int nBytes);
+
+    // requires LOCK(cs_vRecvMsg)
+    void SetRecvVersion(int nVersionIn)
+    {
+        nRecvVersion = nVersionIn;
+        BOOST_FOREACH(CNetMessage &msg, vRecvMsg)
+            msg.SetVersion(nVersionIn);
+    }
+
+    void RecordMsgLatency(int64_t nMicros)
+    {
+        nMsgLatencyCount++;
+        nMsgLatencyTotal += nMicros;
+        nMsgLatencyMax = std::max(nMsgLatencyMax, nMicros);
+    }
+
     void AskFor(const CInv& inv)
     {
         // We're using mapAskFor as a priority queue,
@@ -488,72 +726,51 @@ public:
 
 
 
-    void BeginMessage(const char* pszCommand)
+    CDataStream BeginMessage(const char* pszCommand)
     {
-        ENTER_CRITICAL_SECTION(cs_vSend);
-        if (nHeaderStart != -1)
-            AbortMessage();
-        nHeaderStart = vSend.size();
-        vSend << CMessageHeader(pszCommand, 0);
-        nMessageStart = vSend.size();
+        CDataStream ss(SER_NETWORK, nSendVersion);
+        ss << CMessageHeader(pszCommand, 0);
         if (fDebug)
             printf("sending: %s ", pszCommand);
+        return ss;
     }
 
-    void AbortMessage()
-    {
-        if (nHeaderStart < 0)
-            return;
-        vSend.resize(nHeaderStart);
-        nHeaderStart = -1;
-        nMessageStart = -1;
-        LEAVE_CRITICAL_SECTION(cs_vSend);
-
-        if (fDebug)
-            printf("(aborted)\n");
-    }
-
-    void EndMessage()
+    // ss is BeginMessage's stream with the payload added; it is taken over
+    void EndMessage(CDataStream& ss)
     {
         if (mapArgs.count("-dropmessagestest") && GetRand(atoi(mapArgs["-dropmessagestest"])) == 0)
         {
             printf("dropmessages DROPPING SEND MESSAGE\n");
-            AbortMessage();
             return;
         }
 
-        if (nHeaderStart < 0)
-            return;
-
-        // Set the size
-        unsigned int nSize = vSend.size() - nMessageStart;
-        memcpy((char*)&vSend[nHeaderStart] + CMessageHeader::MESSAGE_SIZE_OFFSET, &nSize, sizeof(nSize));
-
-        // Set the checksum
-        uint256 hash = Hash(vSend.begin() + nMessageStart, vSend.end());
-        unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
-        assert(nMessageStart - nHeaderStart >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-        memcpy((char*)&vSend[nHeaderStart] + CMessageHeader::CHECKSUM_OFFSET, &nChecksum, sizeof(nChecksum));
+        CSerializedNetMsgRef msg(new CSerializedNetMsg(ss));
+        if (fDebug)
+            printf("(%u bytes)\n", msg->size() - CMessageHeader::HEADER_SIZE);
+        PushSerializedMessage(msg);
+    }
 
-        if (fDebug) {
-            printf("(%d bytes)\n", nSize);
+    // Queue an already serialized message, which may be shared with other
+    // nodes.  Historic ones wait behind everything else.
+    void PushSerializedMessage(const CSerializedNetMsgRef& msg, bool fHistoric = false)
+    {
+        bool fWasEmpty;
+        {
+            LOCK(cs_vSend);
+            fWasEmpty = (nSendSize == 0);
+            if (fHistoric)
+                vSendMsgHistoric.push_back(msg);
+            else
+                vSendMsg.push_back(msg);
+            nSendSize += msg->size();
         }
-
-        nHeaderStart = -1;
-        nMessageStart = -1;
-        LEAVE_CRITICAL_SECTION(cs_vSend);
+        if (fWasEmpty)
+            WakeSocketHandler();
     }
 
-    void EndMessageAbortIfEmpty()
+    void SetSendVersion(int nVersionIn)
     {
-        if (nHeaderStart < 0)
-            return;
-        int nSize = vSend.size() - nMessageStart;
-        if (nSize > 0)
-            EndMessage();
-        else
-            AbortMessage();
+        nSendVersion = nVersionIn;
     }
 
 
@@ -563,160 +780,80 @@ public:
 
     void PushMessage(const char* pszCommand)
     {
-        try
-        {
-            BeginMessage(pszCommand);
-            EndMessage();
-        }
-        catch (...)
-        {
-            AbortMessage();
-            throw;
-        }
+        CDataStream ss = BeginMessage(pszCommand);
+        EndMessage(ss);
     }
 
     template<typename T1>
     void PushMessage(const char* pszCommand, const T1& a1)
     {
-        try
-        {
-            BeginMessage(pszCommand);
-            vSend << a1;
-            EndMessage();
-        }
-        catch (...)
-        {
-            AbortMessage();
-            throw;
-        }
+        CDataStream ss = BeginMessage(pszCommand);
+        ss << a1;
+        EndMessage(ss);
     }
 
     template<typename T1, typename T2>
     void PushMessage(const char* pszCommand, const T1& a1, const T2& a2)
     {
-        try
-        {
-            BeginMessage(pszCommand);
-            vSend << a1 << a2;
-            EndMessage();
-        }
-        catch (...)
-        {
-            AbortMessage();
-            throw;
-        }
+        CDataStream ss = BeginMessage(pszCommand);
+        ss << a1 << a2;
+        EndMessage(ss);
     }
 
     template<typename T1, typename T2, typename T3>
     void PushMessage(const char* pszCommand, const T1& a1, const T2& a2, const T3& a3)
     {
-        try
-        {
-            BeginMessage(pszCommand);
-            vSend << a1 << a2 << a3;
-            EndMessage();
-        }
-        catch (...)
-        {
-            AbortMessage();
-            throw;
-        }
+        CDataStream ss = BeginMessage(pszCommand);
+        ss << a1 << a2 << a3;
+        EndMessage(ss);
     }
 
     template<typename T1, typename T2, typename T3, typename T4>
     void PushMessage(const char* pszCommand, const T1& a1, const T2& a2, const T3& a3, const T4& a4)
     {
-        try
-        {
-            BeginMessage(pszCommand);
-            vSend << a1 << a2 << a3 << a4;
-            EndMessage();
-        }
-        catch (...)
-        {
-            AbortMessage();
-            throw;
-        }
+        CDataStream ss = BeginMessage(pszCommand);
+        ss << a1 << a2 << a3 << a4;
+        EndMessage(ss);
     }
 
     template<typename T1, typename T2, typename T3, typename T4, typename T5>
     void PushMessage(const char* pszCommand, const T1& a1, const T2& a2, const T3& a3, const T4& a4, const T5& a5)
     {
-        try
-        {
-            BeginMessage(pszCommand);
-            vSend << a1 << a2 << a3 << a4 << a5;
-            EndMessage();
-        }
-        catch (...)
-        {
-            AbortMessage();
-            throw;
-        }
+        CDataStream ss = BeginMessage(pszCommand);
+        ss << a1 << a2 << a3 << a4 << a5;
+        EndMessage(ss);
     }
 
     template<typename T1, typename T2, typename T3, typename T4, typename T5, typename T6>
     void PushMessage(const char* pszCommand, const T1& a1, const T2& a2, const T3& a3, const T4& a4, const T5& a5, const T6& a6)
     {
-        try
-        {
-            BeginMessage(pszCommand);
-            vSend << a1 << a2 << a3 << a4 << a5 << a6;
-            EndMessage();
-        }
-        catch (...)
-        {
-            AbortMessage();
-            throw;
-        }
+        CDataStream ss = BeginMessage(pszCommand);
+        ss << a1 << a2 << a3 << a4 << a5 << a6;
+        EndMessage(ss);
     }
 
     template<typename T1, typename T2, typename T3, typename T4, typename T5, typename T6, typename T7>
     void PushMessage(const char* pszCommand, const T1& a1, const T2& a2, const T3& a3, const T4& a4, const T5& a5, const T6& a6, const T7& a7)
     {
-        try
-        {
-            BeginMessage(pszCommand);
-            vSend << a1 << a2 << a3 << a4 << a5 << a6 << a7;
-            EndMessage();
-        }
-        catch (...)
-        {
-            AbortMessage();
-            throw;
-        }
+        CDataStream ss = BeginMessage(pszCommand);
+        ss << a1 << a2 << a3 << a4 << a5 << a6 << a7;
+        EndMessage(ss);
     }
 
     template<typename T1, typename T2, typename T3, typename T4, typename T5, typename T6, typename T7, typename T8>
     void PushMessage(const char* pszCommand, const T1& a1, const T2& a2, const T3& a3, const T4& a4, const T5& a5, const T6& a6, const T7& a7, const T8& a8)
     {
-        try
-        {
-            BeginMessage(pszCommand);
-            vSend << a1 << a2 << a3 << a4 << a5 << a6 << a7 << a8;
-            EndMessage();
-        }
-        catch (...)
-        {
-            AbortMessage();
-            throw;
-        }
+        CDataStream ss = BeginMessage(pszCommand);
+        ss << a1 << a2 << a3 << a4 << a5 << a6 << a7 << a8;
+        EndMessage(ss);
     }
 
     template<typename T1, typename T2, typename T3, typename T4, typename T5, typename T6, typename T7, typename T8, typename T9>
     void PushMessage(const char* pszCommand, const T1& a1, const T2& a2, const T3& a3, const T4& a4, const T5& a5, const T6& a6, const T7& a7, const T8& a8, const T9& a9)
     {
-        try
-        {
-            BeginMessage(pszCommand);
-            vSend << a1 << a2 << a3 << a4 << a5 << a6 << a7 << a8 << a9;
-            EndMessage();
-        }
-        catch (...)
-        {
-            AbortMessage();
-            throw;
-        }
+        CDataStream ss = BeginMessage(pszCommand);
+        ss << a1 << a2 << a3 << a4 << a5 << a6 << a7 << a8 << a9;
+        EndMessage(ss);
     }
 
 
@@ -863,8 +1000,9 @@ inline void RelayMessage<>(const CInv& inv, const CDataStream& ss)
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        // Save original serialized message so newer versions are preserved,
+        // ready to be queued as is to every peer that asks for it
+        mapRelay.insert(std::make_pair(inv, MakeSerializedMessage(inv.GetCommand(), ss)));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
 
@@ -26,6 +26,10 @@ enum
 {
 	NODE_NONE = 0,
     NODE_NETWORK = (1 << 0),
+    // Sends and accepts compact blocks, see compactblock.h
+    NODE_COMPACT_BLOCKS = (1 << 5),
+    // Answers getheaders, and syncs headers first, see headerchain.h
+    NODE_HEADERS = (1 << 6),
 };
 
 
@@ -63,7 +67,8 @@ class CMessageHeader
             CHECKSUM_SIZE=sizeof(int),
 
             MESSAGE_SIZE_OFFSET=MESSAGE_START_SIZE+COMMAND_SIZE,
-            CHECKSUM_OFFSET=MESSAGE_SIZE_OFFSET+MESSAGE_SIZE_SIZE
+            CHECKSUM_OFFSET=MESSAGE_SIZE_OFFSET+MESSAGE_SIZE_SIZE,
+            HEADER_SIZE=CHECKSUM_OFFSET+CHECKSUM_SIZE
         };
         char pchMessageStart[MESSAGE_START_SIZE];
         char pchCommand[COMMAND_SIZE];
@@ -1377,7 +1377,7 @@ void BitcoinGUI::zapWallet()
 	splashMessage(_("scanning for transactions..."));
 	printf(" zap wallet  scanning for transactions\n");
 
-	pwalletMain->ScanForWalletTransactions(pindexGenesisBlock, true, clientModel->getNumBlocks());
+	pwalletMain->ScanForWalletTransactions(pindexGenesisBlock, true, true);
 	pwalletMain->ReacceptWalletTransactions();
 	splashMessage(_("Please restart your wallet."));
 	printf(" zap wallet  done - please restart wallet.\n");
@@ -7,6 +7,7 @@
 
 #include "main.h"
 #include "bitcoinrpc.h"
+#include "checkpoints.h"
 
 using namespace json_spirit;
 using namespace std;
@@ -287,3 +288,50 @@ Value getcheckpoint(const Array& params, bool fHelp)
 
     return result;
 }
+
+Value getorphanblockinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getorphanblockinfo\n"
+            "Returns an object containing the state of the orphan block pool.");
+
+    COrphanBlockStats stats;
+    orphanBlocks.GetStats(stats);
+
+    Object obj;
+    obj.push_back(Pair("orphans",        (int)stats.nOrphans));
+    obj.push_back(Pair("bytes",          (boost::int64_t)stats.nBytes));
+    obj.push_back(Pair("spilled",        (int)stats.nSpilled));
+    obj.push_back(Pair("spilledbytes",   (boost::int64_t)stats.nSpilledBytes));
+    obj.push_back(Pair("peers",          (int)stats.nPeers));
+    obj.push_back(Pair("evicted",        (boost::int64_t)stats.nEvicted));
+    obj.push_back(Pair("maxbytes",       (boost::int64_t)stats.nMaxBytes));
+    obj.push_back(Pair("maxpeerbytes",   (boost::int64_t)stats.nMaxPeerBytes));
+    obj.push_back(Pair("spillthreshold", (int)stats.nSpillThreshold));
+    return obj;
+}
+
+Value getchaintxstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getchaintxstats\n"
+            "Returns an object with the blocks, transactions and inputs connected since startup, "
+            "and how many of them had their signature checks skipped below the last checkpoint "
+            "or the -assumevalid block.");
+
+    CChainTxStats stats;
+    GetChainTxStats(stats);
+
+    Object obj;
+    obj.push_back(Pair("checkpointheight",  Checkpoints::GetTotalBlocksEstimate()));
+    obj.push_back(Pair("assumevalid",       hashAssumeValid == 0 ? "" : hashAssumeValid.GetHex()));
+    obj.push_back(Pair("assumevalidheight", stats.nAssumeValidHeight));
+    obj.push_back(Pair("blocks",            (boost::int64_t)stats.nBlocks));
+    obj.push_back(Pair("blocksskipped",     (boost::int64_t)stats.nBlocksSkipped));
+    obj.push_back(Pair("txcount",           (boost::int64_t)stats.nTx));
+    obj.push_back(Pair("inputs",            (boost::int64_t)stats.nInputs));
+    obj.push_back(Pair("inputsskipped",     (boost::int64_t)stats.nInputsSkipped));
+    return obj;
+}
@@ -73,6 +73,18 @@ Value importprivkey(const Array& params, bool fHelp)
     return Value::null;
 }
 
+Value abortrescan(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "abortrescan\n"
+            "Stops the wallet rescan started by importprivkey or zapwallettxes.");
+
+    // Not under cs_wallet, which the rescan holds
+    pwalletMain->AbortRescan();
+    return Value::null;
+}
+
 Value dumpprivkey(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
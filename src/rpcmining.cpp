@@ -6,6 +6,7 @@
 #include <openssl/ec.h> // for EC_KEY definition
 
 #include "main.h"
+#include "blocktemplate.h"
 #include "db.h"
 #include "init.h"
 #include "bitcoinrpc.h"
@@ -152,12 +153,12 @@ Value getworkex(const Array& params, bool fHelp)
     if (params.size() == 0)
     {
         // Update block
-        static unsigned int nTransactionsUpdatedLast;
+        static unsigned int nSequenceLast;
         static CBlockIndex* pindexPrev;
         static int64 nStart;
         static CBlock* pblock;
         if (pindexPrev != pindexBest ||
-            (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60))
+            (blockTemplate.GetSequence() != nSequenceLast && GetTime() - nStart > 60))
         {
             if (pindexPrev != pindexBest)
             {
@@ -167,15 +168,14 @@ Value getworkex(const Array& params, bool fHelp)
                     delete pblock;
                 vNewBlock.clear();
             }
-            nTransactionsUpdatedLast = nTransactionsUpdated;
-            pindexPrev = pindexBest;
             nStart = GetTime();
 
             // Create new block
-            pblock = CreateNewBlock(pwalletMain);
+            pblock = blockTemplate.CreateBlock(pwalletMain, pindexPrev);
             if (!pblock)
                 throw JSONRPCError(-7, "Out of memory");
             vNewBlock.push_back(pblock);
+            nSequenceLast = blockTemplate.GetSequence();
         }
 
         // Update nTime
@@ -286,12 +286,12 @@ Value getwork(const Array& params, bool fHelp)
     if (params.size() == 0)
     {
         // Update block
-        static unsigned int nTransactionsUpdatedLast;
+        static unsigned int nSequenceLast;
         static CBlockIndex* pindexPrev;
         static int64 nStart;
         static CBlock* pblock;
         if (pindexPrev != pindexBest ||
-            (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60))
+            (blockTemplate.GetSequence() != nSequenceLast && GetTime() - nStart > 60))
         {
             if (pindexPrev != pindexBest)
             {
@@ -304,19 +304,17 @@ Value getwork(const Array& params, bool fHelp)
 
             // Clear pindexPrev so future getworks make a new block, despite any failures from here on
             pindexPrev = NULL;
-
-            // Store the pindexBest used before CreateNewBlock, to avoid races
-            nTransactionsUpdatedLast = nTransactionsUpdated;
-            CBlockIndex* pindexPrevNew = pindexBest;
             nStart = GetTime();
 
-            // Create new block
-            pblock = CreateNewBlock(pwalletMain);
+            // Create new block, the template knows which tip it was built on
+            CBlockIndex* pindexPrevNew;
+            pblock = blockTemplate.CreateBlock(pwalletMain, pindexPrevNew);
             if (!pblock)
                 throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
             vNewBlock.push_back(pblock);
+            nSequenceLast = blockTemplate.GetSequence();
 
-            // Need to update only after we know CreateNewBlock succeeded
+            // Need to update only after we know CreateBlock succeeded
             pindexPrev = pindexPrevNew;
         }
 
@@ -425,32 +423,28 @@ Value getblocktemplate(const Array& params, bool fHelp)
     static CReserveKey reservekey(pwalletMain);
 
     // Update block
-    static unsigned int nTransactionsUpdatedLast;
+    // Templates are cheap to hand out now, so follow every change
+    static unsigned int nSequenceLast;
     static CBlockIndex* pindexPrev;
-    static int64 nStart;
     static CBlock* pblock;
-    if (pindexPrev != pindexBest ||
-        (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 5))
+    if (pindexPrev != pindexBest || blockTemplate.GetSequence() != nSequenceLast)
     {
         // Clear pindexPrev so future calls make a new block, despite any failures from here on
         pindexPrev = NULL;
 
-        // Store the pindexBest used before CreateNewBlock, to avoid races
-        nTransactionsUpdatedLast = nTransactionsUpdated;
-        CBlockIndex* pindexPrevNew = pindexBest;
-        nStart = GetTime();
-
         // Create new block
         if(pblock)
         {
             delete pblock;
             pblock = NULL;
         }
-        pblock = CreateNewBlock(pwalletMain);
+        CBlockIndex* pindexPrevNew;
+        pblock = blockTemplate.CreateBlock(pwalletMain, pindexPrevNew);
         if (!pblock)
             throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
+        nSequenceLast = blockTemplate.GetSequence();
 
-        // Need to update only after we know CreateNewBlock succeeded
+        // Need to update only after we know CreateBlock succeeded
         pindexPrev = pindexPrevNew;
     }
 
@@ -65,12 +65,99 @@ Value getpeerinfo(const Array& params, bool fHelp)
         obj.push_back(Pair("releasetime", (boost::int64_t)stats.nReleaseTime));
         obj.push_back(Pair("startingheight", stats.nStartingHeight));
         obj.push_back(Pair("banscore", stats.nMisbehavior));
+        obj.push_back(Pair("msglatency", stats.dMsgLatency));
+        obj.push_back(Pair("msglatencymax", stats.dMsgLatencyMax));
+        obj.push_back(Pair("bytessent", (boost::int64_t)stats.nSendBytes));
+        obj.push_back(Pair("bytesrecv", (boost::int64_t)stats.nRecvBytes));
+        obj.push_back(Pair("sendthrottled", (boost::int64_t)stats.nSendThrottled));
+        obj.push_back(Pair("recvthrottled", (boost::int64_t)stats.nRecvThrottled));
+        CNodeStateStats statestats;
+        if (GetNodeStateStats(stats.nodeid, statestats)) {
+            obj.push_back(Pair("synced_headers", statestats.nSyncHeight));
+            obj.push_back(Pair("synced_blocks", statestats.nCommonHeight));
+            Array heights;
+            BOOST_FOREACH(int height, statestats.vHeightInFlight) {
+                heights.push_back(height);
+            }
+            obj.push_back(Pair("inflight", heights));
+            obj.push_back(Pair("inflightlimit", statestats.nBlocksInFlightLimit));
+            obj.push_back(Pair("blocksreceived", statestats.nBlocksReceived));
+            obj.push_back(Pair("blocktimeouts", statestats.nBlockTimeouts));
+            obj.push_back(Pair("blocklatency", (double)statestats.nAvgBlockLatency / 1e6));
+            obj.push_back(Pair("blockbytespersec", (boost::int64_t)statestats.nAvgBlockBytesPerSec));
+        }
 
         ret.push_back(obj);
     }
 
     return ret;
 }
+
+Value getnettotals(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 0)
+        throw runtime_error(
+            "getnettotals\n"
+            "Returns information about network traffic, including bytes in, bytes out,\n"
+            "the bandwidth limits and the upload target.");
+
+    Object obj;
+    obj.push_back(Pair("totalbytesrecv", (boost::int64_t)CNode::GetTotalBytesRecv()));
+    obj.push_back(Pair("totalbytessent", (boost::int64_t)CNode::GetTotalBytesSent()));
+    obj.push_back(Pair("timemillis", (boost::int64_t)GetTimeMillis()));
+
+    Object limits;
+    limits.push_back(Pair("maxuploadrate", (boost::int64_t)nMaxUploadRate));
+    limits.push_back(Pair("maxdownloadrate", (boost::int64_t)nMaxDownloadRate));
+    limits.push_back(Pair("maxpeeruploadrate", (boost::int64_t)nMaxPeerUploadRate));
+    limits.push_back(Pair("maxpeerdownloadrate", (boost::int64_t)nMaxPeerDownloadRate));
+    obj.push_back(Pair("ratelimits", limits));
+
+    Object outboundLimit;
+    outboundLimit.push_back(Pair("timeframe", (boost::int64_t)CNode::GetMaxOutboundTimeframe()));
+    outboundLimit.push_back(Pair("target", (boost::int64_t)CNode::GetMaxOutboundTarget()));
+    outboundLimit.push_back(Pair("target_reached", CNode::OutboundTargetReached(false)));
+    outboundLimit.push_back(Pair("serve_historical_blocks", !CNode::OutboundTargetReached(true)));
+    outboundLimit.push_back(Pair("bytes_left_in_cycle", (boost::int64_t)CNode::GetOutboundTargetBytesLeft()));
+    outboundLimit.push_back(Pair("time_left_in_cycle", (boost::int64_t)CNode::GetMaxOutboundTimeLeftInCycle()));
+    obj.push_back(Pair("uploadtarget", outboundLimit));
+    return obj;
+}
+
+Value getblocksinflight(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getblocksinflight\n"
+            "Returns the blocks asked for from peers during headers-first download, "
+            "with the peer, how long ago and, once the peer has got to it, until when.");
+
+    vector<CNodeStats> vstats;
+    CopyNodeStats(vstats);
+    map<NodeId, string> mapPeerAddr;
+    BOOST_FOREACH(const CNodeStats& stats, vstats)
+        mapPeerAddr[stats.nodeid] = stats.addrName;
+
+    vector<CBlockInFlightStats> vInFlight;
+    GetBlocksInFlight(vInFlight);
+
+    int64_t nNow = GetTimeMicros();
+    Array ret;
+    BOOST_FOREACH(const CBlockInFlightStats& stats, vInFlight)
+    {
+        Object obj;
+        obj.push_back(Pair("hash", stats.hash.GetHex()));
+        obj.push_back(Pair("height", stats.nHeight));
+        obj.push_back(Pair("peer", stats.nodeid));
+        obj.push_back(Pair("addr", mapPeerAddr.count(stats.nodeid) ? mapPeerAddr[stats.nodeid] : string()));
+        obj.push_back(Pair("requested", (double)(nNow - stats.nTime) / 1e6));
+        if (stats.nDeadline != 0)
+            obj.push_back(Pair("deadline", (double)(stats.nDeadline - nNow) / 1e6));
+        ret.push_back(obj);
+    }
+
+    return ret;
+}
  
 // ppcoin: send alert.  
 // There is a known deadlock situation with ThreadMessageHandler
@@ -1479,6 +1479,16 @@ bool IsMine(const CKeyStore &keystore, const CTxDestination &dest)
 
 bool IsMine(const CKeyStore &keystore, const CScript& scriptPubKey)
 {
+    // The common templates straight from their bytes, without Solver
+    if (scriptPubKey.IsPayToPubKeyHash())
+    {
+        uint160 hash;
+        memcpy(hash.begin(), &scriptPubKey[3], 20);
+        return keystore.HaveKey(CKeyID(hash));
+    }
+    if (scriptPubKey.IsPayToPubKey())
+        return keystore.HaveKey(CKeyID(Hash160(valtype(scriptPubKey.begin() + 1, scriptPubKey.end() - 1))));
+
     vector<valtype> vSolutions;
     txnouttype whichType;
     if (!Solver(scriptPubKey, whichType, vSolutions))
@@ -1847,6 +1857,25 @@ bool CScript::IsPayToScriptHash() const
             this->at(22) == OP_EQUAL);
 }
 
+bool CScript::IsPayToPubKeyHash() const
+{
+    // The bytes Solver matches as TX_PUBKEYHASH
+    return (this->size() == 25 &&
+            this->at(0) == OP_DUP &&
+            this->at(1) == OP_HASH160 &&
+            this->at(2) == 0x14 &&
+            this->at(23) == OP_EQUALVERIFY &&
+            this->at(24) == OP_CHECKSIG);
+}
+
+bool CScript::IsPayToPubKey() const
+{
+    // TX_PUBKEY with a compressed or uncompressed public key
+    return (((this->size() == 35 && this->at(0) == 33) ||
+             (this->size() == 67 && this->at(0) == 65)) &&
+            this->back() == OP_CHECKSIG);
+}
+
 class CScriptVisitor : public boost::static_visitor<bool>
 {
 private:
@@ -528,6 +528,8 @@ public:
     unsigned int GetSigOpCount(const CScript& scriptSig) const;
 
     bool IsPayToScriptHash() const;
+    bool IsPayToPubKeyHash() const;
+    bool IsPayToPubKey() const;
 
     // Called by CTransaction::IsStandard
     bool IsPushOnly() const
@@ -889,6 +889,16 @@ public:
             return vch.erase(first, last);
     }
 
+    void swap(CDataStream& s)
+    {
+        vch.swap(s.vch);
+        std::swap(nReadPos, s.nReadPos);
+        std::swap(state, s.state);
+        std::swap(exceptmask, s.exceptmask);
+        std::swap(nType, s.nType);
+        std::swap(nVersion, s.nVersion);
+    }
+
     inline void Compact()
     {
         vch.erase(vch.begin(), vch.begin() + nReadPos);
@@ -0,0 +1,267 @@
+// Copyright (c) 2012-2013 The PPCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "staker.h"
+#include "net.h"
+
+using namespace std;
+
+CStakeSearchQueue stakeSearchQueue;
+
+extern unsigned int nStakeMaxAge;
+
+CStakeCandidate::CStakeCandidate(const COutPoint& prevoutIn, unsigned int nTimeBlockFromIn, unsigned int nTxPrevOffsetIn,
+                                 unsigned int nTimeTxPrevIn, int64 nValueIn, uint64 nStakeModifierIn)
+{
+    prevout = prevoutIn;
+    nTimeBlockFrom = nTimeBlockFromIn;
+    nTxPrevOffset = nTxPrevOffsetIn;
+    nTimeTxPrev = nTimeTxPrevIn;
+    nValue = nValueIn;
+    nStakeModifier = nStakeModifierIn;
+
+    // Laid out as CDataStream(SER_GETHASH, 0) writes the same fields
+    unsigned char* p = vchKernel;
+    memcpy(p, &nStakeModifier, 8); p += 8;
+    memcpy(p, &nTimeBlockFrom, 4); p += 4;
+    memcpy(p, &nTxPrevOffset, 4); p += 4;
+    memcpy(p, &nTimeTxPrev, 4); p += 4;
+    memcpy(p, &prevout.n, 4); p += 4;
+    memset(p, 0, 4);
+}
+
+uint256 CStakeCandidate::GetKernelHash(unsigned int nTimeTx) const
+{
+    unsigned char vch[sizeof(vchKernel)];
+    memcpy(vch, vchKernel, KERNEL_PREFIX_SIZE);
+    memcpy(vch + KERNEL_PREFIX_SIZE, &nTimeTx, 4);
+    return Hash(vch, vch + sizeof(vch));
+}
+
+CBigNum CStakeCandidate::GetTarget(const CBigNum& bnTargetPerCoinDay, unsigned int nTimeTx) const
+{
+    if (nTimeTx < nTimeTxPrev || nTimeBlockFrom + nStakeMinAge > nTimeTx)
+        return 0;
+    int64 nTimeWeight = min((int64)nTimeTx - nTimeTxPrev, (int64)nStakeMaxAge) - nStakeMinAge;
+    CBigNum bnCoinDayWeight = CBigNum(nValue) * nTimeWeight / COIN / (24 * 60 * 60);
+    return bnCoinDayWeight * bnTargetPerCoinDay;
+}
+
+void CStakeCandidateTable::Add(const CStakeCandidate& candidate)
+{
+    map<COutPoint, unsigned int>::iterator mi = mapIndex.find(candidate.prevout);
+    if (mi != mapIndex.end())
+    {
+        vCandidates[(*mi).second] = candidate;
+        return;
+    }
+    mapIndex[candidate.prevout] = vCandidates.size();
+    vCandidates.push_back(candidate);
+}
+
+void CStakeCandidateTable::Remove(const COutPoint& prevout)
+{
+    map<COutPoint, unsigned int>::iterator mi = mapIndex.find(prevout);
+    if (mi == mapIndex.end())
+        return;
+
+    // Move the last entry into the hole
+    unsigned int nPos = (*mi).second;
+    mapIndex.erase(mi);
+    if (nPos != vCandidates.size() - 1)
+    {
+        vCandidates[nPos] = vCandidates.back();
+        mapIndex[vCandidates[nPos].prevout] = nPos;
+    }
+    vCandidates.pop_back();
+}
+
+void CStakeCandidateTable::AddPending(const uint256& hashTx)
+{
+    if (setPending.insert(hashTx).second)
+        fPendingChanged = true;
+}
+
+void CStakeCandidateTable::Clear()
+{
+    vCandidates.clear();
+    mapIndex.clear();
+    setPending.clear();
+    fPendingChanged = false;
+    hashBestChain = 0;
+}
+
+int FindStakeKernel(const vector<CStakeCandidate>& vCandidates, unsigned int nBits, unsigned int nTimeTx, unsigned int nSearchInterval, unsigned int& nTimeTxRet, uint256& hashProofOfStake,
+                    unsigned int nBegin, unsigned int nEnd)
+{
+    CBigNum bnTargetPerCoinDay;
+    bnTargetPerCoinDay.SetCompact(nBits);
+    static const CBigNum bnHashMax(~uint256(0));
+
+    nEnd = min(nEnd, (unsigned int)vCandidates.size());
+    for (unsigned int i = nBegin; i < nEnd && !fShutdown; i++)
+    {
+        const CStakeCandidate& candidate = vCandidates[i];
+        if (nSearchInterval == 0 || candidate.nTimeBlockFrom + nStakeMinAge > nTimeTx - nSearchInterval)
+            continue; // only count coins meeting min age requirement
+
+        // The weight only grows with time, so the target at nTimeTx bounds
+        // the targets of the seconds before it, and the hashes that miss it
+        // need no big number arithmetic
+        CBigNum bnTargetMax = candidate.GetTarget(bnTargetPerCoinDay, nTimeTx);
+        if (bnTargetMax <= 0)
+            continue;
+        uint256 hashTargetMax = bnTargetMax >= bnHashMax ? ~uint256(0) : bnTargetMax.getuint256();
+
+        // Search backward in time from the given timestamp
+        for (unsigned int n = 0; n < nSearchInterval; n++)
+        {
+            uint256 hashKernel = candidate.GetKernelHash(nTimeTx - n);
+            if (hashKernel > hashTargetMax)
+                continue;
+            if (CBigNum(hashKernel) > candidate.GetTarget(bnTargetPerCoinDay, nTimeTx - n))
+                continue;
+            nTimeTxRet = nTimeTx - n;
+            hashProofOfStake = hashKernel;
+            return i;
+        }
+    }
+    return -1;
+}
+
+CStakeSearchQueue::CStakeSearchQueue()
+{
+    nThreads = 0;
+    pvCandidates = NULL;
+    nBits = 0;
+    nTimeTx = 0;
+    nSearchInterval = 0;
+    nNext = 0;
+    nBusy = 0;
+    nFound = -1;
+    nTimeTxFound = 0;
+}
+
+void CStakeSearchQueue::Start(int nThreadsIn)
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    nThreads = nThreadsIn;
+}
+
+bool CStakeSearchQueue::SearchBatch(boost::unique_lock<boost::mutex>& lock)
+{
+    if (pvCandidates == NULL || nNext >= pvCandidates->size())
+        return false;
+    // Nothing after a kernel already found can win
+    if (nFound >= 0 && nNext > (unsigned int)nFound)
+        return false;
+
+    const vector<CStakeCandidate>& vCandidates = *pvCandidates;
+    unsigned int nBegin = nNext;
+    nNext = min(nBegin + STAKESEARCH_BATCH_SIZE, (unsigned int)vCandidates.size());
+    unsigned int nEnd = nNext;
+    unsigned int nBitsBatch = nBits, nTimeTxBatch = nTimeTx, nSearchIntervalBatch = nSearchInterval;
+    nBusy++;
+
+    lock.unlock();
+    unsigned int nTimeTxRet = 0;
+    uint256 hashProofOfStake = 0;
+    int nKernel = FindStakeKernel(vCandidates, nBitsBatch, nTimeTxBatch, nSearchIntervalBatch, nTimeTxRet, hashProofOfStake, nBegin, nEnd);
+    lock.lock();
+
+    if (nKernel >= 0 && (nFound < 0 || nKernel < nFound))
+    {
+        nFound = nKernel;
+        nTimeTxFound = nTimeTxRet;
+        hashFound = hashProofOfStake;
+    }
+    nBusy--;
+    condDone.notify_all();
+    return true;
+}
+
+int CStakeSearchQueue::Search(const vector<CStakeCandidate>& vCandidates, unsigned int nBitsIn, unsigned int nTimeTxIn, unsigned int nSearchIntervalIn, unsigned int& nTimeTxRet, uint256& hashProofOfStake)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        if (nThreads <= 1 || vCandidates.size() <= STAKESEARCH_BATCH_SIZE)
+        {
+            lock.unlock();
+            return FindStakeKernel(vCandidates, nBitsIn, nTimeTxIn, nSearchIntervalIn, nTimeTxRet, hashProofOfStake);
+        }
+    }
+
+    boost::unique_lock<boost::mutex> lockSearch(csSearch);
+    boost::unique_lock<boost::mutex> lock(cs);
+    pvCandidates = &vCandidates;
+    nBits = nBitsIn;
+    nTimeTx = nTimeTxIn;
+    nSearchInterval = nSearchIntervalIn;
+    nNext = 0;
+    nBusy = 0;
+    nFound = -1;
+    condWork.notify_all();
+
+    // Lend a hand, then wait for the batches still out
+    while (SearchBatch(lock))
+        ;
+    while (nBusy > 0)
+        condDone.wait(lock);
+    pvCandidates = NULL;
+
+    if (nFound >= 0)
+    {
+        nTimeTxRet = nTimeTxFound;
+        hashProofOfStake = hashFound;
+    }
+    return nFound;
+}
+
+void CStakeSearchQueue::ThreadWorker()
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    while (!fShutdown)
+    {
+        if (!SearchBatch(lock))
+            condWork.timed_wait(lock, boost::posix_time::seconds(1));
+    }
+}
+
+void static ThreadStakeSearch(void* parg)
+{
+    RenameThread("litecoinplus-stakesearch");
+    try
+    {
+        vnThreadsRunning[THREAD_STAKESEARCH]++;
+        stakeSearchQueue.ThreadWorker();
+        vnThreadsRunning[THREAD_STAKESEARCH]--;
+    }
+    catch (std::exception& e) {
+        vnThreadsRunning[THREAD_STAKESEARCH]--;
+        PrintException(&e, "ThreadStakeSearch()");
+    } catch (...) {
+        vnThreadsRunning[THREAD_STAKESEARCH]--;
+        PrintException(NULL, "ThreadStakeSearch()");
+    }
+}
+
+void StartStakeSearchThreads(int nThreads)
+{
+    if (nThreads <= 0)
+        nThreads += boost::thread::hardware_concurrency();
+    if (nThreads > MAX_STAKESEARCH_THREADS)
+        nThreads = MAX_STAKESEARCH_THREADS;
+    if (nThreads <= 1)
+    {
+        printf("Stake search threads disabled, searching in the minter thread\n");
+        return;
+    }
+
+    // The minter thread searches along, so one worker fewer
+    printf("Using %d stake search threads\n", nThreads);
+    stakeSearchQueue.Start(nThreads);
+    for (int i = 0; i < nThreads - 1; i++)
+        if (!NewThread(ThreadStakeSearch, NULL))
+            printf("Error: NewThread(ThreadStakeSearch) failed\n");
+}
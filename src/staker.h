@@ -0,0 +1,161 @@
+// Copyright (c) 2012-2013 The PPCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef PPCOIN_STAKER_H
+#define PPCOIN_STAKER_H
+
+#include <map>
+#include <set>
+#include <vector>
+
+#include "main.h"
+
+#include <boost/thread/condition_variable.hpp>
+
+/** Maximum number of stake kernel search threads */
+static const int MAX_STAKESEARCH_THREADS = 16;
+/** Candidates a search thread takes at a time */
+static const unsigned int STAKESEARCH_BATCH_SIZE = 256;
+
+/** A wallet output that can be the kernel of a coinstake, with everything
+ * CheckStakeKernelHash needs to hash it already looked up.
+ *
+ * The kernel hash is taken over
+ *     nStakeModifier nTimeBlockFrom nTxPrevOffset nTimeTxPrev prevout.n nTimeTx
+ * and only the last field changes from one second to the next, so the first
+ * 24 bytes are serialized once and kept in vchKernel.
+ */
+class CStakeCandidate
+{
+public:
+    COutPoint prevout;
+    unsigned int nTimeBlockFrom;
+    unsigned int nTxPrevOffset;
+    unsigned int nTimeTxPrev;
+    int64 nValue;
+    uint64 nStakeModifier;
+
+    static const unsigned int KERNEL_PREFIX_SIZE = 8 + 4 + 4 + 4 + 4;
+
+    CStakeCandidate()
+    {
+        nTimeBlockFrom = 0;
+        nTxPrevOffset = 0;
+        nTimeTxPrev = 0;
+        nValue = 0;
+        nStakeModifier = 0;
+        memset(vchKernel, 0, sizeof(vchKernel));
+    }
+
+    CStakeCandidate(const COutPoint& prevoutIn, unsigned int nTimeBlockFromIn, unsigned int nTxPrevOffsetIn,
+                    unsigned int nTimeTxPrevIn, int64 nValueIn, uint64 nStakeModifierIn);
+
+    // Same as the hashProofOfStake CheckStakeKernelHash computes at nTimeTx
+    uint256 GetKernelHash(unsigned int nTimeTx) const;
+
+    // Hash target for this output at nTimeTx; zero if it is not old enough
+    CBigNum GetTarget(const CBigNum& bnTargetPerCoinDay, unsigned int nTimeTx) const;
+
+private:
+    unsigned char vchKernel[KERNEL_PREFIX_SIZE + 4];
+};
+
+/** Kernel candidates of a wallet, kept up to date as transactions come in
+ * and blocks connect, so the minter doesn't go to the disk every second.
+ *
+ * Outputs go into one flat vector.  Transactions that may have outputs to
+ * add, but that aren't in the main chain or mature yet, or whose stake
+ * modifier isn't known yet, wait in setPending for the next block.
+ *
+ * Guarded by the wallet's cs_wallet.
+ */
+class CStakeCandidateTable
+{
+private:
+    std::vector<CStakeCandidate> vCandidates;
+    std::map<COutPoint, unsigned int> mapIndex;
+
+public:
+    // Wallet transactions still to be looked at
+    std::set<uint256> setPending;
+    // Whether setPending has grown since the last update
+    bool fPendingChanged;
+    // Best block as of the last update; zero to rebuild the table
+    uint256 hashBestChain;
+
+    CStakeCandidateTable()
+    {
+        fPendingChanged = false;
+        hashBestChain = 0;
+    }
+
+    const std::vector<CStakeCandidate>& GetCandidates() const { return vCandidates; }
+    unsigned int size() const { return vCandidates.size(); }
+
+    // Add an output, or refresh it if it is already in
+    void Add(const CStakeCandidate& candidate);
+    void Remove(const COutPoint& prevout);
+    void AddPending(const uint256& hashTx);
+    void Clear();
+};
+
+// Look for a kernel among vCandidates[nBegin, nEnd) at nTimeTx and the
+// nSearchInterval - 1 seconds before it.  Returns the index of the first
+// candidate found and sets nTimeTxRet and hashProofOfStake, or returns -1.
+int FindStakeKernel(const std::vector<CStakeCandidate>& vCandidates, unsigned int nBits, unsigned int nTimeTx, unsigned int nSearchInterval, unsigned int& nTimeTxRet, uint256& hashProofOfStake,
+                    unsigned int nBegin = 0, unsigned int nEnd = std::numeric_limits<unsigned int>::max());
+
+/** Spreads FindStakeKernel over a pool of worker threads for wallets with
+ * many candidates.
+ *
+ * The candidates are handed out in batches of STAKESEARCH_BATCH_SIZE, in
+ * order, to the workers and to the thread that asked for the search.  The
+ * lowest index found wins, and no batch after it is started, so the result
+ * is always the one FindStakeKernel would give on the whole vector.
+ */
+class CStakeSearchQueue
+{
+private:
+    boost::mutex cs;
+    boost::condition_variable condWork;
+    boost::condition_variable condDone;
+    // Only one search runs at a time
+    boost::mutex csSearch;
+    int nThreads;
+
+    // The search being run; pvCandidates is NULL between searches
+    const std::vector<CStakeCandidate>* pvCandidates;
+    unsigned int nBits;
+    unsigned int nTimeTx;
+    unsigned int nSearchInterval;
+    // First candidate not handed out yet, and batches still being searched
+    unsigned int nNext;
+    int nBusy;
+    // Lowest index found so far, or -1
+    int nFound;
+    unsigned int nTimeTxFound;
+    uint256 hashFound;
+
+    // Search the next batch of the current search, if there is one worth it
+    bool SearchBatch(boost::unique_lock<boost::mutex>& lock);
+
+public:
+    CStakeSearchQueue();
+
+    // Size the pool for nThreadsIn workers; until this is called every
+    // search runs in line
+    void Start(int nThreadsIn);
+
+    // Same as FindStakeKernel on the whole vector
+    int Search(const std::vector<CStakeCandidate>& vCandidates, unsigned int nBitsIn, unsigned int nTimeTxIn, unsigned int nSearchIntervalIn, unsigned int& nTimeTxRet, uint256& hashProofOfStake);
+
+    void ThreadWorker();
+};
+
+extern CStakeSearchQueue stakeSearchQueue;
+
+// Start the workers: nThreads <= 0 means one per core less that many,
+// and fewer than two leaves the kernel search in the minter thread
+void StartStakeSearchThreads(int nThreads);
+
+#endif // PPCOIN_STAKER_H
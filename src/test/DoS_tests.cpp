@@ -16,10 +16,12 @@
 #include <stdint.h>
 
 // Tests this internal-to-main.cpp method:
-extern bool AddOrphanTx(const CDataStream& vMsg);
+extern bool AddOrphanTx(const CTransaction& tx, NodeId peer);
+extern void EraseOrphansFor(NodeId peer);
 extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
-extern std::map<uint256, CDataStream*> mapOrphanTransactions;
-extern std::map<uint256, std::map<uint256, CDataStream*> > mapOrphanTransactionsByPrev;
+extern std::map<uint256, COrphanTx> mapOrphanTransactions;
+extern std::map<COutPoint, std::set<uint256> > mapOrphanTransactionsByPrev;
+extern std::map<NodeId, unsigned int> mapOrphanTransactionsByPeer;
 
 CService ip(uint32_t i)
 {
@@ -134,13 +136,23 @@ BOOST_AUTO_TEST_CASE(DoS_checknbits)
 
 CTransaction RandomOrphan()
 {
-    std::map<uint256, CDataStream*>::iterator it;
+    std::map<uint256, COrphanTx>::iterator it;
     it = mapOrphanTransactions.lower_bound(GetRandHash());
     if (it == mapOrphanTransactions.end())
         it = mapOrphanTransactions.begin();
-    const CDataStream* pvMsg = it->second;
+    return it->second.tx;
+}
+
+// An orphan spending an output nobody has seen
+static CTransaction NewOrphan(const CKey& key)
+{
     CTransaction tx;
-    CDataStream(*pvMsg) >> tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.n = 0;
+    tx.vin[0].prevout.hash = GetRandHash();
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 1*CENT;
+    tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
     return tx;
 }
 
@@ -163,9 +175,7 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].nValue = 1*CENT;
         tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
 
-        CDataStream ds(SER_DISK, CLIENT_VERSION);
-        ds << tx;
-        AddOrphanTx(ds);
+        AddOrphanTx(tx, i);
     }
 
     // ... and 50 that depend on other orphans:
@@ -182,9 +192,7 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
         SignSignature(keystore, txPrev, tx, 0);
 
-        CDataStream ds(SER_DISK, CLIENT_VERSION);
-        ds << tx;
-        AddOrphanTx(ds);
+        AddOrphanTx(tx, i);
     }
 
     // This really-big orphan should be ignored:
@@ -208,9 +216,15 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         for (unsigned int j = 1; j < tx.vin.size(); j++)
             tx.vin[j].scriptSig = tx.vin[0].scriptSig;
 
-        CDataStream ds(SER_DISK, CLIENT_VERSION);
-        ds << tx;
-        BOOST_CHECK(!AddOrphanTx(ds));
+        BOOST_CHECK(!AddOrphanTx(tx, i));
+    }
+
+    // Test EraseOrphansFor():
+    for (NodeId i = 0; i < 3; i++)
+    {
+        size_t sizeBefore = mapOrphanTransactions.size();
+        EraseOrphansFor(i);
+        BOOST_CHECK(mapOrphanTransactions.size() < sizeBefore);
     }
 
     // Test LimitOrphanTxSize() function:
@@ -221,6 +235,120 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
     LimitOrphanTxSize(0);
     BOOST_CHECK(mapOrphanTransactions.empty());
     BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+
+    BOOST_CHECK(mapOrphanTransactionsByPeer.empty());
+
+    // A single peer can't fill the pool on its own:
+    for (unsigned int i = 0; i < MAX_ORPHAN_TRANSACTIONS_PER_PEER + 10; i++)
+        BOOST_CHECK(AddOrphanTx(NewOrphan(key), 1) == (i < MAX_ORPHAN_TRANSACTIONS_PER_PEER));
+    BOOST_CHECK(mapOrphanTransactions.size() == MAX_ORPHAN_TRANSACTIONS_PER_PEER);
+    BOOST_CHECK(mapOrphanTransactionsByPeer[1] == MAX_ORPHAN_TRANSACTIONS_PER_PEER);
+
+    // ... and other peers still get theirs in
+    BOOST_CHECK(AddOrphanTx(NewOrphan(key), 2));
+    BOOST_CHECK(mapOrphanTransactionsByPeer[2] == 1);
+
+    // Rejected orphans leave no trace of their peer
+    BOOST_CHECK(!AddOrphanTx(RandomOrphan(), 3));
+    BOOST_CHECK(!mapOrphanTransactionsByPeer.count(3));
+
+    EraseOrphansFor(1);
+    EraseOrphansFor(2);
+    BOOST_CHECK(mapOrphanTransactions.empty());
+    BOOST_CHECK(mapOrphanTransactionsByPeer.empty());
+}
+
+BOOST_AUTO_TEST_CASE(DoS_mapOrphansExpire)
+{
+    CKey key;
+    key.MakeNewKey(true);
+
+    int64 nStartTime = GetTime();
+    SetMockTime(nStartTime);
+    for (int i = 0; i < 10; i++)
+        BOOST_CHECK(AddOrphanTx(NewOrphan(key), i));
+
+    // Later orphans outlive the first ones
+    SetMockTime(nStartTime + ORPHAN_TX_EXPIRE_TIME / 2);
+    for (int i = 0; i < 5; i++)
+        BOOST_CHECK(AddOrphanTx(NewOrphan(key), i));
+
+    // Nothing is due yet, and the pool is within bounds
+    BOOST_CHECK(LimitOrphanTxSize(100) == 0);
+    BOOST_CHECK(mapOrphanTransactions.size() == 15);
+
+    // The first ten expire, whatever room there is
+    SetMockTime(nStartTime + ORPHAN_TX_EXPIRE_TIME);
+    BOOST_CHECK(LimitOrphanTxSize(100) == 10);
+    BOOST_CHECK(mapOrphanTransactions.size() == 5);
+    BOOST_CHECK(mapOrphanTransactionsByPeer.size() == 5);
+
+    // Then the rest
+    SetMockTime(nStartTime + ORPHAN_TX_EXPIRE_TIME * 3 / 2);
+    BOOST_CHECK(LimitOrphanTxSize(100) == 5);
+    BOOST_CHECK(mapOrphanTransactions.empty());
+    BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    BOOST_CHECK(mapOrphanTransactionsByPeer.empty());
+
+    SetMockTime(0);
+}
+
+static CBlock OrphanBlock(const uint256& hashPrev, unsigned int nPadding)
+{
+    CBlock block;
+    block.hashPrevBlock = hashPrev;
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.SetNull();
+    tx.vin[0].scriptSig << std::vector<unsigned char>(nPadding);
+    tx.vout.resize(1);
+    block.vtx.push_back(tx);
+    return block;
+}
+
+BOOST_AUTO_TEST_CASE(DoS_orphanBlocks)
+{
+    COrphanBlockPool pool;
+    pool.SetLimits(4 * MAX_BLOCK_SIZE, 0);
+    COrphanBlockStats stats;
+
+    // A single peer is held to its quota
+    for (int i = 0; i < 20; i++)
+        BOOST_CHECK(pool.Add(GetRandHash(), OrphanBlock(GetRandHash(), MAX_BLOCK_SIZE / 10), 1));
+    pool.GetStats(stats);
+    BOOST_CHECK(stats.nBytes <= stats.nMaxPeerBytes);
+    BOOST_CHECK(stats.nOrphans < 10);
+    BOOST_CHECK(stats.nEvicted > 10);
+
+    // Many peers are held to the total budget
+    for (int nPeer = 2; nPeer < 10; nPeer++)
+        for (int i = 0; i < 9; i++)
+            BOOST_CHECK(pool.Add(GetRandHash(), OrphanBlock(GetRandHash(), MAX_BLOCK_SIZE / 10), nPeer));
+    pool.GetStats(stats);
+    BOOST_CHECK(stats.nBytes <= stats.nMaxBytes);
+
+    // Chains are walked by cached hash, and children come back out
+    uint256 hashWanted = GetRandHash();
+    uint256 hash1 = GetRandHash(), hash2 = GetRandHash(), hash3 = GetRandHash();
+    BOOST_CHECK(pool.Add(hash1, OrphanBlock(hashWanted, 10), -1));
+    BOOST_CHECK(pool.Add(hash2, OrphanBlock(hash1, 10), -1));
+    BOOST_CHECK(pool.Add(hash3, OrphanBlock(hash1, 10), -1));
+    BOOST_CHECK(!pool.Add(hash3, OrphanBlock(hash1, 10), -1));
+    BOOST_CHECK(pool.GetRoot(hash2) == hash1);
+    BOOST_CHECK(pool.GetWanted(hash3) == hashWanted);
+    BOOST_CHECK(pool.HaveChildren(hash1));
+
+    std::vector<std::pair<uint256, CBlock*> > vChildren;
+    pool.TakeChildren(hash1, vChildren);
+    BOOST_CHECK(vChildren.size() == 2);
+    for (unsigned int i = 0; i < vChildren.size(); i++)
+    {
+        BOOST_CHECK(vChildren[i].second->hashPrevBlock == hash1);
+        BOOST_CHECK(!pool.Have(vChildren[i].first));
+        delete vChildren[i].second;
+    }
+    BOOST_CHECK(!pool.HaveChildren(hash1));
+    BOOST_CHECK(pool.Have(hash1));
 }
 
 BOOST_AUTO_TEST_CASE(DoS_checkSig)
@@ -246,9 +374,7 @@ BOOST_AUTO_TEST_CASE(DoS_checkSig)
         tx.vout[0].nValue = 1*CENT;
         tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
 
-        CDataStream ds(SER_DISK, CLIENT_VERSION);
-        ds << tx;
-        AddOrphanTx(ds);
+        AddOrphanTx(tx, 0);
     }
 
     // Create a transaction that depends on orphans:
@@ -0,0 +1,114 @@
+#include <boost/test/unit_test.hpp>
+
+#include "bloom.h"
+#include "net.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(bloom_tests)
+
+BOOST_AUTO_TEST_CASE(rolling_bloom)
+{
+    // last-100-entry, 1% false positive
+    CRollingBloomFilter rb(100, 0.01);
+
+    // Overfill
+    static const int DATASIZE = 399;
+    vector<uint256> data(DATASIZE);
+    for (int i = 0; i < DATASIZE; i++)
+    {
+        data[i] = GetRandHash();
+        rb.insert(data[i]);
+    }
+
+    // Last 100 guaranteed to be remembered
+    for (int i = 299; i < DATASIZE; i++)
+        BOOST_CHECK(rb.contains(data[i]));
+
+    // false positive rate is 1%, so we should get about 100 hits when
+    // testing 10,000 random keys. We get worst-case false positive
+    // behavior when the filter is as full as possible, which is
+    // when we've inserted one minus an integer multiple of nElement*2.
+    unsigned int nHits = 0;
+    for (int i = 0; i < 10000; i++)
+        if (rb.contains(GetRandHash()))
+            ++nHits;
+    BOOST_CHECK(nHits < 175);
+
+    // After a reset only false positives are left
+    rb.reset();
+    nHits = 0;
+    for (int i = 0; i < DATASIZE; i++)
+        if (rb.contains(data[i]))
+            ++nHits;
+    BOOST_CHECK(nHits < 20);
+
+    // Now roll through data, make sure last 100 entries
+    // are always remembered
+    for (int i = 0; i < DATASIZE; i++)
+    {
+        if (i >= 100)
+            BOOST_CHECK(rb.contains(data[i - 100]));
+        rb.insert(data[i]);
+        BOOST_CHECK(rb.contains(data[i]));
+    }
+
+    // Insert 999 more random entries
+    for (int i = 0; i < 999; i++)
+        rb.insert(GetRandHash());
+    // Sanity check to make sure the filter isn't just filling up
+    nHits = 0;
+    for (int i = 0; i < DATASIZE; i++)
+        if (rb.contains(data[i]))
+            ++nHits;
+    // Expect about 5 false positives, more than 100 means
+    // something is definitely broken.
+    BOOST_CHECK(nHits < 100);
+}
+
+BOOST_AUTO_TEST_CASE(rolling_bloom_memory)
+{
+    // Memory doesn't grow with what goes in
+    CRollingBloomFilter rb(1000, 0.000001);
+    unsigned int nMemory = rb.GetMemoryUsage();
+    BOOST_CHECK(nMemory > 0);
+    for (int i = 0; i < 10000; i++)
+        rb.insert(GetRandHash());
+    BOOST_CHECK_EQUAL(rb.GetMemoryUsage(), nMemory);
+
+    vector<unsigned char> vKey;
+    BOOST_CHECK(!rb.contains(vKey));
+    rb.insert(vKey);
+    BOOST_CHECK(rb.contains(vKey));
+}
+
+BOOST_AUTO_TEST_CASE(mrufilter_inventory)
+{
+    mrufilter<CInv> setKnown(100);
+    CInv inv(MSG_TX, GetRandHash());
+    BOOST_CHECK_EQUAL(setKnown.count(inv), 0U);
+    BOOST_CHECK(setKnown.insert(inv).second);
+    BOOST_CHECK(!setKnown.insert(inv).second);
+    BOOST_CHECK_EQUAL(setKnown.count(inv), 1U);
+
+    // Same hash, other type
+    BOOST_CHECK_EQUAL(setKnown.count(CInv(MSG_BLOCK, inv.hash)), 0U);
+
+    // Pushed out by newer ones
+    for (int i = 0; i < 1000; i++)
+        setKnown.insert(CInv(MSG_TX, GetRandHash()));
+    BOOST_CHECK_EQUAL(setKnown.count(inv), 0U);
+
+    setKnown.insert(inv);
+    setKnown.clear();
+    BOOST_CHECK_EQUAL(setKnown.count(inv), 0U);
+
+    BOOST_CHECK_EQUAL(setKnown.max_size(), 100U);
+    setKnown.insert(inv);
+    setKnown.max_size(200);
+    BOOST_CHECK_EQUAL(setKnown.max_size(), 200U);
+    BOOST_CHECK_EQUAL(setKnown.count(inv), 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
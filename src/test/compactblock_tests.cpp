@@ -0,0 +1,132 @@
+#include <boost/test/unit_test.hpp>
+
+#include "compactblock.h"
+
+using namespace std;
+
+// A block with a coinbase and nTx - 1 distinct spends
+static CBlock MakeBlock(unsigned int nTx)
+{
+    CBlock block;
+    block.nBits = 0x1d00ffff;
+    block.nTime = 1400000000;
+    for (unsigned int i = 0; i < nTx; i++)
+    {
+        CTransaction tx;
+        tx.vin.resize(1);
+        tx.vout.resize(1);
+        if (i == 0)
+            tx.vin[0].scriptSig = CScript() << OP_0 << OP_1;
+        else
+            tx.vin[0].prevout = COutPoint(GetRandHash(), i);
+        tx.vout[0].nValue = i * CENT;
+        tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+        block.vtx.push_back(tx);
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+// Send through the wire format, as the receiver would see it
+static CBlockHeaderAndShortTxIDs RoundTrip(const CBlockHeaderAndShortTxIDs& cmpctblock)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << cmpctblock;
+    CBlockHeaderAndShortTxIDs ret;
+    ss >> ret;
+    return ret;
+}
+
+BOOST_AUTO_TEST_SUITE(compactblock_tests)
+
+BOOST_AUTO_TEST_CASE(compactblock_from_mempool)
+{
+    CBlock block = MakeBlock(5);
+    CTxMemPool pool;
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        pool.addUnchecked(block.vtx[i].GetHash(), block.vtx[i]);
+
+    CBlockHeaderAndShortTxIDs cmpctblock = RoundTrip(CBlockHeaderAndShortTxIDs(block));
+    BOOST_CHECK_EQUAL(cmpctblock.vPrefilledTxn.size(), 1U);
+    BOOST_CHECK_EQUAL(cmpctblock.vShortTxIDs.size(), 4U);
+
+    CPartialBlock partial;
+    BOOST_CHECK_EQUAL(partial.Init(cmpctblock, pool), 0);
+    BOOST_CHECK(partial.GetHash() == block.GetHash());
+
+    CBlock rebuilt;
+    BOOST_CHECK(partial.GetBlock(rebuilt));
+    BOOST_CHECK(rebuilt.GetHash() == block.GetHash());
+    BOOST_CHECK_EQUAL(rebuilt.vtx.size(), block.vtx.size());
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+        BOOST_CHECK(rebuilt.vtx[i].GetHash() == block.vtx[i].GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(compactblock_missing)
+{
+    CBlock block = MakeBlock(6);
+    CTxMemPool pool;
+    pool.addUnchecked(block.vtx[1].GetHash(), block.vtx[1]);
+    pool.addUnchecked(block.vtx[4].GetHash(), block.vtx[4]);
+
+    CPartialBlock partial;
+    BOOST_CHECK_EQUAL(partial.Init(RoundTrip(CBlockHeaderAndShortTxIDs(block)), pool), 3);
+
+    CBlockTransactionsRequest req;
+    partial.GetMissing(req);
+    BOOST_CHECK(req.hashBlock == block.GetHash());
+    BOOST_CHECK_EQUAL(req.vIndexes.size(), 3U);
+    BOOST_CHECK_EQUAL(req.vIndexes[0], 2U);
+    BOOST_CHECK_EQUAL(req.vIndexes[1], 3U);
+    BOOST_CHECK_EQUAL(req.vIndexes[2], 5U);
+
+    CBlock rebuilt;
+    BOOST_CHECK(!partial.GetBlock(rebuilt));
+
+    // Too few transactions back doesn't fit
+    vector<CTransaction> vtx;
+    vtx.push_back(block.vtx[2]);
+    vtx.push_back(block.vtx[3]);
+    CPartialBlock partialShort = partial;
+    BOOST_CHECK(!partialShort.FillMissing(vtx));
+
+    vtx.push_back(block.vtx[5]);
+    BOOST_CHECK(partial.FillMissing(vtx));
+    BOOST_CHECK(partial.GetBlock(rebuilt));
+    BOOST_CHECK(rebuilt.GetHash() == block.GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(compactblock_wrong_tx)
+{
+    CBlock block = MakeBlock(3);
+    CBlock other = MakeBlock(3);
+    CTxMemPool pool;
+
+    CPartialBlock partial;
+    BOOST_CHECK_EQUAL(partial.Init(CBlockHeaderAndShortTxIDs(block), pool), 2);
+
+    // Transactions that aren't the block's give the wrong merkle root
+    vector<CTransaction> vtx;
+    vtx.push_back(other.vtx[1]);
+    vtx.push_back(other.vtx[2]);
+    BOOST_CHECK(partial.FillMissing(vtx));
+    CBlock rebuilt;
+    BOOST_CHECK(!partial.GetBlock(rebuilt));
+}
+
+BOOST_AUTO_TEST_CASE(compactblock_malformed)
+{
+    CBlock block = MakeBlock(3);
+    CTxMemPool pool;
+
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+    cmpctblock.vPrefilledTxn[0].nIndex = 3;
+    CPartialBlock partial;
+    BOOST_CHECK_EQUAL(partial.Init(cmpctblock, pool), -1);
+
+    CBlockHeaderAndShortTxIDs cmpctblockDup(block);
+    cmpctblockDup.vShortTxIDs[1] = cmpctblockDup.vShortTxIDs[0];
+    BOOST_CHECK_EQUAL(partial.Init(cmpctblockDup, pool), -1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
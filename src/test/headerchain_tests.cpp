@@ -0,0 +1,186 @@
+#include <boost/test/unit_test.hpp>
+
+#include "headerchain.h"
+
+using namespace std;
+
+// A proof-of-stake header on top of pindexPrev that passes everything that
+// can be checked without its block
+static CHeaderEntry StakeHeader(const CBlockIndex* pindexPrev, unsigned int nTime)
+{
+    CHeaderEntry entry;
+    entry.hashPrevBlock = pindexPrev->GetBlockHash();
+    entry.nTime = nTime;
+    entry.nBits = GetNextTargetRequired(pindexPrev, true);
+    entry.nFlags = CBlockIndex::BLOCK_PROOF_OF_STAKE;
+    entry.hashProofOfStake = GetRandHash();
+    return entry;
+}
+
+BOOST_AUTO_TEST_SUITE(headerchain_tests)
+
+BOOST_AUTO_TEST_CASE(skiplist_ancestor)
+{
+    vector<uint256> vHashes(10000);
+    vector<CBlockIndex> vIndex(10000);
+
+    for (unsigned int i = 0; i < vIndex.size(); i++)
+    {
+        vHashes[i] = i;
+        vIndex[i].nHeight = i;
+        vIndex[i].pprev = (i == 0) ? NULL : &vIndex[i - 1];
+        vIndex[i].phashBlock = &vHashes[i];
+        vIndex[i].BuildSkip();
+    }
+
+    for (unsigned int i = 0; i < vIndex.size(); i++)
+    {
+        if (i > 0)
+        {
+            BOOST_CHECK(vIndex[i].pskip == &vIndex[vIndex[i].pskip->nHeight]);
+            BOOST_CHECK(vIndex[i].pskip->nHeight < (int)i);
+        }
+        else
+            BOOST_CHECK(vIndex[i].pskip == NULL);
+    }
+
+    for (int i = 0; i < 1000; i++)
+    {
+        int nFrom = GetRand(vIndex.size());
+        int nTo = GetRand(nFrom + 1);
+        BOOST_CHECK(vIndex[nFrom].GetAncestor(nTo) == &vIndex[nTo]);
+        BOOST_CHECK(vIndex[nFrom].GetAncestor(nFrom) == &vIndex[nFrom]);
+        BOOST_CHECK(vIndex[nFrom].GetAncestor(nFrom + 1) == NULL);
+        BOOST_CHECK(vIndex[nFrom].GetAncestor(-1) == NULL);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(headerentry_serialize)
+{
+    uint256 hashPrev = GetRandHash();
+    uint256 hash = GetRandHash();
+    CBlockIndex indexPrev;
+    indexPrev.phashBlock = &hashPrev;
+    CBlockIndex index;
+    index.phashBlock = &hash;
+    index.pprev = &indexPrev;
+    index.nVersion = 6;
+    index.hashMerkleRoot = GetRandHash();
+    index.nTime = 1400000000;
+    index.nBits = 0x1d00ffff;
+    index.nNonce = 12345;
+    index.SetProofOfStake();
+    index.hashProofOfStake = GetRandHash();
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CHeaderEntry(&index);
+    CHeaderEntry entry;
+    ss >> entry;
+
+    BOOST_CHECK_EQUAL(entry.nVersion, 6);
+    BOOST_CHECK(entry.hashPrevBlock == hashPrev);
+    BOOST_CHECK(entry.hashMerkleRoot == index.hashMerkleRoot);
+    BOOST_CHECK_EQUAL(entry.nTime, index.nTime);
+    BOOST_CHECK_EQUAL(entry.nBits, index.nBits);
+    BOOST_CHECK_EQUAL(entry.nNonce, index.nNonce);
+    BOOST_CHECK(entry.IsProofOfStake());
+    BOOST_CHECK(entry.hashProofOfStake == index.hashProofOfStake);
+
+    CBlock header = entry.GetBlockHeader();
+    BOOST_CHECK(header.hashPrevBlock == hashPrev);
+    BOOST_CHECK(header.vtx.empty());
+}
+
+BOOST_AUTO_TEST_CASE(headerindex_unconnected)
+{
+    LOCK(cs_main);
+    CHeaderIndex index;
+    CHeaderEntry entry;
+    entry.hashPrevBlock = GetRandHash();
+    uint256 hash = GetRandHash();
+
+    // Not the sender's fault: we may just be missing the headers before it
+    CBlockIndex* pindex = NULL;
+    int nDoS = 0;
+    BOOST_CHECK(!index.Accept(entry, hash, 0, pindex, nDoS));
+    BOOST_CHECK_EQUAL(nDoS, 0);
+    BOOST_CHECK(pindex == NULL);
+    BOOST_CHECK(index.Lookup(hash) == NULL);
+    BOOST_CHECK_EQUAL(index.size(), 0U);
+    BOOST_CHECK(index.Take(hash) == NULL);
+}
+
+BOOST_AUTO_TEST_CASE(headerindex_untrusted)
+{
+    LOCK(cs_main);
+    CHeaderIndex index;
+    vector<uint256> vHashes(MAX_UNTRUSTED_HEADERS_AHEAD + 1);
+    int64 nTimeStart = GetAdjustedTime() - vHashes.size();
+
+    // Proof-of-stake headers past the last checkpoint are taken, but don't
+    // become the best header
+    CBlockIndex* pindexLast = pindexBest;
+    for (unsigned int i = 0; i < vHashes.size(); i++)
+    {
+        CHeaderEntry entry = StakeHeader(pindexLast, nTimeStart + i);
+        vHashes[i] = GetRandHash();
+        CBlockIndex* pindex = NULL;
+        int nDoS = 0;
+        bool fAccepted = index.Accept(entry, vHashes[i], 1, pindex, nDoS);
+        BOOST_CHECK_EQUAL(nDoS, 0);
+        if (pindexLast->nHeight + 1 > nBestHeight + MAX_UNTRUSTED_HEADERS_AHEAD)
+        {
+            // No further than this ahead of our blocks
+            BOOST_CHECK(!fAccepted);
+            BOOST_CHECK(pindex == NULL);
+            break;
+        }
+        BOOST_CHECK(fAccepted);
+        BOOST_CHECK(index.IsUntrusted(pindex));
+        pindexLast = pindex;
+    }
+    BOOST_CHECK_EQUAL(pindexLast->nHeight, nBestHeight + MAX_UNTRUSTED_HEADERS_AHEAD);
+    BOOST_CHECK_EQUAL(index.size(), (unsigned int)MAX_UNTRUSTED_HEADERS_AHEAD);
+    BOOST_CHECK(index.GetBest() == pindexBest);
+
+    // They all build on our best block, so none is pruned
+    vector<CBlockIndex*> vPruned;
+    index.Prune(vPruned);
+    BOOST_CHECK(vPruned.empty());
+
+    BOOST_FOREACH(const uint256& hash, vHashes)
+        delete index.Take(hash);
+    BOOST_CHECK_EQUAL(index.size(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(assumevalid_header_only)
+{
+    LOCK(cs_main);
+    int64 nTimeStart = GetAdjustedTime() - 60;
+    uint256 hash1 = GetRandHash(), hash2 = GetRandHash(), hashFork = GetRandHash();
+    CBlockIndex* pindex1 = NULL;
+    CBlockIndex* pindex2 = NULL;
+    CBlockIndex* pindexFork = NULL;
+    int nDoS = 0;
+    BOOST_CHECK(headerIndex.Accept(StakeHeader(pindexBest, nTimeStart), hash1, 0, pindex1, nDoS));
+    BOOST_CHECK(headerIndex.Accept(StakeHeader(pindex1, nTimeStart + 1), hash2, 0, pindex2, nDoS));
+    BOOST_CHECK(headerIndex.Accept(StakeHeader(pindexBest, nTimeStart + 2), hashFork, 0, pindexFork, nDoS));
+
+    // The blocks under the assumevalid header skip their script checks
+    // before its own block, or theirs, is connected
+    BOOST_CHECK(!IsAssumedValid(pindex1));
+    hashAssumeValid = hash2;
+    BOOST_CHECK(headerIndex.IsHeaderOnly(pindex1));
+    BOOST_CHECK(IsAssumedValid(pindex1));
+    BOOST_CHECK(IsAssumedValid(pindex2));
+    BOOST_CHECK(IsAssumedValid(pindexBest));
+    BOOST_CHECK(!IsAssumedValid(pindexFork));
+
+    hashAssumeValid = 0;
+    BOOST_CHECK(!IsAssumedValid(pindex1));
+    delete headerIndex.Take(hash2);
+    delete headerIndex.Take(hash1);
+    delete headerIndex.Take(hashFork);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
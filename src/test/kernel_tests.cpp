@@ -0,0 +1,90 @@
+#include <boost/test/unit_test.hpp>
+
+#include "kernel.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(kernel_tests)
+
+// GetKernelStakeModifier as it was, one block at a time along pnext
+static bool WalkStakeModifier(const CBlockIndex* pindexFrom, int64 nSelectionInterval, uint64& nStakeModifier)
+{
+    int64 nStakeModifierTime = pindexFrom->GetBlockTime();
+    const CBlockIndex* pindex = pindexFrom;
+    while (nStakeModifierTime < pindexFrom->GetBlockTime() + nSelectionInterval)
+    {
+        if (!pindex->pnext)
+            return false;
+        pindex = pindex->pnext;
+        if (pindex->GeneratedStakeModifier())
+            nStakeModifierTime = pindex->GetBlockTime();
+    }
+    nStakeModifier = pindex->nStakeModifier;
+    return true;
+}
+
+static void CheckStakeModifiers(const vector<CBlockIndex>& vIndex, int nBest, int64 nSelectionInterval)
+{
+    for (int i = 0; i <= nBest; i++)
+    {
+        uint64 nExpected = 0;
+        bool fExpected = WalkStakeModifier(&vIndex[i], nSelectionInterval, nExpected);
+        uint64 nStakeModifier = 0;
+        int nStakeModifierHeight = 0;
+        int64 nStakeModifierTime = 0;
+        bool fFound = GetKernelStakeModifier(vIndex[i].GetBlockHash(), nStakeModifier, nStakeModifierHeight, nStakeModifierTime, false);
+        BOOST_CHECK_EQUAL(fFound, fExpected);
+        if (fFound && fExpected)
+            BOOST_CHECK_EQUAL(nStakeModifier, nExpected);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(stake_modifier_index)
+{
+    LOCK(cs_main);
+    CBlockIndex* pindexBestSaved = pindexBest;
+    CBlockIndex* pindexGenesisSaved = pindexGenesisBlock;
+
+    vector<uint256> vHashes(2000);
+    vector<CBlockIndex> vIndex(2000);
+    for (unsigned int i = 0; i < vIndex.size(); i++)
+    {
+        vHashes[i] = GetRandHash();
+        vIndex[i].phashBlock = &vHashes[i];
+        vIndex[i].nHeight = i;
+        vIndex[i].pprev = (i == 0) ? NULL : &vIndex[i - 1];
+        // Block times are not always in order
+        vIndex[i].nTime = 1400000000 + i * 120 + GetRand(1200);
+        vIndex[i].SetStakeModifier(GetRandHash().Get64(), i == 0 || GetRand(4) == 0);
+        mapBlockIndex[vHashes[i]] = &vIndex[i];
+    }
+    for (unsigned int i = 0; i + 1 < vIndex.size(); i++)
+        vIndex[i].pnext = &vIndex[i + 1];
+    pindexGenesisBlock = &vIndex[0];
+    pindexBest = &vIndex.back();
+
+    int64 nSelectionInterval = GetStakeModifierSelectionInterval();
+    CheckStakeModifiers(vIndex, vIndex.size() - 1, nSelectionInterval);
+
+    // Disconnect the last blocks, as Reorganize does, then connect some back
+    for (unsigned int i = 1699; i < vIndex.size(); i++)
+        vIndex[i].pnext = NULL;
+    pindexBest = &vIndex[1699];
+    CheckStakeModifiers(vIndex, 1699, nSelectionInterval);
+    for (unsigned int i = 1699; i < 1849; i++)
+        vIndex[i].pnext = &vIndex[i + 1];
+    pindexBest = &vIndex[1849];
+    CheckStakeModifiers(vIndex, 1849, nSelectionInterval);
+
+    // Put the real chain back
+    for (unsigned int i = 0; i < vIndex.size(); i++)
+    {
+        vIndex[i].pnext = NULL;
+        mapBlockIndex.erase(vHashes[i]);
+    }
+    pindexBest = pindexBestSaved;
+    pindexGenesisBlock = pindexGenesisSaved;
+    UpdateStakeModifierIndex();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
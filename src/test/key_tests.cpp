@@ -144,4 +144,41 @@ BOOST_AUTO_TEST_CASE(key_test1)
     }
 }
 
+BOOST_AUTO_TEST_CASE(key_extract_secret)
+{
+    for (int i = 0; i < 32; i++)
+    {
+        CKey key;
+        key.MakeNewKey(i % 2 == 0);
+        bool fCompressed;
+        CSecret secret;
+        BOOST_CHECK(CKey::ExtractSecret(key.GetPrivKey(), secret));
+        BOOST_CHECK(secret == key.GetSecret(fCompressed));
+    }
+
+    CPrivKey vchBad(10, 0x30);
+    CSecret secret;
+    BOOST_CHECK(!CKey::ExtractSecret(vchBad, secret));
+    BOOST_CHECK(!CKey::ExtractSecret(CPrivKey(), secret));
+}
+
+BOOST_AUTO_TEST_CASE(keystore_unverified)
+{
+    CKey key, keyOther;
+    key.MakeNewKey(true);
+    keyOther.MakeNewKey(true);
+    bool fCompressed;
+
+    CBasicKeyStore keystore;
+    BOOST_CHECK(keystore.AddKeyUnverified(key.GetPubKey(), key.GetSecret(fCompressed)));
+    CKey keyOut;
+    BOOST_CHECK(keystore.GetKey(key.GetPubKey().GetID(), keyOut));
+    BOOST_CHECK(keyOut.GetPubKey() == key.GetPubKey());
+
+    // A secret that isn't the public key's is caught when the key is used
+    BOOST_CHECK(keystore.AddKeyUnverified(keyOther.GetPubKey(), key.GetSecret(fCompressed)));
+    BOOST_CHECK(keystore.HaveKey(keyOther.GetPubKey().GetID()));
+    BOOST_CHECK(!keystore.GetKey(keyOther.GetPubKey().GetID(), keyOut));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -198,6 +198,31 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     pindexBest->nHeight = nHeight;
 }
 
+BOOST_AUTO_TEST_CASE(coinbase_merkle_update)
+{
+    CBlock block;
+    for (unsigned int i = 0; i < 11; i++)
+    {
+        CTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].scriptSig = CScript() << i;
+        tx.vout.resize(1);
+        tx.vout[0].nValue = i;
+        block.vtx.push_back(tx);
+
+        block.BuildMerkleTree();
+        block.vtx[0].vout[0].nValue++;
+        uint256 hashUpdated = block.UpdateMerkleTreeCoinbase();
+        std::vector<uint256> vMerkleUpdated = block.vMerkleTree;
+        BOOST_CHECK(hashUpdated == block.BuildMerkleTree());
+        BOOST_CHECK(vMerkleUpdated == block.vMerkleTree);
+    }
+
+    // A tree that does not match the transaction list is rebuilt in full
+    block.vMerkleTree.clear();
+    BOOST_CHECK(block.UpdateMerkleTreeCoinbase() == block.BuildMerkleTree());
+}
+
 BOOST_AUTO_TEST_CASE(sha256transform_equality)
 {
     unsigned int pSHA256InitState[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
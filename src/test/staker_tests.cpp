@@ -0,0 +1,115 @@
+#include <boost/test/unit_test.hpp>
+
+#include "staker.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(staker_tests)
+
+BOOST_AUTO_TEST_CASE(candidate_kernel_hash)
+{
+    for (int i = 0; i < 100; i++)
+    {
+        COutPoint prevout(GetRandHash(), GetRand(20));
+        uint64 nStakeModifier = GetRand(std::numeric_limits<uint64>::max());
+        unsigned int nTimeBlockFrom = 1400000000 + GetRand(100000000);
+        unsigned int nTxPrevOffset = 81 + GetRand(100000);
+        unsigned int nTimeTxPrev = nTimeBlockFrom - GetRand(7200);
+        unsigned int nTimeTx = nTimeBlockFrom + GetRand(100000000);
+        CStakeCandidate candidate(prevout, nTimeBlockFrom, nTxPrevOffset, nTimeTxPrev, COIN, nStakeModifier);
+
+        // As CheckStakeKernelHash puts it together
+        CDataStream ss(SER_GETHASH, 0);
+        ss << nStakeModifier;
+        ss << nTimeBlockFrom << nTxPrevOffset << nTimeTxPrev << prevout.n << nTimeTx;
+        BOOST_CHECK(candidate.GetKernelHash(nTimeTx) == Hash(ss.begin(), ss.end()));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(candidate_table)
+{
+    CStakeCandidateTable table;
+    vector<COutPoint> vPrevout;
+    for (int i = 0; i < 10; i++)
+    {
+        vPrevout.push_back(COutPoint(GetRandHash(), i));
+        table.Add(CStakeCandidate(vPrevout.back(), 1400000000, 81, 1400000000, i * COIN, 0));
+    }
+    BOOST_CHECK_EQUAL(table.size(), 10U);
+
+    // Adding again refreshes the entry
+    table.Add(CStakeCandidate(vPrevout[3], 1400000000, 81, 1400000000, 42 * COIN, 0));
+    BOOST_CHECK_EQUAL(table.size(), 10U);
+
+    table.Remove(vPrevout[0]);
+    table.Remove(vPrevout[9]);
+    table.Remove(vPrevout[9]);
+    BOOST_CHECK_EQUAL(table.size(), 8U);
+
+    set<COutPoint> setLeft;
+    BOOST_FOREACH(const CStakeCandidate& candidate, table.GetCandidates())
+    {
+        setLeft.insert(candidate.prevout);
+        if (candidate.prevout == vPrevout[3])
+            BOOST_CHECK_EQUAL(candidate.nValue, 42 * COIN);
+    }
+    BOOST_CHECK_EQUAL(setLeft.size(), 8U);
+    BOOST_CHECK(!setLeft.count(vPrevout[0]));
+    BOOST_CHECK(!setLeft.count(vPrevout[9]));
+
+    table.AddPending(vPrevout[1].hash);
+    BOOST_CHECK(table.fPendingChanged);
+    table.Clear();
+    BOOST_CHECK_EQUAL(table.size(), 0U);
+    BOOST_CHECK(table.setPending.empty());
+}
+
+BOOST_AUTO_TEST_CASE(find_kernel)
+{
+    unsigned int nTimeTx = 1400000000;
+    vector<CStakeCandidate> vCandidates;
+
+    // Too young to stake
+    vCandidates.push_back(CStakeCandidate(COutPoint(GetRandHash(), 0), nTimeTx - nStakeMinAge + 10, 81, nTimeTx - nStakeMinAge, 1000 * COIN, 1));
+    unsigned int nTimeTxRet = 0;
+    uint256 hashProofOfStake = 0;
+    BOOST_CHECK_EQUAL(FindStakeKernel(vCandidates, 0x207fffff, nTimeTx, 60, nTimeTxRet, hashProofOfStake), -1);
+
+    // Old enough, and the easiest target there is
+    vCandidates.push_back(CStakeCandidate(COutPoint(GetRandHash(), 1), nTimeTx - 30 * 24 * 60 * 60, 81, nTimeTx - 30 * 24 * 60 * 60, 1000 * COIN, 1));
+    BOOST_CHECK_EQUAL(FindStakeKernel(vCandidates, 0x207fffff, nTimeTx, 60, nTimeTxRet, hashProofOfStake), 1);
+    BOOST_CHECK_EQUAL(nTimeTxRet, nTimeTx);
+    BOOST_CHECK(hashProofOfStake == vCandidates[1].GetKernelHash(nTimeTx));
+
+    // Nothing meets a target of one
+    BOOST_CHECK_EQUAL(FindStakeKernel(vCandidates, 0x01010000, nTimeTx, 60, nTimeTxRet, hashProofOfStake), -1);
+}
+
+BOOST_AUTO_TEST_CASE(search_batches)
+{
+    unsigned int nTimeTx = 1400000000;
+    vector<CStakeCandidate> vCandidates;
+    for (int i = 0; i < 1000; i++)
+    {
+        // Only a few are old enough, and the easiest target finds those
+        unsigned int nTimeFrom = (i == 700 || i == 900) ? nTimeTx - 30 * 24 * 60 * 60 : nTimeTx - nStakeMinAge;
+        vCandidates.push_back(CStakeCandidate(COutPoint(GetRandHash(), i), nTimeFrom, 81, nTimeFrom, 1000 * COIN, GetRandHash().Get64()));
+    }
+
+    unsigned int nTimeTxExpected = 0;
+    uint256 hashExpected = 0;
+    BOOST_CHECK_EQUAL(FindStakeKernel(vCandidates, 0x207fffff, nTimeTx, 60, nTimeTxExpected, hashExpected), 700);
+    BOOST_CHECK_EQUAL(FindStakeKernel(vCandidates, 0x207fffff, nTimeTx, 60, nTimeTxExpected, hashExpected, 701, 1000), 900);
+
+    // Without workers the calling thread goes through every batch itself
+    CStakeSearchQueue queue;
+    queue.Start(4);
+    unsigned int nTimeTxRet = 0;
+    uint256 hashProofOfStake = 0;
+    BOOST_CHECK_EQUAL(queue.Search(vCandidates, 0x207fffff, nTimeTx, 60, nTimeTxRet, hashProofOfStake), 700);
+    BOOST_CHECK_EQUAL(nTimeTxRet, nTimeTx);
+    BOOST_CHECK(hashProofOfStake == vCandidates[700].GetKernelHash(nTimeTx));
+    BOOST_CHECK_EQUAL(queue.Search(vCandidates, 0x01010000, nTimeTx, 60, nTimeTxRet, hashProofOfStake), -1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
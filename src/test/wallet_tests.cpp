@@ -1,4 +1,6 @@
+#include <boost/assign/list_of.hpp>
 #include <boost/test/unit_test.hpp>
+#include <boost/version.hpp>
 
 #include "main.h"
 #include "wallet.h"
@@ -6,9 +8,8 @@
 // how many times to run all the tests to have a chance to catch errors that only show up with particular random shuffles
 #define RUN_TESTS 100
 
-// some tests fail 1% of the time due to bad luck.
-// we repeat those tests this many times and only complain if all iterations of the test fail
-#define RANDOM_REPEATS 5
+// late enough for any coin to be spent
+static const unsigned int nSpendTime = std::numeric_limits<unsigned int>::max();
 
 using namespace std;
 
@@ -64,24 +65,24 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
         empty_wallet();
 
         // with an empty wallet we can't even pay one cent
-        BOOST_CHECK(!wallet.SelectCoinsMinConf( 1 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK(!wallet.SelectCoinsMinConf( 1 * CENT, nSpendTime, 1, 6, vCoins, setCoinsRet, nValueRet));
 
         add_coin(1*CENT, 4);        // add a new 1 cent coin
 
         // with a new 1 cent coin, we still can't find a mature 1 cent
-        BOOST_CHECK(!wallet.SelectCoinsMinConf( 1 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK(!wallet.SelectCoinsMinConf( 1 * CENT, nSpendTime, 1, 6, vCoins, setCoinsRet, nValueRet));
 
         // but we can find a new 1 cent
-        BOOST_CHECK( wallet.SelectCoinsMinConf( 1 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf( 1 * CENT, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 1 * CENT);
 
         add_coin(2*CENT);           // add a mature 2 cent coin
 
         // we can't make 3 cents of mature coins
-        BOOST_CHECK(!wallet.SelectCoinsMinConf( 3 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK(!wallet.SelectCoinsMinConf( 3 * CENT, nSpendTime, 1, 6, vCoins, setCoinsRet, nValueRet));
 
         // we can make 3 cents of new  coins
-        BOOST_CHECK( wallet.SelectCoinsMinConf( 3 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf( 3 * CENT, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 3 * CENT);
 
         add_coin(5*CENT);           // add a mature 5 cent coin,
@@ -91,33 +92,33 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
         // now we have new: 1+10=11 (of which 10 was self-sent), and mature: 2+5+20=27.  total = 38
 
         // we can't make 38 cents only if we disallow new coins:
-        BOOST_CHECK(!wallet.SelectCoinsMinConf(38 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK(!wallet.SelectCoinsMinConf(38 * CENT, nSpendTime, 1, 6, vCoins, setCoinsRet, nValueRet));
         // we can't even make 37 cents if we don't allow new coins even if they're from us
-        BOOST_CHECK(!wallet.SelectCoinsMinConf(38 * CENT, 6, 6, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK(!wallet.SelectCoinsMinConf(38 * CENT, nSpendTime, 6, 6, vCoins, setCoinsRet, nValueRet));
         // but we can make 37 cents if we accept new coins from ourself
-        BOOST_CHECK( wallet.SelectCoinsMinConf(37 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(37 * CENT, nSpendTime, 1, 6, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 37 * CENT);
         // and we can make 38 cents if we accept all new coins
-        BOOST_CHECK( wallet.SelectCoinsMinConf(38 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(38 * CENT, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 38 * CENT);
 
         // try making 34 cents from 1,2,5,10,20 - we can't do it exactly
-        BOOST_CHECK( wallet.SelectCoinsMinConf(34 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(34 * CENT, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_GT(nValueRet, 34 * CENT);         // but should get more than 34 cents
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 3);     // the best should be 20+10+5.  it's incredibly unlikely the 1 or 2 got included (but possible)
 
         // when we try making 7 cents, the smaller coins (1,2,5) are enough.  We should see just 2+5
-        BOOST_CHECK( wallet.SelectCoinsMinConf( 7 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf( 7 * CENT, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 7 * CENT);
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 2);
 
         // when we try making 8 cents, the smaller coins (1,2,5) are exactly enough.
-        BOOST_CHECK( wallet.SelectCoinsMinConf( 8 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf( 8 * CENT, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK(nValueRet == 8 * CENT);
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 3);
 
         // when we try making 9 cents, no subset of smaller coins is enough, and we get the next bigger coin (10)
-        BOOST_CHECK( wallet.SelectCoinsMinConf( 9 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf( 9 * CENT, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 10 * CENT);
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 1);
 
@@ -131,30 +132,30 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
         add_coin(30*CENT); // now we have 6+7+8+20+30 = 71 cents total
 
         // check that we have 71 and not 72
-        BOOST_CHECK( wallet.SelectCoinsMinConf(71 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
-        BOOST_CHECK(!wallet.SelectCoinsMinConf(72 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(71 * CENT, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK(!wallet.SelectCoinsMinConf(72 * CENT, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
 
         // now try making 16 cents.  the best smaller coins can do is 6+7+8 = 21; not as good at the next biggest coin, 20
-        BOOST_CHECK( wallet.SelectCoinsMinConf(16 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(16 * CENT, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 20 * CENT); // we should get 20 in one coin
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 1);
 
         add_coin( 5*CENT); // now we have 5+6+7+8+20+30 = 75 cents total
 
         // now if we try making 16 cents again, the smaller coins can make 5+6+7 = 18 cents, better than the next biggest coin, 20
-        BOOST_CHECK( wallet.SelectCoinsMinConf(16 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(16 * CENT, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 18 * CENT); // we should get 18 in 3 coins
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 3);
 
         add_coin( 18*CENT); // now we have 5+6+7+8+18+20+30
 
         // and now if we try making 16 cents again, the smaller coins can make 5+6+7 = 18 cents, the same as the next biggest coin, 18
-        BOOST_CHECK( wallet.SelectCoinsMinConf(16 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(16 * CENT, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 18 * CENT);  // we should get 18 in 1 coin
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 1); // because in the event of a tie, the biggest coin wins
 
         // now try making 11 cents.  we should get 5+6
-        BOOST_CHECK( wallet.SelectCoinsMinConf(11 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(11 * CENT, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 11 * CENT);
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 2);
 
@@ -163,11 +164,11 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
         add_coin( 2*COIN);
         add_coin( 3*COIN);
         add_coin( 4*COIN); // now we have 5+6+7+8+18+20+30+100+200+300+400 = 1094 cents
-        BOOST_CHECK( wallet.SelectCoinsMinConf(95 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(95 * CENT, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 1 * COIN);  // we should get 1 BTC in 1 coin
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 1);
 
-        BOOST_CHECK( wallet.SelectCoinsMinConf(195 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(195 * CENT, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 2 * COIN);  // we should get 2 BTC in 1 coin
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 1);
 
@@ -181,14 +182,14 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
 
         // try making 1 cent from 0.1 + 0.2 + 0.3 + 0.4 + 0.5 = 1.5 cents
         // we'll get sub-cent change whatever happens, so can expect 1.0 exactly
-        BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 1 * CENT);
 
         // but if we add a bigger coin, making it possible to avoid sub-cent change, things change:
         add_coin(1111*CENT);
 
         // try making 1 cent from 0.1 + 0.2 + 0.3 + 0.4 + 0.5 + 1111 = 1112.5 cents
-        BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 1 * CENT); // we should get the exact amount
 
         // if we add more sub-cent coins:
@@ -196,7 +197,7 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
         add_coin(0.7*CENT);
 
         // and try again to make 1.0 cents, we can still make 1.0 cents
-        BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 1 * CENT); // we should get the exact amount
 
         // run the 'mtgox' test (see http://blockexplorer.com/tx/29a3efd3ef04f9153d47a990bd7b048a4b2d213daaa5fb8ed670fb85f13bdbcf)
@@ -205,7 +206,7 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
         for (int i = 0; i < 20; i++)
             add_coin(50000 * COIN);
 
-        BOOST_CHECK( wallet.SelectCoinsMinConf(500000 * COIN, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(500000 * COIN, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 500000 * COIN); // we should get the exact amount
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 10); // in ten coins
 
@@ -218,7 +219,7 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
         add_coin(0.6 * CENT);
         add_coin(0.7 * CENT);
         add_coin(1111 * CENT);
-        BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 1111 * CENT); // we get the bigger coin
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 1);
 
@@ -228,7 +229,7 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
         add_coin(0.6 * CENT);
         add_coin(0.8 * CENT);
         add_coin(1111 * CENT);
-        BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 1 * CENT);   // we should get the exact amount
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 2); // in two coins 0.4+0.6
 
@@ -239,56 +240,222 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
         add_coin(1 * COIN);
 
         // trying to make 1.0001 from these three coins
-        BOOST_CHECK( wallet.SelectCoinsMinConf(1.0001 * COIN, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(1.0001 * COIN, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 1.0105 * COIN);   // we should get all coins
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 3);
 
         // but if we try to make 0.999, we should take the bigger of the two small coins to avoid sub-cent change
-        BOOST_CHECK( wallet.SelectCoinsMinConf(0.999 * COIN, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(0.999 * COIN, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 1.01 * COIN);   // we should get 1 + 0.01
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 2);
 
-        // test randomness
+        // test that the same coins give the same selection
         {
             empty_wallet();
             for (int i2 = 0; i2 < 100; i2++)
                 add_coin(COIN);
 
-            // picking 50 from 100 coins doesn't depend on the shuffle,
-            // but does depend on randomness in the stochastic approximation code
-            BOOST_CHECK(wallet.SelectCoinsMinConf(50 * COIN, 1, 6, vCoins, setCoinsRet , nValueRet));
-            BOOST_CHECK(wallet.SelectCoinsMinConf(50 * COIN, 1, 6, vCoins, setCoinsRet2, nValueRet));
-            BOOST_CHECK(!equal_sets(setCoinsRet, setCoinsRet2));
-
-            int fails = 0;
-            for (int i = 0; i < RANDOM_REPEATS; i++)
-            {
-                // selecting 1 from 100 identical coins depends on the shuffle; this test will fail 1% of the time
-                // run the test RANDOM_REPEATS times and only complain if all of them fail
-                BOOST_CHECK(wallet.SelectCoinsMinConf(COIN, 1, 6, vCoins, setCoinsRet , nValueRet));
-                BOOST_CHECK(wallet.SelectCoinsMinConf(COIN, 1, 6, vCoins, setCoinsRet2, nValueRet));
-                if (equal_sets(setCoinsRet, setCoinsRet2))
-                    fails++;
-            }
-            BOOST_CHECK_NE(fails, RANDOM_REPEATS);
+            BOOST_CHECK(wallet.SelectCoinsMinConf(50 * COIN, nSpendTime, 1, 6, vCoins, setCoinsRet , nValueRet));
+            BOOST_CHECK(wallet.SelectCoinsMinConf(50 * COIN, nSpendTime, 1, 6, vCoins, setCoinsRet2, nValueRet));
+            BOOST_CHECK(equal_sets(setCoinsRet, setCoinsRet2));
+            BOOST_CHECK_EQUAL(setCoinsRet.size(), 50);
+
+            BOOST_CHECK(wallet.SelectCoinsMinConf(COIN, nSpendTime, 1, 6, vCoins, setCoinsRet , nValueRet));
+            BOOST_CHECK(wallet.SelectCoinsMinConf(COIN, nSpendTime, 1, 6, vCoins, setCoinsRet2, nValueRet));
+            BOOST_CHECK(equal_sets(setCoinsRet, setCoinsRet2));
 
             // add 75 cents in small change.  not enough to make 90 cents,
-            // then try making 90 cents.  there are multiple competing "smallest bigger" coins,
-            // one of which should be picked at random
+            // then try making 90 cents.  there are multiple competing "smallest bigger" coins
             add_coin( 5*CENT); add_coin(10*CENT); add_coin(15*CENT); add_coin(20*CENT); add_coin(25*CENT);
 
-            fails = 0;
-            for (int i = 0; i < RANDOM_REPEATS; i++)
-            {
-                // selecting 1 from 100 identical coins depends on the shuffle; this test will fail 1% of the time
-                // run the test RANDOM_REPEATS times and only complain if all of them fail
-                BOOST_CHECK(wallet.SelectCoinsMinConf(90*CENT, 1, 6, vCoins, setCoinsRet , nValueRet));
-                BOOST_CHECK(wallet.SelectCoinsMinConf(90*CENT, 1, 6, vCoins, setCoinsRet2, nValueRet));
-                if (equal_sets(setCoinsRet, setCoinsRet2))
-                    fails++;
-            }
-            BOOST_CHECK_NE(fails, RANDOM_REPEATS);
+            BOOST_CHECK(wallet.SelectCoinsMinConf(90*CENT, nSpendTime, 1, 6, vCoins, setCoinsRet , nValueRet));
+            BOOST_CHECK(wallet.SelectCoinsMinConf(90*CENT, nSpendTime, 1, 6, vCoins, setCoinsRet2, nValueRet));
+            BOOST_CHECK(equal_sets(setCoinsRet, setCoinsRet2));
+            BOOST_CHECK_EQUAL(nValueRet, COIN);
         }
+
+        // a subset that needs no change beats one that does
+        empty_wallet();
+        add_coin(3 * CENT);
+        add_coin(4 * CENT);
+        add_coin(5 * CENT);
+        add_coin(6 * CENT);
+        BOOST_CHECK( wallet.SelectCoinsMinConf(10 * CENT - MIN_TXOUT_AMOUNT / 2, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK_EQUAL(nValueRet, 10 * CENT);
+        BOOST_CHECK_EQUAL(setCoinsRet.size(), 2);
+    }
+}
+
+// Synthetic wallets of many outputs, for coin selection.  Values come from
+// a fixed seed, so every run selects the same coins.
+static void SelectCoinsOutOf(unsigned int nOutputs, bool fTime)
+{
+    CTransaction tx;
+    tx.vout.resize(nOutputs);
+    uint64 nSeed = nOutputs;
+    int64 nTotal = 0;
+    for (unsigned int i = 0; i < nOutputs; i++)
+    {
+        nSeed = nSeed * 6364136223846793005ULL + 1442695040888963407ULL;
+        tx.vout[i].nValue = (nSeed >> 33) % (10 * COIN) + CENT / 10;
+        nTotal += tx.vout[i].nValue;
+    }
+    CWalletTx wtx(&wallet, tx);
+    vector<COutput> vOutputs;
+    for (unsigned int i = 0; i < nOutputs; i++)
+        vOutputs.push_back(COutput(&wtx, i, 6*24));
+
+    CoinSet setCoins, setCoins2;
+    int64 nValue = 0, nValue2 = 0;
+    int64 nTargets[] = { CENT, 7 * COIN + 12345, 100 * COIN + 1, nTotal / 3 };
+    for (unsigned int n = 0; n < sizeof(nTargets) / sizeof(nTargets[0]); n++)
+    {
+        int64 nStart = GetTimeMicros();
+        BOOST_CHECK(wallet.SelectCoinsMinConf(nTargets[n], nSpendTime, 1, 6, vOutputs, setCoins, nValue));
+        int64 nElapsed = GetTimeMicros() - nStart;
+        BOOST_CHECK_GE(nValue, nTargets[n]);
+        BOOST_CHECK(wallet.SelectCoinsMinConf(nTargets[n], nSpendTime, 1, 6, vOutputs, setCoins2, nValue2));
+        BOOST_CHECK(equal_sets(setCoins, setCoins2));
+        if (fTime)
+            BOOST_TEST_MESSAGE(strprintf("SelectCoinsMinConf %u outputs, target %s: %" PRI64d " us, %" PRIszu " coins, %s change",
+                                         nOutputs, FormatMoney(nTargets[n]).c_str(), nElapsed, setCoins.size(), FormatMoney(nValue - nTargets[n]).c_str()));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(coin_selection_many_outputs)
+{
+    SelectCoinsOutOf(1000, false);
+}
+
+// Timings only, so it is left out unless asked for with
+//   test_litecoinplus --run_test=wallet_tests/coin_selection_benchmark --log_level=message
+#if BOOST_VERSION >= 105900
+BOOST_AUTO_TEST_CASE(coin_selection_benchmark, *boost::unit_test::disabled())
+{
+    SelectCoinsOutOf(1000, true);
+    SelectCoinsOutOf(10000, true);
+    SelectCoinsOutOf(100000, true);
+}
+#endif
+
+BOOST_AUTO_TEST_CASE(ledger_unspent_index)
+{
+    CWalletLedger ledger;
+    vector<uint256> vHash;
+    for (int i = 0; i < 10; i++)
+    {
+        CWalletLedger::CEntry entry;
+        entry.fFinal = entry.fConfirmed = true;
+        entry.nHeight = i;
+        entry.nAvailable = 3 * i * CENT;
+        for (int n = 0; n < 3; n++)
+            entry.vUnspent.push_back(make_pair(n, i * CENT));
+        // A few still wait for a block
+        if (i % 4 == 0)
+            entry.nHeight = -1;
+        vHash.push_back(GetRandHash());
+        ledger.Insert(vHash.back(), entry);
+    }
+    BOOST_CHECK_EQUAL(ledger.nAvailable, 135 * CENT);
+    BOOST_CHECK_EQUAL(ledger.setUnspent.size(), 10U);
+    BOOST_CHECK_EQUAL(ledger.setUnspentByValue.size(), 30U);
+    BOOST_CHECK_EQUAL(ledger.setUnsettled.size(), 3U);
+    BOOST_CHECK_EQUAL(ledger.setUnspentByValue.rbegin()->first, 9 * CENT);
+
+    // Spending every output takes the transaction out of the index
+    CWalletLedger::CEntry entry = *ledger.GetEntry(vHash[9]);
+    entry.nAvailable = 0;
+    entry.vUnspent.clear();
+    ledger.Erase(vHash[9]);
+    ledger.Insert(vHash[9], entry);
+    BOOST_CHECK_EQUAL(ledger.nAvailable, 108 * CENT);
+    BOOST_CHECK_EQUAL(ledger.setUnspent.size(), 9U);
+    BOOST_CHECK_EQUAL(ledger.setUnspentByValue.size(), 27U);
+    BOOST_CHECK_EQUAL(ledger.setUnspentByValue.rbegin()->first, 8 * CENT);
+
+    ledger.Erase(vHash[0]);
+    ledger.Erase(vHash[0]);
+    BOOST_CHECK(ledger.GetEntry(vHash[0]) == NULL);
+    BOOST_CHECK_EQUAL(ledger.setUnsettled.size(), 2U);
+    BOOST_CHECK_EQUAL(ledger.setUnspentByValue.begin()->first, 1 * CENT);
+}
+
+BOOST_AUTO_TEST_CASE(scan_filter)
+{
+    CBasicKeyStore keystore;
+    CKey key, keyOther;
+    key.MakeNewKey(true);
+    keyOther.MakeNewKey(false);
+    keystore.AddKey(key);
+
+    CScript scriptMultisig;
+    scriptMultisig << OP_1 << key.GetPubKey() << keyOther.GetPubKey() << OP_2 << OP_CHECKMULTISIG;
+    keystore.AddCScript(scriptMultisig);
+
+    CWalletScanFilter filter(keystore);
+
+    CScript scriptPubKey;
+    scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    BOOST_CHECK(filter.MayBeMine(scriptPubKey));
+    scriptPubKey.clear();
+    scriptPubKey << key.GetPubKey() << OP_CHECKSIG;
+    BOOST_CHECK(filter.MayBeMine(scriptPubKey));
+    scriptPubKey.SetDestination(scriptMultisig.GetID());
+    BOOST_CHECK(filter.MayBeMine(scriptPubKey));
+    BOOST_CHECK(filter.MayBeMine(scriptMultisig));
+
+    scriptPubKey.SetDestination(keyOther.GetPubKey().GetID());
+    BOOST_CHECK(!filter.MayBeMine(scriptPubKey));
+    scriptPubKey.clear();
+    scriptPubKey << keyOther.GetPubKey() << OP_CHECKSIG;
+    BOOST_CHECK(!filter.MayBeMine(scriptPubKey));
+    BOOST_CHECK(!filter.MayBeMine(CScript()));
+}
+
+BOOST_AUTO_TEST_CASE(is_mine_index)
+{
+    CWallet keystore;
+    CKey key, keyUncompressed, keyOther;
+    key.MakeNewKey(true);
+    keyUncompressed.MakeNewKey(false);
+    keyOther.MakeNewKey(true);
+    keystore.AddKey(key);
+    keystore.LoadKey(keyUncompressed);
+
+    CScript scriptMine, scriptPartly;
+    scriptMine << OP_1 << key.GetPubKey() << OP_1 << OP_CHECKMULTISIG;
+    scriptPartly << OP_2 << key.GetPubKey() << keyOther.GetPubKey() << OP_2 << OP_CHECKMULTISIG;
+    keystore.AddCScript(scriptMine);
+    keystore.LoadCScript(scriptPartly);
+
+    vector<CScript> vScript;
+    BOOST_FOREACH(const CKey* pkey, boost::assign::list_of(&key)(&keyUncompressed)(&keyOther))
+    {
+        CScript scriptPubKey;
+        scriptPubKey.SetDestination(pkey->GetPubKey().GetID());
+        vScript.push_back(scriptPubKey);
+        scriptPubKey.clear();
+        scriptPubKey << pkey->GetPubKey() << OP_CHECKSIG;
+        vScript.push_back(scriptPubKey);
+    }
+    vScript.push_back(scriptMine);
+    vScript.push_back(scriptPartly);
+    CScript scriptPubKey;
+    scriptPubKey.SetDestination(scriptMine.GetID());
+    vScript.push_back(scriptPubKey);
+    scriptPubKey.SetDestination(scriptPartly.GetID());
+    vScript.push_back(scriptPubKey);
+    scriptPubKey.SetDestination((CScript() << OP_TRUE).GetID());
+    vScript.push_back(scriptPubKey);
+    vScript.push_back(CScript() << OP_RETURN);
+
+    // The index and Solver agree on every script
+    bool fExpected[] = { true, true, true, true, false, false, true, false, true, false, false, false };
+    BOOST_CHECK_EQUAL(vScript.size(), sizeof(fExpected) / sizeof(fExpected[0]));
+    for (unsigned int i = 0; i < vScript.size(); i++)
+    {
+        BOOST_CHECK_EQUAL(keystore.IsMine(vScript[i]), fExpected[i]);
+        BOOST_CHECK_EQUAL(IsMine(keystore, vScript[i]), fExpected[i]);
     }
 }
 
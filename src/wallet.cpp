@@ -57,10 +57,42 @@ CPubKey CWallet::GenerateNewKey()
     return key.GetPubKey();
 }
 
+void CWallet::AddMineScripts(const CPubKey& vchPubKey)
+{
+    CScript scriptPubKey;
+    scriptPubKey.SetDestination(vchPubKey.GetID());
+    CScript scriptPubKey2;
+    scriptPubKey2 << vchPubKey << OP_CHECKSIG;
+    {
+        LOCK(cs_KeyStore);
+        setMineScripts.insert(scriptPubKey);
+        setMineScripts.insert(scriptPubKey2);
+    }
+}
+
+bool CWallet::IsMine(const CScript& scriptPubKey) const
+{
+    if (scriptPubKey.IsPayToPubKeyHash() || scriptPubKey.IsPayToPubKey())
+    {
+        LOCK(cs_KeyStore);
+        return setMineScripts.count(scriptPubKey) > 0;
+    }
+    if (scriptPubKey.IsPayToScriptHash())
+    {
+        uint160 hash;
+        memcpy(hash.begin(), &scriptPubKey[2], 20);
+        LOCK(cs_KeyStore);
+        if (!setMineScriptIDs.count(CScriptID(hash)))
+            return false;
+    }
+    return ::IsMine(*this, scriptPubKey);
+}
+
 bool CWallet::AddKey(const CKey& key)
 {
     if (!CCryptoKeyStore::AddKey(key))
         return false;
+    AddMineScripts(key.GetPubKey());
     if (!fFileBacked)
         return true;
     if (!IsCrypted())
@@ -68,10 +100,27 @@ bool CWallet::AddKey(const CKey& key)
     return true;
 }
 
+bool CWallet::LoadKey(const CKey& key)
+{
+    if (!CCryptoKeyStore::AddKey(key))
+        return false;
+    AddMineScripts(key.GetPubKey());
+    return true;
+}
+
+bool CWallet::LoadKey(const CPubKey& vchPubKey, const CSecret& vchSecret)
+{
+    if (!CCryptoKeyStore::AddKeyUnverified(vchPubKey, vchSecret))
+        return false;
+    AddMineScripts(vchPubKey);
+    return true;
+}
+
 bool CWallet::AddCryptedKey(const CPubKey &vchPubKey, const vector<unsigned char> &vchCryptedSecret)
 {
     if (!CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret))
         return false;
+    AddMineScripts(vchPubKey);
     if (!fFileBacked)
         return true;
     {
@@ -84,15 +133,35 @@ bool CWallet::AddCryptedKey(const CPubKey &vchPubKey, const vector<unsigned char
     return false;
 }
 
+bool CWallet::LoadCryptedKey(const CPubKey &vchPubKey, const vector<unsigned char> &vchCryptedSecret)
+{
+    SetMinVersion(FEATURE_WALLETCRYPT);
+    if (!CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret))
+        return false;
+    AddMineScripts(vchPubKey);
+    return true;
+}
+
 bool CWallet::AddCScript(const CScript& redeemScript)
 {
-    if (!CCryptoKeyStore::AddCScript(redeemScript))
+    if (!LoadCScript(redeemScript))
         return false;
     if (!fFileBacked)
         return true;
     return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript), redeemScript);
 }
 
+bool CWallet::LoadCScript(const CScript& redeemScript)
+{
+    if (!CCryptoKeyStore::AddCScript(redeemScript))
+        return false;
+    {
+        LOCK(cs_KeyStore);
+        setMineScriptIDs.insert(redeemScript.GetID());
+    }
+    return true;
+}
+
 // ppcoin: optional setting to unlock wallet for block minting only;
 //         serves to disable the trivial sendmoney when OS account compromised
 //bool fWalletUnlockMintOnly = false;
@@ -377,6 +446,7 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        ledger.MarkAllDirty();
     }
 }
 
@@ -492,6 +562,10 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
         // since AddToWallet is called directly for self-originating transactions, check for consumption of own coins
         WalletUpdateSpent(wtx);
 
+        // Its outputs may stake once it is in the chain
+        stakeCandidates.AddPending(hash);
+        ledger.MarkDirty(hash);
+
         // Notify UI of new or updated transaction
         NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
 
@@ -537,8 +611,15 @@ bool CWallet::EraseFromWallet(uint256 hash)
         return false;
     {
         LOCK(cs_wallet);
-        if (mapWallet.erase(hash))
+        map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+        if (mi != mapWallet.end())
+        {
+            for (unsigned int n = 0; n < (*mi).second.vout.size(); n++)
+                stakeCandidates.Remove(COutPoint(hash, n));
+            mapWallet.erase(mi);
+            ledger.MarkDirty(hash);
             CWalletDB(strWalletFile).EraseTx(hash);
+        }
     }
     return true;
 }
@@ -793,41 +874,287 @@ bool CWalletTx::WriteToDisk()
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
+CWalletScanFilter::CWalletScanFilter(const CBasicKeyStore& keystore)
+{
+    set<CKeyID> setKeyID;
+    keystore.GetKeys(setKeyID);
+    BOOST_FOREACH(const CKeyID& keyID, setKeyID)
+        setHash.insert(keyID);
+
+    set<CScriptID> setScriptID;
+    keystore.GetCScripts(setScriptID);
+    BOOST_FOREACH(const CScriptID& scriptID, setScriptID)
+        setHash.insert(scriptID);
+}
+
+bool CWalletScanFilter::MayBeMine(const CScript& scriptPubKey) const
+{
+    CScript::const_iterator pc = scriptPubKey.begin();
+    opcodetype opcode;
+    vector<unsigned char> vch;
+    while (scriptPubKey.GetOp(pc, opcode, vch))
+    {
+        if (vch.size() == 20 && setHash.count(uint160(vch)))
+            return true;
+        if ((vch.size() == 33 || vch.size() == 65) && setHash.count(Hash160(vch)))
+            return true;
+    }
+    return false;
+}
+
+/** Reads the blocks of a rescan on worker threads, in batches of
+ * RESCAN_BATCH_SIZE and no more than a few batches ahead of the rescan,
+ * which takes them in chain order.
+ *
+ * Blocks are read straight from their file position: the block index has
+ * their hash already, so they aren't hashed again.  Each worker builds the
+ * merkle tree, which gives the transaction hashes, and runs the filter over
+ * the outputs, so all that is left for the rescan under cs_wallet is the
+ * map lookups and IsMine on the few transactions that may be ours.
+ */
+class CWalletScanner
+{
+public:
+    struct CBatch
+    {
+        std::vector<CBlock> vBlock;
+        // For each block and transaction, whether an output may be ours
+        std::vector<std::vector<char> > vfMaybeMine;
+        bool fStarted;
+        bool fDone;
+
+        CBatch() : fStarted(false), fDone(false) {}
+    };
+
+private:
+    const std::vector<CBlockIndex*>& vIndex;
+    const CWalletScanFilter& filter;
+    boost::mutex cs;
+    boost::condition_variable condWork;
+    boost::condition_variable condDone;
+    std::vector<CBatch> vBatch;
+    // First batch not handed out yet, and first one the rescan still needs
+    unsigned int nNext;
+    unsigned int nFirst;
+    unsigned int nAhead;
+    int nWorkers;
+    bool fStop;
+
+    void ReadBatch(unsigned int n)
+    {
+        CBatch& batch = vBatch[n];
+        unsigned int nBegin = n * RESCAN_BATCH_SIZE;
+        unsigned int nEnd = min(nBegin + RESCAN_BATCH_SIZE, (unsigned int)vIndex.size());
+        batch.vBlock.resize(nEnd - nBegin);
+        batch.vfMaybeMine.resize(nEnd - nBegin);
+        for (unsigned int i = 0; i < nEnd - nBegin && !fShutdown; i++)
+        {
+            CBlock& block = batch.vBlock[i];
+            if (!block.ReadFromDisk(vIndex[nBegin + i]->nFile, vIndex[nBegin + i]->nBlockPos))
+            {
+                // Whatever made it in before the failure is no use
+                printf("Rescan: failed to read block %d from disk\n", vIndex[nBegin + i]->nHeight);
+                block.SetNull();
+                continue;
+            }
+            block.BuildMerkleTree();
+
+            vector<char>& vfMaybeMine = batch.vfMaybeMine[i];
+            vfMaybeMine.assign(block.vtx.size(), false);
+            for (unsigned int j = 0; j < block.vtx.size(); j++)
+                BOOST_FOREACH(const CTxOut& txout, block.vtx[j].vout)
+                    if (filter.MayBeMine(txout.scriptPubKey))
+                    {
+                        vfMaybeMine[j] = true;
+                        break;
+                    }
+        }
+    }
+
+public:
+    CWalletScanner(const std::vector<CBlockIndex*>& vIndexIn, const CWalletScanFilter& filterIn) : vIndex(vIndexIn), filter(filterIn)
+    {
+        vBatch.resize((vIndex.size() + RESCAN_BATCH_SIZE - 1) / RESCAN_BATCH_SIZE);
+        nNext = 0;
+        nFirst = 0;
+        nAhead = 1;
+        nWorkers = 0;
+        fStop = false;
+    }
+
+    unsigned int size() const { return vBatch.size(); }
+
+    void ThreadWorker()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        while (!fStop && !fShutdown)
+        {
+            if (nNext >= vBatch.size() || nNext >= nFirst + nAhead)
+            {
+                condWork.timed_wait(lock, boost::posix_time::seconds(1));
+                continue;
+            }
+            unsigned int n = nNext++;
+            vBatch[n].fStarted = true;
+            lock.unlock();
+            ReadBatch(n);
+            lock.lock();
+            vBatch[n].fDone = true;
+            condDone.notify_all();
+        }
+        nWorkers--;
+        condDone.notify_all();
+    }
+
+    // Start nThreads workers, which keep twice as many batches read ahead
+    void Start(int nThreads);
+
+    // The blocks of batch n, read here if no worker has started on them
+    CBatch& Wait(unsigned int n)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        if (!vBatch[n].fStarted)
+        {
+            vBatch[n].fStarted = true;
+            nNext = max(nNext, n + 1);
+            lock.unlock();
+            ReadBatch(n);
+            lock.lock();
+            vBatch[n].fDone = true;
+        }
+        while (!vBatch[n].fDone)
+            condDone.wait(lock);
+        return vBatch[n];
+    }
+
+    // Done with batch n; let the workers read further
+    void Release(unsigned int n)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        vector<CBlock>().swap(vBatch[n].vBlock);
+        vector<vector<char> >().swap(vBatch[n].vfMaybeMine);
+        nFirst = n + 1;
+        condWork.notify_all();
+    }
+
+    // Wait for the workers to leave
+    void Stop()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        fStop = true;
+        condWork.notify_all();
+        while (nWorkers > 0)
+            condDone.wait(lock);
+    }
+};
+
+void static ThreadWalletScan(void* parg)
+{
+    RenameThread("litecoinplus-rescan");
+    CWalletScanner* pscanner = (CWalletScanner*)parg;
+    pscanner->ThreadWorker();
+}
+
+void CWalletScanner::Start(int nThreads)
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    nAhead = 2 * nThreads + 1;
+    for (int i = 0; i < nThreads; i++)
+    {
+        nWorkers++;
+        if (!NewThread(ThreadWalletScan, this))
+        {
+            printf("Error: NewThread(ThreadWalletScan) failed\n");
+            nWorkers--;
+        }
+    }
+}
+
 // Scan the block chain (starting in pindexStart) for transactions
 // from or to us. If fUpdate is true, found transactions that already
-// exist in the wallet will be updated.
-int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate, int numBlocks)
+// exist in the wallet will be updated.  Stops early on AbortRescan.
+int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate, bool fShowProgress)
 {
     int ret = 0;
+    int64 nStart = GetTimeMillis();
+
+    vector<CBlockIndex*> vIndex;
+    for (CBlockIndex* pindex = pindexStart; pindex; pindex = pindex->pnext)
+        vIndex.push_back(pindex);
+    if (vIndex.empty())
+        return 0;
 
-    CBlockIndex* pindex = pindexStart;
     {
         LOCK(cs_wallet);
-		int ccc = 0;
-		int progress;
-		int oldProgress = -1;
-		char message[256];
-        while (pindex)
-        {
-			progress = (int)(((float)ccc / (float)numBlocks) * 100);
-			if ((progress != oldProgress) && (numBlocks != 0)) {
-				sprintf(message, "Scanning transactions %d%%...", progress);
+        fAbortRescan = false;
+        CWalletScanFilter filter(*this);
+        CWalletScanner scanner(vIndex, filter);
+
+        // The rescan reads along with the workers, so one fewer
+        int nThreads = GetArg("-rescanthreads", 0);
+        if (nThreads <= 0)
+            nThreads += boost::thread::hardware_concurrency();
+        if (nThreads > MAX_RESCAN_THREADS)
+            nThreads = MAX_RESCAN_THREADS;
+        if (nThreads > 1)
+            scanner.Start(nThreads - 1);
+
+        int nProgressLast = -1;
+        unsigned int n = 0;
+        for (; n < scanner.size() && !fAbortRescan && !fShutdown; n++)
+        {
+            int nProgress = n * 100 / scanner.size();
+            if (nProgress != nProgressLast)
+            {
+                char message[256];
+                sprintf(message, "Scanning transactions %d%%...", nProgress);
 #ifdef QT_GUI
-				updateBitcoinGUISplashMessage(message);
+                if (fShowProgress)
+                    updateBitcoinGUISplashMessage(message);
 #endif
-				oldProgress = progress;
-			}
-            CBlock block;
-            block.ReadFromDisk(pindex, true);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+                if (nProgress % 10 == 0)
+                    printf("Rescan: %d%%, block %d\n", nProgress, vIndex[n * RESCAN_BATCH_SIZE]->nHeight);
+                nProgressLast = nProgress;
+            }
+
+            CWalletScanner::CBatch& batch = scanner.Wait(n);
+            for (unsigned int i = 0; i < batch.vBlock.size(); i++)
             {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
-                    ret++;
+                // Blocks that couldn't be read have no results
+                const CBlock& block = batch.vBlock[i];
+                if (batch.vfMaybeMine[i].size() != block.vtx.size())
+                    continue;
+                uint256 hashBlock = vIndex[n * RESCAN_BATCH_SIZE + i]->GetBlockHash();
+                for (unsigned int j = 0; j < block.vtx.size(); j++)
+                {
+                    // As AddToWalletIfInvolvingMe, with the hashes the
+                    // scanner has worked out already
+                    const CTransaction& tx = block.vtx[j];
+                    bool fExisted = mapWallet.count(block.vMerkleTree[j]);
+                    if (fExisted && !fUpdate)
+                        continue;
+                    if (fExisted || (batch.vfMaybeMine[i][j] && IsMine(tx)) || IsFromMe(tx))
+                    {
+                        CWalletTx wtx(this, tx);
+                        wtx.hashBlock = hashBlock;
+                        wtx.nIndex = j;
+                        wtx.vMerkleBranch = block.GetMerkleBranch(j);
+                        if (AddToWallet(wtx))
+                            ret++;
+                    }
+                    else
+                        WalletUpdateSpent(tx);
+                }
             }
-            pindex = pindex->pnext;
-			ccc++;
+            scanner.Release(n);
         }
+        scanner.Stop();
+
+        if (n < scanner.size())
+            printf("Rescan aborted before block %d\n", vIndex[n * RESCAN_BATCH_SIZE]->nHeight);
+        fAbortRescan = false;
     }
+    printf("Rescan: %d transactions in %" PRIszu " blocks, %" PRI64d "ms\n", ret, vIndex.size(), GetTimeMillis() - nStart);
     return ret;
 }
 
@@ -982,149 +1309,266 @@ void CWallet::ResendWalletTransactions()
 //
 
 
-int64 CWallet::GetBalance() const
+void CWalletLedger::Insert(const uint256& hash, const CEntry& entry)
 {
-    int64 nTotal = 0;
-    {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsFinal() && pcoin->IsConfirmed())
-                nTotal += pcoin->GetAvailableCredit();
-        }
+    nAvailable += entry.nAvailable;
+    nUnconfirmed += entry.nUnconfirmed;
+    nImmature += entry.nImmature;
+    nStake += entry.nStake;
+    nNewMint += entry.nNewMint;
+    if (!entry.IsSettled())
+        setUnsettled.insert(hash);
+    if (!entry.vUnspent.empty())
+        setUnspent.insert(hash);
+    for (unsigned int i = 0; i < entry.vUnspent.size(); i++)
+        setUnspentByValue.insert(make_pair(entry.vUnspent[i].second, COutPoint(hash, entry.vUnspent[i].first)));
+    mapEntries[hash] = entry;
+}
+
+void CWalletLedger::Erase(const uint256& hash)
+{
+    map<uint256, CEntry>::iterator mi = mapEntries.find(hash);
+    if (mi == mapEntries.end())
+        return;
+    const CEntry& entry = (*mi).second;
+    nAvailable -= entry.nAvailable;
+    nUnconfirmed -= entry.nUnconfirmed;
+    nImmature -= entry.nImmature;
+    nStake -= entry.nStake;
+    nNewMint -= entry.nNewMint;
+    setUnsettled.erase(hash);
+    setUnspent.erase(hash);
+    for (unsigned int i = 0; i < entry.vUnspent.size(); i++)
+        setUnspentByValue.erase(make_pair(entry.vUnspent[i].second, COutPoint(hash, entry.vUnspent[i].first)));
+    mapEntries.erase(mi);
+}
+
+// Work out what wtx adds to each balance and which of its outputs are left,
+// as the loops over mapWallet the balance queries and AvailableCoins used to
+// be did
+void CWallet::GetLedgerEntry(const CWalletTx& wtx, CWalletLedger::CEntry& entry) const
+{
+    entry = CWalletLedger::CEntry();
+    entry.fFinal = wtx.IsFinal();
+    entry.fConfirmed = wtx.IsConfirmed();
+    if (entry.fFinal && entry.fConfirmed)
+        entry.nAvailable = wtx.GetAvailableCredit();
+    else
+        entry.nUnconfirmed = wtx.GetAvailableCredit();
+
+    CBlockIndex* pindex = NULL;
+    int nDepth = wtx.GetDepthInMainChain(pindex);
+    if (nDepth > 0 && pindex)
+        entry.nHeight = pindex->nHeight;
+    entry.fImmature = (wtx.IsCoinBase() || wtx.IsCoinStake()) && wtx.GetBlocksToMaturity() > 0;
+    if (entry.fImmature && nDepth > 0)
+    {
+        if (wtx.IsCoinBase())
+            entry.nImmature = entry.nNewMint = GetCredit(wtx);
+        else
+            entry.nStake = GetCredit(wtx);
     }
 
-    return nTotal;
+    entry.nTime = wtx.nTime;
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+        if (!wtx.IsSpent(i) && IsMine(wtx.vout[i]) && wtx.vout[i].nValue > 0)
+            entry.vUnspent.push_back(make_pair(i, wtx.vout[i].nValue));
 }
 
-int64 CWallet::GetUnconfirmedBalance() const
+// Bring the running balances and the unspent outputs up to date
+void CWallet::UpdateLedger() const
 {
-    int64 nTotal = 0;
+    LOCK(cs_wallet);
+    bool fRebuild = !ledger.fValid;
+    if (!fRebuild && GetAdjustedTime() >= ledger.nTimeLockNext)
     {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        // Transactions that aren't final yet are all unsettled
+        ledger.setDirty.insert(ledger.setUnsettled.begin(), ledger.setUnsettled.end());
+        ledger.nTimeLockNext = std::numeric_limits<int64>::max();
+    }
+    if (!fRebuild && ledger.hashBestChain != hashBestChain)
+    {
+        // Settled transactions stay so unless the block they are in was
+        // disconnected, so those above the fork are worked out again too
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(ledger.hashBestChain);
+        if (mi == mapBlockIndex.end())
+            fRebuild = true;
+        else
         {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsFinal() || !pcoin->IsConfirmed())
-                nTotal += pcoin->GetAvailableCredit();
+            CBlockIndex* pindexFork = (*mi).second;
+            while (pindexFork && !pindexFork->IsInMainChain())
+                pindexFork = pindexFork->pprev;
+            int nForkHeight = pindexFork ? pindexFork->nHeight : -1;
+            if (nForkHeight < (*mi).second->nHeight)
+                for (map<uint256, CWalletLedger::CEntry>::const_iterator it = ledger.mapEntries.begin(); it != ledger.mapEntries.end(); ++it)
+                    if ((*it).second.nHeight > nForkHeight)
+                        ledger.setDirty.insert((*it).first);
+            ledger.setDirty.insert(ledger.setUnsettled.begin(), ledger.setUnsettled.end());
         }
+        ledger.hashBestChain = hashBestChain;
+    }
+    if (fRebuild)
+    {
+        ledger = CWalletLedger();
+        ledger.fValid = true;
+        ledger.hashBestChain = hashBestChain;
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            ledger.setDirty.insert((*it).first);
+    }
+    if (ledger.setDirty.empty())
+        return;
+
+    BOOST_FOREACH(const uint256& hash, ledger.setDirty)
+    {
+        ledger.Erase(hash);
+
+        map<uint256, CWalletTx>::const_iterator it = mapWallet.find(hash);
+        if (it == mapWallet.end())
+            continue;
+        const CWalletTx& wtx = (*it).second;
+        CWalletLedger::CEntry entry;
+        GetLedgerEntry(wtx, entry);
+        ledger.Insert(hash, entry);
+        if (!entry.fFinal && wtx.nLockTime >= LOCKTIME_THRESHOLD)
+            ledger.nTimeLockNext = min(ledger.nTimeLockNext, (int64)wtx.nLockTime);
     }
-    return nTotal;
+    ledger.setDirty.clear();
+    ledger.fWeightValid = false;
+}
+
+int64 CWallet::GetBalance() const
+{
+    LOCK(cs_wallet);
+    UpdateLedger();
+    return ledger.nAvailable;
+}
+
+int64 CWallet::GetUnconfirmedBalance() const
+{
+    LOCK(cs_wallet);
+    UpdateLedger();
+    return ledger.nUnconfirmed;
 }
 
 int64 CWallet::GetImmatureBalance() const
 {
-    int64 nTotal = 0;
-    {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx& pcoin = (*it).second;
-            if (pcoin.IsCoinBase() && pcoin.GetBlocksToMaturity() > 0 && pcoin.IsInMainChain())
-                nTotal += GetCredit(pcoin);
-        }
-    }
-    return nTotal;
+    LOCK(cs_wallet);
+    UpdateLedger();
+    return ledger.nImmature;
 }
 
-// populate vCoins with vector of spendable COutputs
+// populate vCoins with vector of spendable COutputs, largest first
 void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const CCoinControl *coinControl) const
 {
     vCoins.clear();
 
     {
         LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateLedger();
+        for (set<pair<int64, COutPoint> >::const_reverse_iterator it = ledger.setUnspentByValue.rbegin(); it != ledger.setUnspentByValue.rend(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
-
-            if (!pcoin->IsFinal())
+            const COutPoint& outpoint = (*it).second;
+            if (coinControl && coinControl->HasSelected() && !coinControl->IsSelected(outpoint.hash, outpoint.n))
                 continue;
 
-            if (fOnlyConfirmed && !pcoin->IsConfirmed())
+            const CWalletLedger::CEntry* pentry = ledger.GetEntry(outpoint.hash);
+            if (!pentry->fFinal)
                 continue;
 
-            if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
+            if (fOnlyConfirmed && !pentry->fConfirmed)
                 continue;
 
-            if(pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0)
+            if (pentry->fImmature)
                 continue;
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++)
-                if (!(pcoin->IsSpent(i)) && IsMine(pcoin->vout[i]) && pcoin->vout[i].nValue > 0 &&
-                 (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i)))
-                    vCoins.push_back(COutput(pcoin, i, pcoin->GetDepthInMainChain()));
+            map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(outpoint.hash);
+            if (mi != mapWallet.end())
+                vCoins.push_back(COutput(&(*mi).second, outpoint.n, pentry->GetDepthInMainChain()));
         }
     }
 }
 
-static void ApproximateBestSubset(vector<pair<int64, pair<const CWalletTx*,unsigned int> > >vValue, int64 nTotalLower, int64 nTargetValue,
-                                  vector<char>& vfBest, int64& nBest, int iterations = 1000)
+// Depth first search over vValue, sorted largest first, for the subset with
+// the smallest total in [nTargetValue, nUpper).  Coins are tried in before
+// they are left out, so the first subset found is the greedy one, and every
+// one after that has to beat it; a coin of the same value as one just left
+// out is left out too, as taking it would only repeat a subset already seen.
+// Gives up after nMaxTries steps with the best subset found so far.
+static bool SearchBestSubset(const vector<pair<int64, pair<const CWalletTx*,unsigned int> > >& vValue, int64 nTargetValue, int64 nUpper,
+                             vector<unsigned int>& vBest, int64& nBest, int nMaxTries = 100000)
 {
-    vector<char> vfIncluded;
+    unsigned int nSize = vValue.size();
+    if (nSize == 0)
+        return false;
 
-    vfBest.assign(vValue.size(), true);
-    nBest = nTotalLower;
+    // What is left from each coin to the end
+    vector<int64> vRemaining(nSize + 1, 0);
+    for (unsigned int i = nSize; i-- > 0; )
+        vRemaining[i] = vRemaining[i + 1] + vValue[i].first;
 
-    for (int nRep = 0; nRep < iterations && nBest != nTargetValue; nRep++)
-    {
-        vfIncluded.assign(vValue.size(), false);
-        int64 nTotal = 0;
-        bool fReachedTarget = false;
-        for (int nPass = 0; nPass < 2 && !fReachedTarget; nPass++)
+    // vBest only takes the coins after the part it has in common with
+    // vSelected, which is most of it
+    vector<unsigned int> vSelected;
+    unsigned int nCommon = 0;
+    int64 nTotal = 0;
+    unsigned int i = 0;
+    bool fFound = false;
+    for (int nTries = 0; nTries < nMaxTries; nTries++)
+    {
+        bool fBacktrack = false;
+        if (nTotal >= nUpper || nTotal + vRemaining[i] < nTargetValue)
+            fBacktrack = true;
+        else if (nTotal >= nTargetValue)
         {
-            for (unsigned int i = 0; i < vValue.size(); i++)
-            {
-                if (nPass == 0 ? rand() % 2 : !vfIncluded[i])
-                {
-                    nTotal += vValue[i].first;
-                    vfIncluded[i] = true;
-                    if (nTotal >= nTargetValue)
-                    {
-                        fReachedTarget = true;
-                        if (nTotal < nBest)
-                        {
-                            nBest = nTotal;
-                            vfBest = vfIncluded;
-                        }
-                        nTotal -= vValue[i].first;
-                        vfIncluded[i] = false;
-                    }
-                }
-            }
+            if (!fFound)
+                nCommon = 0;
+            vBest.resize(nCommon);
+            vBest.insert(vBest.end(), vSelected.begin() + nCommon, vSelected.end());
+            nCommon = vSelected.size();
+            nBest = nUpper = nTotal;
+            fFound = true;
+            if (nTotal == nTargetValue)
+                break;
+            fBacktrack = true;
+        }
+
+        if (fBacktrack)
+        {
+            // Leave out the last coin taken, and the ones like it
+            if (vSelected.empty())
+                break;
+            unsigned int nLast = vSelected.back();
+            vSelected.pop_back();
+            nCommon = min(nCommon, (unsigned int)vSelected.size());
+            nTotal -= vValue[nLast].first;
+            for (i = nLast + 1; i < nSize && vValue[i].first == vValue[nLast].first; i++)
+                ;
+            continue;
         }
+
+        vSelected.push_back(i);
+        nTotal += vValue[i].first;
+        i++;
     }
+    return fFound;
 }
 
 // ppcoin: total coins staked (non-spendable until maturity)
 int64 CWallet::GetStake() const
 {
-    int64 nTotal = 0;
     LOCK(cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin);
-    }
-    return nTotal;
+    UpdateLedger();
+    return ledger.nStake;
 }
 
 int64 CWallet::GetNewMint() const
 {
-    int64 nTotal = 0;
     LOCK(cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin);
-    }
-    return nTotal;
+    UpdateLedger();
+    return ledger.nNewMint;
 }
 
-bool CWallet::SelectCoinsMinConf(int64 nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, vector<COutput> vCoins, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const
+bool CWallet::SelectCoinsMinConf(int64 nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, const vector<COutput>& vCoins, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const
 {
     setCoinsRet.clear();
     nValueRet = 0;
@@ -1136,9 +1580,7 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, unsigned int nSpendTime, in
     vector<pair<int64, pair<const CWalletTx*,unsigned int> > > vValue;
     int64 nTotalLower = 0;
 
-    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
-
-    BOOST_FOREACH(COutput output, vCoins)
+    BOOST_FOREACH(const COutput& output, vCoins)
     {
         const CWalletTx *pcoin = output.tx;
 
@@ -1190,17 +1632,38 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, unsigned int nSpendTime, in
         return true;
     }
 
-    // Solve subset sum by stochastic approximation
-    sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
-    vector<char> vfBest;
+    stable_sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
+    vector<unsigned int> vBest;
     int64 nBest;
 
-    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
-    if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
-        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
+    // A subset that leaves less change than CreateTransaction would put in
+    // an output needs no change output at all
+    if (SearchBestSubset(vValue, nTargetValue, nTargetValue + MIN_TXOUT_AMOUNT, vBest, nBest))
+    {
+        BOOST_FOREACH(unsigned int i, vBest)
+        {
+            setCoinsRet.insert(vValue[i].second);
+            nValueRet += vValue[i].first;
+        }
+        return true;
+    }
+
+    // Otherwise the smallest total over the target, better still with at
+    // least a cent of change, and all of them if nothing is found
+    if (!SearchBestSubset(vValue, nTargetValue, nTotalLower + 1, vBest, nBest))
+        nBest = nTotalLower;
+    if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT &&
+        !SearchBestSubset(vValue, nTargetValue + CENT, nTotalLower + 1, vBest, nBest))
+        nBest = nTotalLower;
+    if (nBest == nTotalLower)
+    {
+        vBest.resize(vValue.size());
+        for (unsigned int i = 0; i < vValue.size(); i++)
+            vBest[i] = i;
+    }
 
-    // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
-    //                                   or the next bigger coin is closer), return the bigger coin
+    // If we have a bigger coin and (either the subset search didn't find a good solution,
+    //                                or the next bigger coin is closer), return the bigger coin
     if (coinLowestLarger.second.first &&
         ((nBest != nTargetValue && nBest < nTargetValue + CENT) || coinLowestLarger.first <= nBest))
     {
@@ -1208,20 +1671,18 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, unsigned int nSpendTime, in
         nValueRet += coinLowestLarger.first;
     }
     else {
-        for (unsigned int i = 0; i < vValue.size(); i++)
-            if (vfBest[i])
-            {
-                setCoinsRet.insert(vValue[i].second);
-                nValueRet += vValue[i].first;
-            }
+        BOOST_FOREACH(unsigned int i, vBest)
+        {
+            setCoinsRet.insert(vValue[i].second);
+            nValueRet += vValue[i].first;
+        }
 
         if (fDebug && GetBoolArg("-printpriority"))
         {
             //// debug print
             printf("SelectCoins() best subset: ");
-            for (unsigned int i = 0; i < vValue.size(); i++)
-                if (vfBest[i])
-                    printf("%s ", FormatMoney(vValue[i].first).c_str());
+            BOOST_FOREACH(unsigned int i, vBest)
+                printf("%s ", FormatMoney(vValue[i].first).c_str());
             printf("total %s\n", FormatMoney(nBest).c_str());
         }
     }
@@ -1437,61 +1898,68 @@ bool CWallet::CreateTransaction(CScript scriptPubKey, int64 nValue, CWalletTx& w
 }
 
 // NovaCoin: get current stake weight
- bool CWallet::GetStakeWeight(const CKeyStore& keystore, uint64& nMinWeight, uint64& nMaxWeight, uint64& nWeight)
- {
-     // Choose coins to use
-     int64 nBalance = GetBalance();
- 
-     int64 nReserveBalance = 0;
-     if (mapArgs.count("-reservebalance") && !ParseMoney(mapArgs["-reservebalance"], nReserveBalance))
-         return error("GetStakeWeight : invalid reserve balance amount");
-     if (nBalance <= nReserveBalance)
-         return false;
- 
-     set<pair<const CWalletTx*,unsigned int> > setCoins;
-     vector<const CWalletTx*> vwtxPrev;
-     int64 nValueIn = 0;
- 
-     if (!SelectCoins(nBalance - nReserveBalance, GetTime(), setCoins, nValueIn))
-         return false;
- 
-     if (setCoins.empty())
-         return false;
- 
-     CTxDB txdb("r");
-     BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
-     {
-         CTxIndex txindex;
-         {
-             LOCK2(cs_main, cs_wallet);
-             if (!txdb.ReadTxIndex(pcoin.first->GetHash(), txindex))
-                 continue;
-         }
- 
-         int64 nTimeWeight = GetWeight((int64)pcoin.first->nTime, (int64)GetTime());
-         CBigNum bnCoinDayWeight = CBigNum(pcoin.first->vout[pcoin.second].nValue) * nTimeWeight / COIN / (24 * 60 * 60);
- 
-         // Weight is greater than zero
-         if (nTimeWeight > 0)
-         {
-             nWeight += bnCoinDayWeight.getuint64();
-         }
- 
-         // Weight is greater than zero, but the maximum value isn't reached yet
-         if (nTimeWeight > 0 && nTimeWeight < nStakeMaxAge)
-         {
-             nMinWeight += bnCoinDayWeight.getuint64();
-         }
- 
-         // Maximum weight was reached
-         if (nTimeWeight == nStakeMaxAge)
-         {
-             nMaxWeight += bnCoinDayWeight.getuint64();
-         }
-     }
- 
-     return true;
- }
+bool CWallet::GetStakeWeight(const CKeyStore& keystore, uint64& nMinWeight, uint64& nMaxWeight, uint64& nWeight)
+{
+    int64 nReserveBalance = 0;
+    if (mapArgs.count("-reservebalance") && !ParseMoney(mapArgs["-reservebalance"], nReserveBalance))
+        return error("GetStakeWeight : invalid reserve balance amount");
+
+    LOCK(cs_wallet);
+    UpdateLedger();
+    int64 nBalance = ledger.nAvailable;
+    if (nBalance <= nReserveBalance)
+        return false;
+
+    // Weights only change by the second
+    int64 nTime = GetTime();
+    if (!ledger.fWeightValid || ledger.nWeightTime != nTime || ledger.nWeightReserve != nReserveBalance)
+    {
+        ledger.nWeight = ledger.nMinWeight = ledger.nMaxWeight = 0;
+        int64 nValueIn = 0;
+        bool fReserveReached = false;
+        for (set<uint256>::const_iterator it = ledger.setUnspent.begin(); it != ledger.setUnspent.end() && !fReserveReached; ++it)
+        {
+            // What AvailableCoins gives the minter, as far as it is in the chain
+            const CWalletLedger::CEntry& entry = *ledger.GetEntry(*it);
+            if (!entry.IsSettled() || entry.nTime > nTime)
+                continue;
+            int64 nTimeWeight = GetWeight((int64)entry.nTime, nTime);
+            for (unsigned int i = 0; i < entry.vUnspent.size(); i++)
+            {
+                int64 nValue = entry.vUnspent[i].second;
+                // Leave out what -reservebalance keeps from staking
+                if (nReserveBalance > 0 && nValueIn + nValue > nBalance - nReserveBalance)
+                {
+                    fReserveReached = true;
+                    break;
+                }
+                nValueIn += nValue;
+
+                CBigNum bnCoinDayWeight = CBigNum(nValue) * nTimeWeight / COIN / (24 * 60 * 60);
+
+                // Weight is greater than zero
+                if (nTimeWeight > 0)
+                    ledger.nWeight += bnCoinDayWeight.getuint64();
+
+                // Weight is greater than zero, but the maximum value isn't reached yet
+                if (nTimeWeight > 0 && nTimeWeight < nStakeMaxAge)
+                    ledger.nMinWeight += bnCoinDayWeight.getuint64();
+
+                // Maximum weight was reached
+                if (nTimeWeight == nStakeMaxAge)
+                    ledger.nMaxWeight += bnCoinDayWeight.getuint64();
+            }
+        }
+        ledger.fWeightValid = true;
+        ledger.nWeightTime = nTime;
+        ledger.nWeightReserve = nReserveBalance;
+    }
+
+    nWeight += ledger.nWeight;
+    nMinWeight += ledger.nMinWeight;
+    nMaxWeight += ledger.nMaxWeight;
+    return true;
+}
 
 bool CWallet::GetStakeWeightFromValue(const int64& nTime, const int64& nValue, uint64& nWeight)
 {
@@ -1509,6 +1977,93 @@ bool CWallet::GetStakeWeightFromValue(const int64& nTime, const int64& nValue, u
 }
 
 
+// Bring the stake candidates up to date with the wallet and the best chain
+void CWallet::UpdateStakeCandidates()
+{
+    LOCK2(cs_main, cs_wallet);
+    if (stakeCandidates.hashBestChain == hashBestChain && !stakeCandidates.fPendingChanged)
+        return;
+
+    // Blocks the candidates came from may have been disconnected
+    if (stakeCandidates.hashBestChain != 0)
+    {
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(stakeCandidates.hashBestChain);
+        if (mi == mapBlockIndex.end() || !(*mi).second->IsInMainChain())
+            stakeCandidates.hashBestChain = 0;
+    }
+    if (stakeCandidates.hashBestChain == 0)
+    {
+        stakeCandidates.Clear();
+        for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            stakeCandidates.setPending.insert((*it).first);
+    }
+    stakeCandidates.hashBestChain = hashBestChain;
+    stakeCandidates.fPendingChanged = false;
+
+    CTxDB txdb("r");
+    for (set<uint256>::iterator it = stakeCandidates.setPending.begin(); it != stakeCandidates.setPending.end(); )
+    {
+        map<uint256, CWalletTx>::iterator mi = mapWallet.find(*it);
+        if (mi == mapWallet.end() || AddStakeCandidates(txdb, (*mi).second))
+            stakeCandidates.setPending.erase(it++);
+        else
+            ++it;
+    }
+}
+
+// Put the outputs of wtx that can stake into the candidate table, and take
+// out the ones that can't any more.  Returns false to look again after the
+// next block.
+bool CWallet::AddStakeCandidates(CTxDB& txdb, const CWalletTx& wtx)
+{
+    uint256 hash = wtx.GetHash();
+    if ((wtx.IsCoinBase() || wtx.IsCoinStake()) && wtx.GetBlocksToMaturity() > 0)
+        return false;
+
+    // Where the kernel hash says the transaction is
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(wtx.hashBlock);
+    if (mi == mapBlockIndex.end() || !(*mi).second->IsInMainChain())
+        return false;
+    const CBlockIndex* pindexFrom = (*mi).second;
+    CTxIndex txindex;
+    if (!txdb.ReadTxIndex(hash, txindex))
+        return false;
+    if (txindex.pos.nFile != pindexFrom->nFile || txindex.pos.nBlockPos != pindexFrom->nBlockPos)
+        return false;
+
+    uint64 nStakeModifier = 0;
+    int nStakeModifierHeight = 0;
+    int64 nStakeModifierTime = 0;
+    if (!GetKernelStakeModifier(wtx.hashBlock, nStakeModifier, nStakeModifierHeight, nStakeModifierTime, false))
+        return false;
+
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+    {
+        const CTxOut& txout = wtx.vout[i];
+        COutPoint prevout(hash, i);
+        stakeCandidates.Remove(prevout);
+        if (wtx.IsSpent(i) || !IsMine(txout) || txout.nValue <= 0)
+            continue;
+
+        // CreateCoinStake only pays to public keys it has
+        vector<valtype> vSolutions;
+        txnouttype whichType;
+        if (!Solver(txout.scriptPubKey, whichType, vSolutions))
+            continue;
+        if (whichType == TX_PUBKEYHASH)
+        {
+            if (!HaveKey(uint160(vSolutions[0])))
+                continue;
+        }
+        else if (whichType != TX_PUBKEY)
+            continue;
+
+        stakeCandidates.Add(CStakeCandidate(prevout, pindexFrom->nTime, txindex.pos.nTxPos - txindex.pos.nBlockPos,
+                                            wtx.nTime, txout.nValue, nStakeModifier));
+    }
+    return true;
+}
+
 // ppcoin: create coin stake transaction
 bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64 nSearchInterval, CTransaction& txNew)
 {
@@ -1537,139 +2092,146 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     if (nBalance <= nReserveBalance)
         return false;
 
-    set<pair<const CWalletTx*,unsigned int> > setCoins;
-    vector<const CWalletTx*> vwtxPrev;
-    int64 nValueIn = 0;
-    if (!SelectCoins(nBalance - nReserveBalance, txNew.nTime, setCoins, nValueIn))
+    // Take the candidates as of now, so the search runs without the locks
+    UpdateStakeCandidates();
+    vector<CStakeCandidate> vCandidates;
+    {
+        LOCK(cs_wallet);
+        vCandidates = stakeCandidates.GetCandidates();
+    }
+
+    // Leave out what -reservebalance keeps from staking
+    if (nReserveBalance > 0)
+    {
+        int64 nValueIn = 0;
+        unsigned int nCount = 0;
+        for (; nCount < vCandidates.size(); nCount++)
+        {
+            if (nValueIn + vCandidates[nCount].nValue > nBalance - nReserveBalance)
+                break;
+            nValueIn += vCandidates[nCount].nValue;
+        }
+        vCandidates.resize(nCount);
+    }
+
+    if (vCandidates.empty())
         return false;
 
-    if (setCoins.empty())
+    static int nMaxStakeSearchInterval = 60;
+    unsigned int nTimeTx = txNew.nTime;
+    uint256 hashProofOfStake = 0;
+    int nKernel = stakeSearchQueue.Search(vCandidates, nBits, txNew.nTime, min(nSearchInterval, (int64)nMaxStakeSearchInterval), nTimeTx, hashProofOfStake);
+    if (nKernel < 0)
         return false;
+    const CStakeCandidate& kernel = vCandidates[nKernel];
+    if (fDebug && GetBoolArg("-printcoinstake"))
+        printf("CreateCoinStake : kernel found\n");
 
-    int64 nCredit = 0;
-    CScript scriptPubKeyKernel;
-    BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
+    // The table may be behind the wallet: the coin has to be there and
+    // unspent still, and pass the full check against the disk
+    const CWalletTx* pcoinKernel = NULL;
     {
+        LOCK2(cs_main, cs_wallet);
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(kernel.prevout.hash);
+        if (mi == mapWallet.end() || kernel.prevout.n >= (*mi).second.vout.size() || (*mi).second.IsSpent(kernel.prevout.n))
+            return false;
+        pcoinKernel = &(*mi).second;
+
         CTxDB txdb("r");
         CTxIndex txindex;
-		{
-		    LOCK2(cs_main, cs_wallet);
-			if (!txdb.ReadTxIndex(pcoin.first->GetHash(), txindex))
-				continue;
-		}
-
-        // Read block header
+        if (!txdb.ReadTxIndex(kernel.prevout.hash, txindex))
+            return false;
         CBlock block;
-		{
-		    LOCK2(cs_main, cs_wallet);
-			if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
-				continue;
-		}
+        if (!ReadStakeBlockHeader(txindex.pos.nFile, txindex.pos.nBlockPos, block))
+            return false;
+        uint256 hashProofCheck = 0;
+        if (!CheckStakeKernelHash(nBits, block, txindex.pos.nTxPos - txindex.pos.nBlockPos, *pcoinKernel, kernel.prevout, nTimeTx, hashProofCheck) || hashProofCheck != hashProofOfStake)
+            return error("CreateCoinStake : stake candidate %s:%u out of date", kernel.prevout.hash.ToString().c_str(), kernel.prevout.n);
+    }
 
-        static int nMaxStakeSearchInterval = 60;
-		
-		// printf(">> block.GetBlockTime() = %" PRI64d ", nStakeMinAge = %d, txNew.nTime = %d\n", block.GetBlockTime(), nStakeMinAge,txNew.nTime); 
-        if (block.GetBlockTime() + nStakeMinAge > txNew.nTime - nMaxStakeSearchInterval)
-            continue; // only count coins meeting min age requirement
-
-        bool fKernelFound = false;
-        for (unsigned int n=0; n<min(nSearchInterval,(int64)nMaxStakeSearchInterval) && !fKernelFound && !fShutdown; n++)
-        {
-			// printf(">> In.....\n");
-            // Search backward in time from the given txNew timestamp 
-            // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
-            uint256 hashProofOfStake = 0;
-            COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
-            if (CheckStakeKernelHash(nBits, block, txindex.pos.nTxPos - txindex.pos.nBlockPos, *pcoin.first, prevoutStake, txNew.nTime - n, hashProofOfStake))
+    vector<const CWalletTx*> vwtxPrev;
+    int64 nCredit = 0;
+    CScript scriptPubKeyKernel = pcoinKernel->vout[kernel.prevout.n].scriptPubKey;
+    {
+        vector<valtype> vSolutions;
+        txnouttype whichType;
+        CScript scriptPubKeyOut;
+        if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
+        {
+            if (fDebug && GetBoolArg("-printcoinstake"))
+                printf("CreateCoinStake : failed to parse kernel\n");
+            return false;
+        }
+        if (fDebug && GetBoolArg("-printcoinstake"))
+            printf("CreateCoinStake : parsed kernel type=%d\n", whichType);
+        if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
+        {
+            if (fDebug && GetBoolArg("-printcoinstake"))
+                printf("CreateCoinStake : no support for kernel type=%d\n", whichType);
+            return false;  // only support pay to public key and pay to address
+        }
+        if (whichType == TX_PUBKEYHASH) // pay to address type
+        {
+            // convert to pay to public key type
+            CKey key;
+            if (!keystore.GetKey(uint160(vSolutions[0]), key))
             {
-               // Found a kernel
-                if (fDebug && GetBoolArg("-printcoinstake"))
-                    printf("CreateCoinStake : kernel found\n");
-                vector<valtype> vSolutions;
-                txnouttype whichType;
-                CScript scriptPubKeyOut;
-                scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
-                if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
-                {
-                    if (fDebug && GetBoolArg("-printcoinstake"))
-                        printf("CreateCoinStake : failed to parse kernel\n");
-                    break;
-                }
-                if (fDebug && GetBoolArg("-printcoinstake"))
-                    printf("CreateCoinStake : parsed kernel type=%d\n", whichType);
-                if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
-                {
-                    if (fDebug && GetBoolArg("-printcoinstake"))
-                        printf("CreateCoinStake : no support for kernel type=%d\n", whichType);
-                    break;  // only support pay to public key and pay to address
-                }
-                if (whichType == TX_PUBKEYHASH) // pay to address type
-                {
-                    // convert to pay to public key type
-                    CKey key;
-                    if (!keystore.GetKey(uint160(vSolutions[0]), key))
-                    {
-                        if (fDebug && GetBoolArg("-printcoinstake"))
-                            printf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-                    scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
-                }
-                else
-                    scriptPubKeyOut = scriptPubKeyKernel;
-
-                txNew.nTime -= n; 
-                txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
-                nCredit += pcoin.first->vout[pcoin.second].nValue;
-
-				// printf(">> Wallet: CreateCoinStake: nCredit = %" PRI64d "\n", nCredit);
-
-                vwtxPrev.push_back(pcoin.first);
-                txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
-                if (block.GetBlockTime() + nStakeSplitAge > txNew.nTime)
-                    txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
-
                 if (fDebug && GetBoolArg("-printcoinstake"))
-                    printf("CreateCoinStake : added kernel type=%d\n", whichType);
-                fKernelFound = true;
-                break;
+                    printf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                return false;  // unable to find corresponding public key
             }
+            scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
         }
-        if (fKernelFound || fShutdown)
-            break; // if kernel is found stop searching
+        else
+            scriptPubKeyOut = scriptPubKeyKernel;
+
+        txNew.nTime = nTimeTx;
+        txNew.vin.push_back(CTxIn(kernel.prevout));
+        nCredit += kernel.nValue;
+        vwtxPrev.push_back(pcoinKernel);
+        txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+        if (kernel.nTimeBlockFrom + nStakeSplitAge > txNew.nTime)
+            txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
+
+        if (fDebug && GetBoolArg("-printcoinstake"))
+            printf("CreateCoinStake : added kernel type=%d\n", whichType);
     }
     if (nCredit == 0 || nCredit > nBalance - nReserveBalance)
-	{
-		// printf(">> Wallet: CreateCoinStake: nCredit = % " PRI64d ", nBalance = %" PRI64d ", nReserveBalance = %" PRI64d "\n", nCredit, nBalance, nReserveBalance);
         return false;
-	}
 
-    BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
+    BOOST_FOREACH(const CStakeCandidate& candidate, vCandidates)
     {
         // Attempt to add more inputs
         // Only add coins of the same key/address as kernel
-        if (txNew.vout.size() == 2 && ((pcoin.first->vout[pcoin.second].scriptPubKey == scriptPubKeyKernel || pcoin.first->vout[pcoin.second].scriptPubKey == txNew.vout[1].scriptPubKey))
-            && pcoin.first->GetHash() != txNew.vin[0].prevout.hash)
-        {
-            // Stop adding more inputs if already too many inputs
-            if (txNew.vin.size() >= 100)
-                break;
-            // Stop adding more inputs if value is already pretty significant
-            if (nCredit > nCombineThreshold)
-                break;
-            // Stop adding inputs if reached reserve limit
-            if (nCredit + pcoin.first->vout[pcoin.second].nValue > nBalance - nReserveBalance)
-                break;
-            // Do not add additional significant input
-            if (pcoin.first->vout[pcoin.second].nValue > nCombineThreshold)
-                continue;
-            // Do not add input that is still too young
-            if (pcoin.first->nTime + nStakeMaxAge > txNew.nTime)
-                continue;
-            txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
-            nCredit += pcoin.first->vout[pcoin.second].nValue;
-            vwtxPrev.push_back(pcoin.first);
-        }
+        if (txNew.vout.size() != 2 || candidate.prevout.hash == txNew.vin[0].prevout.hash)
+            continue;
+        // Stop adding more inputs if already too many inputs
+        if (txNew.vin.size() >= 100)
+            break;
+        // Stop adding more inputs if value is already pretty significant
+        if (nCredit > nCombineThreshold)
+            break;
+        // Do not add additional significant input
+        if (candidate.nValue > nCombineThreshold)
+            continue;
+        // Do not add input that is still too young
+        if (candidate.nTimeTxPrev + nStakeMaxAge > txNew.nTime)
+            continue;
+
+        LOCK(cs_wallet);
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(candidate.prevout.hash);
+        if (mi == mapWallet.end() || (*mi).second.IsSpent(candidate.prevout.n))
+            continue;
+        const CWalletTx* pcoin = &(*mi).second;
+        const CScript& scriptPubKey = pcoin->vout[candidate.prevout.n].scriptPubKey;
+        if (scriptPubKey != scriptPubKeyKernel && scriptPubKey != txNew.vout[1].scriptPubKey)
+            continue;
+        // Stop adding inputs if reached reserve limit
+        if (nCredit + candidate.nValue > nBalance - nReserveBalance)
+            break;
+        txNew.vin.push_back(CTxIn(candidate.prevout));
+        nCredit += candidate.nValue;
+        vwtxPrev.push_back(pcoin);
     }
     // Calculate coin age reward
     {
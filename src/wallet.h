@@ -17,6 +17,7 @@
 #include "ui_interface.h"
 #include "util.h"
 #include "walletdb.h"
+#include "staker.h"
 
 // by Simone: suspend all sending, emergency flag
 extern bool nSendSuspended;
@@ -27,6 +28,11 @@ class CReserveKey;
 class COutput;
 class CCoinControl;
 
+/** Maximum number of threads reading blocks for a rescan */
+static const int MAX_RESCAN_THREADS = 16;
+/** Blocks a rescan thread reads at a time */
+static const unsigned int RESCAN_BATCH_SIZE = 64;
+
 /** (client) version numbers for particular wallet features */
 enum WalletFeature
 {
@@ -66,6 +72,142 @@ public:
     )
 };
 
+/** The key and script hashes of a wallet, to pass over the outputs of a
+ * rescan that can't be ours without running IsMine on them.
+ *
+ * Every script IsMine accepts has a push of one of the wallet's key IDs,
+ * script IDs or public keys, so looking for those among the pushes finds a
+ * superset of the outputs that are ours.  It is a copy, safe to use from
+ * any thread while the keys it was built from change.
+ */
+class CWalletScanFilter
+{
+private:
+    std::set<uint160> setHash;
+
+public:
+    CWalletScanFilter(const CBasicKeyStore& keystore);
+
+    bool MayBeMine(const CScript& scriptPubKey) const;
+};
+
+/** The balances and unspent outputs of a wallet, kept as the sum of what
+ * each transaction adds to them, so the balance queries the GUI and getinfo
+ * poll, coin selection and the stake weight don't go over all of mapWallet.
+ *
+ * The share of a transaction is worked out again when it changes:
+ * AddToWallet, EraseFromWallet and the spent flags mark it dirty.  Depth,
+ * maturity and finality move with the chain, but only for transactions that
+ * aren't settled yet (final, confirmed and mature in a block), so a new best
+ * block works out those in setUnsettled again, along with those in blocks
+ * above the fork when blocks were disconnected, and a time lock running out
+ * works out those in setUnsettled.  Only CWallet::MarkDirty has all of them
+ * worked out again.
+ *
+ * Guarded by the wallet's cs_wallet.
+ */
+class CWalletLedger
+{
+public:
+    class CEntry
+    {
+    public:
+        int64 nAvailable;
+        int64 nUnconfirmed;
+        int64 nImmature;
+        int64 nStake;
+        int64 nNewMint;
+        // Status as AvailableCoins filters on it, and the height of the
+        // block the transaction is in or -1
+        bool fFinal;
+        bool fConfirmed;
+        bool fImmature;
+        int nHeight;
+        unsigned int nTime;
+        // Outputs to us not spent yet, with their values
+        std::vector<std::pair<unsigned int, int64> > vUnspent;
+
+        CEntry()
+        {
+            nAvailable = nUnconfirmed = nImmature = nStake = nNewMint = 0;
+            fFinal = fConfirmed = fImmature = false;
+            nHeight = -1;
+            nTime = 0;
+        }
+
+        // Nothing but spending an output or a disconnected block changes it
+        bool IsSettled() const
+        {
+            return fFinal && fConfirmed && !fImmature && nHeight >= 0;
+        }
+
+        int GetDepthInMainChain() const
+        {
+            return nHeight >= 0 ? nBestHeight - nHeight + 1 : 0;
+        }
+    };
+
+    std::map<uint256, CEntry> mapEntries;
+    std::set<uint256> setDirty;
+    // Transactions that aren't settled, and those with unspent outputs
+    std::set<uint256> setUnsettled;
+    std::set<uint256> setUnspent;
+    // Unspent outputs by value
+    std::set<std::pair<int64, COutPoint> > setUnspentByValue;
+    // Whether the entries are there at all, and the best block they were
+    // worked out at
+    bool fValid;
+    uint256 hashBestChain;
+    // When a time locked transaction becomes final
+    int64 nTimeLockNext;
+
+    int64 nAvailable;
+    int64 nUnconfirmed;
+    int64 nImmature;
+    int64 nStake;
+    int64 nNewMint;
+
+    // The last stake weight worked out, and the time and reserve it was for
+    bool fWeightValid;
+    int64 nWeightTime;
+    int64 nWeightReserve;
+    uint64 nWeight;
+    uint64 nMinWeight;
+    uint64 nMaxWeight;
+
+    CWalletLedger()
+    {
+        fValid = false;
+        hashBestChain = 0;
+        nTimeLockNext = std::numeric_limits<int64>::max();
+        nAvailable = nUnconfirmed = nImmature = nStake = nNewMint = 0;
+        fWeightValid = false;
+        nWeightTime = nWeightReserve = 0;
+        nWeight = nMinWeight = nMaxWeight = 0;
+    }
+
+    void MarkDirty(const uint256& hash)
+    {
+        setDirty.insert(hash);
+        fWeightValid = false;
+    }
+
+    void MarkAllDirty()
+    {
+        fValid = false;
+        fWeightValid = false;
+    }
+
+    const CEntry* GetEntry(const uint256& hash) const
+    {
+        std::map<uint256, CEntry>::const_iterator mi = mapEntries.find(hash);
+        return mi == mapEntries.end() ? NULL : &(*mi).second;
+    }
+
+    void Insert(const uint256& hash, const CEntry& entry);
+    void Erase(const uint256& hash);
+};
+
 /** A CWallet is an extension of a keystore, which also maintains a set of transactions and balances,
  * and provides the ability to create new transactions.
  */
@@ -82,6 +224,14 @@ private:
     // the maximum wallet format version: memory-only variable that specifies to what version this wallet may be upgraded
     int nWalletMaxVersion;
 
+    // The pay-to-pubkey-hash and pay-to-pubkey scripts of every key, and
+    // the hashes of the scripts held, so IsMine neither runs Solver nor
+    // goes through the keystore for outputs that aren't ours.  Guarded by
+    // cs_KeyStore.
+    std::set<CScript> setMineScripts;
+    std::set<CScriptID> setMineScriptIDs;
+    void AddMineScripts(const CPubKey& vchPubKey);
+
 public:
     mutable CCriticalSection cs_wallet;
 
@@ -91,6 +241,9 @@ public:
 
     std::set<int64> setKeyPool;
 
+    // Set to stop the rescan running
+    bool fAbortRescan;
+
 
     typedef std::map<unsigned int, CMasterKey> MasterKeyMap;
     MasterKeyMap mapMasterKeys;
@@ -105,6 +258,7 @@ public:
         pwalletdbEncryption = NULL;
         nOrderPosNext = 0;
         fWalletUnlockMintOnly = false;
+        fAbortRescan = false;
     }
     CWallet(std::string strWalletFileIn)
     {
@@ -116,12 +270,19 @@ public:
         pwalletdbEncryption = NULL;
         nOrderPosNext = 0;
         fWalletUnlockMintOnly = false;
+        fAbortRescan = false;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
     int64 nOrderPosNext;
     std::map<uint256, int> mapRequestCount;
 
+    // Outputs CreateCoinStake hashes for a kernel; a cache of mapWallet,
+    // which the wallet transactions update as their outputs get spent
+    mutable CStakeCandidateTable stakeCandidates;
+    // Running balances, worked out as they are asked for
+    mutable CWalletLedger ledger;
+
     std::map<CTxDestination, std::string> mapAddressBook;
 
     CPubKey vchDefaultKey;
@@ -130,23 +291,25 @@ public:
     bool CanSupportFeature(enum WalletFeature wf) { return nWalletMaxVersion >= wf; }
 
     void AvailableCoins(std::vector<COutput>& vCoins, bool fOnlyConfirmed=true, const CCoinControl *coinControl=NULL) const;
-    bool SelectCoinsMinConf(int64 nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const;
+    bool SelectCoinsMinConf(int64 nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const;
     // keystore implementation
     // Generate a new key
     CPubKey GenerateNewKey();
     // Adds a key to the store, and saves it to disk.
     bool AddKey(const CKey& key);
     // Adds a key to the store, without saving it to disk (used by LoadWallet)
-    bool LoadKey(const CKey& key) { return CCryptoKeyStore::AddKey(key); }
+    bool LoadKey(const CKey& key);
+    // Same, for a secret not yet checked against its public key
+    bool LoadKey(const CPubKey& vchPubKey, const CSecret& vchSecret);
 
     bool LoadMinVersion(int nVersion) { nWalletVersion = nVersion; nWalletMaxVersion = std::max(nWalletMaxVersion, nVersion); return true; }
 
     // Adds an encrypted key to the store, and saves it to disk.
     bool AddCryptedKey(const CPubKey &vchPubKey, const std::vector<unsigned char> &vchCryptedSecret);
     // Adds an encrypted key to the store, without saving it to disk (used by LoadWallet)
-    bool LoadCryptedKey(const CPubKey &vchPubKey, const std::vector<unsigned char> &vchCryptedSecret) { SetMinVersion(FEATURE_WALLETCRYPT); return CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret); }
+    bool LoadCryptedKey(const CPubKey &vchPubKey, const std::vector<unsigned char> &vchCryptedSecret);
     bool AddCScript(const CScript& redeemScript);
-    bool LoadCScript(const CScript& redeemScript) { return CCryptoKeyStore::AddCScript(redeemScript); }
+    bool LoadCScript(const CScript& redeemScript);
 
     bool Unlock(const SecureString& strWalletPassphrase);
     bool ChangeWalletPassphrase(const SecureString& strOldWalletPassphrase, const SecureString& strNewWalletPassphrase);
@@ -171,7 +334,8 @@ public:
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate = false, bool fFindBlock = false);
     bool EraseFromWallet(uint256 hash);
     void WalletUpdateSpent(const CTransaction& prevout);
-    int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false, int numBlocks = 0);
+    int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false, bool fShowProgress = false);
+    void AbortRescan() { fAbortRescan = true; }
     int ScanForWalletTransaction(const uint256& hashTx);
     void ReacceptWalletTransactions();
     void ResendWalletTransactions();
@@ -180,12 +344,16 @@ public:
     int64 GetImmatureBalance() const;
     int64 GetStake() const;
     int64 GetNewMint() const;
+    void UpdateLedger() const;
+    void GetLedgerEntry(const CWalletTx& wtx, CWalletLedger::CEntry& entry) const;
     bool CreateTransaction(const std::vector<std::pair<CScript, int64> >& vecSend, CWalletTx& wtxNew, CReserveKey& reservekey, int64& nFeeRet, const CCoinControl *coinControl=NULL);
     bool CreateTransaction(CScript scriptPubKey, int64 nValue, CWalletTx& wtxNew, CReserveKey& reservekey, int64& nFeeRet, const CCoinControl *coinControl=NULL);
     bool CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey);
     bool GetStakeWeight(const CKeyStore& keystore, uint64& nMinWeight, uint64& nMaxWeight, uint64& nWeight);
     bool GetStakeWeightFromValue(const int64& nTime, const int64& nValue, uint64& nWeight);
     bool CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64 nSearchInterval, CTransaction& txNew);
+    void UpdateStakeCandidates();
+    bool AddStakeCandidates(CTxDB& txdb, const CWalletTx& wtx);
     std::string SendMoney(CScript scriptPubKey, int64 nValue, CWalletTx& wtxNew, bool fAskFee=false);
     std::string SendMoneyToDestination(const CTxDestination &address, int64 nValue, CWalletTx& wtxNew, bool fAskFee=false);
 
@@ -204,9 +372,10 @@ public:
 
     bool IsMine(const CTxIn& txin) const;
     int64 GetDebit(const CTxIn& txin) const;
+    bool IsMine(const CScript& scriptPubKey) const;
     bool IsMine(const CTxOut& txout) const
     {
-        return ::IsMine(*this, txout.scriptPubKey);
+        return IsMine(txout.scriptPubKey);
     }
     int64 GetCredit(const CTxOut& txout) const
     {
@@ -544,6 +713,13 @@ public:
         {
             vfSpent[nOut] = true;
             fAvailableCreditCached = false;
+            if (pwallet)
+            {
+                uint256 hash = GetHash();
+                LOCK(pwallet->cs_wallet);
+                pwallet->stakeCandidates.Remove(COutPoint(hash, nOut));
+                pwallet->ledger.MarkDirty(hash);
+            }
         }
     }
 
@@ -556,6 +732,13 @@ public:
         {
             vfSpent[nOut] = false;
             fAvailableCreditCached = false;
+            if (pwallet)
+            {
+                uint256 hash = GetHash();
+                LOCK(pwallet->cs_wallet);
+                pwallet->stakeCandidates.AddPending(hash);
+                pwallet->ledger.MarkDirty(hash);
+            }
         }
     }
 
@@ -182,10 +182,15 @@ CWalletDB::ReorderTransactions(CWallet* pwallet)
 }
 
 
+// With fDeferKeyChecks, keys are loaded without checking their secrets
+// against their public keys, which the key store does when they are used.
+// pfValidTx, if given, says a "tx" record was already unserialized into its
+// mapWallet entry and whether it passed the checks.
 bool
 ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
              int& nFileVersion, vector<uint256>& vWalletUpgrade,
-             bool& fIsEncrypted,  bool& fAnyUnordered, string& strType, string& strErr)
+             bool& fIsEncrypted,  bool& fAnyUnordered, string& strType, string& strErr,
+             bool fDeferKeyChecks = false, const bool* pfValidTx = NULL)
 {
     try {
         // Unserialize
@@ -203,8 +208,15 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
             uint256 hash;
             ssKey >> hash;
             CWalletTx& wtx = pwallet->mapWallet[hash];
-            ssValue >> wtx;
-            if (wtx.CheckTransaction() && (wtx.GetHash() == hash))
+            bool fValid;
+            if (pfValidTx)
+                fValid = *pfValidTx;
+            else
+            {
+                ssValue >> wtx;
+                fValid = wtx.CheckTransaction() && (wtx.GetHash() == hash);
+            }
+            if (fValid)
                 wtx.BindWallet(pwallet);
             else
             {
@@ -264,50 +276,49 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
         {
             vector<unsigned char> vchPubKey;
             ssKey >> vchPubKey;
-            CKey key;
+            CPrivKey pkey;
+            string strKeyClass;
             if (strType == "key")
             {
-                CPrivKey pkey;
                 ssValue >> pkey;
-                key.SetPubKey(vchPubKey);
-                if (!key.SetPrivKey(pkey))
-                {
-                    strErr = "Error reading wallet database: CPrivKey corrupt";
-                    return false;
-                }
-                if (key.GetPubKey() != vchPubKey)
-                {
-                    strErr = "Error reading wallet database: CPrivKey pubkey inconsistency";
-                    return false;
-                }
-                if (!key.IsValid())
-                {
-                    strErr = "Error reading wallet database: invalid CPrivKey";
-                    return false;
-                }
+                strKeyClass = "CPrivKey";
             }
             else
             {
                 CWalletKey wkey;
                 ssValue >> wkey;
+                pkey = wkey.vchPrivKey;
+                strKeyClass = "CWalletKey";
+            }
+
+            // Checking the secret against the public key takes elliptic curve
+            // arithmetic, so for a big wallet it waits until the key is used
+            CSecret secret;
+            bool fLoaded;
+            if (fDeferKeyChecks && CKey::ExtractSecret(pkey, secret))
+                fLoaded = pwallet->LoadKey(CPubKey(vchPubKey), secret);
+            else
+            {
+                CKey key;
                 key.SetPubKey(vchPubKey);
-                if (!key.SetPrivKey(wkey.vchPrivKey))
+                if (!key.SetPrivKey(pkey))
                 {
                     strErr = "Error reading wallet database: CPrivKey corrupt";
                     return false;
                 }
                 if (key.GetPubKey() != vchPubKey)
                 {
-                    strErr = "Error reading wallet database: CWalletKey pubkey inconsistency";
+                    strErr = "Error reading wallet database: " + strKeyClass + " pubkey inconsistency";
                     return false;
                 }
                 if (!key.IsValid())
                 {
-                    strErr = "Error reading wallet database: invalid CWalletKey";
+                    strErr = "Error reading wallet database: invalid " + strKeyClass;
                     return false;
                 }
+                fLoaded = pwallet->LoadKey(key);
             }
-            if (!pwallet->LoadKey(key))
+            if (!fLoaded)
             {
                 strErr = "Error reading wallet database: LoadKey failed";
                 return false;
@@ -380,6 +391,158 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
     return true;
 }
 
+/** A record of the wallet database, read ahead of being loaded */
+struct CWalletRecord
+{
+    CDataStream ssKey;
+    CDataStream ssValue;
+    // For "tx" records, the mapWallet entry it is unserialized into, and
+    // whether it passed CheckTransaction and matched its hash
+    uint256 hash;
+    CWalletTx* pwtx;
+    bool fValid;
+
+    CWalletRecord() : ssKey(SER_DISK, CLIENT_VERSION), ssValue(SER_DISK, CLIENT_VERSION), pwtx(NULL), fValid(false)
+    {
+    }
+};
+
+// Read every record of the database with bulk cursor gets, a buffer full
+// of key/value pairs at a time, as LoadBlockIndexGuts does
+static int ReadWalletRecords(Db* pdb, deque<CWalletRecord>& vRecords)
+{
+    DB* dbp = pdb->get_DB();
+    DBC* dbcp = NULL;
+    int ret = dbp->cursor(dbp, NULL, &dbcp, 0);
+    if (ret != 0)
+        return ret;
+
+    vector<unsigned char> vBuffer(WALLETLOAD_BUFFER_SIZE);
+    DBT key, data;
+    memset(&key, 0, sizeof(key));
+    memset(&data, 0, sizeof(data));
+    data.data = &vBuffer[0];
+    data.ulen = vBuffer.size();
+    data.flags = DB_DBT_USERMEM;
+
+    loop()
+    {
+        ret = dbcp->c_get(dbcp, &key, &data, DB_MULTIPLE_KEY | DB_NEXT);
+        if (ret == DB_BUFFER_SMALL)
+        {
+            // The next record doesn't fit; the buffer has to be a multiple
+            // of 1024 bytes
+            unsigned int nSize = max((unsigned int)vBuffer.size() * 2, (data.size / 1024 + 1) * 1024);
+            memset(&vBuffer[0], 0, vBuffer.size());
+            vector<unsigned char>(nSize).swap(vBuffer);
+            data.data = &vBuffer[0];
+            data.ulen = vBuffer.size();
+            continue;
+        }
+        if (ret != 0)
+            break;
+
+        void* p;
+        unsigned char *retkey, *retdata;
+        size_t retklen, retdlen;
+        for (DB_MULTIPLE_INIT(p, &data);;)
+        {
+            DB_MULTIPLE_KEY_NEXT(p, &data, retkey, retklen, retdata, retdlen);
+            if (p == NULL)
+                break;
+            vRecords.push_back(CWalletRecord());
+            CWalletRecord& record = vRecords.back();
+            record.ssKey.write((char*)retkey, retklen);
+            record.ssValue.write((char*)retdata, retdlen);
+        }
+    }
+    dbcp->c_close(dbcp);
+
+    // Private keys went through the buffer
+    memset(&vBuffer[0], 0, vBuffer.size());
+    return (ret == DB_NOTFOUND) ? 0 : ret;
+}
+
+/** Unserializes and checks the "tx" records of a wallet being loaded, in
+ * batches of WALLETLOAD_BATCH_SIZE, on worker threads and the thread that
+ * runs it.  Every record has its mapWallet entry made beforehand, so
+ * mapWallet itself isn't touched. */
+class CWalletTxDecoder
+{
+private:
+    boost::mutex cs;
+    boost::condition_variable condDone;
+    const vector<CWalletRecord*>& vTx;
+    // First record not handed out yet, and workers not finished
+    unsigned int nNext;
+    int nRunning;
+
+    static void Decode(CWalletRecord& record)
+    {
+        try {
+            record.ssValue >> *record.pwtx;
+            record.fValid = record.pwtx->CheckTransaction() && (record.pwtx->GetHash() == record.hash);
+        }
+        catch (...) {
+            record.fValid = false;
+        }
+    }
+
+    void Work()
+    {
+        loop()
+        {
+            unsigned int nBegin, nEnd;
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                if (nNext >= vTx.size())
+                    return;
+                nBegin = nNext;
+                nNext = nEnd = min(nBegin + WALLETLOAD_BATCH_SIZE, (unsigned int)vTx.size());
+            }
+            for (unsigned int i = nBegin; i < nEnd; i++)
+                Decode(*vTx[i]);
+        }
+    }
+
+    static void ThreadWorker(void* parg)
+    {
+        RenameThread("litecoinplus-walletload");
+        CWalletTxDecoder* decoder = (CWalletTxDecoder*)parg;
+        decoder->Work();
+        boost::unique_lock<boost::mutex> lock(decoder->cs);
+        decoder->nRunning--;
+        decoder->condDone.notify_all();
+    }
+
+public:
+    CWalletTxDecoder(const vector<CWalletRecord*>& vTxIn) : vTx(vTxIn), nNext(0), nRunning(0)
+    {
+    }
+
+    // Returns once every record is done, with nThreads - 1 workers helping
+    void Run(int nThreads)
+    {
+        for (int i = 1; i < nThreads; i++)
+        {
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                nRunning++;
+            }
+            if (!NewThread(ThreadWorker, this))
+            {
+                printf("Error: NewThread(ThreadWorker) failed\n");
+                boost::unique_lock<boost::mutex> lock(cs);
+                nRunning--;
+            }
+        }
+        Work();
+        boost::unique_lock<boost::mutex> lock(cs);
+        while (nRunning > 0)
+            condDone.wait(lock);
+    }
+};
+
 static bool IsKeyType(string strType)
 {
     return (strType== "key" || strType == "wkey" ||
@@ -406,32 +569,50 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
             pwallet->LoadMinVersion(nMinVersion);
         }
 
-        // Get cursor
-        Dbc* pcursor = GetCursor();
-        if (!pcursor)
+        // Read the whole database up front
+        int64 nStart = GetTimeMillis();
+        deque<CWalletRecord> vRecords;
+        if (ReadWalletRecords(pdb, vRecords) != 0)
         {
-            printf("Error getting wallet database cursor\n");
+            printf("Error reading wallet database\n");
             return DB_CORRUPT;
         }
+        int64 nTimeRead = GetTimeMillis() - nStart;
 
-        loop()
+        // Transactions are most of a big wallet, and unserializing and
+        // checking them is most of the work, so that is spread over threads
+        vector<CWalletRecord*> vTx;
+        BOOST_FOREACH(CWalletRecord& record, vRecords)
         {
-            // Read next record
-            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-            int ret = ReadAtCursor(pcursor, ssKey, ssValue);
-            if (ret == DB_NOTFOUND)
-                break;
-            else if (ret != 0)
-            {
-                printf("Error reading next record from wallet database\n");
-                return DB_CORRUPT;
+            try {
+                CDataStream ssKey(record.ssKey);
+                string strType;
+                ssKey >> strType;
+                if (strType == "tx")
+                {
+                    ssKey >> record.hash;
+                    record.pwtx = &pwallet->mapWallet[record.hash];
+                    vTx.push_back(&record);
+                }
             }
-
+            catch (...) {
+                // ReadKeyValue will complain about it
+            }
+        }
+        int nThreads = max(1, min((int)boost::thread::hardware_concurrency(), MAX_WALLETLOAD_THREADS));
+        if (vTx.size() < 2 * WALLETLOAD_BATCH_SIZE)
+            nThreads = 1;
+        CWalletTxDecoder(vTx).Run(nThreads);
+        int64 nTimeDecode = GetTimeMillis() - nStart - nTimeRead;
+
+        unsigned int nKeys = 0;
+        BOOST_FOREACH(CWalletRecord& record, vRecords)
+        {
             // Try to be tolerant of single corrupt records:
             string strType, strErr;
-            if (!ReadKeyValue(pwallet, ssKey, ssValue, nFileVersion,
-                              vWalletUpgrade, fIsEncrypted, fAnyUnordered, strType, strErr))
+            if (!ReadKeyValue(pwallet, record.ssKey, record.ssValue, nFileVersion,
+                              vWalletUpgrade, fIsEncrypted, fAnyUnordered, strType, strErr,
+                              true, record.pwtx ? &record.fValid : NULL))
             {
                 // losing keys is considered a catastrophic error, anything else
                 // we assume the user can live with:
@@ -448,8 +629,12 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
             }
             if (!strErr.empty())
                 printf("%s\n", strErr.c_str());
+            if (strType == "key" || strType == "wkey")
+                nKeys++;
         }
-        pcursor->close();
+        int64 nTimeApply = GetTimeMillis() - nStart - nTimeRead - nTimeDecode;
+        printf("Wallet load: %u records read in %" PRI64d "ms, %u transactions checked in %" PRI64d "ms on %d threads, loaded in %" PRI64d "ms (%u keys checked when first used)\n",
+               (unsigned int)vRecords.size(), nTimeRead, (unsigned int)vTx.size(), nTimeDecode, nThreads, nTimeApply, nKeys);
     }
     catch (...)
     {
@@ -477,7 +662,11 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
         WriteVersion(CLIENT_VERSION);
 
     if (fAnyUnordered)
+    {
+        int64 nStartReorder = GetTimeMillis();
         result = ReorderTransactions(pwallet);
+        printf("Wallet transactions reordered in %" PRI64d "ms\n", GetTimeMillis() - nStartReorder);
+    }
 
     return result;
 }
@@ -12,6 +12,13 @@ class CKeyPool;
 class CAccount;
 class CAccountingEntry;
 
+/** Maximum number of threads unserializing wallet transactions on load */
+static const int MAX_WALLETLOAD_THREADS = 8;
+/** Wallet transactions a load thread takes at a time */
+static const unsigned int WALLETLOAD_BATCH_SIZE = 128;
+/** Starting size of the buffer for bulk reads of the wallet database */
+static const unsigned int WALLETLOAD_BUFFER_SIZE = 4 * 1024 * 1024;
+
 /** Error statuses for the wallet database */
 enum DBErrors
 {